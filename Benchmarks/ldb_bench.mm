@@ -0,0 +1,446 @@
+//
+//  ldb_bench.mm
+//
+//  Runs each benchmark twice, through `LevelDB` and directly through `leveldb::DB`, on databases
+//  opened with the same options, so that the cost of the wrapper shows up next to leveldb's own.
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+#import "LDBCodec.h"
+#import "LDBOptions.h"
+#import "LDBWriteBatch.h"
+
+#import <leveldb/db.h>
+#import <leveldb/write_batch.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+#include "LDBCommon.h"
+
+// Flags, named after db_bench's
+static int FLAGS_num = 100000;
+static int FLAGS_value_size = 100;
+static NSString *FLAGS_db = @"/tmp/ldb_bench";
+static NSString *FLAGS_benchmarks = @"fillseq,fillrandom,readrandom,readseq,prefixscan,multiget,"
+                                    @"writebatch1,writebatch10,writebatch100,writebatch1000,codec";
+
+// Seed of the key generator, reset before each run so that both runs see the same keys
+static const uint32_t kRandomSeed = 301;
+// Size of the buffer values are sliced from
+static const size_t kValueBufferSize = 1024 * 1024;
+// Keys sharing their first 13 digits, enumerated by each prefix scan
+static const int kPrefixScanKeys = 1000;
+// Keys fetched by each multi-get
+static const int kMultiGetKeys = 100;
+// Operations between drains of the autorelease pool
+static const int kOperationsPerPool = 1000;
+
+namespace {
+    struct Result {
+        double micros;
+        uint64_t bytes;
+        int ops;
+    };
+
+    class Stopwatch {
+    public:
+        Stopwatch() : start_(std::chrono::steady_clock::now()) {}
+        double Micros() const {
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_).count();
+        }
+    private:
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // The pair of databases every benchmark runs against
+    struct Databases {
+        LevelDB *wrapper;
+        leveldb::DB *raw;
+        bool filled;
+    };
+
+    std::string valueBuffer;
+
+    inline leveldb::Slice ValueAt(int i) {
+        size_t offset = ((size_t)i * FLAGS_value_size) % (kValueBufferSize - FLAGS_value_size);
+        return leveldb::Slice(valueBuffer.data() + offset, FLAGS_value_size);
+    }
+
+    inline leveldb::Slice KeyAt(int k, char *buffer) {
+        snprintf(buffer, 32, "%016d", k);
+        return leveldb::Slice(buffer, 16);
+    }
+}
+
+#pragma mark - Databases
+
+static void CloseDatabases(Databases *dbs) {
+    [dbs->wrapper close];
+    [dbs->wrapper release];
+    dbs->wrapper = nil;
+    delete dbs->raw;
+    dbs->raw = NULL;
+}
+
+static void OpenFreshDatabases(Databases *dbs) {
+    CloseDatabases(dbs);
+    [[NSFileManager defaultManager] removeItemAtPath:FLAGS_db error:NULL];
+
+    // Both databases get leveldb's defaults: an 8MB block cache, Snappy, no bloom filter
+    LDBOptions *options = [LDBOptions options];
+    dbs->wrapper = [[LevelDB alloc] initWithPath:FLAGS_db name:@"wrapper" options:options];
+    dbs->wrapper.encoder = [[LDBCodecRegistry sharedRegistry] encoderWithCodec:[LDBRawDataCodec codec]];
+
+    leveldb::Options rawOptions;
+    rawOptions.create_if_missing = true;
+    NSString *rawPath = [FLAGS_db stringByAppendingPathComponent:@"raw"];
+    leveldb::Status status = leveldb::DB::Open(rawOptions, [rawPath fileSystemRepresentation], &dbs->raw);
+    if (dbs->wrapper == nil || !status.ok()) {
+        fprintf(stderr, "Can't open the databases in %s: %s\n", [FLAGS_db UTF8String], status.ToString().c_str());
+        exit(1);
+    }
+    dbs->filled = false;
+}
+
+static void FillSequentially(Databases *dbs) {
+    char buffer[32];
+    leveldb::WriteOptions options;
+    for (int i = 0; i < FLAGS_num; i++) {
+        @autoreleasepool {
+            leveldb::Slice key = KeyAt(i, buffer), value = ValueAt(i);
+            [dbs->wrapper setObject:TransientDataFromSlice(value) forKey:DataFromSlice(key)];
+            dbs->raw->Put(options, key, value);
+        }
+    }
+    dbs->filled = true;
+}
+
+static void EnsureFilled(Databases *dbs) {
+    if (!dbs->filled)
+        FillSequentially(dbs);
+}
+
+#pragma mark - Benchmarks
+
+static void Fill(Databases *dbs, bool random, Result *wrapper, Result *raw) {
+    char buffer[32];
+    std::mt19937 rng;
+
+    OpenFreshDatabases(dbs);
+    rng.seed(kRandomSeed);
+    Stopwatch wrapperWatch;
+    for (int i = 0; i < FLAGS_num; ) {
+        @autoreleasepool {
+            for (int end = std::min(i + kOperationsPerPool, FLAGS_num); i < end; i++) {
+                int k = random ? (int)(rng() % FLAGS_num) : i;
+                leveldb::Slice key = KeyAt(k, buffer), value = ValueAt(i);
+                [dbs->wrapper setObject:TransientDataFromSlice(value) forKey:DataFromSlice(key)];
+            }
+        }
+    }
+    *wrapper = (Result) { wrapperWatch.Micros(), (uint64_t)FLAGS_num * (16 + FLAGS_value_size), FLAGS_num };
+
+    rng.seed(kRandomSeed);
+    leveldb::WriteOptions options;
+    Stopwatch rawWatch;
+    for (int i = 0; i < FLAGS_num; i++) {
+        int k = random ? (int)(rng() % FLAGS_num) : i;
+        dbs->raw->Put(options, KeyAt(k, buffer), ValueAt(i));
+    }
+    *raw = (Result) { rawWatch.Micros(), (uint64_t)FLAGS_num * (16 + FLAGS_value_size), FLAGS_num };
+    dbs->filled = !random;
+}
+
+static void ReadRandom(Databases *dbs, Result *wrapper, Result *raw) {
+    char buffer[32];
+    std::mt19937 rng;
+    EnsureFilled(dbs);
+
+    rng.seed(kRandomSeed);
+    uint64_t bytes = 0;
+    Stopwatch wrapperWatch;
+    for (int i = 0; i < FLAGS_num; ) {
+        @autoreleasepool {
+            for (int end = std::min(i + kOperationsPerPool, FLAGS_num); i < end; i++) {
+                leveldb::Slice key = KeyAt((int)(rng() % FLAGS_num), buffer);
+                NSData *value = [dbs->wrapper objectForKey:DataFromSlice(key)];
+                bytes += [value length];
+            }
+        }
+    }
+    *wrapper = (Result) { wrapperWatch.Micros(), bytes, FLAGS_num };
+
+    rng.seed(kRandomSeed);
+    bytes = 0;
+    leveldb::ReadOptions options;
+    std::string value;
+    Stopwatch rawWatch;
+    for (int i = 0; i < FLAGS_num; i++) {
+        if (dbs->raw->Get(options, KeyAt((int)(rng() % FLAGS_num), buffer), &value).ok())
+            bytes += value.size();
+    }
+    *raw = (Result) { rawWatch.Micros(), bytes, FLAGS_num };
+}
+
+static void ReadSequentially(Databases *dbs, Result *wrapper, Result *raw) {
+    EnsureFilled(dbs);
+
+    __block uint64_t bytes = 0;
+    __block int ops = 0;
+    Stopwatch wrapperWatch;
+    @autoreleasepool {
+        [dbs->wrapper enumerateKeysAndObjectsUsingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+            bytes += key->length + [(NSData *)value length];
+            ops++;
+        }];
+    }
+    *wrapper = (Result) { wrapperWatch.Micros(), bytes, ops };
+
+    bytes = 0;
+    ops = 0;
+    Stopwatch rawWatch;
+    leveldb::Iterator *iter = dbs->raw->NewIterator(leveldb::ReadOptions());
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+        bytes += iter->key().size() + iter->value().size();
+        ops++;
+    }
+    delete iter;
+    *raw = (Result) { rawWatch.Micros(), bytes, ops };
+}
+
+static void PrefixScan(Databases *dbs, Result *wrapper, Result *raw) {
+    char buffer[32];
+    std::mt19937 rng;
+    EnsureFilled(dbs);
+    int groups = std::max(FLAGS_num / kPrefixScanKeys, 1);
+    int scans = std::max(FLAGS_num / kPrefixScanKeys, 10);
+
+    rng.seed(kRandomSeed);
+    __block uint64_t bytes = 0;
+    __block int ops = 0;
+    Stopwatch wrapperWatch;
+    for (int i = 0; i < scans; i++) {
+        @autoreleasepool {
+            leveldb::Slice prefix(KeyAt((int)(rng() % groups) * kPrefixScanKeys, buffer).data(), 13);
+            [dbs->wrapper enumerateKeysAndObjectsBackward:NO
+                                                   lazily:NO
+                                            startingAtKey:nil
+                                      filteredByPredicate:nil
+                                                andPrefix:DataFromSlice(prefix)
+                                               usingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+                                                   bytes += key->length + [(NSData *)value length];
+                                                   ops++;
+                                               }];
+        }
+    }
+    *wrapper = (Result) { wrapperWatch.Micros(), bytes, ops };
+
+    rng.seed(kRandomSeed);
+    bytes = 0;
+    ops = 0;
+    Stopwatch rawWatch;
+    leveldb::Iterator *iter = dbs->raw->NewIterator(leveldb::ReadOptions());
+    for (int i = 0; i < scans; i++) {
+        leveldb::Slice prefix(KeyAt((int)(rng() % groups) * kPrefixScanKeys, buffer).data(), 13);
+        for (iter->Seek(prefix); iter->Valid() && iter->key().starts_with(prefix); iter->Next()) {
+            bytes += iter->key().size() + iter->value().size();
+            ops++;
+        }
+    }
+    delete iter;
+    *raw = (Result) { rawWatch.Micros(), bytes, ops };
+}
+
+static void MultiGet(Databases *dbs, Result *wrapper, Result *raw) {
+    char buffer[32];
+    std::mt19937 rng;
+    EnsureFilled(dbs);
+    int batches = std::max(FLAGS_num / kMultiGetKeys, 1);
+
+    rng.seed(kRandomSeed);
+    uint64_t bytes = 0;
+    Stopwatch wrapperWatch;
+    for (int i = 0; i < batches; i++) {
+        @autoreleasepool {
+            NSMutableArray *keys = [NSMutableArray arrayWithCapacity:kMultiGetKeys];
+            for (int j = 0; j < kMultiGetKeys; j++) {
+                leveldb::Slice key = KeyAt((int)(rng() % FLAGS_num), buffer);
+                [keys addObject:DataFromSlice(key)];
+            }
+            for (id value in [dbs->wrapper objectsForKeys:keys notFoundMarker:[NSNull null]])
+                if (value != [NSNull null])
+                    bytes += [(NSData *)value length];
+        }
+    }
+    *wrapper = (Result) { wrapperWatch.Micros(), bytes, batches * kMultiGetKeys };
+
+    // The wrapper reads every key of a batch from the same snapshot, so the raw run does too
+    rng.seed(kRandomSeed);
+    bytes = 0;
+    std::string value;
+    Stopwatch rawWatch;
+    for (int i = 0; i < batches; i++) {
+        leveldb::ReadOptions options;
+        options.snapshot = dbs->raw->GetSnapshot();
+        for (int j = 0; j < kMultiGetKeys; j++) {
+            if (dbs->raw->Get(options, KeyAt((int)(rng() % FLAGS_num), buffer), &value).ok())
+                bytes += value.size();
+        }
+        dbs->raw->ReleaseSnapshot(options.snapshot);
+    }
+    *raw = (Result) { rawWatch.Micros(), bytes, batches * kMultiGetKeys };
+}
+
+static void WriteBatches(Databases *dbs, int batchSize, Result *wrapper, Result *raw) {
+    char buffer[32];
+    std::mt19937 rng;
+    int batches = std::max(FLAGS_num / batchSize, 1);
+    uint64_t bytes = (uint64_t)batches * batchSize * (16 + FLAGS_value_size);
+
+    OpenFreshDatabases(dbs);
+    rng.seed(kRandomSeed);
+    Stopwatch wrapperWatch;
+    for (int i = 0; i < batches; i++) {
+        @autoreleasepool {
+            LDBWritebatch *wb = [dbs->wrapper newWritebatch];
+            for (int j = 0; j < batchSize; j++) {
+                leveldb::Slice key = KeyAt((int)(rng() % FLAGS_num), buffer), value = ValueAt(j);
+                [wb setObject:TransientDataFromSlice(value) forKey:DataFromSlice(key)];
+            }
+            [wb apply];
+            [wb release];
+        }
+    }
+    *wrapper = (Result) { wrapperWatch.Micros(), bytes, batches * batchSize };
+
+    rng.seed(kRandomSeed);
+    leveldb::WriteOptions options;
+    leveldb::WriteBatch batch;
+    Stopwatch rawWatch;
+    for (int i = 0; i < batches; i++) {
+        batch.Clear();
+        for (int j = 0; j < batchSize; j++)
+            batch.Put(KeyAt((int)(rng() % FLAGS_num), buffer), ValueAt(j));
+        dbs->raw->Write(options, &batch);
+    }
+    *raw = (Result) { rawWatch.Micros(), bytes, batches * batchSize };
+}
+
+// Encoding and decoding a small dictionary with the default codecs, against copying the encoded bytes
+static void Codec(Result *wrapper, Result *raw) {
+    LDBCodecRegistry *registry = [LDBCodecRegistry sharedRegistry];
+    LevelDBEncoderBlock encoder = [registry defaultEncoder];
+    LevelDBDecoderBlock decoder = [registry decoder];
+    LevelDBKey key = { "key", 3 };
+
+    uint64_t bytes = 0;
+    Stopwatch wrapperWatch;
+    for (int i = 0; i < FLAGS_num; ) {
+        @autoreleasepool {
+            for (int end = std::min(i + kOperationsPerPool, FLAGS_num); i < end; i++) {
+                NSDictionary *object = @{@"id": @(i), @"name": @"benchmark", @"score": @(i * 0.5), @"tags": @[@"a", @"b"]};
+                NSData *data = encoder(&key, object);
+                decoder(&key, data);
+                bytes += [data length];
+            }
+        }
+    }
+    *wrapper = (Result) { wrapperWatch.Micros(), bytes, FLAGS_num };
+
+    NSData *encoded = encoder(&key, @{@"id": @0, @"name": @"benchmark", @"score": @0.0, @"tags": @[@"a", @"b"]});
+    std::string copy;
+    Stopwatch rawWatch;
+    for (int i = 0; i < FLAGS_num; i++)
+        copy.assign((const char *)[encoded bytes], [encoded length]);
+    *raw = (Result) { rawWatch.Micros(), (uint64_t)FLAGS_num * [encoded length], FLAGS_num };
+}
+
+#pragma mark - Reporting
+
+static void Report(const char *name, const Result &wrapper, const Result &raw, const char *rawName) {
+    double wrapperMicros = wrapper.micros / std::max(wrapper.ops, 1);
+    double rawMicros = raw.micros / std::max(raw.ops, 1);
+    double tax = rawMicros > 0 ? (wrapperMicros / rawMicros - 1) * 100 : 0;
+    fprintf(stdout, "%-16s : LevelDB %10.3f micros/op %8.1f MB/s | %-7s %10.3f micros/op %8.1f MB/s | wrapper %+7.1f%%\n",
+            name,
+            wrapperMicros, wrapper.bytes / 1048576.0 / std::max(wrapper.micros / 1e6, 1e-9),
+            rawName,
+            rawMicros, raw.bytes / 1048576.0 / std::max(raw.micros / 1e6, 1e-9),
+            tax);
+    fflush(stdout);
+}
+
+static void ParseFlags(int argc, const char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        int n;
+        char rest;
+        if (sscanf(argv[i], "--num=%d%c", &n, &rest) == 1)
+            FLAGS_num = n;
+        else if (sscanf(argv[i], "--value_size=%d%c", &n, &rest) == 1)
+            FLAGS_value_size = n;
+        else if (strncmp(argv[i], "--benchmarks=", 13) == 0)
+            FLAGS_benchmarks = [NSString stringWithUTF8String:argv[i] + 13];
+        else if (strncmp(argv[i], "--db=", 5) == 0)
+            FLAGS_db = [NSString stringWithUTF8String:argv[i] + 5];
+        else {
+            fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (FLAGS_num <= 0 || FLAGS_value_size <= 0 || (size_t)FLAGS_value_size >= kValueBufferSize) {
+        fprintf(stderr, "--num and --value_size should be positive, and --value_size below %zu\n", kValueBufferSize);
+        exit(1);
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    @autoreleasepool {
+        ParseFlags(argc, argv);
+        fprintf(stdout, "Keys:       16 bytes each\nValues:     %d bytes each\nEntries:    %d\n\n", FLAGS_value_size, FLAGS_num);
+
+        std::mt19937 rng(kRandomSeed);
+        valueBuffer.resize(kValueBufferSize);
+        for (size_t i = 0; i < kValueBufferSize; i++)
+            valueBuffer[i] = (char)(' ' + rng() % 95);
+
+        Databases dbs = { nil, NULL, false };
+        OpenFreshDatabases(&dbs);
+        for (NSString *name in [FLAGS_benchmarks componentsSeparatedByString:@","]) {
+            Result wrapper, raw;
+            const char *rawName = "leveldb";
+            if ([name isEqualToString:@"fillseq"])
+                Fill(&dbs, false, &wrapper, &raw);
+            else if ([name isEqualToString:@"fillrandom"])
+                Fill(&dbs, true, &wrapper, &raw);
+            else if ([name isEqualToString:@"readrandom"])
+                ReadRandom(&dbs, &wrapper, &raw);
+            else if ([name isEqualToString:@"readseq"])
+                ReadSequentially(&dbs, &wrapper, &raw);
+            else if ([name isEqualToString:@"prefixscan"])
+                PrefixScan(&dbs, &wrapper, &raw);
+            else if ([name isEqualToString:@"multiget"])
+                MultiGet(&dbs, &wrapper, &raw);
+            else if ([name hasPrefix:@"writebatch"] && [[name substringFromIndex:10] intValue] > 0)
+                WriteBatches(&dbs, [[name substringFromIndex:10] intValue], &wrapper, &raw);
+            else if ([name isEqualToString:@"codec"]) {
+                Codec(&wrapper, &raw);
+                rawName = "memcpy";
+            } else {
+                fprintf(stderr, "Unknown benchmark '%s'\n", [name UTF8String]);
+                continue;
+            }
+            Report([name UTF8String], wrapper, raw, rawName);
+        }
+        CloseDatabases(&dbs);
+    }
+    return 0;
+}
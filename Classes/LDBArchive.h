@@ -0,0 +1,143 @@
+//
+//  LDBArchive.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+typedef void (^LevelDBArchiveProgressBlock)(uint64_t count, uint64_t bytes, BOOL *stop);
+
+/**
+ A file holding the key value pairs of a range of a database, as read from a snapshot, to back up a database while it
+ is being written to, or to copy a range into another database at a much higher throughput than `setObject:forKey:`.
+
+ The file starts with a header describing the exported range, follows with blocks of sorted key value pairs, and ends
+ with a footer locating every block in key order. Within a block, keys only hold the bytes they don't share with the
+ previous key. Blocks are compressed with zlib, unless that saves less than an eighth of their size, and checksummed
+ with CRC-32, so that a damaged archive fails to import instead of loading garbage. Keys and values are copied as they
+ are stored, without going through the database's encoder and decoder, values separated into blob files included.
+ The keys the database keeps for itself, such as secondary index entries, are left out: the indexes of the importing
+ database are maintained as the keys are loaded.
+
+ Exports split the range into shards of roughly the same size on disk, scanned and compressed concurrently, each
+ appending its blocks to the file as they fill. Imports load every shard concurrently, with its own sorted bulk load.
+ An export or import that was stopped, or interrupted by a crash, can be resumed: blocks already written (or shards
+ already loaded) are kept, and the rest is done again. A resumed export reads the remaining keys from the snapshot it
+ is resumed with, so the archive is only consistent when the export completes in one go.
+
+ An archive instance must only be used from one thread at a time.
+ */
+@interface LDBArchive : NSObject
+
+/**
+ The path of the archive file
+ */
+@property (nonatomic, readonly) NSString *path;
+
+/**
+ The number of shards an export is split into. If 0, the number of active processors is used (defaults to 0). Ranges
+ are only split under leveldb's bytewise comparator.
+ */
+@property (nonatomic) NSUInteger shards;
+
+/**
+ The size in bytes of the keys and values of a block, before compression (defaults to 256KB)
+ */
+@property (nonatomic) NSUInteger blockSize;
+
+/**
+ A boolean value indicating whether exported blocks are compressed (defaults to true)
+ */
+@property (nonatomic) BOOL compression;
+
+/**
+ The rate in bytes per second at which an export writes blocks, or an import reads them, or 0 for no limit (defaults
+ to 0)
+ */
+@property (nonatomic) uint64_t bytesPerSecond;
+
+/**
+ A boolean value indicating whether the imported range should be compacted once the import completes (defaults to
+ true)
+ */
+@property (nonatomic) BOOL compactsWhenFinished;
+
+/**
+ A block called whenever a block was written by an export, or loaded by an import, with the number of key value pairs
+ and the number of bytes of the archive processed so far (defaults to `nil`). It is called from the threads
+ processing shards, one at a time. Setting its `stop` argument to `TRUE` stops the export or import, which can then be
+ resumed.
+ */
+@property (nonatomic, copy) LevelDBArchiveProgressBlock progress;
+
+/**
+ Return a new archive reading from or writing to a file
+
+ @param path The path of the archive file
+ */
++ (instancetype) archiveWithPath:(NSString *)path;
+
+#pragma mark - Exporting
+
+/**
+ Write the key value pairs of a snapshot in the range [`startKey`, `endKey`) to the archive file, replacing it
+
+ Tables are read without filling the block cache, and with their checksums verified. The file is synced once complete.
+
+ @param snapshot The snapshot to read keys from
+ @param startKey (optional) The first key of the range (`NSString` or `NSData`). If `nil`, the range starts at the first key of the database.
+ @param endKey (optional) The key right after the range (`NSString` or `NSData`). If `nil`, the range ends with the last key of the database.
+ @param resume A boolean value indicating whether an export of the same range left incomplete in the file should be resumed, rather than started over
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if the export failed, was stopped, or the database closed
+
+ @return A boolean value indicating whether the archive is complete
+ */
+- (BOOL) exportSnapshot:(LDBSnapshot *)snapshot
+                fromKey:(id)startKey
+                  toKey:(id)endKey
+                 resume:(BOOL)resume
+                  error:(NSError **)error;
+
+/**
+ Write the key value pairs of a snapshot prefixed with a given value to the archive file, replacing it
+
+ Same as `exportSnapshot:fromKey:toKey:resume:error:`, with the range of keys starting with `prefix`, or every key if
+ `prefix` is `nil`.
+ */
+- (BOOL) exportSnapshot:(LDBSnapshot *)snapshot
+             withPrefix:(id)prefix
+                 resume:(BOOL)resume
+                  error:(NSError **)error;
+
+#pragma mark - Importing
+
+/**
+ Load every key value pair of the archive into a database, empty or not, with one sorted bulk load per shard
+
+ Imported keys replace the values already in the database, and other keys are left untouched. Writes are indexed as
+ any other (see `LDBIndex`). Each shard loaded is recorded in the database, for a stopped or failed import to skip it
+ when resumed, until the import completes.
+
+ @param db The database to load
+ @param resume A boolean value indicating whether the shards loaded by a previous import of the archive should be skipped
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if the archive is incomplete or damaged, or if the import failed, was stopped, or the database closed
+
+ @return A boolean value indicating whether every key value pair of the archive was loaded
+ */
+- (BOOL) importIntoDB:(LevelDB *)db
+               resume:(BOOL)resume
+                error:(NSError **)error;
+
+/**
+ Read every block of the archive, checking that it is complete and that no block is damaged
+
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if the archive is incomplete or damaged
+
+ @return A boolean value indicating whether the archive can be imported
+ */
+- (BOOL) verifyWithError:(NSError **)error;
+
+@end
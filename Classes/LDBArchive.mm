@@ -0,0 +1,1017 @@
+//
+//  LDBArchive.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBArchive.h"
+#import "LDBBlobStore.h"
+#import "LDBBulkLoader.h"
+#import "LDBSnapshot.h"
+
+#import <leveldb/comparator.h>
+#import <leveldb/db.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+#include "LDBCommon.h"
+
+// Magic bytes opening the header of an archive, and closing its trailer
+static const char kArchiveMagic[8] = { 'L', 'D', 'B', 'A', 'R', 'C', 'H', '1' };
+// Version of the format, following the magic bytes of the header
+static const uint32_t kArchiveVersion = 1;
+// Size of the random identifier of an archive, telling imports of different archives apart
+static const size_t kArchiveIdSize = 16;
+// Magic number opening every block
+static const uint32_t kBlockMagic = 0x4b42444c;
+// Size of the fixed part of a block: magic, shard, sequence, entries, raw and stored sizes, flags and checksum
+static const size_t kBlockHeaderSize = 29;
+// Size of the trailer of a complete archive: footer offset and size, footer checksum and magic bytes
+static const size_t kTrailerSize = 24;
+// Flags of a block
+static const uint8_t kBlockCompressed = 0x01;
+static const uint8_t kBlockLastOfShard = 0x02;
+// Default size of the keys and values of a block, before compression
+static const NSUInteger kArchiveBlockSize = 256 * 1024;
+// Prefix of the key recording the shards an import loaded, followed by the archive's identifier in hexadecimal
+static const char kImportStatePrefix[] = kLDBReservedKeyPrefix "import:";
+
+@interface LevelDB ()
+- (leveldb::DB *) db;
+- (LDBInFlightTracker *) inFlightTracker;
+- (const leveldb::Comparator *) comparator;
+- (LDBBlobStore *) blobStore;
+- (std::vector<std::string>) _shardSplitKeysFromKey:(const std::string &)start
+                                              toKey:(const std::string *)limit
+                                             shards:(size_t)shards;
+@end
+
+@interface LDBSnapshot ()
+- (const leveldb::Snapshot *) getSnapshot;
+@end
+
+@interface LDBBulkLoader ()
+- (void) _addKey:(const leveldb::Slice &)key value:(const leveldb::Slice &)value;
+@end
+
+namespace {
+    void PutFixed32(std::string *dst, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            dst->push_back((char)(value >> (8 * i)));
+    }
+    void PutFixed64(std::string *dst, uint64_t value) {
+        for (int i = 0; i < 8; i++)
+            dst->push_back((char)(value >> (8 * i)));
+    }
+    uint32_t DecodeFixed32(const char *p) {
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; i--)
+            value = (value << 8) | (unsigned char)p[i];
+        return value;
+    }
+    uint64_t DecodeFixed64(const char *p) {
+        return (uint64_t)DecodeFixed32(p + 4) << 32 | DecodeFixed32(p);
+    }
+
+    void PutVarint(std::string *dst, uint64_t value) {
+        while (value >= 0x80) {
+            dst->push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        dst->push_back((char)value);
+    }
+    bool GetVarint(leveldb::Slice *input, uint64_t *value) {
+        uint64_t result = 0;
+        for (int shift = 0; shift < 64 && !input->empty(); shift += 7) {
+            unsigned char byte = (unsigned char)(*input)[0];
+            input->remove_prefix(1);
+            result |= (uint64_t)(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                *value = result;
+                return true;
+            }
+        }
+        return false;
+    }
+    void PutLengthPrefixed(std::string *dst, const leveldb::Slice &value) {
+        PutVarint(dst, value.size());
+        dst->append(value.data(), value.size());
+    }
+    bool GetLengthPrefixed(leveldb::Slice *input, std::string *value) {
+        uint64_t length;
+        if (!GetVarint(input, &length) || length > input->size())
+            return false;
+        value->assign(input->data(), (size_t)length);
+        input->remove_prefix((size_t)length);
+        return true;
+    }
+
+    uint32_t Checksum(uint32_t crc, const char *data, size_t length) {
+        return (uint32_t)crc32(crc, (const Bytef *)data, (uInt)length);
+    }
+
+    bool ReadFully(int fd, uint64_t offset, char *buffer, size_t length) {
+        while (length > 0) {
+            ssize_t count = pread(fd, buffer, length, (off_t)offset);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            buffer += count;
+            offset += count;
+            length -= count;
+        }
+        return true;
+    }
+    bool WriteFully(int fd, uint64_t offset, const std::string &data) {
+        const char *buffer = data.data();
+        size_t length = data.size();
+        while (length > 0) {
+            ssize_t count = pwrite(fd, buffer, length, (off_t)offset);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            buffer += count;
+            offset += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    leveldb::Status IOErrorForPath(NSString *path) {
+        return leveldb::Status::IOError([path fileSystemRepresentation], strerror(errno));
+    }
+
+    /*
+     * The range an archive holds, split into shards by the keys separating them. Shards are
+     * written and loaded independently, and a resumed export keeps the shards it started with.
+     */
+    struct ArchiveHeader {
+        std::string id;
+        std::string start;
+        std::vector<std::string> splits;
+        bool bounded;
+        std::string limit;
+
+        size_t ShardCount() const {
+            return splits.size() + 1;
+        }
+        leveldb::Slice ShardStart(size_t shard) const {
+            return shard == 0 ? leveldb::Slice(start) : leveldb::Slice(splits[shard - 1]);
+        }
+        const std::string * ShardLimit(size_t shard) const {
+            if (shard < splits.size())
+                return &splits[shard];
+            return bounded ? &limit : NULL;
+        }
+
+        std::string Encode() const {
+            std::string body(id);
+            PutVarint(&body, ShardCount());
+            PutLengthPrefixed(&body, start);
+            for (const std::string &split : splits)
+                PutLengthPrefixed(&body, split);
+            body.push_back(bounded ? 1 : 0);
+            if (bounded)
+                PutLengthPrefixed(&body, limit);
+
+            std::string header(kArchiveMagic, sizeof(kArchiveMagic));
+            PutFixed32(&header, kArchiveVersion);
+            PutFixed32(&header, (uint32_t)body.size());
+            PutFixed32(&header, Checksum(0, body.data(), body.size()));
+            return header + body;
+        }
+
+        // Read the header at the start of a file, and the offset of the first block following it
+        leveldb::Status Read(int fd, uint64_t fileSize, uint64_t *end) {
+            char fixed[sizeof(kArchiveMagic) + 12];
+            if (fileSize < sizeof(fixed) || !ReadFully(fd, 0, fixed, sizeof(fixed))
+                || memcmp(fixed, kArchiveMagic, sizeof(kArchiveMagic)) != 0)
+                return leveldb::Status::Corruption("Not an archive");
+            if (DecodeFixed32(fixed + 8) != kArchiveVersion)
+                return leveldb::Status::NotSupported("Unknown archive version");
+
+            uint32_t length = DecodeFixed32(fixed + 12);
+            if (length > fileSize - sizeof(fixed))
+                return leveldb::Status::Corruption("Truncated archive header");
+            std::string body(length, '\0');
+            if (!ReadFully(fd, sizeof(fixed), &body[0], length)
+                || Checksum(0, body.data(), body.size()) != DecodeFixed32(fixed + 16))
+                return leveldb::Status::Corruption("Damaged archive header");
+
+            leveldb::Slice input(body);
+            uint64_t shards;
+            if (input.size() < kArchiveIdSize)
+                return leveldb::Status::Corruption("Damaged archive header");
+            id.assign(input.data(), kArchiveIdSize);
+            input.remove_prefix(kArchiveIdSize);
+            if (!GetVarint(&input, &shards) || shards == 0 || shards > input.size() || !GetLengthPrefixed(&input, &start))
+                return leveldb::Status::Corruption("Damaged archive header");
+            splits.resize((size_t)shards - 1);
+            for (std::string &split : splits)
+                if (!GetLengthPrefixed(&input, &split))
+                    return leveldb::Status::Corruption("Damaged archive header");
+            if (input.empty())
+                return leveldb::Status::Corruption("Damaged archive header");
+            bounded = (input[0] != 0);
+            input.remove_prefix(1);
+            if (bounded && !GetLengthPrefixed(&input, &limit))
+                return leveldb::Status::Corruption("Damaged archive header");
+
+            *end = sizeof(fixed) + length;
+            return leveldb::Status::OK();
+        }
+    };
+
+    /*
+     * The offsets of the blocks of every shard, in key order, and the number of key value pairs
+     * they hold, written after the last block along with a trailer locating them.
+     */
+    struct ArchiveFooter {
+        uint64_t count;
+        uint64_t offset;
+        std::vector<std::vector<uint64_t> > blocks;
+
+        std::string Encode() const {
+            std::string body;
+            PutVarint(&body, count);
+            for (const std::vector<uint64_t> &offsets : blocks) {
+                PutVarint(&body, offsets.size());
+                for (uint64_t blockOffset : offsets)
+                    PutVarint(&body, blockOffset);
+            }
+            std::string footer(body);
+            PutFixed64(&footer, offset);
+            PutFixed32(&footer, (uint32_t)body.size());
+            PutFixed32(&footer, Checksum(0, body.data(), body.size()));
+            footer.append(kArchiveMagic, sizeof(kArchiveMagic));
+            return footer;
+        }
+
+        leveldb::Status Read(int fd, uint64_t fileSize, size_t shards) {
+            char trailer[kTrailerSize];
+            if (fileSize < kTrailerSize || !ReadFully(fd, fileSize - kTrailerSize, trailer, kTrailerSize)
+                || memcmp(trailer + 16, kArchiveMagic, sizeof(kArchiveMagic)) != 0)
+                return leveldb::Status::Corruption("Incomplete archive");
+
+            offset = DecodeFixed64(trailer);
+            uint32_t length = DecodeFixed32(trailer + 8);
+            if (offset > fileSize - kTrailerSize || length != fileSize - kTrailerSize - offset)
+                return leveldb::Status::Corruption("Damaged archive footer");
+            std::string body(length, '\0');
+            if (!ReadFully(fd, offset, &body[0], length)
+                || Checksum(0, body.data(), body.size()) != DecodeFixed32(trailer + 12))
+                return leveldb::Status::Corruption("Damaged archive footer");
+
+            leveldb::Slice input(body);
+            if (!GetVarint(&input, &count))
+                return leveldb::Status::Corruption("Damaged archive footer");
+            blocks.assign(shards, std::vector<uint64_t>());
+            for (std::vector<uint64_t> &offsets : blocks) {
+                uint64_t blockCount;
+                if (!GetVarint(&input, &blockCount) || blockCount > input.size())
+                    return leveldb::Status::Corruption("Damaged archive footer");
+                offsets.resize((size_t)blockCount);
+                for (uint64_t &blockOffset : offsets)
+                    if (!GetVarint(&input, &blockOffset) || blockOffset >= offset)
+                        return leveldb::Status::Corruption("Damaged archive footer");
+            }
+            return leveldb::Status::OK();
+        }
+    };
+
+    struct BlockInfo {
+        uint32_t shard;
+        uint32_t sequence;
+        uint32_t entries;
+        uint64_t offset;
+        uint64_t size;      // Header and stored payload
+        bool last;
+    };
+
+    /*
+     * Read the block at `offset`, checking it lies before `end` and matches its checksum, and
+     * uncompress its contents unless `contents` is NULL.
+     */
+    leveldb::Status ReadBlock(int fd, uint64_t offset, uint64_t end, BlockInfo *info, std::string *contents) {
+        char header[kBlockHeaderSize];
+        if (offset > end || end - offset < kBlockHeaderSize || !ReadFully(fd, offset, header, kBlockHeaderSize))
+            return leveldb::Status::Corruption("Truncated archive block");
+        if (DecodeFixed32(header) != kBlockMagic)
+            return leveldb::Status::Corruption("Damaged archive block");
+
+        uint32_t rawSize = DecodeFixed32(header + 16), storedSize = DecodeFixed32(header + 20);
+        uint8_t flags = (uint8_t)header[24];
+        if (storedSize > end - offset - kBlockHeaderSize)
+            return leveldb::Status::Corruption("Truncated archive block");
+        std::string stored(storedSize, '\0');
+        if (storedSize > 0 && !ReadFully(fd, offset + kBlockHeaderSize, &stored[0], storedSize))
+            return leveldb::Status::Corruption("Truncated archive block");
+        uint32_t crc = Checksum(Checksum(0, header, kBlockHeaderSize - 4), stored.data(), stored.size());
+        if (crc != DecodeFixed32(header + 25))
+            return leveldb::Status::Corruption("Damaged archive block");
+
+        info->shard = DecodeFixed32(header + 4);
+        info->sequence = DecodeFixed32(header + 8);
+        info->entries = DecodeFixed32(header + 12);
+        info->offset = offset;
+        info->size = kBlockHeaderSize + storedSize;
+        info->last = (flags & kBlockLastOfShard) != 0;
+
+        if (contents == NULL)
+            return leveldb::Status::OK();
+        if (flags & kBlockCompressed) {
+            contents->resize(rawSize);
+            uLongf length = rawSize;
+            if (uncompress((Bytef *)&(*contents)[0], &length, (const Bytef *)stored.data(), storedSize) != Z_OK
+                || length != rawSize)
+                return leveldb::Status::Corruption("Damaged archive block");
+        } else {
+            contents->swap(stored);
+        }
+        return leveldb::Status::OK();
+    }
+
+    /*
+     * The key value pairs of a block, each stored as the length of the prefix its key shares with
+     * the previous key, the lengths of the rest of the key and of the value, then their bytes.
+     */
+    class BlockBuilder {
+    public:
+        BlockBuilder() : entries_(0) {}
+
+        void Add(const leveldb::Slice &key, const leveldb::Slice &value) {
+            size_t shared = 0, common = std::min(last_.size(), key.size());
+            while (shared < common && last_[shared] == key[shared])
+                shared++;
+            PutVarint(&raw_, shared);
+            PutVarint(&raw_, key.size() - shared);
+            PutVarint(&raw_, value.size());
+            raw_.append(key.data() + shared, key.size() - shared);
+            raw_.append(value.data(), value.size());
+            last_.assign(key.data(), key.size());
+            entries_++;
+        }
+
+        size_t RawSize() const { return raw_.size(); }
+        uint32_t Entries() const { return entries_; }
+
+        // Return the block as written to the file, compressed unless that saves less than an eighth of its size, and reset the builder
+        std::string Finish(uint32_t shard, uint32_t sequence, bool last, bool compress) {
+            uint8_t flags = last ? kBlockLastOfShard : 0;
+            std::string compressed;
+            if (compress && !raw_.empty()) {
+                uLongf length = compressBound(raw_.size());
+                compressed.resize(length);
+                if (compress2((Bytef *)&compressed[0], &length, (const Bytef *)raw_.data(), raw_.size(), Z_BEST_SPEED) == Z_OK
+                    && length < raw_.size() - raw_.size() / 8) {
+                    compressed.resize(length);
+                    flags |= kBlockCompressed;
+                }
+            }
+            const std::string &stored = (flags & kBlockCompressed) ? compressed : raw_;
+
+            std::string block;
+            block.reserve(kBlockHeaderSize + stored.size());
+            PutFixed32(&block, kBlockMagic);
+            PutFixed32(&block, shard);
+            PutFixed32(&block, sequence);
+            PutFixed32(&block, entries_);
+            PutFixed32(&block, (uint32_t)raw_.size());
+            PutFixed32(&block, (uint32_t)stored.size());
+            block.push_back((char)flags);
+            PutFixed32(&block, Checksum(Checksum(0, block.data(), block.size()), stored.data(), stored.size()));
+            block.append(stored);
+
+            raw_.clear();
+            last_.clear();
+            entries_ = 0;
+            return block;
+        }
+
+    private:
+        std::string raw_;
+        std::string last_;
+        uint32_t entries_;
+    };
+
+    // Read back the key value pairs of a block's contents
+    class BlockReader {
+    public:
+        explicit BlockReader(const std::string &contents) : input_(contents), valid_(false), corrupted_(false) {
+            Next();
+        }
+
+        bool Valid() const { return valid_; }
+        bool Corrupted() const { return corrupted_; }
+        const std::string &key() const { return key_; }
+        const leveldb::Slice &value() const { return value_; }
+
+        void Next() {
+            valid_ = false;
+            if (input_.empty())
+                return;
+            uint64_t shared, unshared, length;
+            if (!GetVarint(&input_, &shared) || !GetVarint(&input_, &unshared) || !GetVarint(&input_, &length)
+                || shared > key_.size() || unshared > input_.size() || length > input_.size() - unshared) {
+                corrupted_ = true;
+                return;
+            }
+            key_.resize((size_t)shared);
+            key_.append(input_.data(), (size_t)unshared);
+            value_ = leveldb::Slice(input_.data() + unshared, (size_t)length);
+            input_.remove_prefix((size_t)(unshared + length));
+            valid_ = true;
+        }
+
+    private:
+        leveldb::Slice input_;
+        bool valid_;
+        bool corrupted_;
+        std::string key_;
+        leveldb::Slice value_;
+    };
+
+    // Spread the bytes written or read by several threads over time, so that they don't exceed a rate on average
+    class RateLimiter {
+    public:
+        explicit RateLimiter(uint64_t bytesPerSecond)
+            : rate_(bytesPerSecond), bytes_(0), start_(std::chrono::steady_clock::now()) {}
+
+        void Acquire(uint64_t bytes) {
+            if (rate_ == 0)
+                return;
+            std::chrono::steady_clock::time_point due;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                bytes_ += bytes;
+                due = start_ + std::chrono::microseconds((uint64_t)((double)bytes_ * 1e6 / rate_));
+            }
+            std::this_thread::sleep_until(due);
+        }
+
+    private:
+        const uint64_t rate_;
+        std::mutex mu_;
+        uint64_t bytes_;
+        const std::chrono::steady_clock::time_point start_;
+    };
+
+    /*
+     * The state shared by the shards of an export or import: the progress reported so far, and
+     * the first error, or whether the progress block stopped the work.
+     */
+    class ArchiveTask {
+    public:
+        ArchiveTask(uint64_t bytesPerSecond, LevelDBArchiveProgressBlock progress)
+            : limiter_(bytesPerSecond), progress_(progress), count_(0), bytes_(0),
+              stopped_(false), cancelled_(false), error_(nil) {}
+        ~ArchiveTask() {
+            [error_ release];
+        }
+
+        RateLimiter *limiter() { return &limiter_; }
+        bool Stopped() const { return stopped_.load(std::memory_order_relaxed); }
+        bool Cancelled() const { return cancelled_; }
+        NSError *error() const { return error_; }
+
+        void Fail(NSError *error) {
+            std::lock_guard<std::mutex> lock(errorMu_);
+            if (error_ == nil)
+                error_ = [error retain];
+            stopped_.store(true);
+        }
+        void Fail(const leveldb::Status &status) {
+            Fail(NSErrorFromLevelDBStatus(status));
+        }
+
+        // Account for key value pairs processed before the task started, as when resuming it
+        void AddProcessed(uint64_t count, uint64_t bytes) {
+            count_ += count;
+            bytes_ += bytes;
+        }
+
+        // Call `block` under the task's lock, unless the task stopped, then report the progress it made
+        template <typename Block>
+        bool Perform(uint64_t count, uint64_t bytes, Block block) {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (Stopped() || !block())
+                return false;
+            count_ += count;
+            bytes_ += bytes;
+            if (progress_ && (count > 0 || bytes > 0)) {
+                BOOL stop = NO;
+                progress_(count_, bytes_, &stop);
+                if (stop) {
+                    cancelled_ = true;
+                    stopped_.store(true);
+                }
+            }
+            return true;
+        }
+
+        uint64_t Count() const { return count_; }
+
+    private:
+        RateLimiter limiter_;
+        LevelDBArchiveProgressBlock progress_;
+        std::mutex mu_;
+        std::mutex errorMu_;
+        uint64_t count_, bytes_;
+        std::atomic<bool> stopped_;
+        bool cancelled_;
+        NSError *error_;
+    };
+
+    // How far an interrupted export went through a shard
+    struct ShardProgress {
+        ShardProgress() : blocks(0), finished(false) {}
+        uint32_t blocks;
+        bool finished;
+        std::string lastKey;
+    };
+
+    NSError * StoppedError() {
+        return [NSError errorWithDomain:kLevelDBErrorDomain
+                                   code:LevelDBErrorCancelled
+                               userInfo:@{ NSLocalizedDescriptionKey: @"The operation was stopped" }];
+    }
+
+    BOOL FailWithStatus(NSError **error, const leveldb::Status &status) {
+        if (error != NULL)
+            *error = NSErrorFromLevelDBStatus(status);
+        return NO;
+    }
+}
+
+@implementation LDBArchive
+
++ (instancetype) archiveWithPath:(NSString *)path {
+    NSParameterAssert(path != nil);
+    LDBArchive *archive = [[[self alloc] init] autorelease];
+    archive->_path = [path copy];
+    return archive;
+}
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _blockSize = kArchiveBlockSize;
+        _compression = YES;
+        _compactsWhenFinished = YES;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [_path release];
+    [_progress release];
+    [super dealloc];
+}
+
+#pragma mark - Exporting
+
+- (BOOL) exportSnapshot:(LDBSnapshot *)snapshot
+                fromKey:(id)startKey
+                  toKey:(id)endKey
+                 resume:(BOOL)resume
+                  error:(NSError **)error {
+    std::string start, limit;
+    if (startKey) {
+        AssertKeyType(startKey);
+        start = (KeyFromStringOrData(startKey)).ToString();
+    }
+    if (endKey) {
+        AssertKeyType(endKey);
+        limit = (KeyFromStringOrData(endKey)).ToString();
+    }
+    return [self _exportSnapshot:snapshot fromKey:start toKey:endKey ? &limit : NULL resume:resume error:error];
+}
+
+- (BOOL) exportSnapshot:(LDBSnapshot *)snapshot
+             withPrefix:(id)prefix
+                 resume:(BOOL)resume
+                  error:(NSError **)error {
+    std::string start, limit;
+    bool bounded = false;
+    if (prefix) {
+        AssertKeyType(prefix);
+        start = (KeyFromStringOrData(prefix)).ToString();
+        bounded = PrefixUpperBound(start, &limit);
+    }
+    return [self _exportSnapshot:snapshot fromKey:start toKey:bounded ? &limit : NULL resume:resume error:error];
+}
+
+/*
+ * Keep the blocks an interrupted export of the same range left in the file, dropping the ones
+ * following the first damaged or truncated block. Blocks of a shard are appended in sequence, so
+ * every shard keeps its first blocks, and resumes after the last key of its last block.
+ */
+- (leveldb::Status) _resumeExportInFile:(int)fd
+                                 header:(const ArchiveHeader &)header
+                                  start:(uint64_t)offset
+                                   task:(ArchiveTask *)task
+                               progress:(std::vector<ShardProgress> *)progress
+                                 blocks:(std::vector<BlockInfo> *)blocks
+                                    end:(uint64_t *)end {
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+        return IOErrorForPath(_path);
+    uint64_t fileSize = (uint64_t)info.st_size;
+
+    std::vector<size_t> lastBlocks(header.ShardCount(), SIZE_MAX);
+    BlockInfo block;
+    while (ReadBlock(fd, offset, fileSize, &block, NULL).ok()) {
+        if (block.shard >= header.ShardCount() || block.sequence != (*progress)[block.shard].blocks
+            || (*progress)[block.shard].finished)
+            break;
+        (*progress)[block.shard].blocks++;
+        (*progress)[block.shard].finished = block.last;
+        lastBlocks[block.shard] = blocks->size();
+        blocks->push_back(block);
+        task->AddProcessed(block.entries, block.size);
+        offset += block.size;
+    }
+    if (ftruncate(fd, (off_t)offset) != 0)
+        return IOErrorForPath(_path);
+    *end = offset;
+
+    std::string contents;
+    for (size_t shard = 0; shard < header.ShardCount(); shard++) {
+        if (lastBlocks[shard] == SIZE_MAX || (*progress)[shard].finished)
+            continue;
+        leveldb::Status status = ReadBlock(fd, (*blocks)[lastBlocks[shard]].offset, offset, &block, &contents);
+        if (!status.ok())
+            return status;
+        BlockReader reader(contents);
+        for (; reader.Valid(); reader.Next())
+            (*progress)[shard].lastKey = reader.key();
+        if (reader.Corrupted())
+            return leveldb::Status::Corruption("Damaged archive block");
+    }
+    return leveldb::Status::OK();
+}
+
+- (BOOL) _exportSnapshot:(LDBSnapshot *)snapshot
+                 fromKey:(const std::string &)start
+                   toKey:(const std::string *)limit
+                  resume:(BOOL)resume
+                   error:(NSError **)error {
+    NSParameterAssert(snapshot != nil);
+    LevelDB *database = snapshot.db;
+    LDBOperation operation([database inFlightTracker]);
+    if (!operation.Entered() || [snapshot getSnapshot] == NULL)
+        return FailWithStatus(error, leveldb::Status::IOError("The database is closed"));
+
+    ArchiveTask task(_bytesPerSecond, _progress);
+    ArchiveHeader header;
+    std::vector<ShardProgress> progress;
+    std::vector<BlockInfo> blocks;
+    uint64_t end = 0;
+    int fd = -1;
+
+    if (resume && (fd = open([_path fileSystemRepresentation], O_RDWR)) >= 0) {
+        struct stat info;
+        uint64_t fileSize = fstat(fd, &info) == 0 ? (uint64_t)info.st_size : 0;
+        ArchiveFooter footer;
+        if (!header.Read(fd, fileSize, &end).ok()) {
+            // Nothing was exported yet
+            close(fd);
+            fd = -1;
+        } else if (header.start != start || header.bounded != (limit != NULL) || (limit && header.limit != *limit)) {
+            close(fd);
+            return FailWithStatus(error, leveldb::Status::InvalidArgument("The archive holds another range of keys"));
+        } else if (footer.Read(fd, fileSize, header.ShardCount()).ok()) {
+            close(fd);
+            return YES;
+        } else {
+            progress.resize(header.ShardCount());
+            leveldb::Status status = [self _resumeExportInFile:fd
+                                                        header:header
+                                                         start:end
+                                                          task:&task
+                                                      progress:&progress
+                                                        blocks:&blocks
+                                                           end:&end];
+            if (!status.ok()) {
+                close(fd);
+                return FailWithStatus(error, status);
+            }
+        }
+    }
+
+    if (fd < 0) {
+        fd = open([_path fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return FailWithStatus(error, IOErrorForPath(_path));
+
+        std::random_device device;
+        for (size_t i = 0; i < kArchiveIdSize; i++)
+            header.id.push_back((char)device());
+        header.start = start;
+        header.bounded = (limit != NULL);
+        if (limit)
+            header.limit = *limit;
+        size_t shards = _shards > 0 ? _shards : [[NSProcessInfo processInfo] activeProcessorCount];
+        header.splits = [database _shardSplitKeysFromKey:start toKey:limit shards:shards];
+        progress.resize(header.ShardCount());
+
+        std::string encoded = header.Encode();
+        if (!WriteFully(fd, 0, encoded)) {
+            close(fd);
+            return FailWithStatus(error, IOErrorForPath(_path));
+        }
+        end = encoded.size();
+    }
+
+    // Tables are read for the export only, so they shouldn't evict the blocks the database uses
+    leveldb::ReadOptions options;
+    options.snapshot = [snapshot getSnapshot];
+    options.fill_cache = false;
+    options.verify_checksums = true;
+
+    // Blocks can't capture these by copy, so they are handed over by pointer
+    leveldb::DB *db = [database db];
+    LDBBlobStore *blobs = [database blobStore];
+    const leveldb::Comparator *comparator = [database comparator];
+    const leveldb::ReadOptions *optionsPtr = &options;
+    const ArchiveHeader *headerPtr = &header;
+    ShardProgress *progressPtr = progress.data();
+    std::vector<BlockInfo> *blocksPtr = &blocks;
+    uint64_t *endPtr = &end;
+    ArchiveTask *taskPtr = &task;
+    NSString *path = _path;
+    size_t blockSize = MAX(_blockSize, 1);
+    bool compress = _compression;
+
+    // Every shard is scanned by its own iterator, and appends a block to the file whenever one fills
+    dispatch_apply(header.ShardCount(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t shard) {
+        ShardProgress *shardProgress = &progressPtr[shard];
+        if (shardProgress->finished)
+            return;
+
+        const std::string *shardLimit = headerPtr->ShardLimit(shard);
+        // The library's own keys (index entries, import state) are rebuilt or meaningless in another database
+        leveldb::Iterator *iter = NewUserKeyIterator(db->NewIterator(*optionsPtr), comparator);
+        if (shardProgress->blocks == 0) {
+            iter->Seek(headerPtr->ShardStart(shard));
+        } else {
+            iter->Seek(shardProgress->lastKey);
+            if (iter->Valid() && iter->key() == leveldb::Slice(shardProgress->lastKey))
+                iter->Next();
+        }
+
+        BlockBuilder builder;
+        std::string blob;
+        uint32_t sequence = shardProgress->blocks;
+        bool done = false;
+        while (!done && !taskPtr->Stopped()) {
+            if (iter->Valid() && !(shardLimit && comparator->Compare(iter->key(), *shardLimit) >= 0)) {
+                // Separated values are archived themselves, the snapshot keeping their blob files
+                if (blobs && LDBBlobStore::IsPointer(iter->value())) {
+                    leveldb::Status status = blobs->Get(iter->value(), &blob);
+                    if (!status.ok()) {
+                        taskPtr->Fail(status);
+                        break;
+                    }
+                    builder.Add(iter->key(), blob);
+                } else {
+                    builder.Add(iter->key(), iter->value());
+                }
+                iter->Next();
+                if (builder.RawSize() < blockSize)
+                    continue;
+            } else if (!iter->status().ok()) {
+                taskPtr->Fail(iter->status());
+                break;
+            } else {
+                done = true;
+            }
+
+            // The last block of a shard is flagged, so that a resumed export knows it is complete
+            uint32_t entries = builder.Entries();
+            std::string block = builder.Finish(shard, sequence, done, compress);
+            taskPtr->limiter()->Acquire(block.size());
+            bool appended = taskPtr->Perform(entries, block.size(), [&]() {
+                if (!WriteFully(fd, *endPtr, block)) {
+                    taskPtr->Fail(IOErrorForPath(path));
+                    return false;
+                }
+                blocksPtr->push_back(BlockInfo { (uint32_t)shard, sequence, entries, *endPtr, block.size(), done });
+                *endPtr += block.size();
+                return true;
+            });
+            if (!appended)
+                break;
+            sequence++;
+        }
+        delete iter;
+    });
+
+    if (task.Stopped()) {
+        close(fd);
+        if (error != NULL)
+            *error = task.Cancelled() ? StoppedError() : [[task.error() retain] autorelease];
+        return NO;
+    }
+
+    ArchiveFooter footer;
+    footer.count = task.Count();
+    footer.offset = end;
+    footer.blocks.resize(header.ShardCount());
+    std::sort(blocks.begin(), blocks.end(), [](const BlockInfo &a, const BlockInfo &b) {
+        return a.shard != b.shard ? a.shard < b.shard : a.sequence < b.sequence;
+    });
+    for (const BlockInfo &block : blocks)
+        footer.blocks[block.shard].push_back(block.offset);
+
+    bool written = WriteFully(fd, end, footer.Encode()) && fsync(fd) == 0;
+    if (!written) {
+        leveldb::Status status = IOErrorForPath(_path);
+        close(fd);
+        return FailWithStatus(error, status);
+    }
+    close(fd);
+    return YES;
+}
+
+#pragma mark - Importing
+
+- (leveldb::Status) _openForReading:(int *)fd header:(ArchiveHeader *)header footer:(ArchiveFooter *)footer {
+    *fd = open([_path fileSystemRepresentation], O_RDONLY);
+    if (*fd < 0)
+        return IOErrorForPath(_path);
+
+    struct stat info;
+    uint64_t end;
+    leveldb::Status status;
+    if (fstat(*fd, &info) != 0)
+        status = IOErrorForPath(_path);
+    if (status.ok())
+        status = header->Read(*fd, (uint64_t)info.st_size, &end);
+    if (status.ok())
+        status = footer->Read(*fd, (uint64_t)info.st_size, header->ShardCount());
+    if (!status.ok()) {
+        close(*fd);
+        *fd = -1;
+    }
+    return status;
+}
+
+- (BOOL) importIntoDB:(LevelDB *)database
+               resume:(BOOL)resume
+                error:(NSError **)error {
+    NSParameterAssert(database != nil);
+    LDBOperation operation([database inFlightTracker]);
+    if (!operation.Entered())
+        return FailWithStatus(error, leveldb::Status::IOError("The database is closed"));
+
+    int fd;
+    ArchiveHeader header;
+    ArchiveFooter footer;
+    leveldb::Status status = [self _openForReading:&fd header:&header footer:&footer];
+    if (!status.ok())
+        return FailWithStatus(error, status);
+
+    // Shards loaded so far are recorded as a '1' at their index, under a key naming the archive
+    std::string stateKey(kImportStatePrefix);
+    for (char c : header.id) {
+        static const char digits[] = "0123456789abcdef";
+        stateKey.push_back(digits[(unsigned char)c >> 4]);
+        stateKey.push_back(digits[(unsigned char)c & 0xf]);
+    }
+    std::string loaded(header.ShardCount(), '0');
+    if (resume) {
+        std::string state;
+        if ([database db]->Get(leveldb::ReadOptions(), stateKey, &state).ok() && state.size() == loaded.size())
+            loaded = state;
+    }
+
+    ArchiveTask task(_bytesPerSecond, _progress);
+    ArchiveTask *taskPtr = &task;
+    const ArchiveFooter *footerPtr = &footer;
+    const std::string *stateKeyPtr = &stateKey;
+    std::string *loadedPtr = &loaded;
+
+    // Every shard is loaded by its own bulk load, in key order, and recorded once it completed
+    dispatch_apply(header.ShardCount(), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t shard) {
+        if ((*loadedPtr)[shard] == '1' || taskPtr->Stopped())
+            return;
+
+        LDBBulkLoader *loader = [database newBulkLoaderWithSortedInput:YES];
+        loader.compactsWhenFinished = NO;
+
+        std::string contents;
+        const std::vector<uint64_t> &offsets = footerPtr->blocks[shard];
+        for (size_t i = 0; i < offsets.size() && !taskPtr->Stopped(); i++) {
+            BlockInfo block;
+            leveldb::Status blockStatus = ReadBlock(fd, offsets[i], footerPtr->offset, &block, &contents);
+            if (blockStatus.ok() && (block.shard != shard || block.sequence != i))
+                blockStatus = leveldb::Status::Corruption("Misplaced archive block");
+            if (!blockStatus.ok()) {
+                taskPtr->Fail(blockStatus);
+                break;
+            }
+            taskPtr->limiter()->Acquire(block.size);
+
+            uint32_t entries = 0;
+            BlockReader reader(contents);
+            @autoreleasepool {
+                for (; reader.Valid(); reader.Next(), entries++)
+                    [loader _addKey:reader.key() value:reader.value()];
+            }
+            if (reader.Corrupted() || entries != block.entries) {
+                taskPtr->Fail(leveldb::Status::Corruption("Damaged archive block"));
+                break;
+            }
+            taskPtr->Perform(entries, block.size, []() { return true; });
+        }
+
+        NSError *loadError = nil;
+        if (![loader finishWithError:&loadError])
+            taskPtr->Fail(loadError);
+        [loader release];
+        if (taskPtr->Stopped())
+            return;
+
+        // Written directly like index markers, so that the bookkeeping reaches neither indexes nor change subscribers
+        taskPtr->Perform(0, 0, [&]() {
+            (*loadedPtr)[shard] = '1';
+            leveldb::WriteOptions options;
+            options.sync = true;
+            leveldb::Status stateStatus = [database db]->Put(options, *stateKeyPtr, *loadedPtr);
+            if (!stateStatus.ok()) {
+                taskPtr->Fail(stateStatus);
+                return false;
+            }
+            return true;
+        });
+    });
+    close(fd);
+
+    if (task.Stopped()) {
+        if (error != NULL)
+            *error = task.Cancelled() ? StoppedError() : [[task.error() retain] autorelease];
+        return NO;
+    }
+
+    status = [database db]->Delete(leveldb::WriteOptions(), stateKey);
+    if (!status.ok())
+        return FailWithStatus(error, status);
+
+    if (_compactsWhenFinished) {
+        [database compactRangeFromKey:DataFromSlice(leveldb::Slice(header.start))
+                                toKey:header.bounded ? DataFromSlice(leveldb::Slice(header.limit)) : nil
+                             progress:nil];
+    }
+    return YES;
+}
+
+- (BOOL) verifyWithError:(NSError **)error {
+    int fd;
+    ArchiveHeader header;
+    ArchiveFooter footer;
+    leveldb::Status status = [self _openForReading:&fd header:&header footer:&footer];
+
+    uint64_t count = 0;
+    std::string contents;
+    for (size_t shard = 0; status.ok() && shard < footer.blocks.size(); shard++) {
+        for (size_t i = 0; status.ok() && i < footer.blocks[shard].size(); i++) {
+            BlockInfo block;
+            status = ReadBlock(fd, footer.blocks[shard][i], footer.offset, &block, &contents);
+            if (status.ok() && (block.shard != shard || block.sequence != i))
+                status = leveldb::Status::Corruption("Misplaced archive block");
+            uint32_t entries = 0;
+            BlockReader reader(contents);
+            for (; status.ok() && reader.Valid(); reader.Next())
+                entries++;
+            if (status.ok() && (reader.Corrupted() || entries != block.entries))
+                status = leveldb::Status::Corruption("Damaged archive block");
+            count += entries;
+        }
+    }
+    if (status.ok() && count != footer.count)
+        status = leveldb::Status::Corruption("Incomplete archive");
+
+    if (fd >= 0)
+        close(fd);
+    if (!status.ok())
+        return FailWithStatus(error, status);
+    return YES;
+}
+
+@end
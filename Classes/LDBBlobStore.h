@@ -0,0 +1,164 @@
+//
+//  LDBBlobStore.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+#ifdef __cplusplus
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+namespace leveldb {
+    class DB;
+    class Slice;
+    class Status;
+    class WriteBatch;
+    struct WriteOptions;
+}
+
+/*
+ * The blob files of a database, holding the values separated from leveldb's tables because of their size.
+ *
+ * Blob files sit in the `blobs` directory of the database, and are only ever appended to, a new one being started
+ * whenever the current one reaches its maximum size, or the database is opened. Each record holds a key and its value,
+ * after their lengths and a CRC-32 of both lengths and key. Leveldb holds a fixed-size pointer in place of the value:
+ * a reserved prefix, the file number, the offset and size of the value, the CRC-32 of the value, and a CRC-32 of the
+ * pointer itself.
+ *
+ * Writes hold a shared lock from the moment their values are appended until their pointers are committed. The garbage
+ * collector takes it exclusively, so that a pointer it moves can't be overwritten between the check that it is still
+ * the key's value and the write relocating it. A blob file whose live values were relocated is only deleted once no
+ * reader may still follow the pointers it was read with: snapshots and cursors pin the epoch they were created in, and
+ * shorter reads hold a read guard, counted under the parity of the epoch they started in.
+ */
+class LDBBlobStore {
+public:
+    // Open the blob files in `path`, creating the directory if needed. Values of `threshold` bytes or more (if not
+    // 0) are separated from then on, into files of at most `fileSize` bytes.
+    static leveldb::Status Open(const std::string &path, size_t threshold, size_t fileSize, LDBBlobStore **store);
+    ~LDBBlobStore();
+
+    // Return whether a value read from leveldb is a pointer to a blob
+    static bool IsPointer(const leveldb::Slice &value);
+    // Return the size of a value read from leveldb, or of the blob it points to
+    static size_t ValueSize(const leveldb::Slice &value);
+    // Return whether the value of a put is separated into a blob file
+    bool Separates(const leveldb::Slice &key, const leveldb::Slice &value) const;
+
+    // Commit a batch (or a single put), after appending its large values to a blob file and replacing them with
+    // pointers. Blobs are synced before the batch is, once per batch, even if `options.sync` isn't set.
+    leveldb::Status Write(leveldb::DB *db, const leveldb::WriteOptions &options, leveldb::WriteBatch *batch);
+    leveldb::Status Put(leveldb::DB *db, const leveldb::WriteOptions &options,
+                        const leveldb::Slice &key, const leveldb::Slice &value);
+    // Commit a deletion, which mustn't race with the relocation of the key's value either
+    leveldb::Status Delete(leveldb::DB *db, const leveldb::WriteOptions &options, const leveldb::Slice &key);
+
+    // Read the value a pointer refers to, straight from the mapped blob file if it isn't the one being written.
+    // Returns nil, and sets `status`, if it can't be read or doesn't match its checksum.
+    NSData *Read(const leveldb::Slice &pointer, leveldb::Status *status);
+    // Same, copying the value into `value`
+    leveldb::Status Get(const leveldb::Slice &pointer, std::string *value);
+
+    // Keep the files read by a snapshot or cursor created after `Pin`, until the matching `Unpin`
+    uint64_t Pin();
+    void Unpin(uint64_t epoch);
+
+    // Keep the files read by a short operation, until the matching `LeaveRead`. See LDBBlobReadGuard.
+    int EnterRead();
+    void LeaveRead(int slot);
+
+    // Examine up to `maxFiles` blob files, relocating the live values of those with at least `ratio` garbage, and
+    // delete the files collected earlier that no reader can use anymore. Stops early once `cancelled` is set.
+    LevelDBBlobCollectionStatistics CollectGarbage(leveldb::DB *db, double ratio, size_t maxFiles,
+                                                   const std::atomic<bool> *cancelled);
+
+    LevelDBBlobStatistics Statistics();
+
+private:
+    struct Mapping;
+    struct BlobFile;
+    struct Record;
+    class Separator;
+
+    static const int kStripes = 16;
+
+    struct alignas(64) ReaderStripe {
+        std::atomic<uint64_t> count[2];     // Readers in flight, by parity of the epoch they started in
+    };
+
+    LDBBlobStore(const std::string &path, size_t threshold, size_t fileSize);
+
+    std::string FilePath(uint64_t number) const;
+    leveldb::Status Load();
+    leveldb::Status AppendLocked(const leveldb::Slice &key, const leveldb::Slice &value, std::string *pointer);
+    leveldb::Status SyncLocked();
+    leveldb::Status SealLocked();
+    std::shared_ptr<Mapping> MappingLocked(const std::shared_ptr<BlobFile> &file);
+    std::shared_ptr<BlobFile> NextCandidate();
+    leveldb::Status Examine(leveldb::DB *db, const std::shared_ptr<BlobFile> &file, double ratio,
+                            LevelDBBlobCollectionStatistics *stats);
+    leveldb::Status Relocate(leveldb::DB *db, const std::shared_ptr<BlobFile> &file, const char *base,
+                             const std::vector<Record> &records, LevelDBBlobCollectionStatistics *stats);
+    void MarkObsolete(const std::shared_ptr<BlobFile> &file);
+    void ReclaimObsolete(LevelDBBlobCollectionStatistics *stats);
+    uint64_t Readers(int parity) const;
+    uint64_t OldestPin();
+
+    const std::string path_;
+    const size_t threshold_;
+    const size_t fileSize_;
+
+    pthread_rwlock_t commitLock_;           // Shared by writes, exclusive while relocating values
+    std::mutex writeMu_;                    // Appends to the current file
+    std::shared_ptr<BlobFile> current_;     // The file being written, or NULL before the first append
+    uint64_t nextNumber_;
+
+    std::mutex filesMu_;
+    std::map<uint64_t, std::shared_ptr<BlobFile> > files_;
+    size_t mappedFiles_;
+    uint64_t useClock_;                     // Orders the uses of mappings, to unmap the least recently used
+
+    std::mutex gcMu_;                       // A single collection at a time
+    uint64_t lastExamined_;                 // Collections go through files in order, from the one after this
+
+    std::atomic<uint64_t> epoch_;
+    ReaderStripe readers_[kStripes];
+    std::mutex pinMu_;
+    std::multiset<uint64_t> pins_;
+
+    std::atomic<uint64_t> blobsWritten_, bytesWritten_, blobsRead_, bytesRead_;
+    std::atomic<uint64_t> filesExamined_, bytesRelocated_, bytesReclaimed_;
+
+    LDBBlobStore(const LDBBlobStore &);
+    LDBBlobStore &operator=(const LDBBlobStore &);
+};
+
+/*
+ * A short read following blob pointers, for as long as it is in scope. The store may be NULL.
+ */
+class LDBBlobReadGuard {
+public:
+    explicit LDBBlobReadGuard(LDBBlobStore *store) : store_(store), slot_(store ? store->EnterRead() : -1) {}
+    ~LDBBlobReadGuard() {
+        if (store_)
+            store_->LeaveRead(slot_);
+    }
+
+private:
+    LDBBlobStore *store_;
+    int slot_;
+
+    LDBBlobReadGuard(const LDBBlobReadGuard &);
+    LDBBlobReadGuard &operator=(const LDBBlobReadGuard &);
+};
+#endif
@@ -0,0 +1,862 @@
+//
+//  LDBBlobStore.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBBlobStore.h"
+
+#import <leveldb/db.h>
+#import <leveldb/write_batch.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "LDBCommon.h"
+
+// Prefix of the pointers leveldb holds in place of separated values
+static const char kBlobPointerPrefix[] = kLDBReservedKeyPrefix "blob:";
+// Size of a pointer: prefix, file number, offset and size of the value, checksum of the value, and its own checksum
+static const size_t kBlobPointerSize = sizeof(kBlobPointerPrefix) - 1 + 8 + 8 + 4 + 4 + 4;
+// Size of the header of a record: checksum of the lengths and key, length of the key, length of the value
+static const size_t kRecordHeaderSize = 12;
+// Extension of blob files, named after their number
+static const char kBlobFileSuffix[] = ".blob";
+// At most this many blob files are mapped at once, the least recently read being unmapped first
+static const size_t kMaxMappedFiles = 64;
+// Live values are relocated in write batches of at most this many bytes, while writes wait
+static const size_t kRelocationBatchBytes = 4 * 1024 * 1024;
+
+/*
+ * An immutable NSData pointing inside a mapped blob file, which it keeps mapped for as long as it lives
+ */
+@interface LDBBlobData : NSData
+
++ (instancetype) dataWithBytes:(const void *)bytes length:(NSUInteger)length owner:(const std::shared_ptr<void> &)owner;
+
+@end
+
+@implementation LDBBlobData {
+    std::shared_ptr<void> _owner;
+    const void *_bytes;
+    NSUInteger _length;
+}
+
++ (instancetype) dataWithBytes:(const void *)bytes length:(NSUInteger)length owner:(const std::shared_ptr<void> &)owner {
+    LDBBlobData *data = [[[self alloc] init] autorelease];
+    data->_owner = owner;
+    data->_bytes = bytes;
+    data->_length = length;
+    return data;
+}
+- (const void *) bytes {
+    return _bytes;
+}
+- (NSUInteger) length {
+    return _length;
+}
+
+@end
+
+namespace {
+    void PutFixed32(std::string *dst, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            dst->push_back((char)(value >> (8 * i)));
+    }
+    void PutFixed64(std::string *dst, uint64_t value) {
+        for (int i = 0; i < 8; i++)
+            dst->push_back((char)(value >> (8 * i)));
+    }
+    uint32_t DecodeFixed32(const char *p) {
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; i--)
+            value = (value << 8) | (unsigned char)p[i];
+        return value;
+    }
+    uint64_t DecodeFixed64(const char *p) {
+        return (uint64_t)DecodeFixed32(p + 4) << 32 | DecodeFixed32(p);
+    }
+
+    uint32_t Checksum(uint32_t crc, const char *data, size_t length) {
+        return (uint32_t)crc32(crc, (const Bytef *)data, (uInt)length);
+    }
+
+    bool ReadFully(int fd, uint64_t offset, char *buffer, size_t length) {
+        while (length > 0) {
+            ssize_t count = pread(fd, buffer, length, (off_t)offset);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            buffer += count;
+            offset += count;
+            length -= count;
+        }
+        return true;
+    }
+    bool WriteFully(int fd, uint64_t offset, const char *buffer, size_t length) {
+        while (length > 0) {
+            ssize_t count = pwrite(fd, buffer, length, (off_t)offset);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            buffer += count;
+            offset += count;
+            length -= count;
+        }
+        return true;
+    }
+
+    leveldb::Status IOErrorForPath(const std::string &path) {
+        return leveldb::Status::IOError(path, strerror(errno));
+    }
+
+    // Hold a read-write lock, shared or exclusively, until the end of the scope
+    class RWLockHolder {
+    public:
+        RWLockHolder(pthread_rwlock_t *lock, bool exclusive) : lock_(lock) {
+            if (exclusive)
+                pthread_rwlock_wrlock(lock_);
+            else
+                pthread_rwlock_rdlock(lock_);
+        }
+        ~RWLockHolder() {
+            pthread_rwlock_unlock(lock_);
+        }
+
+    private:
+        pthread_rwlock_t *lock_;
+    };
+
+    // Where a separated value lives
+    struct BlobPointer {
+        uint64_t file;
+        uint64_t offset;
+        uint32_t size;
+        uint32_t checksum;
+    };
+
+    std::string EncodePointer(const BlobPointer &blob) {
+        std::string pointer(kBlobPointerPrefix);
+        PutFixed64(&pointer, blob.file);
+        PutFixed64(&pointer, blob.offset);
+        PutFixed32(&pointer, blob.size);
+        PutFixed32(&pointer, blob.checksum);
+        PutFixed32(&pointer, Checksum(0, pointer.data(), pointer.size()));
+        return pointer;
+    }
+    bool DecodePointer(const leveldb::Slice &pointer, BlobPointer *blob) {
+        if (!LDBBlobStore::IsPointer(pointer))
+            return false;
+        const char *fields = pointer.data() + sizeof(kBlobPointerPrefix) - 1;
+        if (DecodeFixed32(fields + 24) != Checksum(0, pointer.data(), kBlobPointerSize - 4))
+            return false;
+        blob->file = DecodeFixed64(fields);
+        blob->offset = DecodeFixed64(fields + 8);
+        blob->size = DecodeFixed32(fields + 16);
+        blob->checksum = DecodeFixed32(fields + 20);
+        return true;
+    }
+
+    // Find whether a write batch holds any value to separate, before paying for rebuilding it
+    class SeparableFinder : public leveldb::WriteBatch::Handler {
+    public:
+        explicit SeparableFinder(const LDBBlobStore *store) : found(false), store_(store) {}
+
+        virtual void Put(const leveldb::Slice &key, const leveldb::Slice &value) {
+            found = found || store_->Separates(key, value);
+        }
+        virtual void Delete(const leveldb::Slice &key) {}
+
+        bool found;
+
+    private:
+        const LDBBlobStore *store_;
+    };
+
+    int StripeForCurrentThread(int stripes) {
+        uint64_t thread = (uint64_t)(uintptr_t)pthread_self();
+        return (int)((((thread >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) % (uint64_t)stripes);
+    }
+}
+
+// A blob file mapped in memory, unmapped once neither the store nor any value read from it uses it
+struct LDBBlobStore::Mapping {
+    void *base;
+    size_t length;
+
+    Mapping(void *base, size_t length) : base(base), length(length) {}
+    ~Mapping() {
+        munmap(base, length);
+    }
+};
+
+// Everything but `size` is guarded by filesMu_
+struct LDBBlobStore::BlobFile {
+    const uint64_t number;
+    const int fd;                   // Open on the files written since the database was opened, -1 on the others
+    std::atomic<uint64_t> size;
+    bool sealed;                    // No longer written to, and mapped when read
+    bool examined;
+    uint64_t garbage;               // Bytes of dead records, as of the last examination
+    bool obsolete;                  // Collected, and deleted once no reader started in `obsoleteEpoch` or before remains
+    uint64_t obsoleteEpoch;
+    std::shared_ptr<Mapping> mapping;
+    uint64_t lastUse;
+
+    BlobFile(uint64_t number, int fd, uint64_t size, bool sealed)
+        : number(number), fd(fd), size(size), sealed(sealed), examined(false), garbage(0),
+          obsolete(false), obsoleteEpoch(0), lastUse(0) {}
+    ~BlobFile() {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+// A record of a blob file, as found by the garbage collector
+struct LDBBlobStore::Record {
+    leveldb::Slice key;
+    uint64_t valueOffset;
+    uint32_t valueSize;
+    uint64_t size;
+};
+
+/*
+ * Rebuild a write batch with its large values appended to the current blob file, and replaced by pointers to them.
+ * Runs with writeMu_ held.
+ */
+class LDBBlobStore::Separator : public leveldb::WriteBatch::Handler {
+public:
+    explicit Separator(LDBBlobStore *store) : store_(store) {}
+
+    virtual void Put(const leveldb::Slice &key, const leveldb::Slice &value) {
+        if (!status.ok())
+            return;
+        if (!store_->Separates(key, value)) {
+            batch.Put(key, value);
+            return;
+        }
+        std::string pointer;
+        status = store_->AppendLocked(key, value, &pointer);
+        batch.Put(key, pointer);
+        store_->blobsWritten_++;
+        store_->bytesWritten_ += value.size();
+    }
+    virtual void Delete(const leveldb::Slice &key) {
+        batch.Delete(key);
+    }
+
+    leveldb::WriteBatch batch;
+    leveldb::Status status;
+
+private:
+    LDBBlobStore *store_;
+};
+
+#pragma mark - Opening
+
+leveldb::Status LDBBlobStore::Open(const std::string &path, size_t threshold, size_t fileSize, LDBBlobStore **store) {
+    *store = NULL;
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+        return IOErrorForPath(path);
+
+    LDBBlobStore *opened = new LDBBlobStore(path, threshold, fileSize);
+    leveldb::Status status = opened->Load();
+    if (!status.ok()) {
+        delete opened;
+        return status;
+    }
+    *store = opened;
+    return status;
+}
+
+LDBBlobStore::LDBBlobStore(const std::string &path, size_t threshold, size_t fileSize)
+    : path_(path), threshold_(threshold), fileSize_(std::max(fileSize, (size_t)1)), nextNumber_(1),
+      mappedFiles_(0), useClock_(0), lastExamined_(0), epoch_(0),
+      blobsWritten_(0), bytesWritten_(0), blobsRead_(0), bytesRead_(0),
+      filesExamined_(0), bytesRelocated_(0), bytesReclaimed_(0) {
+    pthread_rwlock_init(&commitLock_, NULL);
+    for (int i = 0; i < kStripes; i++) {
+        readers_[i].count[0].store(0, std::memory_order_relaxed);
+        readers_[i].count[1].store(0, std::memory_order_relaxed);
+    }
+}
+
+LDBBlobStore::~LDBBlobStore() {
+    // Values still referencing a mapping keep it until they are released
+    current_.reset();
+    files_.clear();
+    pthread_rwlock_destroy(&commitLock_);
+}
+
+std::string LDBBlobStore::FilePath(uint64_t number) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/%06llu%s", (unsigned long long)number, kBlobFileSuffix);
+    return path_ + name;
+}
+
+// Every file found is sealed: writes always start a new one
+leveldb::Status LDBBlobStore::Load() {
+    DIR *dir = opendir(path_.c_str());
+    if (dir == NULL)
+        return IOErrorForPath(path_);
+
+    leveldb::Status status;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+        uint64_t number = strtoull(entry->d_name, &end, 10);
+        if (number == 0 || strcmp(end, kBlobFileSuffix) != 0)
+            continue;
+
+        struct stat info;
+        if (stat(FilePath(number).c_str(), &info) != 0) {
+            status = IOErrorForPath(FilePath(number));
+            break;
+        }
+        files_[number] = std::make_shared<BlobFile>(number, -1, (uint64_t)info.st_size, true);
+        nextNumber_ = std::max(nextNumber_, number + 1);
+    }
+    closedir(dir);
+    return status;
+}
+
+#pragma mark - Writing
+
+bool LDBBlobStore::IsPointer(const leveldb::Slice &value) {
+    return value.size() == kBlobPointerSize && value.starts_with(kBlobPointerPrefix);
+}
+
+size_t LDBBlobStore::ValueSize(const leveldb::Slice &value) {
+    BlobPointer blob;
+    return DecodePointer(value, &blob) ? blob.size : value.size();
+}
+
+bool LDBBlobStore::Separates(const leveldb::Slice &key, const leveldb::Slice &value) const {
+    return threshold_ > 0 && value.size() >= threshold_ && value.size() > kBlobPointerSize
+        && value.size() <= UINT32_MAX && !key.starts_with(kLDBReservedKeyPrefix);
+}
+
+leveldb::Status LDBBlobStore::Write(leveldb::DB *db, const leveldb::WriteOptions &options, leveldb::WriteBatch *batch) {
+    RWLockHolder lock(&commitLock_, false);
+    SeparableFinder finder(this);
+    if (threshold_ > 0)
+        batch->Iterate(&finder);
+    if (!finder.found)
+        return db->Write(options, batch);
+
+    // Synced whatever `options.sync`: leveldb makes pointers durable on its own (a later synced write, a flushed
+    // memtable), which must never leave them pointing past the end of a blob file after a system crash
+    Separator separator(this);
+    {
+        std::lock_guard<std::mutex> appendLock(writeMu_);
+        batch->Iterate(&separator);
+        if (separator.status.ok())
+            separator.status = SyncLocked();
+    }
+    if (!separator.status.ok())
+        return separator.status;
+    return db->Write(options, &separator.batch);
+}
+
+leveldb::Status LDBBlobStore::Put(leveldb::DB *db, const leveldb::WriteOptions &options,
+                                  const leveldb::Slice &key, const leveldb::Slice &value) {
+    RWLockHolder lock(&commitLock_, false);
+    if (!Separates(key, value))
+        return db->Put(options, key, value);
+
+    std::string pointer;
+    leveldb::Status status;
+    {
+        std::lock_guard<std::mutex> appendLock(writeMu_);
+        status = AppendLocked(key, value, &pointer);
+        if (status.ok())
+            status = SyncLocked();
+    }
+    if (!status.ok())
+        return status;
+    blobsWritten_++;
+    bytesWritten_ += value.size();
+    return db->Put(options, key, pointer);
+}
+
+leveldb::Status LDBBlobStore::Delete(leveldb::DB *db, const leveldb::WriteOptions &options, const leveldb::Slice &key) {
+    RWLockHolder lock(&commitLock_, false);
+    return db->Delete(options, key);
+}
+
+// A failed append leaves the size of the file unchanged, so that the next one overwrites what it wrote
+leveldb::Status LDBBlobStore::AppendLocked(const leveldb::Slice &key, const leveldb::Slice &value, std::string *pointer) {
+    uint64_t recordSize = kRecordHeaderSize + key.size() + value.size();
+    if (current_ && current_->size.load() > 0 && current_->size.load() + recordSize > fileSize_) {
+        leveldb::Status status = SealLocked();
+        if (!status.ok())
+            return status;
+    }
+    if (!current_) {
+        uint64_t number = nextNumber_++;
+        int fd = open(FilePath(number).c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+            return IOErrorForPath(FilePath(number));
+        current_ = std::make_shared<BlobFile>(number, fd, 0, false);
+        std::lock_guard<std::mutex> lock(filesMu_);
+        files_[number] = current_;
+    }
+
+    std::string header, lengths;
+    PutFixed32(&lengths, (uint32_t)key.size());
+    PutFixed32(&lengths, (uint32_t)value.size());
+    PutFixed32(&header, Checksum(Checksum(0, lengths.data(), lengths.size()), key.data(), key.size()));
+    header.append(lengths);
+
+    uint64_t offset = current_->size.load();
+    uint64_t valueOffset = offset + kRecordHeaderSize + key.size();
+    if (!WriteFully(current_->fd, offset, header.data(), header.size())
+        || !WriteFully(current_->fd, offset + kRecordHeaderSize, key.data(), key.size())
+        || !WriteFully(current_->fd, valueOffset, value.data(), value.size()))
+        return IOErrorForPath(FilePath(current_->number));
+    current_->size.store(offset + recordSize);
+
+    BlobPointer blob = { current_->number, valueOffset, (uint32_t)value.size(), Checksum(0, value.data(), value.size()) };
+    *pointer = EncodePointer(blob);
+    return leveldb::Status::OK();
+}
+
+leveldb::Status LDBBlobStore::SyncLocked() {
+    if (current_ && fsync(current_->fd) != 0)
+        return IOErrorForPath(FilePath(current_->number));
+    return leveldb::Status::OK();
+}
+
+// Sealed files are synced, so that writes only ever need to sync the current one
+leveldb::Status LDBBlobStore::SealLocked() {
+    leveldb::Status status = SyncLocked();
+    if (!status.ok())
+        return status;
+    std::lock_guard<std::mutex> lock(filesMu_);
+    current_->sealed = true;
+    current_.reset();
+    return status;
+}
+
+#pragma mark - Reading
+
+NSData *LDBBlobStore::Read(const leveldb::Slice &pointer, leveldb::Status *status) {
+    BlobPointer blob;
+    if (!DecodePointer(pointer, &blob)) {
+        *status = leveldb::Status::Corruption("Damaged blob pointer");
+        return nil;
+    }
+
+    std::shared_ptr<BlobFile> file;
+    std::shared_ptr<Mapping> mapping;
+    {
+        std::lock_guard<std::mutex> lock(filesMu_);
+        auto found = files_.find(blob.file);
+        if (found != files_.end()) {
+            file = found->second;
+            if (file->sealed)
+                mapping = MappingLocked(file);
+        }
+    }
+    if (!file) {
+        *status = leveldb::Status::Corruption("Missing blob file", FilePath(blob.file));
+        return nil;
+    }
+    if (blob.offset + blob.size > file->size.load()) {
+        *status = leveldb::Status::Corruption("Blob past the end of its file", FilePath(blob.file));
+        return nil;
+    }
+
+    NSData *data;
+    if (mapping) {
+        data = [LDBBlobData dataWithBytes:(const char *)mapping->base + blob.offset length:blob.size owner:mapping];
+    } else {
+        // The file being written, or one that couldn't be mapped
+        NSMutableData *buffer = [NSMutableData dataWithLength:blob.size];
+        int fd = file->fd >= 0 ? file->fd : open(FilePath(blob.file).c_str(), O_RDONLY);
+        bool read = fd >= 0 && ReadFully(fd, blob.offset, (char *)[buffer mutableBytes], blob.size);
+        if (!read)
+            *status = IOErrorForPath(FilePath(blob.file));
+        if (fd >= 0 && fd != file->fd)
+            close(fd);
+        if (!read)
+            return nil;
+        data = buffer;
+    }
+
+    if (Checksum(0, (const char *)[data bytes], blob.size) != blob.checksum) {
+        *status = leveldb::Status::Corruption("Blob checksum mismatch", FilePath(blob.file));
+        return nil;
+    }
+    blobsRead_++;
+    bytesRead_ += blob.size;
+    return data;
+}
+
+leveldb::Status LDBBlobStore::Get(const leveldb::Slice &pointer, std::string *value) {
+    leveldb::Status status;
+    @autoreleasepool {
+        NSData *data = Read(pointer, &status);
+        if (data != nil)
+            value->assign((const char *)[data bytes], [data length]);
+    }
+    return status;
+}
+
+// Map a sealed file, unless it is empty or mmap fails. Runs with filesMu_ held.
+std::shared_ptr<LDBBlobStore::Mapping> LDBBlobStore::MappingLocked(const std::shared_ptr<BlobFile> &file) {
+    file->lastUse = ++useClock_;
+    if (file->mapping)
+        return file->mapping;
+
+    uint64_t length = file->size.load();
+    if (length == 0 || length > SIZE_MAX)
+        return nullptr;
+    int fd = file->fd >= 0 ? file->fd : open(FilePath(file->number).c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    void *base = mmap(NULL, (size_t)length, PROT_READ, MAP_SHARED, fd, 0);
+    if (fd != file->fd)
+        close(fd);
+    if (base == MAP_FAILED)
+        return nullptr;
+
+    if (mappedFiles_ >= kMaxMappedFiles) {
+        BlobFile *leastRecent = NULL;
+        for (auto &entry : files_) {
+            BlobFile *mapped = entry.second.get();
+            if (mapped->mapping && (leastRecent == NULL || mapped->lastUse < leastRecent->lastUse))
+                leastRecent = mapped;
+        }
+        if (leastRecent) {
+            leastRecent->mapping.reset();
+            mappedFiles_--;
+        }
+    }
+    file->mapping = std::make_shared<Mapping>(base, (size_t)length);
+    mappedFiles_++;
+    return file->mapping;
+}
+
+#pragma mark - Readers
+
+uint64_t LDBBlobStore::Pin() {
+    std::lock_guard<std::mutex> lock(pinMu_);
+    uint64_t epoch = epoch_.load();
+    pins_.insert(epoch);
+    return epoch;
+}
+
+void LDBBlobStore::Unpin(uint64_t epoch) {
+    std::lock_guard<std::mutex> lock(pinMu_);
+    auto found = pins_.find(epoch);
+    if (found != pins_.end())
+        pins_.erase(found);
+}
+
+uint64_t LDBBlobStore::OldestPin() {
+    std::lock_guard<std::mutex> lock(pinMu_);
+    return pins_.empty() ? UINT64_MAX : *pins_.begin();
+}
+
+// A reader that saw the epoch change before it was counted retries, so that it never counts under a stale parity
+int LDBBlobStore::EnterRead() {
+    int stripe = StripeForCurrentThread(kStripes);
+    for (;;) {
+        uint64_t epoch = epoch_.load();
+        int parity = (int)(epoch & 1);
+        readers_[stripe].count[parity].fetch_add(1);
+        if (epoch_.load() == epoch)
+            return stripe * 2 + parity;
+        readers_[stripe].count[parity].fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void LDBBlobStore::LeaveRead(int slot) {
+    readers_[slot / 2].count[slot % 2].fetch_sub(1, std::memory_order_release);
+}
+
+// Sequentially consistent, like the add and load in EnterRead(): either the reader sees the new epoch, or this sees it
+uint64_t LDBBlobStore::Readers(int parity) const {
+    uint64_t total = 0;
+    for (int i = 0; i < kStripes; i++)
+        total += readers_[i].count[parity].load();
+    return total;
+}
+
+#pragma mark - Garbage collection
+
+LevelDBBlobCollectionStatistics LDBBlobStore::CollectGarbage(leveldb::DB *db, double ratio, size_t maxFiles,
+                                                             const std::atomic<bool> *cancelled) {
+    std::lock_guard<std::mutex> lock(gcMu_);
+    LevelDBBlobCollectionStatistics stats = {};
+    NSTimeInterval start = LDBMonotonicTime();
+
+    ReclaimObsolete(&stats);
+    std::set<uint64_t> examined;
+    while (examined.size() < maxFiles && !(cancelled && cancelled->load())) {
+        std::shared_ptr<BlobFile> file = NextCandidate();
+        if (!file || !examined.insert(file->number).second)
+            break;
+        leveldb::Status status = Examine(db, file, ratio, &stats);
+        if (!status.ok()) {
+            NSLog(@"Problem collecting blob file %llu: %s", (unsigned long long)file->number, status.ToString().c_str());
+            break;
+        }
+    }
+    ReclaimObsolete(&stats);
+
+    stats.time = LDBMonotonicTime() - start;
+    return stats;
+}
+
+// The sealed file following the last one examined, going back to the first one after the last
+std::shared_ptr<LDBBlobStore::BlobFile> LDBBlobStore::NextCandidate() {
+    std::lock_guard<std::mutex> lock(filesMu_);
+    std::shared_ptr<BlobFile> first;
+    for (auto &entry : files_) {
+        const std::shared_ptr<BlobFile> &file = entry.second;
+        if (!file->sealed || file->obsolete)
+            continue;
+        if (file->number > lastExamined_) {
+            lastExamined_ = file->number;
+            return file;
+        }
+        if (!first)
+            first = file;
+    }
+    if (first)
+        lastExamined_ = first->number;
+    return first;
+}
+
+/*
+ * A record is live if its key still points to it. A file without live records is collected, and one with enough
+ * garbage has its live records relocated first.
+ */
+leveldb::Status LDBBlobStore::Examine(leveldb::DB *db, const std::shared_ptr<BlobFile> &file, double ratio,
+                                      LevelDBBlobCollectionStatistics *stats) {
+    // Writes that appended to the file before it was sealed may not have committed their pointers yet
+    {
+        RWLockHolder barrier(&commitLock_, true);
+    }
+
+    uint64_t length = file->size.load();
+    std::shared_ptr<Mapping> mapping;
+    {
+        std::lock_guard<std::mutex> lock(filesMu_);
+        mapping = MappingLocked(file);
+    }
+    std::string contents;
+    const char *base;
+    if (mapping) {
+        base = (const char *)mapping->base;
+    } else {
+        contents.resize((size_t)length);
+        int fd = open(FilePath(file->number).c_str(), O_RDONLY);
+        bool read = fd >= 0 && ReadFully(fd, 0, &contents[0], contents.size());
+        leveldb::Status status = read ? leveldb::Status::OK() : IOErrorForPath(FilePath(file->number));
+        if (fd >= 0)
+            close(fd);
+        if (!status.ok())
+            return status;
+        base = contents.data();
+    }
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    std::vector<Record> live;
+    uint64_t liveBytes = 0;
+    std::string current;
+    for (uint64_t offset = 0; offset + kRecordHeaderSize <= length; ) {
+        const char *header = base + offset;
+        uint32_t keySize = DecodeFixed32(header + 4), valueSize = DecodeFixed32(header + 8);
+        Record record = { leveldb::Slice(header + kRecordHeaderSize, keySize),
+                          offset + kRecordHeaderSize + keySize, valueSize, kRecordHeaderSize + keySize + valueSize };
+        // A record torn by a crash ends the file
+        if (offset + record.size > length
+            || DecodeFixed32(header) != Checksum(Checksum(0, header + 4, 8), record.key.data(), keySize))
+            break;
+        offset += record.size;
+
+        leveldb::Status status = db->Get(options, record.key, &current);
+        if (!status.ok() && !status.IsNotFound())
+            return status;
+        BlobPointer blob;
+        if (status.ok() && DecodePointer(current, &blob) && blob.file == file->number && blob.offset == record.valueOffset) {
+            live.push_back(record);
+            liveBytes += record.size;
+        }
+    }
+
+    uint64_t garbage = length - liveBytes;
+    {
+        std::lock_guard<std::mutex> lock(filesMu_);
+        file->examined = true;
+        file->garbage = garbage;
+    }
+    filesExamined_++;
+    stats->filesExamined++;
+
+    if (!live.empty()) {
+        if (garbage == 0 || (double)garbage < ratio * (double)length)
+            return leveldb::Status::OK();
+        leveldb::Status status = Relocate(db, file, base, live, stats);
+        if (!status.ok())
+            return status;
+    }
+    MarkObsolete(file);
+    stats->filesCollected++;
+    return leveldb::Status::OK();
+}
+
+// Move live records to the current file, checking again under the exclusive lock that their keys still point to them
+leveldb::Status LDBBlobStore::Relocate(leveldb::DB *db, const std::shared_ptr<BlobFile> &file, const char *base,
+                                       const std::vector<Record> &records, LevelDBBlobCollectionStatistics *stats) {
+    leveldb::ReadOptions readOptions;
+    readOptions.fill_cache = false;
+    // The file is deleted once relocated, so the new pointers must be durable first
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+
+    std::string current;
+    for (size_t i = 0; i < records.size(); ) {
+        RWLockHolder lock(&commitLock_, true);
+        leveldb::WriteBatch batch;
+        uint64_t batchBytes = 0;
+        leveldb::Status status;
+        {
+            std::lock_guard<std::mutex> appendLock(writeMu_);
+            for (; i < records.size() && batchBytes < kRelocationBatchBytes; i++) {
+                const Record &record = records[i];
+                status = db->Get(readOptions, record.key, &current);
+                if (status.IsNotFound()) {
+                    status = leveldb::Status::OK();
+                    continue;
+                }
+                if (!status.ok())
+                    break;
+                BlobPointer blob;
+                if (!DecodePointer(current, &blob) || blob.file != file->number || blob.offset != record.valueOffset)
+                    continue;
+
+                leveldb::Slice value(base + record.valueOffset, record.valueSize);
+                if (Checksum(0, value.data(), value.size()) != blob.checksum) {
+                    status = leveldb::Status::Corruption("Blob checksum mismatch", FilePath(file->number));
+                    break;
+                }
+                std::string pointer;
+                status = AppendLocked(record.key, value, &pointer);
+                if (!status.ok())
+                    break;
+                batch.Put(record.key, pointer);
+                batchBytes += record.size;
+            }
+            if (status.ok() && batchBytes > 0)
+                status = SyncLocked();
+        }
+        if (status.ok() && batchBytes > 0)
+            status = db->Write(writeOptions, &batch);
+        if (!status.ok())
+            return status;
+        bytesRelocated_ += batchBytes;
+        stats->bytesRelocated += batchBytes;
+    }
+    return leveldb::Status::OK();
+}
+
+void LDBBlobStore::MarkObsolete(const std::shared_ptr<BlobFile> &file) {
+    std::lock_guard<std::mutex> lock(filesMu_);
+    file->obsolete = true;
+    file->obsoleteEpoch = epoch_.load();
+}
+
+/*
+ * Delete the files collected in an earlier epoch than the current one, once every reader that started before the
+ * current epoch is done, and no snapshot or cursor pinned since then remains. If files collected in the current
+ * epoch remain, a new one is started, for them to be deleted as soon as its readers are done.
+ */
+void LDBBlobStore::ReclaimObsolete(LevelDBBlobCollectionStatistics *stats) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint64_t epoch = epoch_.load();
+        // Readers that started before the current epoch are counted under the other parity
+        if (Readers((int)((epoch + 1) & 1)) > 0)
+            return;
+
+        uint64_t oldestPin = OldestPin();
+        std::vector<std::shared_ptr<BlobFile> > deleted;
+        bool waiting = false;
+        {
+            std::lock_guard<std::mutex> lock(filesMu_);
+            for (auto entry = files_.begin(); entry != files_.end(); ) {
+                BlobFile *file = entry->second.get();
+                if (file->obsolete && file->obsoleteEpoch < epoch && file->obsoleteEpoch < oldestPin) {
+                    if (file->mapping) {
+                        file->mapping.reset();
+                        mappedFiles_--;
+                    }
+                    deleted.push_back(entry->second);
+                    entry = files_.erase(entry);
+                    continue;
+                }
+                waiting = waiting || (file->obsolete && file->obsoleteEpoch >= epoch);
+                ++entry;
+            }
+        }
+
+        // A file that fails to be deleted is collected again when the database is next opened
+        for (const std::shared_ptr<BlobFile> &file : deleted) {
+            unlink(FilePath(file->number).c_str());
+            bytesReclaimed_ += file->size.load();
+            stats->filesDeleted++;
+            stats->bytesReclaimed += file->size.load();
+        }
+        if (!waiting)
+            return;
+        epoch_.store(epoch + 1);
+    }
+}
+
+#pragma mark - Statistics
+
+LevelDBBlobStatistics LDBBlobStore::Statistics() {
+    LevelDBBlobStatistics stats = {};
+    {
+        std::lock_guard<std::mutex> lock(filesMu_);
+        for (auto &entry : files_) {
+            const BlobFile *file = entry.second.get();
+            uint64_t size = file->size.load();
+            stats.files++;
+            stats.size += size;
+            if (file->obsolete) {
+                stats.pendingFiles++;
+                stats.garbageBytes += size;
+            } else if (file->examined) {
+                stats.garbageBytes += file->garbage;
+            } else if (file->sealed) {
+                stats.unexaminedFiles++;
+            }
+        }
+    }
+    stats.blobsWritten = blobsWritten_.load();
+    stats.bytesWritten = bytesWritten_.load();
+    stats.blobsRead = blobsRead_.load();
+    stats.bytesRead = bytesRead_.load();
+    stats.filesExamined = (NSUInteger)filesExamined_.load();
+    stats.bytesRelocated = bytesRelocated_.load();
+    stats.bytesReclaimed = bytesReclaimed_.load();
+    return stats;
+}
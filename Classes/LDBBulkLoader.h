@@ -0,0 +1,107 @@
+//
+//  LDBBulkLoader.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+/**
+ Load a large number of key value pairs into a database, at a much higher throughput than `setObject:forKey:`.
+
+ Values are encoded in parallel, by chunks, and written in large unsynced write batches committed on a background
+ queue while the next chunk is encoded. Finishing the load syncs the log once, then compacts the loaded range.
+
+ Keys are written in ascending order, so that leveldb flushes tables that don't overlap, which compactions can move
+ between levels without rewriting them. If the input isn't known to be sorted, it is sorted externally: runs of at most
+ `memoryLimit` bytes are sorted in memory and spilled to temporary files, which are merged when the load finishes.
+ When a key is loaded several times, its last value wins.
+
+ A bulk loader must be fed from one thread at a time. Open the database with `-[LDBOptions bulkLoadOptions]` to
+ also get a larger memtable, since leveldb can't change it once the database is open.
+ */
+@interface LDBBulkLoader : NSObject
+
+@property (nonatomic, readonly) LevelDB *db;
+
+/**
+ A boolean value indicating whether keys are added in ascending order, in which case they aren't sorted again
+ */
+@property (nonatomic, readonly) BOOL sorted;
+
+/**
+ The size in bytes a write batch can reach before it is committed (defaults to 4MB)
+ */
+@property (nonatomic) NSUInteger batchSize;
+
+/**
+ The size in bytes of the keys and encoded values sorted in memory before being spilled to disk, when the input
+ isn't sorted (defaults to 64MB)
+ */
+@property (nonatomic) NSUInteger memoryLimit;
+
+/**
+ A boolean value indicating whether the loaded range should be compacted when the load finishes (defaults to true)
+ */
+@property (nonatomic) BOOL compactsWhenFinished;
+
+/**
+ A block called whenever a write batch is handed over to be committed, with the number of keys written so far
+ (defaults to `nil`). Setting its `stop` argument to `TRUE` ignores every key added afterwards.
+ */
+@property (nonatomic, copy) LevelDBProgressBlock progress;
+
+/**
+ The number of keys added so far
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ The size in bytes of the keys and encoded values added so far, once they are encoded
+ */
+@property (nonatomic, readonly) uint64_t byteSize;
+
+/**
+ Return a new bulk loader writing into a database
+
+ @param db The database to load
+ @param sorted A boolean value indicating whether keys will be added in ascending order
+ */
++ (instancetype) bulkLoaderForDB:(LevelDB *)db sorted:(BOOL)sorted;
+
+/**
+ Add a key value pair, encoded with the database's encoder. Values are encoded a chunk at a time, on several threads at
+ once, so the encoder must be thread-safe, and a value must not be mutated once added.
+
+ @param value The value to load
+ @param key The key of the value (`NSString` or `NSData`)
+ */
+- (void) setObject:(id)value forKey:(id)key;
+
+/**
+ Add a key and its raw data, which won't go through the database's encoder
+ */
+- (void) setData:(NSData *)data forKey:(id)key;
+
+/**
+ Add every key value pair of an enumerator, each being an array holding a key and its value
+ */
+- (void) addEntriesFromEnumerator:(NSEnumerator *)enumerator;
+
+/**
+ Add every key value pair of a dictionary
+ */
+- (void) addEntriesFromDictionary:(NSDictionary *)dictionary;
+
+/**
+ Write every key still pending, wait for all write batches to be committed, sync the log and compact the loaded range
+
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if a write failed
+
+ @return A boolean value indicating whether every key was written
+ */
+- (BOOL) finishWithError:(NSError **)error;
+
+@end
@@ -0,0 +1,416 @@
+//
+//  LDBBulkLoader.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBBulkLoader.h"
+
+#import <leveldb/comparator.h>
+#import <leveldb/status.h>
+#import <leveldb/write_batch.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "LDBCommon.h"
+
+// Values are encoded in parallel, by chunks of this many entries
+static const NSUInteger kBulkEncodeChunkSize = 4096;
+// At most this many write batches are committed while the next one is filled
+static const long kBulkBatchesInFlight = 2;
+// Default limits of write batches, and of runs sorted in memory
+static const NSUInteger kBulkBatchSize = 4 * 1024 * 1024;
+static const NSUInteger kBulkMemoryLimit = 64 * 1024 * 1024;
+// Bookkeeping of an entry sorted in memory, counted along with its key and value against the memory limit
+static const size_t kBulkEntryOverhead = 64;
+
+@interface LevelDB ()
+- (BOOL) _writeBulkBatch:(leveldb::WriteBatch *)batch sync:(BOOL)sync error:(NSError **)error;
+- (const leveldb::Comparator *) comparator;
+@end
+
+namespace {
+    typedef std::pair<std::string, std::string> Entry;
+
+    // Entries are sorted in the order of the database's comparator
+    struct EntryKeyLess {
+        const leveldb::Comparator *comparator;
+        bool operator()(const Entry &a, const Entry &b) const {
+            return comparator->Compare(a.first, b.first) < 0;
+        }
+    };
+
+    bool WriteString(FILE *file, const std::string &string) {
+        uint32_t length = (uint32_t)string.size();
+        return fwrite(&length, sizeof(length), 1, file) == 1
+            && (length == 0 || fwrite(string.data(), 1, length, file) == length);
+    }
+
+    // Read back the entries of a sorted run spilled to a temporary file, which it closes
+    class RunReader {
+    public:
+        explicit RunReader(FILE *file) : file_(file), valid_(false) {
+            rewind(file_);
+            Next();
+        }
+        ~RunReader() {
+            fclose(file_);
+        }
+
+        bool Valid() const { return valid_; }
+        const Entry &entry() const { return entry_; }
+
+        void Next() {
+            valid_ = ReadString(&entry_.first) && ReadString(&entry_.second);
+        }
+
+    private:
+        bool ReadString(std::string *string) {
+            uint32_t length;
+            if (fread(&length, sizeof(length), 1, file_) != 1)
+                return false;
+            string->resize(length);
+            return length == 0 || fread(&(*string)[0], 1, length, file_) == length;
+        }
+
+        FILE *file_;
+        bool valid_;
+        Entry entry_;
+    };
+
+    // Open a temporary file, removed from the file system right away so that it goes away once closed
+    FILE * OpenTemporaryFile() {
+        NSString *pattern = [NSTemporaryDirectory() stringByAppendingPathComponent:@"leveldb-bulk-XXXXXX"];
+        char *path = strdup([pattern fileSystemRepresentation]);
+        FILE *file = NULL;
+        int fd = mkstemp(path);
+        if (fd >= 0) {
+            unlink(path);
+            file = fdopen(fd, "w+b");
+            if (file == NULL)
+                close(fd);
+        }
+        free(path);
+        return file;
+    }
+}
+
+@implementation LDBBulkLoader {
+    NSMutableArray *_pendingKeys;
+    NSMutableArray *_pendingValues;
+    std::vector<bool> _pendingRaw;          // Whether pending values are raw data, skipping the encoder
+
+    const leveldb::Comparator *_comparator;
+    leveldb::WriteBatch *_batch;
+    size_t _batchBytes;
+    NSUInteger _written;
+    std::string _smallest, _largest;
+    dispatch_queue_t _commitQueue;
+    dispatch_semaphore_t _inFlight;
+    NSError *_error;                        // The first error, set on the commit queue until it is drained
+
+    std::vector<Entry> _run;
+    size_t _runBytes;
+    std::vector<FILE *> _spills;
+
+    BOOL _stopped;
+    BOOL _finished;
+}
+
++ (instancetype) bulkLoaderForDB:(LevelDB *)db sorted:(BOOL)sorted {
+    LDBBulkLoader *loader = [[[self alloc] init] autorelease];
+    loader->_db = [db retain];
+    loader->_comparator = [db comparator];
+    loader->_sorted = sorted;
+    return loader;
+}
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _batchSize = kBulkBatchSize;
+        _memoryLimit = kBulkMemoryLimit;
+        _compactsWhenFinished = YES;
+        _pendingKeys = [[NSMutableArray alloc] initWithCapacity:kBulkEncodeChunkSize];
+        _pendingValues = [[NSMutableArray alloc] initWithCapacity:kBulkEncodeChunkSize];
+        _commitQueue = dispatch_queue_create("com.matehat.leveldb.bulkloader", DISPATCH_QUEUE_SERIAL);
+        _inFlight = dispatch_semaphore_create(kBulkBatchesInFlight);
+    }
+    return self;
+}
+
+- (void) dealloc {
+    // Batches handed over reference the loader's state until committed
+    if (_commitQueue) {
+        dispatch_sync(_commitQueue, ^{});
+        dispatch_release(_commitQueue);
+    }
+    if (_inFlight) dispatch_release(_inFlight);
+    delete _batch;
+    for (FILE *file : _spills)
+        fclose(file);
+    [_pendingKeys release];
+    [_pendingValues release];
+    [_progress release];
+    [_error release];
+    [_db release];
+    [super dealloc];
+}
+
+#pragma mark - Adding entries
+
+- (void) setObject:(id)value forKey:(id)key {
+    AssertKeyType(key);
+    NSParameterAssert(value != nil);
+    [self _addValue:value forKey:key raw:NO];
+}
+- (void) setData:(NSData *)data forKey:(id)key {
+    AssertKeyType(key);
+    NSParameterAssert(data != nil);
+    [self _addValue:data forKey:key raw:YES];
+}
+- (void) addEntriesFromEnumerator:(NSEnumerator *)enumerator {
+    for (NSArray *pair in enumerator) {
+        NSParameterAssert([pair isKindOfClass:[NSArray class]] && pair.count == 2);
+        [self setObject:pair[1] forKey:pair[0]];
+    }
+}
+- (void) addEntriesFromDictionary:(NSDictionary *)dictionary {
+    [dictionary enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
+        [self setObject:obj forKey:key];
+    }];
+}
+
+- (void) _addValue:(id)value forKey:(id)key raw:(BOOL)raw {
+    NSAssert(!_finished, @"Keys can't be added to a finished bulk load");
+    if (_stopped)
+        return;
+    [_pendingKeys addObject:key];
+    [_pendingValues addObject:value];
+    _pendingRaw.push_back(raw);
+    _count++;
+    if (_pendingKeys.count >= kBulkEncodeChunkSize)
+        [self _encodePending];
+}
+
+/*
+ * Encode the pending values concurrently, then hand them over in order, to be written or sorted.
+ */
+- (void) _encodePending {
+    NSUInteger count = _pendingKeys.count;
+    if (count == 0)
+        return;
+
+    NSData **encoded = (NSData **)calloc(count, sizeof(NSData *));
+    NSArray *keys = _pendingKeys;
+    NSArray *values = _pendingValues;
+    const std::vector<bool> *raw = &_pendingRaw;
+    LevelDBEncoderBlock encoder = _db.encoder;
+
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        @autoreleasepool {
+            id value = values[i];
+            if ((*raw)[i]) {
+                encoded[i] = [value retain];
+            } else {
+                id key = keys[i];
+                leveldb::Slice k = KeyFromStringOrData(key);
+                LevelDBKey lkey = GenericKeyFromSlice(k);
+                encoded[i] = [encoder(&lkey, value) retain];
+            }
+        }
+    });
+
+    @autoreleasepool {
+        for (NSUInteger i = 0; i < count; i++) {
+            id key = keys[i];
+            if (!_stopped)
+                [self _addKey:(KeyFromStringOrData(key)) value:SliceFromData(encoded[i])];
+            [encoded[i] release];
+        }
+    }
+    free(encoded);
+
+    [_pendingKeys removeAllObjects];
+    [_pendingValues removeAllObjects];
+    _pendingRaw.clear();
+}
+
+- (void) _addKey:(const leveldb::Slice &)key value:(const leveldb::Slice &)value {
+    _byteSize += key.size() + value.size();
+    if (_sorted) {
+        [self _writeKey:key value:value];
+        return;
+    }
+    _run.push_back(Entry(key.ToString(), value.ToString()));
+    _runBytes += key.size() + value.size() + kBulkEntryOverhead;
+    if (_runBytes >= _memoryLimit)
+        [self _spillRun];
+}
+
+#pragma mark - External sort
+
+- (void) _spillRun {
+    std::stable_sort(_run.begin(), _run.end(), EntryKeyLess { _comparator });
+
+    FILE *file = OpenTemporaryFile();
+    bool written = (file != NULL);
+    for (size_t i = 0; written && i < _run.size(); i++)
+        written = WriteString(file, _run[i].first) && WriteString(file, _run[i].second);
+    written = written && fflush(file) == 0;
+
+    if (written) {
+        _spills.push_back(file);
+    } else {
+        if (file != NULL)
+            fclose(file);
+        [self _failWithStatus:leveldb::Status::IOError("Unable to spill sorted keys to a temporary file")];
+    }
+    std::vector<Entry>().swap(_run);
+    _runBytes = 0;
+}
+
+/*
+ * Write the entries sorted so far, merging the spilled runs if there are any. Runs are merged by key,
+ * then in the order they were spilled, so that the last value of a key loaded several times wins.
+ */
+- (void) _writeSortedRuns {
+    if (_spills.empty()) {
+        std::stable_sort(_run.begin(), _run.end(), EntryKeyLess { _comparator });
+        for (size_t i = 0; i < _run.size() && !_stopped; i++)
+            [self _writeKey:_run[i].first value:_run[i].second];
+        std::vector<Entry>().swap(_run);
+        return;
+    }
+
+    if (!_run.empty())
+        [self _spillRun];
+
+    std::vector<RunReader *> readers;
+    for (FILE *file : _spills)
+        readers.push_back(new RunReader(file));
+    _spills.clear();
+
+    const leveldb::Comparator *comparator = _comparator;
+    auto later = [&readers, comparator](size_t a, size_t b) {
+        int cmp = comparator->Compare(readers[a]->entry().first, readers[b]->entry().first);
+        return cmp != 0 ? cmp > 0 : a > b;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+    for (size_t i = 0; i < readers.size(); i++)
+        if (readers[i]->Valid())
+            heap.push(i);
+
+    while (!heap.empty() && !_stopped) {
+        size_t i = heap.top();
+        heap.pop();
+        [self _writeKey:readers[i]->entry().first value:readers[i]->entry().second];
+        readers[i]->Next();
+        if (readers[i]->Valid())
+            heap.push(i);
+    }
+
+    for (RunReader *reader : readers)
+        delete reader;
+}
+
+#pragma mark - Writing
+
+- (void) _writeKey:(const leveldb::Slice &)key value:(const leveldb::Slice &)value {
+    if (_written == 0 || _comparator->Compare(key, _smallest) < 0)
+        _smallest.assign(key.data(), key.size());
+    if (_written == 0 || _comparator->Compare(key, _largest) > 0)
+        _largest.assign(key.data(), key.size());
+
+    if (_batch == NULL)
+        _batch = new leveldb::WriteBatch();
+    _batch->Put(key, value);
+    _batchBytes += key.size() + value.size();
+    _written++;
+
+    if (_batchBytes >= _batchSize)
+        [self _commitBatch];
+}
+
+/*
+ * Hand the current batch over to the commit queue, once fewer than `kBulkBatchesInFlight` are waiting there.
+ */
+- (void) _commitBatch {
+    if (_batch == NULL)
+        return;
+
+    leveldb::WriteBatch *batch = _batch;
+    _batch = NULL;
+    _batchBytes = 0;
+
+    // The block mustn't retain the loader, which would otherwise be deallocated on the commit queue it drains
+    LevelDB *db = _db;
+    NSError **firstError = &_error;
+    dispatch_semaphore_t inFlight = _inFlight;
+    
+    dispatch_semaphore_wait(inFlight, DISPATCH_TIME_FOREVER);
+    dispatch_async(_commitQueue, ^{
+        NSError *error = nil;
+        if (*firstError == nil && ![db _writeBulkBatch:batch sync:NO error:&error])
+            *firstError = [error retain];
+        delete batch;
+        dispatch_semaphore_signal(inFlight);
+    });
+
+    if (_progress) {
+        BOOL stop = false;
+        _progress(_written, &stop);
+        if (stop)
+            _stopped = YES;
+    }
+}
+
+- (void) _failWithStatus:(const leveldb::Status &)status {
+    _stopped = YES;
+    NSError **firstError = &_error;
+    NSError *error = NSErrorFromLevelDBStatus(status);
+    dispatch_sync(_commitQueue, ^{
+        if (*firstError == nil)
+            *firstError = [error retain];
+    });
+}
+
+- (BOOL) finishWithError:(NSError **)error {
+    NSAssert(!_finished, @"A bulk load can only be finished once");
+    _finished = YES;
+
+    if (!_stopped)
+        [self _encodePending];
+    if (!_sorted && !_stopped)
+        [self _writeSortedRuns];
+    [self _commitBatch];
+    dispatch_sync(_commitQueue, ^{});
+
+    // Batches were written without syncing, a single synced write makes all of them durable
+    if (_error == nil && _written > 0) {
+        leveldb::WriteBatch empty;
+        NSError *syncError = nil;
+        if (![_db _writeBulkBatch:&empty sync:YES error:&syncError])
+            _error = [syncError retain];
+    }
+
+    if (_error == nil && _written > 0 && _compactsWhenFinished) {
+        [_db compactRangeFromKey:DataFromSlice(leveldb::Slice(_smallest))
+                           toKey:DataFromSlice(leveldb::Slice(_largest))
+                        progress:nil];
+    }
+
+    if (_error != nil) {
+        if (error != NULL)
+            *error = [[_error retain] autorelease];
+        return NO;
+    }
+    return YES;
+}
+
+@end
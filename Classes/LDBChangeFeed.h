@@ -0,0 +1,56 @@
+//
+//  LDBChangeFeed.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+/**
+ A subscription to the changes committed to a database, returned by
+ `-[LevelDB subscribeToChangesWithPrefix:capacity:overflowPolicy:queue:usingBlock:]`.
+
+ Every committed put and delete whose key matches the subscription's prefix is appended to a bounded buffer, from which
+ changes are delivered in batches on the subscription's queue, in commit order, and never on the writing thread. Writers
+ never wait for a subscriber: once the buffer is full, the overflow policy decides which changes are lost, and the
+ number of lost changes is reported along with the next delivery.
+
+ Each change is a dictionary holding its type (`kLevelDBChangeType`, either `kLevelDBChangeTypePut` or
+ `kLevelDBChangeTypeDelete`), its key as `NSData` (`kLevelDBChangeKey`) and, for puts, its value decoded with the
+ database's decoder (`kLevelDBChangeValue`).
+ */
+@interface LDBChangeSubscription : NSObject
+
+/**
+ The prefix of the keys whose changes are delivered, or `nil` if every change is delivered
+ */
+@property (nonatomic, readonly) NSData *prefix;
+
+/**
+ The maximum number of changes waiting to be delivered
+ */
+@property (nonatomic, readonly) NSUInteger capacity;
+
+/**
+ What happens to changes committed while `capacity` changes are waiting to be delivered
+ */
+@property (nonatomic, readonly) LDBChangeOverflowPolicy overflowPolicy;
+
+/**
+ The number of changes lost to overflows since the subscription started
+ */
+@property (readonly) NSUInteger droppedCount;
+
+/**
+ A boolean value indicating whether the subscription was cancelled, either explicitly or by an overflow
+ */
+@property (readonly, getter = isCancelled) BOOL cancelled;
+
+/**
+ Stop delivering changes. Changes still waiting to be delivered are discarded.
+ */
+- (void) cancel;
+
+@end
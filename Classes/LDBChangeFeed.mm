@@ -0,0 +1,222 @@
+//
+//  LDBChangeFeed.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBChangeFeed.h"
+
+#import <leveldb/slice.h>
+
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "LDBCommon.h"
+
+@interface LevelDB ()
+- (void) _removeChangeSubscription:(LDBChangeSubscription *)subscription;
+@end
+
+namespace {
+    struct PendingChange {
+        bool put;
+        std::string key, value;
+    };
+}
+
+@interface LDBChangeSubscription () {
+    LevelDB *_db;                       // Not retained, cleared when the database closes
+    std::string _prefixString;
+    dispatch_queue_t _queue;
+    LevelDBChangesBlock _block;
+    LevelDBDecoderBlock _decoder;       // The database's decoder when changes were last published
+
+    std::mutex _mu;
+    std::deque<PendingChange> _pending;
+    NSUInteger _droppedCount, _droppedSinceDelivery;
+    BOOL _cancelled;
+    BOOL _scheduled;                    // A delivery is queued or running
+    BOOL _overflowed;                   // An overflow is cancelling the subscription
+}
+
+- (id) initWithDB:(LevelDB *)db
+           prefix:(NSData *)prefix
+         capacity:(NSUInteger)capacity
+   overflowPolicy:(LDBChangeOverflowPolicy)policy
+            queue:(dispatch_queue_t)queue
+       usingBlock:(LevelDBChangesBlock)block;
+
+- (void) appendChange:(BOOL)put key:(const leveldb::Slice &)key value:(const leveldb::Slice &)value;
+- (void) flushWithDecoder:(LevelDBDecoderBlock)decoder;
+- (void) detach;
+
+@end
+
+@implementation LDBChangeSubscription
+
+- (id) initWithDB:(LevelDB *)db
+           prefix:(NSData *)prefix
+         capacity:(NSUInteger)capacity
+   overflowPolicy:(LDBChangeOverflowPolicy)policy
+            queue:(dispatch_queue_t)queue
+       usingBlock:(LevelDBChangesBlock)block {
+    NSParameterAssert(capacity > 0 && block != nil);
+    self = [super init];
+    if (self) {
+        _db = db;
+        _prefix = [prefix copy];
+        if (prefix)
+            _prefixString.assign((const char *)[prefix bytes], [prefix length]);
+        _capacity = capacity;
+        _overflowPolicy = policy;
+        if (queue) {
+            dispatch_retain(queue);
+            _queue = queue;
+        } else
+            _queue = dispatch_queue_create("com.matehat.leveldb.changes", DISPATCH_QUEUE_SERIAL);
+        _block = [block copy];
+    }
+    return self;
+}
+
+- (NSUInteger) droppedCount {
+    std::lock_guard<std::mutex> lock(_mu);
+    return _droppedCount;
+}
+- (BOOL) isCancelled {
+    std::lock_guard<std::mutex> lock(_mu);
+    return _cancelled;
+}
+
+#pragma mark - Publishing
+
+- (void) appendChange:(BOOL)put key:(const leveldb::Slice &)key value:(const leveldb::Slice &)value {
+    if (!key.starts_with(_prefixString))
+        return;
+
+    std::lock_guard<std::mutex> lock(_mu);
+    if (_cancelled || _overflowed)
+        return;
+    if (_pending.size() >= _capacity) {
+        _droppedCount++;
+        _droppedSinceDelivery++;
+        switch (_overflowPolicy) {
+            case LDBChangeOverflowDropOldest:
+                _pending.pop_front();
+                break;
+            case LDBChangeOverflowDropNewest:
+                return;
+            case LDBChangeOverflowCancel:
+                _overflowed = YES;
+                return;
+        }
+    }
+    _pending.push_back(PendingChange());
+    PendingChange &change = _pending.back();
+    change.put = put;
+    change.key.assign(key.data(), key.size());
+    if (put)
+        change.value.assign(value.data(), value.size());
+}
+
+- (void) flushWithDecoder:(LevelDBDecoderBlock)decoder {
+    {
+        std::lock_guard<std::mutex> lock(_mu);
+        if (_decoder != decoder) {
+            [_decoder release];
+            _decoder = [decoder retain];
+        }
+        if (_scheduled || _cancelled || _pending.empty())
+            return;
+        _scheduled = YES;
+    }
+    [self scheduleDelivery];
+}
+
+#pragma mark - Delivery
+
+- (void) scheduleDelivery {
+    dispatch_async(_queue, ^{
+        [self deliver];
+    });
+}
+
+- (void) deliver {
+    std::deque<PendingChange> changes;
+    NSUInteger dropped;
+    LevelDBDecoderBlock decoder;
+    {
+        std::lock_guard<std::mutex> lock(_mu);
+        if (_cancelled) {
+            _scheduled = NO;
+            return;
+        }
+        changes.swap(_pending);
+        dropped = _droppedSinceDelivery;
+        _droppedSinceDelivery = 0;
+        decoder = [_decoder retain];
+    }
+
+    @autoreleasepool {
+        NSMutableArray *array = [NSMutableArray arrayWithCapacity:changes.size()];
+        for (PendingChange &change : changes) {
+            NSData *key = DataFromString(change.key);
+            if (change.put) {
+                LevelDBKey lkey = GenericKeyFromNSDataOrString(key);
+                id value = DecodeFromString(change.value, &lkey, decoder);
+                [array addObject:@{kLevelDBChangeType: kLevelDBChangeTypePut,
+                                   kLevelDBChangeKey: key,
+                                   kLevelDBChangeValue: value ?: [NSNull null]}];
+            } else {
+                [array addObject:@{kLevelDBChangeType: kLevelDBChangeTypeDelete,
+                                   kLevelDBChangeKey: key}];
+            }
+        }
+        _block(array, dropped);
+    }
+    [decoder release];
+
+    BOOL again, cancel;
+    {
+        std::lock_guard<std::mutex> lock(_mu);
+        cancel = _overflowed && !_cancelled;
+        again = !cancel && !_cancelled && !_pending.empty();
+        _scheduled = again;
+    }
+    if (cancel)
+        [self cancel];
+    else if (again)
+        [self scheduleDelivery];
+}
+
+#pragma mark - Cancellation
+
+- (void) cancel {
+    LevelDB *db;
+    {
+        std::lock_guard<std::mutex> lock(_mu);
+        if (_cancelled)
+            return;
+        _cancelled = YES;
+        _pending.clear();
+        db = _db;
+        _db = nil;
+    }
+    [db _removeChangeSubscription:self];
+}
+
+- (void) detach {
+    std::lock_guard<std::mutex> lock(_mu);
+    _db = nil;
+}
+
+- (void) dealloc {
+    [_prefix release];
+    [_block release];
+    [_decoder release];
+    dispatch_release(_queue);
+    [super dealloc];
+}
+
+@end
@@ -0,0 +1,118 @@
+//
+//  LDBCodec.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+#import "LevelDB.h"
+
+/**
+ An object encoding values to bytes, and decoding them back.
+
+ Values encoded through a `LDBCodecRegistry` are prefixed with the codec's tag and version, so that every value
+ written by a registered codec can still be decoded after the database's encoder changed.
+ */
+@protocol LDBCodec <NSObject>
+
+/**
+ The byte identifying the codec in stored values. Tags below 16 are reserved for built-in codecs.
+ */
+@property (nonatomic, readonly) uint8_t tag;
+
+/**
+ The version of the format written by `encodeObject:intoData:`, stored along every value
+ */
+@property (nonatomic, readonly) uint8_t version;
+
+/**
+ Return a boolean value indicating whether the codec can encode an object
+ */
+- (BOOL) canEncodeObject:(id)object;
+
+/**
+ Append the encoded object to `data`
+ */
+- (void) encodeObject:(id)object intoData:(NSMutableData *)data;
+
+/**
+ Return the object encoded in a buffer, written by the given version of the codec, or `nil` if it can't be decoded.
+
+ @warning The buffer is only valid for the duration of the call, the returned object must not reference it.
+ */
+- (id) decodeBytes:(const void *)bytes length:(NSUInteger)length version:(uint8_t)version;
+
+@end
+
+/**
+ A compact binary encoding of property list values: `NSNumber`, `NSString`, `NSData`, `NSDate`, `NSNull`, and
+ `NSArray` and `NSDictionary` instances containing those, nested at most 64 deep.
+
+ Values always decode as immutable instances, so mutable instances and other subclasses are not accepted: the default
+ encoder keyed archives them instead, which keeps their class.
+ */
+@interface LDBBinaryCodec : NSObject <LDBCodec>
++ (instancetype) codec;
+@end
+
+/**
+ A codec storing `NSNumber` instances as a type byte followed by 8 big-endian bytes.
+ */
+@interface LDBNumberCodec : NSObject <LDBCodec>
++ (instancetype) codec;
+@end
+
+/**
+ A codec storing `NSData` instances as they are.
+ */
+@interface LDBRawDataCodec : NSObject <LDBCodec>
++ (instancetype) codec;
+@end
+
+/**
+ A codec using `NSKeyedArchiver`/`NSKeyedUnarchiver`, for any object conforming to `NSCoding`.
+ */
+@interface LDBKeyedArchiverCodec : NSObject <LDBCodec>
++ (instancetype) codec;
+@end
+
+/**
+ The codecs available to decode stored values, indexed by tag.
+
+ Codecs should be registered before any database uses them, registration isn't synchronized with decoding.
+ */
+@interface LDBCodecRegistry : NSObject
+
+/**
+ Return the registry used by default by every database, with the built-in codecs registered
+ */
++ (instancetype) sharedRegistry;
+
+/**
+ Register a codec, replacing any codec registered with the same tag
+ */
+- (void) registerCodec:(id<LDBCodec>)codec;
+
+/**
+ Return the codec registered with a tag, or `nil`
+ */
+- (id<LDBCodec>) codecForTag:(uint8_t)tag;
+
+/**
+ Return an encoder block writing values tagged with `codec`, which must be registered
+ */
+- (LevelDBEncoderBlock) encoderWithCodec:(id<LDBCodec>)codec;
+
+/**
+ Return the encoder block used when none is set: values are written with `LDBBinaryCodec` when possible, and with
+ `LDBKeyedArchiverCodec` otherwise.
+ */
+- (LevelDBEncoderBlock) defaultEncoder;
+
+/**
+ Return a decoder block reading values written by any registered codec, as well as untagged values written by
+ `NSKeyedArchiver` (the default encoder of previous versions).
+ */
+- (LevelDBDecoderBlock) decoder;
+
+@end
@@ -0,0 +1,524 @@
+//
+//  LDBCodec.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBCodec.h"
+
+// Tags of the built-in codecs, written as the first byte of every value
+enum {
+    LDBBinaryCodecTag = 1,
+    LDBNumberCodecTag,
+    LDBRawDataCodecTag,
+    LDBKeyedArchiverCodecTag
+};
+
+// Type bytes of LDBBinaryCodec
+enum {
+    LDBBinaryNull = 0,
+    LDBBinaryFalse,
+    LDBBinaryTrue,
+    LDBBinaryInteger,           // Zigzag varint
+    LDBBinaryUnsignedInteger,   // Varint, only for values above INT64_MAX
+    LDBBinaryDouble,            // 8 big-endian bytes
+    LDBBinaryString,            // Varint length, UTF-8 bytes
+    LDBBinaryData,              // Varint length, bytes
+    LDBBinaryDate,              // Time interval since the reference date, as a double
+    LDBBinaryArray,             // Varint count, elements
+    LDBBinaryDictionary         // Varint count, alternating keys and values
+};
+
+// Deepest nesting of arrays and dictionaries LDBBinaryCodec writes or reads. Deeper values are keyed archived.
+static const NSUInteger kMaxBinaryDepth = 64;
+
+#pragma mark - Buffers
+
+static void AppendByte(NSMutableData *data, uint8_t byte) {
+    [data appendBytes:&byte length:1];
+}
+
+static void AppendVarint(NSMutableData *data, uint64_t value) {
+    uint8_t buffer[10];
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buffer[length++] = (uint8_t)value;
+    [data appendBytes:buffer length:length];
+}
+
+static void AppendBigEndian64(NSMutableData *data, uint64_t value) {
+    uint8_t buffer[8];
+    for (int i = 7; i >= 0; i--) {
+        buffer[i] = (uint8_t)value;
+        value >>= 8;
+    }
+    [data appendBytes:buffer length:8];
+}
+
+static uint64_t DoubleBits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double DoubleFromBits(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// A bounds-checked read position in an encoded value
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} LDBReader;
+
+static bool ReadByte(LDBReader *r, uint8_t *byte) {
+    if (r->p >= r->end) return false;
+    *byte = *r->p++;
+    return true;
+}
+
+static bool ReadVarint(LDBReader *r, uint64_t *value) {
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        uint8_t byte = *r->p++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ReadBigEndian64(LDBReader *r, uint64_t *value) {
+    if (r->end - r->p < 8) return false;
+    uint64_t result = 0;
+    for (int i = 0; i < 8; i++)
+        result = (result << 8) | r->p[i];
+    r->p += 8;
+    *value = result;
+    return true;
+}
+
+static bool ReadLength(LDBReader *r, NSUInteger *length) {
+    uint64_t value;
+    if (!ReadVarint(r, &value) || value > (uint64_t)(r->end - r->p)) return false;
+    *length = (NSUInteger)value;
+    return true;
+}
+
+#pragma mark - Numbers
+
+static BOOL IsBoolean(NSNumber *number) {
+    static NSNumber *yes, *no;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        yes = [[NSNumber numberWithBool:YES] retain];
+        no  = [[NSNumber numberWithBool:NO] retain];
+    });
+    return number == yes || number == no;
+}
+
+static BOOL IsFloatingPoint(NSNumber *number) {
+    char type = [number objCType][0];
+    return type == 'f' || type == 'd';
+}
+
+static BOOL IsUnsignedAboveInt64(NSNumber *number) {
+    char type = [number objCType][0];
+    return (type == 'Q' || type == 'L') && [number unsignedLongLongValue] > (unsigned long long)INT64_MAX;
+}
+
+#pragma mark - Binary codec
+
+/*
+ * Return whether an object is archived as an instance of `cls` itself, as opposed to a mutable or custom subclass,
+ * which decoding as `cls` would lose
+ */
+static BOOL IsArchivedAs(id object, Class cls) {
+    return [object isKindOfClass:cls] && [object classForKeyedArchiver] == cls;
+}
+
+static BOOL AppendBinaryObject(NSMutableData *data, id object, NSUInteger depth) {
+    if (object == [NSNull null]) {
+        AppendByte(data, LDBBinaryNull);
+    } else if (IsArchivedAs(object, [NSString class])) {
+        NSString *string = object;
+        const char *bytes = [string UTF8String];
+        NSUInteger length = [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+        // Strings without a UTF-8 form (holding a lone surrogate) would be written empty
+        if (bytes == NULL || (length == 0 && [string length] > 0))
+            return NO;
+        AppendByte(data, LDBBinaryString);
+        AppendVarint(data, length);
+        [data appendBytes:bytes length:length];
+    } else if (IsArchivedAs(object, [NSNumber class])) {
+        // Decimal numbers would lose precision as doubles
+        if ([object isKindOfClass:[NSDecimalNumber class]])
+            return NO;
+        NSNumber *number = object;
+        if (IsBoolean(number)) {
+            AppendByte(data, [number boolValue] ? LDBBinaryTrue : LDBBinaryFalse);
+        } else if (IsFloatingPoint(number)) {
+            AppendByte(data, LDBBinaryDouble);
+            AppendBigEndian64(data, DoubleBits([number doubleValue]));
+        } else if (IsUnsignedAboveInt64(number)) {
+            AppendByte(data, LDBBinaryUnsignedInteger);
+            AppendVarint(data, [number unsignedLongLongValue]);
+        } else {
+            int64_t value = [number longLongValue];
+            AppendByte(data, LDBBinaryInteger);
+            AppendVarint(data, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        }
+    } else if (IsArchivedAs(object, [NSData class])) {
+        AppendByte(data, LDBBinaryData);
+        AppendVarint(data, [object length]);
+        [data appendData:object];
+    } else if (IsArchivedAs(object, [NSDate class])) {
+        AppendByte(data, LDBBinaryDate);
+        AppendBigEndian64(data, DoubleBits([object timeIntervalSinceReferenceDate]));
+    } else if (IsArchivedAs(object, [NSArray class])) {
+        if (depth >= kMaxBinaryDepth) return NO;
+        AppendByte(data, LDBBinaryArray);
+        AppendVarint(data, [object count]);
+        for (id element in object)
+            if (!AppendBinaryObject(data, element, depth + 1)) return NO;
+    } else if (IsArchivedAs(object, [NSDictionary class])) {
+        if (depth >= kMaxBinaryDepth) return NO;
+        AppendByte(data, LDBBinaryDictionary);
+        AppendVarint(data, [object count]);
+        for (id key in object)
+            if (!AppendBinaryObject(data, key, depth + 1)
+                || !AppendBinaryObject(data, [object objectForKey:key], depth + 1)) return NO;
+    } else {
+        return NO;
+    }
+    return YES;
+}
+
+// Collections are decoded immutable, as they were written
+static id ReadBinaryObject(LDBReader *r, NSUInteger depth) {
+    uint8_t type;
+    uint64_t value;
+    NSUInteger length;
+    if (!ReadByte(r, &type)) return nil;
+
+    switch (type) {
+        case LDBBinaryNull:
+            return [NSNull null];
+        case LDBBinaryFalse:
+            return [NSNumber numberWithBool:NO];
+        case LDBBinaryTrue:
+            return [NSNumber numberWithBool:YES];
+        case LDBBinaryInteger:
+            if (!ReadVarint(r, &value)) return nil;
+            return [NSNumber numberWithLongLong:(int64_t)(value >> 1) ^ -(int64_t)(value & 1)];
+        case LDBBinaryUnsignedInteger:
+            if (!ReadVarint(r, &value)) return nil;
+            return [NSNumber numberWithUnsignedLongLong:value];
+        case LDBBinaryDouble:
+            if (!ReadBigEndian64(r, &value)) return nil;
+            return [NSNumber numberWithDouble:DoubleFromBits(value)];
+        case LDBBinaryString: {
+            if (!ReadLength(r, &length)) return nil;
+            NSString *string = [[[NSString alloc] initWithBytes:r->p length:length encoding:NSUTF8StringEncoding] autorelease];
+            r->p += length;
+            return string;
+        }
+        case LDBBinaryData: {
+            if (!ReadLength(r, &length)) return nil;
+            NSData *data = [NSData dataWithBytes:r->p length:length];
+            r->p += length;
+            return data;
+        }
+        case LDBBinaryDate:
+            if (!ReadBigEndian64(r, &value)) return nil;
+            return [NSDate dateWithTimeIntervalSinceReferenceDate:DoubleFromBits(value)];
+        case LDBBinaryArray:
+        case LDBBinaryDictionary: {
+            // Every element takes at least one byte, which bounds the count before allocating
+            if (depth >= kMaxBinaryDepth || !ReadLength(r, &length)) return nil;
+            NSUInteger count = (type == LDBBinaryDictionary) ? length * 2 : length;
+            id *objects = (id *)malloc(MAX(count, (NSUInteger)1) * sizeof(id));
+            NSUInteger i = 0;
+            for (; i < count; i++) {
+                objects[i] = ReadBinaryObject(r, depth + 1);
+                if (objects[i] == nil) break;
+            }
+            id result = nil;
+            if (i == count) {
+                if (type == LDBBinaryArray) {
+                    result = [NSArray arrayWithObjects:objects count:count];
+                } else {
+                    // Keys and values alternate, which splitting in place puts into two halves
+                    id *keys = (id *)malloc(MAX(length, (NSUInteger)1) * sizeof(id));
+                    for (NSUInteger j = 0; j < length; j++) {
+                        keys[j] = objects[2 * j];
+                        objects[j] = objects[2 * j + 1];
+                    }
+                    result = [NSDictionary dictionaryWithObjects:objects forKeys:keys count:length];
+                    free(keys);
+                }
+            }
+            free(objects);
+            return result;
+        }
+        default:
+            return nil;
+    }
+}
+
+@implementation LDBBinaryCodec
+
++ (instancetype) codec {
+    static LDBBinaryCodec *codec;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        codec = [[self alloc] init];
+    });
+    return codec;
+}
+
+- (uint8_t) tag {
+    return LDBBinaryCodecTag;
+}
+- (uint8_t) version {
+    return 1;
+}
+
+- (BOOL) canEncodeObject:(id)object {
+    NSMutableData *scratch = [NSMutableData data];
+    return AppendBinaryObject(scratch, object, 0);
+}
+- (void) encodeObject:(id)object intoData:(NSMutableData *)data {
+    if (!AppendBinaryObject(data, object, 0))
+        [NSException raise:NSInvalidArgumentException
+                    format:@"LDBBinaryCodec can't encode an instance of %@", [object class]];
+}
+- (id) decodeBytes:(const void *)bytes length:(NSUInteger)length version:(uint8_t)version {
+    if (version != 1) return nil;
+    LDBReader reader = { (const uint8_t *)bytes, (const uint8_t *)bytes + length };
+    id object = ReadBinaryObject(&reader, 0);
+    return (reader.p == reader.end) ? object : nil;
+}
+
+@end
+
+#pragma mark - Number codec
+
+@implementation LDBNumberCodec
+
++ (instancetype) codec {
+    static LDBNumberCodec *codec;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        codec = [[self alloc] init];
+    });
+    return codec;
+}
+
+- (uint8_t) tag {
+    return LDBNumberCodecTag;
+}
+- (uint8_t) version {
+    return 1;
+}
+
+- (BOOL) canEncodeObject:(id)object {
+    return [object isKindOfClass:[NSNumber class]] && ![object isKindOfClass:[NSDecimalNumber class]];
+}
+- (void) encodeObject:(id)object intoData:(NSMutableData *)data {
+    NSParameterAssert([self canEncodeObject:object]);
+    NSNumber *number = object;
+    if (IsFloatingPoint(number)) {
+        AppendByte(data, 'd');
+        AppendBigEndian64(data, DoubleBits([number doubleValue]));
+    } else if (IsUnsignedAboveInt64(number)) {
+        AppendByte(data, 'Q');
+        AppendBigEndian64(data, [number unsignedLongLongValue]);
+    } else {
+        AppendByte(data, 'q');
+        AppendBigEndian64(data, (uint64_t)[number longLongValue]);
+    }
+}
+- (id) decodeBytes:(const void *)bytes length:(NSUInteger)length version:(uint8_t)version {
+    if (version != 1 || length != 9) return nil;
+    LDBReader reader = { (const uint8_t *)bytes + 1, (const uint8_t *)bytes + length };
+    uint64_t value;
+    ReadBigEndian64(&reader, &value);
+    switch (((const uint8_t *)bytes)[0]) {
+        case 'd': return [NSNumber numberWithDouble:DoubleFromBits(value)];
+        case 'Q': return [NSNumber numberWithUnsignedLongLong:value];
+        case 'q': return [NSNumber numberWithLongLong:(int64_t)value];
+        default:  return nil;
+    }
+}
+
+@end
+
+#pragma mark - Raw data codec
+
+@implementation LDBRawDataCodec
+
++ (instancetype) codec {
+    static LDBRawDataCodec *codec;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        codec = [[self alloc] init];
+    });
+    return codec;
+}
+
+- (uint8_t) tag {
+    return LDBRawDataCodecTag;
+}
+- (uint8_t) version {
+    return 1;
+}
+
+- (BOOL) canEncodeObject:(id)object {
+    return [object isKindOfClass:[NSData class]];
+}
+- (void) encodeObject:(id)object intoData:(NSMutableData *)data {
+    NSParameterAssert([self canEncodeObject:object]);
+    [data appendData:object];
+}
+- (id) decodeBytes:(const void *)bytes length:(NSUInteger)length version:(uint8_t)version {
+    if (version != 1) return nil;
+    return [NSData dataWithBytes:bytes length:length];
+}
+
+@end
+
+#pragma mark - Keyed archiver codec
+
+@implementation LDBKeyedArchiverCodec
+
++ (instancetype) codec {
+    static LDBKeyedArchiverCodec *codec;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        codec = [[self alloc] init];
+    });
+    return codec;
+}
+
+- (uint8_t) tag {
+    return LDBKeyedArchiverCodecTag;
+}
+- (uint8_t) version {
+    return 1;
+}
+
+- (BOOL) canEncodeObject:(id)object {
+    return [object conformsToProtocol:@protocol(NSCoding)];
+}
+- (void) encodeObject:(id)object intoData:(NSMutableData *)data {
+    [data appendData:[NSKeyedArchiver archivedDataWithRootObject:object]];
+}
+- (id) decodeBytes:(const void *)bytes length:(NSUInteger)length version:(uint8_t)version {
+    if (version != 1) return nil;
+    return [NSKeyedUnarchiver unarchiveObjectWithData:[NSData dataWithBytes:bytes length:length]];
+}
+
+@end
+
+#pragma mark - Registry
+
+@implementation LDBCodecRegistry {
+    id<LDBCodec> _codecs[256];
+}
+
++ (instancetype) sharedRegistry {
+    static LDBCodecRegistry *registry;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        registry = [[self alloc] init];
+    });
+    return registry;
+}
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        [self registerCodec:[LDBBinaryCodec codec]];
+        [self registerCodec:[LDBNumberCodec codec]];
+        [self registerCodec:[LDBRawDataCodec codec]];
+        [self registerCodec:[LDBKeyedArchiverCodec codec]];
+    }
+    return self;
+}
+
+- (void) registerCodec:(id<LDBCodec>)codec {
+    // Untagged values starting with these bytes are property lists written by NSKeyedArchiver
+    NSParameterAssert(codec.tag != 'b' && codec.tag != '<');
+    @synchronized(self) {
+        id<LDBCodec> previous = _codecs[codec.tag];
+        _codecs[codec.tag] = [codec retain];
+        [previous release];
+    }
+}
+
+- (id<LDBCodec>) codecForTag:(uint8_t)tag {
+    return _codecs[tag];
+}
+
+- (LevelDBEncoderBlock) encoderWithCodec:(id<LDBCodec>)codec {
+    NSParameterAssert(_codecs[codec.tag] == codec);
+    uint8_t tag = codec.tag, version = codec.version;
+    return [[^ NSData * (LevelDBKey *key, id object) {
+        const uint8_t header[2] = { tag, version };
+        NSMutableData *data = [NSMutableData dataWithCapacity:64];
+        [data appendBytes:header length:2];
+        [codec encodeObject:object intoData:data];
+        return data;
+    } copy] autorelease];
+}
+
+- (LevelDBEncoderBlock) defaultEncoder {
+    LDBBinaryCodec *binary = [LDBBinaryCodec codec];
+    LDBKeyedArchiverCodec *archiver = [LDBKeyedArchiverCodec codec];
+    return [[^ NSData * (LevelDBKey *key, id object) {
+        NSMutableData *data = [NSMutableData dataWithCapacity:64];
+        const uint8_t binaryHeader[2] = { binary.tag, binary.version };
+        [data appendBytes:binaryHeader length:2];
+        if (AppendBinaryObject(data, object, 0))
+            return data;
+
+        // Not a property list value, fall back to keyed archiving
+        const uint8_t archiverHeader[2] = { archiver.tag, archiver.version };
+        [data setLength:0];
+        [data appendBytes:archiverHeader length:2];
+        [archiver encodeObject:object intoData:data];
+        return data;
+    } copy] autorelease];
+}
+
+- (LevelDBDecoderBlock) decoder {
+    return [[^ id (LevelDBKey *key, NSData *data) {
+        const uint8_t *bytes = (const uint8_t *)[data bytes];
+        NSUInteger length = [data length];
+        if (length < 2)
+            return nil;
+
+        // Values written by the NSKeyedArchiver default encoder of previous versions aren't tagged
+        if (bytes[0] == 'b' || bytes[0] == '<')
+            return [[LDBKeyedArchiverCodec codec] decodeBytes:bytes length:length version:1];
+
+        id<LDBCodec> codec = _codecs[bytes[0]];
+        return [codec decodeBytes:bytes + 2 length:length - 2 version:bytes[1]];
+    } copy] autorelease];
+}
+
+- (void) dealloc {
+    for (int i = 0; i < 256; i++)
+        [_codecs[i] release];
+    [super dealloc];
+}
+
+@end
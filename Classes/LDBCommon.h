@@ -17,8 +17,14 @@
 
 #define SliceFromData(_data_)               leveldb::Slice((char *)[_data_ bytes], [_data_ length])
 #define DataFromSlice(_slice_)              [NSData dataWithBytes:_slice_.data() length:_slice_.size()]
+#define TransientDataFromSlice(_slice_)     [NSData dataWithBytesNoCopy:(void *)_slice_.data() length:_slice_.size() freeWhenDone:NO]
+#define DataFromString(_string_)            [LDBStringData dataWithString:&_string_]
 
 #define DecodeFromSlice(_slice_, _key_, _d) _d(_key_, DataFromSlice(_slice_))
+#define DecodeFromTransientSlice(_slice_, _key_, _d) \
+                                            _d(_key_, TransientDataFromSlice(_slice_))
+#define DecodeFromString(_string_, _key_, _d) \
+                                            _d(_key_, DataFromString(_string_))
 #define EncodeToSlice(_object_, _key_, _e)  SliceFromData(_e(_key_, _object_))
 
 #define KeyFromStringOrData(_key_)          ([_key_ isKindOfClass:[NSString class]]) ? SliceFromString(_key_) \
@@ -34,3 +40,148 @@
                                                     .data = [_obj_ bytes], \
                                                     .length = [_obj_ length] \
                                                 }
+
+// Prefix of the keys the library keeps for itself, such as the entries of secondary indexes
+#define kLDBReservedKeyPrefix               "\xff\xff" "ldb."
+
+#ifdef __cplusplus
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace leveldb { class Comparator; class Iterator; class Slice; class Status; }
+
+/*
+ * Build a NSError in the kLevelDBErrorDomain domain, describing a failed leveldb::Status
+ */
+NSError * NSErrorFromLevelDBStatus(const leveldb::Status &status);
+
+/*
+ * Compute the smallest key greater than every key starting with `prefix`. Returns false if there is
+ * no such key (empty prefix, or made of 0xff bytes only), in which case the range is unbounded.
+ */
+bool PrefixUpperBound(const leveldb::Slice &prefix, std::string *limit);
+
+/*
+ * Seconds elapsed on a monotonic clock, for the durations reported in statistics. Unlike
+ * CFAbsoluteTimeGetCurrent, it is available under GNUstep and doesn't follow system clock changes.
+ */
+inline NSTimeInterval LDBMonotonicTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Wrap an iterator so that it steps over the keys reserved by the library (see kLDBReservedKeyPrefix),
+ * for enumerations, removals and cursors to only ever see the keys written by users. Takes ownership
+ * of `iter`. Under the bytewise comparator, the reserved range is skipped with a single seek.
+ */
+leveldb::Iterator * NewUserKeyIterator(leveldb::Iterator *iter, const leveldb::Comparator *comparator);
+
+/*
+ * Track the operations in flight on a database, so that closing it can wait for them to finish
+ * before deleting anything they use. Entering and leaving an operation is a single atomic add on
+ * one of several counters, picked by thread, so that concurrent readers neither take a lock nor
+ * contend on the same cache line.
+ */
+class LDBInFlightTracker {
+public:
+    static const int kStripes = 16;
+
+    LDBInFlightTracker() : closing_(false) {
+        for (int i = 0; i < kStripes; i++)
+            stripes_[i].count.store(0, std::memory_order_relaxed);
+    }
+
+    // Return the counter the operation was added to, or -1 if the database is closing
+    int Enter() {
+        int stripe = StripeForCurrentThread();
+        stripes_[stripe].count.fetch_add(1);
+        if (closing_.load()) {
+            stripes_[stripe].count.fetch_sub(1, std::memory_order_release);
+            return -1;
+        }
+        return stripe;
+    }
+    void Leave(int stripe) {
+        stripes_[stripe].count.fetch_sub(1, std::memory_order_release);
+    }
+
+    bool Closing() const {
+        return closing_.load(std::memory_order_relaxed);
+    }
+
+    // Refuse any new operation, and wait for the ones in flight. Must not be called from inside an operation.
+    void Close() {
+        BeginClose();
+        WaitForOperations();
+    }
+    void BeginClose() {
+        closing_.store(true);
+    }
+    void WaitForOperations() {
+        for (unsigned spins = 0; InFlight() > 0; spins++) {
+            if (spins < 1024)
+                sched_yield();
+            else
+                usleep(100);
+        }
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> count;
+    };
+
+    static int StripeForCurrentThread() {
+        uint64_t thread = (uint64_t)(uintptr_t)pthread_self();
+        return (int)(((thread >> 4) * 0x9E3779B97F4A7C15ULL) >> 60);    // Top 4 bits, one of kStripes
+    }
+
+    // Sequentially consistent, like the add and load in Enter(): either the operation sees closing_, or this sees it
+    uint64_t InFlight() const {
+        uint64_t total = 0;
+        for (int i = 0; i < kStripes; i++)
+            total += stripes_[i].count.load();
+        return total;
+    }
+
+    Stripe stripes_[kStripes];
+    std::atomic<bool> closing_;
+};
+
+/*
+ * An operation in flight, for as long as it is in scope. Check `Entered()` before touching the
+ * database, which is closing (or closed) otherwise.
+ */
+class LDBOperation {
+public:
+    explicit LDBOperation(LDBInFlightTracker *tracker) : tracker_(tracker), stripe_(tracker->Enter()) {}
+    ~LDBOperation() {
+        if (stripe_ >= 0)
+            tracker_->Leave(stripe_);
+    }
+
+    bool Entered() const {
+        return stripe_ >= 0;
+    }
+
+private:
+    LDBInFlightTracker *tracker_;
+    int stripe_;
+
+    LDBOperation(const LDBOperation &);
+    LDBOperation &operator=(const LDBOperation &);
+};
+
+/*
+ * An immutable NSData that takes ownership of a std::string's buffer (by swapping it in),
+ * so that a value fetched with `leveldb::DB::Get` can be handed to a decoder without a second copy.
+ */
+@interface LDBStringData : NSData
+
++ (instancetype) dataWithString:(std::string *)string;
+
+@end
+#endif
@@ -0,0 +1,117 @@
+//
+//  LDBCursor.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+/**
+ A position in the keys of a database (or of a snapshot), which can be moved in both directions, and read a page of
+ key value pairs at a time into buffers that are reused from one page to the next.
+
+ A cursor only sees the keys between its optional lower bound (inclusive) and upper bound (exclusive). It holds a
+ leveldb iterator, and therefore a consistent view of the database, until it is closed or deallocated, so a cursor
+ shouldn't be kept around for longer than needed. Closing the database closes its cursors along, which are invalid
+ afterwards. A cursor must be used from one thread at a time.
+
+ Fast enumeration yields the keys (as `NSData`) from the current position, or from the first key if the cursor
+ hasn't been positioned yet, and leaves the cursor past the last key it yielded.
+ */
+@interface LDBCursor : NSObject <NSFastEnumeration>
+
+@property (nonatomic, readonly) LevelDB *db;
+
+/**
+ The snapshot the cursor reads from, or `nil` if it reads from the database
+ */
+@property (nonatomic, readonly) LDBSnapshot *snapshot;
+
+/**
+ The smallest key the cursor can reach, or `nil` if it's unbounded
+ */
+@property (nonatomic, readonly) NSData *lowerBound;
+
+/**
+ The key above every key the cursor can reach, or `nil` if it's unbounded
+ */
+@property (nonatomic, readonly) NSData *upperBound;
+
+/**
+ A boolean value indicating whether the cursor is positioned on a key within its bounds
+ */
+@property (nonatomic, readonly, getter = isValid) BOOL valid;
+
+/**
+ The key the cursor is positioned on, or `nil` if it isn't valid
+ */
+@property (nonatomic, readonly) NSData *key;
+
+/**
+ The value the cursor is positioned on, decoded with the database's decoder, or `nil` if it isn't valid
+ */
+@property (nonatomic, readonly) id value;
+
+/**
+ Position the cursor on the first key within its bounds
+ */
+- (void) seekToFirst;
+
+/**
+ Position the cursor on the last key within its bounds
+ */
+- (void) seekToLast;
+
+/**
+ Position the cursor on the first key greater than or equal to a given key (and within bounds)
+
+ @param key The key to seek (`NSString` or `NSData`)
+ */
+- (void) seekToKey:(id)key;
+
+/**
+ Move the cursor to the next key
+ */
+- (void) next;
+
+/**
+ Move the cursor to the previous key
+ */
+- (void) prev;
+
+/**
+ Read at most `count` key value pairs from the current position, moving the cursor past them.
+
+ The buffers are emptied first, so that the same arrays (and their storage) can be reused for every page.
+
+ @param count The maximum number of key value pairs to read
+ @param keys A mutable array filled with the keys read, as `NSData` instances
+ @param values (optional) A mutable array filled with the decoded values. If `nil`, no value is decoded.
+
+ @return The number of key value pairs read, smaller than `count` only once the cursor reaches its upper bound
+ */
+- (NSUInteger) fetchNext:(NSUInteger)count intoKeys:(NSMutableArray *)keys values:(NSMutableArray *)values;
+
+/**
+ Return an opaque token from which a cursor over the same database can resume reading, after the keys read so far.
+
+ The token holds the key the cursor is positioned on, so a resumed cursor skips any key removed in the meantime, and
+ sees any key added after that position. Returns `nil` if the cursor is past its last key.
+ */
+- (NSData *) continuationKey;
+
+/**
+ Position the cursor where the cursor that returned a continuation token left off
+
+ @param continuationKey A token returned by `continuationKey`
+ */
+- (void) seekToContinuationKey:(NSData *)continuationKey;
+
+/**
+ Release the iterator held by the cursor. The cursor is invalid afterwards.
+ */
+- (void) close;
+
+@end
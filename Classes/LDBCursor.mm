@@ -0,0 +1,258 @@
+//
+//  LDBCursor.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBCursor.h"
+#import "LDBSnapshot.h"
+#import "LDBInstrumentation.h"
+#import "LDBBlobStore.h"
+
+#import <leveldb/comparator.h>
+#import <leveldb/db.h>
+#import <leveldb/iterator.h>
+
+#include <string>
+
+#include "LDBCommon.h"
+
+// First byte of continuation tokens, bumped whenever their format changes
+static const uint8_t kContinuationKeyVersion = 1;
+
+// Keep the database open until the end of the scope, or return `_failure_` if it is closing or the cursor is closed
+#define EnterCursorOperation(_failure_) \
+    LDBOperation __operation([_db inFlightTracker]); \
+    if (!__operation.Entered() || _iter == NULL) \
+        return _failure_;
+
+@interface LevelDB ()
+- (LDBLatencyRecorder *) latencyRecorder;
+- (LDBInFlightTracker *) inFlightTracker;
+- (const leveldb::Comparator *) comparator;
+- (id) _decodeValue:(const leveldb::Slice &)value forKey:(LevelDBKey *)key;
+- (void) _closeResource:(id)resource usingBlock:(void (^)(void))block;
+@end
+
+@interface LDBCursor () {
+    leveldb::Iterator *_iter;
+    const leveldb::Comparator *_comparator;
+    std::string _lower, _upper;
+    BOOL _positioned;
+    LDBBlobStore *_pinnedBlobs;     // Set if the cursor pinned blob files itself, reading without a snapshot
+    uint64_t _blobPin;
+}
+
++ (instancetype) cursorForDB:(LevelDB *)db
+                    iterator:(leveldb::Iterator *)iter
+                    snapshot:(LDBSnapshot *)snapshot
+                  lowerBound:(NSData *)lowerBound
+                  upperBound:(NSData *)upperBound;
+- (void) pinBlobs:(LDBBlobStore *)blobs epoch:(uint64_t)epoch;
+
+@end
+
+@implementation LDBCursor
+
++ (instancetype) cursorForDB:(LevelDB *)db
+                    iterator:(leveldb::Iterator *)iter
+                    snapshot:(LDBSnapshot *)snapshot
+                  lowerBound:(NSData *)lowerBound
+                  upperBound:(NSData *)upperBound {
+    LDBCursor *cursor = [[[self alloc] init] autorelease];
+    cursor->_db = [db retain];
+    cursor->_snapshot = [snapshot retain];
+    cursor->_iter = iter;
+    cursor->_comparator = [db comparator];
+    cursor->_lowerBound = [lowerBound copy];
+    cursor->_upperBound = [upperBound copy];
+    if (lowerBound)
+        cursor->_lower.assign((const char *)[lowerBound bytes], [lowerBound length]);
+    if (upperBound)
+        cursor->_upper.assign((const char *)[upperBound bytes], [upperBound length]);
+    return cursor;
+}
+
+- (void) pinBlobs:(LDBBlobStore *)blobs epoch:(uint64_t)epoch {
+    _pinnedBlobs = blobs;
+    _blobPin = epoch;
+}
+
+// Only called inside cursor operations
+- (BOOL) inBounds {
+    if (!_iter->Valid())
+        return NO;
+    leveldb::Slice key = _iter->key();
+    return (_lowerBound == nil || _comparator->Compare(key, _lower) >= 0)
+        && (_upperBound == nil || _comparator->Compare(key, _upper) < 0);
+}
+
+- (BOOL) isValid {
+    EnterCursorOperation(NO);
+    return [self inBounds];
+}
+
+- (NSData *) key {
+    EnterCursorOperation(nil);
+    if (![self inBounds])
+        return nil;
+    leveldb::Slice key = _iter->key();
+    return DataFromSlice(key);
+}
+
+- (id) value {
+    EnterCursorOperation(nil);
+    if (![self inBounds])
+        return nil;
+    return [self decodedValue];
+}
+
+- (id) decodedValue {
+    leveldb::Slice key = _iter->key();
+    LevelDBKey lkey = GenericKeyFromSlice(key);
+    return [_db _decodeValue:_iter->value() forKey:&lkey];
+}
+
+#pragma mark - Positioning
+
+- (void) seekToFirst {
+    EnterCursorOperation();
+    _positioned = YES;
+    if (_lowerBound)
+        _iter->Seek(_lower);
+    else
+        _iter->SeekToFirst();
+}
+
+- (void) seekToLast {
+    EnterCursorOperation();
+    _positioned = YES;
+    if (_upperBound) {
+        _iter->Seek(_upper);
+        if (_iter->Valid())
+            _iter->Prev();
+        else
+            _iter->SeekToLast();
+    } else
+        _iter->SeekToLast();
+}
+
+- (void) seekToKey:(id)key {
+    AssertKeyType(key);
+    EnterCursorOperation();
+    _positioned = YES;
+    leveldb::Slice target = KeyFromStringOrData(key);
+    if (_lowerBound && _comparator->Compare(target, _lower) < 0)
+        _iter->Seek(_lower);
+    else
+        _iter->Seek(target);
+}
+
+- (void) next {
+    EnterCursorOperation();
+    if (_iter->Valid())
+        _iter->Next();
+}
+
+- (void) prev {
+    EnterCursorOperation();
+    if (_iter->Valid())
+        _iter->Prev();
+}
+
+#pragma mark - Reading
+
+- (NSUInteger) fetchNext:(NSUInteger)count intoKeys:(NSMutableArray *)keys values:(NSMutableArray *)values {
+    NSParameterAssert(keys != nil);
+    [keys removeAllObjects];
+    [values removeAllObjects];
+    EnterCursorOperation(0);
+    if (!_positioned)
+        [self seekToFirst];
+
+    LDBLatencyTimer timer([_db latencyRecorder], LevelDBOperationScan);
+    uint64_t bytes = 0;
+    NSUInteger fetched = 0;
+    for (; fetched < count && (timer.Phase(LevelDBPhaseEngine), [self inBounds]); fetched++) {
+        leveldb::Slice key = _iter->key();
+        [keys addObject:DataFromSlice(key)];
+        if (values) {
+            timer.Mark();
+            [values addObject:[self decodedValue] ?: [NSNull null]];
+            timer.Phase(LevelDBPhaseDecode);
+        }
+        bytes += key.size() + _iter->value().size();
+        timer.Mark();
+        _iter->Next();
+    }
+    timer.Count(fetched, bytes);
+    return fetched;
+}
+
+- (NSData *) continuationKey {
+    EnterCursorOperation(nil);
+    if (![self inBounds])
+        return nil;
+    leveldb::Slice key = _iter->key();
+    NSMutableData *token = [NSMutableData dataWithCapacity:key.size() + 1];
+    [token appendBytes:&kContinuationKeyVersion length:1];
+    [token appendBytes:key.data() length:key.size()];
+    return token;
+}
+
+- (void) seekToContinuationKey:(NSData *)continuationKey {
+    NSParameterAssert([continuationKey length] > 0 && *(const uint8_t *)[continuationKey bytes] == kContinuationKeyVersion);
+    [self seekToKey:[continuationKey subdataWithRange:NSMakeRange(1, [continuationKey length] - 1)]];
+}
+
+#pragma mark - NSFastEnumeration
+
+- (NSUInteger) countByEnumeratingWithState:(NSFastEnumerationState *)state
+                                   objects:(id __unsafe_unretained [])buffer
+                                     count:(NSUInteger)len {
+    if (state->state == 0) {
+        state->state = 1;
+        // The keys can't be mutated from under the iterator, which reads a consistent view
+        state->mutationsPtr = &state->extra[0];
+        if (!_positioned)
+            [self seekToFirst];
+    }
+    EnterCursorOperation(0);
+    NSUInteger count = 0;
+    while (count < len && [self inBounds]) {
+        leveldb::Slice key = _iter->key();
+        buffer[count++] = DataFromSlice(key);
+        _iter->Next();
+    }
+    state->itemsPtr = buffer;
+    return count;
+}
+
+#pragma mark - Closing
+
+- (void) close {
+    // The iterator must be released before the snapshot it reads from
+    [_db _closeResource:self usingBlock:^{
+        [self databaseWillClose];
+    }];
+    [_snapshot release];
+    _snapshot = nil;
+}
+
+- (void) databaseWillClose {
+    delete _iter;
+    _iter = NULL;
+    if (_pinnedBlobs)
+        _pinnedBlobs->Unpin(_blobPin);
+    _pinnedBlobs = NULL;
+}
+
+- (void) dealloc {
+    [self close];
+    [_lowerBound release];
+    [_upperBound release];
+    [_db release];
+    [super dealloc];
+}
+
+@end
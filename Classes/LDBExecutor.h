@@ -0,0 +1,86 @@
+//
+//  LDBExecutor.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+typedef enum {
+    LDBExecutorPriorityHigh = 0,    // Point reads (gets and multi-gets)
+    LDBExecutorPriorityDefault,     // Writes
+    LDBExecutorPriorityLow,         // Scans
+    LDBExecutorPriorityCount
+} LDBExecutorPriority;
+
+/**
+ A token handed out by asynchronous operations, used to cancel them.
+
+ An operation cancelled before it starts never runs, and calls its completion block with a `LevelDBErrorCancelled`
+ error. A scan cancelled while running stops at the next key. Other operations can't be interrupted once started.
+ */
+@interface LDBCancellationToken : NSObject
+
+@property (readonly, getter = isCancelled) BOOL cancelled;
+
++ (instancetype) token;
+
+- (void) cancel;
+
+@end
+
+/**
+ A bounded pool of threads running the asynchronous operations of databases.
+
+ Tasks run on at most `concurrency` threads at once, higher priorities first, and low priority tasks never take the
+ last thread, so that scans can't hold point reads back. At most `maxOutstanding` tasks can be queued or running:
+ submitting another one blocks the caller until one finishes, unless the caller is a task of the executor, which runs
+ the task it submits in place instead.
+ */
+@interface LDBExecutor : NSObject
+
+/**
+ The maximum number of tasks running at once
+ */
+@property (nonatomic, readonly) NSUInteger concurrency;
+
+/**
+ The maximum number of tasks queued or running at once
+ */
+@property (nonatomic, readonly) NSUInteger maxOutstanding;
+
+/**
+ The number of tasks queued or running
+ */
+@property (readonly) NSUInteger outstandingCount;
+
+/**
+ The executor used by databases unless told otherwise, running as many tasks as there are active processors (and at
+ least 2), and allowing 1024 outstanding tasks
+ */
++ (instancetype) sharedExecutor;
+
+/**
+ Initialize an executor
+
+ @param concurrency The maximum number of tasks running at once, at least 2 for low priority tasks to leave a thread
+ @param maxOutstanding The maximum number of tasks queued or running at once
+ */
+- (id) initWithConcurrency:(NSUInteger)concurrency maxOutstanding:(NSUInteger)maxOutstanding;
+
+/**
+ Submit a task, blocking until less than `maxOutstanding` tasks are queued or running. Called from a task of the
+ executor, the task is run in place if it can't be queued right away, as waiting could hold the very thread that would
+ make room.
+
+ @param priority The priority of the task
+ @param token (optional) A cancellation token. If cancelled before the task runs, `cancelled` is called instead.
+ @param task The task to run
+ @param cancelled (optional) The block called instead of the task, if it's cancelled before it runs
+ */
+- (void) submitWithPriority:(LDBExecutorPriority)priority
+                      token:(LDBCancellationToken *)token
+                       task:(void (^)(void))task
+                  cancelled:(void (^)(void))cancelled;
+
+@end
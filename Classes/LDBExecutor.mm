@@ -0,0 +1,200 @@
+//
+//  LDBExecutor.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBExecutor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <pthread.h>
+
+// Outstanding tasks allowed by the shared executor
+static const NSUInteger kSharedExecutorMaxOutstanding = 1024;
+
+namespace {
+    struct Task {
+        void (^run)(void);              // Copied
+        void (^cancelled)(void);        // Copied
+        LDBCancellationToken *token;    // Retained
+    };
+
+    // Holds the executor a thread is running tasks for, so that tasks submitting tasks can be recognized
+    pthread_key_t WorkerKey() {
+        static pthread_key_t key;
+        static dispatch_once_t onceToken;
+        dispatch_once(&onceToken, ^{
+            pthread_key_create(&key, NULL);
+        });
+        return key;
+    }
+
+    void RunOrCancel(void (^run)(void), void (^cancelled)(void), LDBCancellationToken *token) {
+        @autoreleasepool {
+            if (token.cancelled) {
+                if (cancelled)
+                    cancelled();
+            } else
+                run();
+        }
+    }
+}
+
+@implementation LDBCancellationToken {
+    std::atomic<bool> _cancelledFlag;
+}
+
++ (instancetype) token {
+    return [[[self alloc] init] autorelease];
+}
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        _cancelledFlag = false;
+    }
+    return self;
+}
+
+- (BOOL) isCancelled {
+    return _cancelledFlag.load(std::memory_order_relaxed);
+}
+
+- (void) cancel {
+    _cancelledFlag = true;
+}
+
+@end
+
+@implementation LDBExecutor {
+    std::mutex _mu;
+    std::deque<Task> _queues[LDBExecutorPriorityCount];
+    NSUInteger _workers;
+    NSUInteger _lowPriorityRunning;
+    dispatch_semaphore_t _slots;
+    std::atomic<NSUInteger> _outstanding;
+}
+
++ (instancetype) sharedExecutor {
+    static LDBExecutor *executor;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSUInteger processors = [[NSProcessInfo processInfo] activeProcessorCount];
+        executor = [[LDBExecutor alloc] initWithConcurrency:MAX(processors, (NSUInteger)2)
+                                             maxOutstanding:kSharedExecutorMaxOutstanding];
+    });
+    return executor;
+}
+
+- (id) initWithConcurrency:(NSUInteger)concurrency maxOutstanding:(NSUInteger)maxOutstanding {
+    NSParameterAssert(concurrency > 1 && maxOutstanding > 0);
+    self = [super init];
+    if (self) {
+        _concurrency = concurrency;
+        _maxOutstanding = maxOutstanding;
+        _slots = dispatch_semaphore_create((long)maxOutstanding);
+        _outstanding = 0;
+    }
+    return self;
+}
+
+- (NSUInteger) outstandingCount {
+    return _outstanding.load(std::memory_order_relaxed);
+}
+
+- (void) submitWithPriority:(LDBExecutorPriority)priority
+                      token:(LDBCancellationToken *)token
+                       task:(void (^)(void))task
+                  cancelled:(void (^)(void))cancelled {
+    NSParameterAssert(priority < LDBExecutorPriorityCount && task != nil);
+    if (pthread_getspecific(WorkerKey()) == self) {
+        // Waiting would hold one of the threads finishing the tasks that could make room, possibly the only one
+        if (dispatch_semaphore_wait(_slots, DISPATCH_TIME_NOW) != 0) {
+            RunOrCancel(task, cancelled, token);
+            return;
+        }
+    } else
+        dispatch_semaphore_wait(_slots, DISPATCH_TIME_FOREVER);
+    _outstanding++;
+
+    Task entry;
+    entry.run = [task copy];
+    entry.cancelled = [cancelled copy];
+    entry.token = [token retain];
+
+    bool spawn;
+    {
+        std::lock_guard<std::mutex> lock(_mu);
+        _queues[priority].push_back(entry);
+        spawn = _workers < _concurrency;
+        if (spawn)
+            _workers++;
+    }
+    if (spawn) {
+        // Released by the worker once it runs out of tasks
+        [self retain];
+        dispatch_async_f(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), self, &RunWorker);
+    }
+}
+
+static void RunWorker(void *context) {
+    LDBExecutor *executor = (LDBExecutor *)context;
+    [executor runTasks];
+    [executor release];
+}
+
+// Must be called with _mu held. Low priority tasks never take the last worker, so that point reads always find one.
+- (bool) popTask:(Task *)task priority:(LDBExecutorPriority *)priority {
+    NSUInteger lowPriorityLimit = _concurrency - 1;
+    for (int p = 0; p < LDBExecutorPriorityCount; p++) {
+        if (_queues[p].empty())
+            continue;
+        if (p == LDBExecutorPriorityLow && _lowPriorityRunning >= lowPriorityLimit)
+            continue;
+        *task = _queues[p].front();
+        _queues[p].pop_front();
+        *priority = (LDBExecutorPriority)p;
+        return true;
+    }
+    return false;
+}
+
+- (void) runTasks {
+    pthread_setspecific(WorkerKey(), self);
+    while (true) {
+        Task task;
+        LDBExecutorPriority priority;
+        {
+            std::lock_guard<std::mutex> lock(_mu);
+            if (![self popTask:&task priority:&priority]) {
+                _workers--;
+                pthread_setspecific(WorkerKey(), NULL);
+                return;
+            }
+            if (priority == LDBExecutorPriorityLow)
+                _lowPriorityRunning++;
+        }
+
+        RunOrCancel(task.run, task.cancelled, task.token);
+        [task.run release];
+        [task.cancelled release];
+        [task.token release];
+
+        if (priority == LDBExecutorPriorityLow) {
+            std::lock_guard<std::mutex> lock(_mu);
+            _lowPriorityRunning--;
+        }
+        _outstanding--;
+        dispatch_semaphore_signal(_slots);
+    }
+}
+
+- (void) dealloc {
+    dispatch_release(_slots);
+    [super dealloc];
+}
+
+@end
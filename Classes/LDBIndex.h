@@ -0,0 +1,101 @@
+//
+//  LDBIndex.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+/**
+ A secondary index of a database, returned by `-[LevelDB addIndexNamed:extractor:]`, finding keys by the values their
+ extractor returns for them.
+
+ Index entries are kept in a keyspace reserved by the database (keys starting with `0xFF 0xFF "ldb."`, which sort after
+ any other key), one per indexed value and key, encoded with `LDBKeyEncoding` so that values sort by type and value.
+ Enumerations, cursors, range removals and size estimates of the database never see that keyspace.
+ They are added and removed in the same `leveldb::WriteBatch` as the puts and deletes they index, whether those come
+ from single writes, write batches, range removals or bulk loads, so an index is never out of date. Doing so reads and
+ decodes the value each write replaces, and commits writes one at a time, as long as the database has an index.
+
+ Indexes aren't persisted, only their entries are: they must be added again every time the database is opened, before
+ writing to it. An index added to a database holding keys written without it must be built once (see `isBuilt`).
+
+ Queries read the index and the values it points to from a single snapshot, and return keys (as `NSData`) and values
+ in the order of the values they are indexed under, then of keys.
+ */
+@interface LDBIndex : NSObject
+
+@property (nonatomic, readonly) LevelDB *db;
+
+/**
+ The name of the index, which identifies its entries across launches
+ */
+@property (nonatomic, readonly) NSString *name;
+
+/**
+ A boolean value indicating whether the index covers every key, which is the case once it was built, or if it was
+ added to a database before any write
+ */
+@property (readonly, getter = isBuilt) BOOL built;
+
+#pragma mark - Queries
+
+/**
+ Return the keys indexed under a value, or under any value starting with the given components for composite values
+ */
+- (NSArray *) keysForValue:(id)value;
+
+/**
+ Return the keys indexed under a value in the range [`lowerValue`, `upperValue`]
+
+ @param lowerValue (optional) The smallest value of the range. If `nil`, the range starts from the first value.
+ @param upperValue (optional) The largest value of the range. If `nil`, the range ends at the last value.
+ @param snapshot (optional) The snapshot the index is read from. If `nil`, an implicit snapshot is used.
+ */
+- (NSArray *) keysFromValue:(id)lowerValue
+                    toValue:(id)upperValue
+               withSnapshot:(LDBSnapshot *)snapshot;
+
+/**
+ Return the values of the keys indexed under a value, or under any value starting with the given components for
+ composite values
+ */
+- (NSArray *) objectsForValue:(id)value;
+
+/**
+ Return the values of the keys indexed under a value in the range [`lowerValue`, `upperValue`]
+
+ Same as `keysFromValue:toValue:withSnapshot:`, returning the values associated with the keys instead.
+ */
+- (NSArray *) objectsFromValue:(id)lowerValue
+                       toValue:(id)upperValue
+                  withSnapshot:(LDBSnapshot *)snapshot;
+
+/**
+ Enumerate over the key value pairs indexed under a value in the range [`lowerValue`, `upperValue`]
+
+ Same as `keysFromValue:toValue:withSnapshot:`, calling a block with every key and its value.
+ */
+- (void) enumerateKeysAndObjectsFromValue:(id)lowerValue
+                                  toValue:(id)upperValue
+                             withSnapshot:(LDBSnapshot *)snapshot
+                               usingBlock:(LevelDBKeyValueBlock)block;
+
+#pragma mark - Building
+
+/**
+ Remove every entry of the index, and index every key of the database again, on the database's executor, behind reads
+ and writes. Needed once for an index added to a database holding keys, or after its extractor changed.
+
+ Keys are indexed a bounded batch at a time, each reading the latest values while writes wait, so that writes committed
+ during the build are indexed along with it. Queries may miss keys until the build completes.
+
+ @param completion (optional) A block called on the executor once the index is built, with a `NSError` instance if the build failed, or if it was cancelled or the database closed before it completed
+
+ @return A token cancelling the build, which stops before the next batch and leaves the index unbuilt
+ */
+- (LDBCancellationToken *) buildWithCompletion:(void (^)(NSError *error))completion;
+
+@end
@@ -0,0 +1,205 @@
+//
+//  LDBIndex.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBIndex.h"
+#import "LDBKeyEncoding.h"
+#import "LDBSnapshot.h"
+
+#import <leveldb/slice.h>
+
+#include <atomic>
+#include <set>
+#include <string>
+
+#include "LDBCommon.h"
+
+// Prefix of the entries of an index, followed by its name and the components of the entry
+static const char kIndexEntryPrefix[] = kLDBReservedKeyPrefix "index:";
+// Prefix of the key marking an index as built, followed by its name
+static const char kIndexBuiltPrefix[] = kLDBReservedKeyPrefix "built:";
+
+// The components a value is indexed under, composite values being arrays
+static NSArray * ComponentsOfValue(id value) {
+    return [value isKindOfClass:[NSArray class]] ? value : @[value];
+}
+
+static void AppendData(std::string *string, NSData *data) {
+    string->append((const char *)[data bytes], [data length]);
+}
+
+@interface LevelDB ()
+- (void) _enumerateIndexEntriesFromSlice:(const leveldb::Slice &)start
+                                 toSlice:(const leveldb::Slice &)limit
+                            withSnapshot:(LDBSnapshot *)snapshot
+                              usingBlock:(void (^)(const leveldb::Slice &entry, BOOL *stop))block;
+- (LDBCancellationToken *) _buildIndex:(LDBIndex *)index completion:(void (^)(NSError *error))completion;
+@end
+
+@interface LDBIndex () {
+    LevelDB *_db;               // Not retained, cleared when the database goes away
+    LevelDBIndexExtractorBlock _extractor;
+    std::string _entryPrefix;   // Reserved prefix and encoded name, starting every entry of the index
+    std::atomic<bool> _built;
+}
+
++ (instancetype) indexWithDB:(LevelDB *)db name:(NSString *)name extractor:(LevelDBIndexExtractorBlock)extractor;
++ (std::string) entryPrefixForName:(NSString *)name;
++ (std::string) builtKeyForName:(NSString *)name;
+
+- (const std::string &) entryPrefix;
+- (void) setBuilt:(BOOL)built;
+- (void) addEntriesForKey:(const leveldb::Slice &)key value:(id)value toSet:(std::set<std::string> *)entries;
+- (void) detach;
+
+@end
+
+@implementation LDBIndex
+
++ (instancetype) indexWithDB:(LevelDB *)db name:(NSString *)name extractor:(LevelDBIndexExtractorBlock)extractor {
+    NSParameterAssert([name length] > 0 && extractor != nil);
+    LDBIndex *index = [[[self alloc] init] autorelease];
+    index->_db = db;
+    index->_name = [name copy];
+    index->_extractor = [extractor copy];
+    index->_entryPrefix = [self entryPrefixForName:name];
+    index->_built = false;
+    return index;
+}
+
++ (std::string) entryPrefixForName:(NSString *)name {
+    std::string prefix(kIndexEntryPrefix);
+    AppendData(&prefix, [LDBKeyEncoding keyWithString:name]);
+    return prefix;
+}
++ (std::string) builtKeyForName:(NSString *)name {
+    std::string key(kIndexBuiltPrefix);
+    key.append([name UTF8String], [name lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
+    return key;
+}
+
+- (const std::string &) entryPrefix {
+    return _entryPrefix;
+}
+
+- (void) detach {
+    _db = nil;
+}
+
+- (BOOL) isBuilt {
+    return _built.load();
+}
+- (void) setBuilt:(BOOL)built {
+    _built.store(built);
+}
+
+// An entry is the index's prefix, followed by the components of an indexed value and the key as a data component
+- (void) addEntriesForKey:(const leveldb::Slice &)key value:(id)value toSet:(std::set<std::string> *)entries {
+    if (value == nil)
+        return;
+    LevelDBKey lkey = GenericKeyFromSlice(key);
+    NSArray *indexed = _extractor(&lkey, value);
+    if ([indexed count] == 0)
+        return;
+
+    NSData *keyComponent = [LDBKeyEncoding keyWithComponents:@[TransientDataFromSlice(key)]];
+    for (id indexedValue in indexed) {
+        std::string entry(_entryPrefix);
+        AppendData(&entry, [LDBKeyEncoding keyWithComponents:ComponentsOfValue(indexedValue)]);
+        AppendData(&entry, keyComponent);
+        entries->insert(entry);
+    }
+}
+
+#pragma mark - Queries
+
+- (NSArray *) keysForValue:(id)value {
+    NSParameterAssert(value != nil);
+    return [self keysFromValue:value toValue:value withSnapshot:nil];
+}
+
+- (NSArray *) keysFromValue:(id)lowerValue
+                    toValue:(id)upperValue
+               withSnapshot:(LDBSnapshot *)snapshot {
+
+    std::string start(_entryPrefix), limit(_entryPrefix);
+    if (lowerValue)
+        AppendData(&start, [LDBKeyEncoding keyWithComponents:ComponentsOfValue(lowerValue)]);
+    if (upperValue)
+        AppendData(&limit, [LDBKeyEncoding keyWithComponents:ComponentsOfValue(upperValue)]);
+    // Entries under the upper value (or extending it) go on with a type byte, below the byte escaping zeros
+    limit.push_back('\xff');
+
+    NSMutableArray *keys = [NSMutableArray array];
+    size_t prefixLength = _entryPrefix.size();
+    [_db _enumerateIndexEntriesFromSlice:start
+                                 toSlice:limit
+                            withSnapshot:snapshot
+                              usingBlock:^(const leveldb::Slice &entry, BOOL *stop) {
+        LevelDBKey components = { entry.data() + prefixLength, entry.size() - prefixLength };
+        NSData *key = [[LDBKeyEncoding componentsOfKey:&components] lastObject];
+        if ([key isKindOfClass:[NSData class]])
+            [keys addObject:key];
+    }];
+    return keys;
+}
+
+- (NSArray *) objectsForValue:(id)value {
+    NSParameterAssert(value != nil);
+    return [self objectsFromValue:value toValue:value withSnapshot:nil];
+}
+
+- (NSArray *) objectsFromValue:(id)lowerValue
+                       toValue:(id)upperValue
+                  withSnapshot:(LDBSnapshot *)snapshot {
+
+    NSMutableArray *objects = [NSMutableArray array];
+    [self enumerateKeysAndObjectsFromValue:lowerValue
+                                   toValue:upperValue
+                              withSnapshot:snapshot
+                                usingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+        [objects addObject:value];
+    }];
+    return objects;
+}
+
+- (void) enumerateKeysAndObjectsFromValue:(id)lowerValue
+                                  toValue:(id)upperValue
+                             withSnapshot:(LDBSnapshot *)snapshot
+                               usingBlock:(LevelDBKeyValueBlock)block {
+
+    // The index and the values it points to are read from the same snapshot
+    LDBSnapshot *implicitSnapshot = nil;
+    if (snapshot == nil)
+        snapshot = implicitSnapshot = [_db newSnapshot];
+
+    NSArray *keys = [self keysFromValue:lowerValue toValue:upperValue withSnapshot:snapshot];
+    NSArray *values = [snapshot objectsForKeys:keys notFoundMarker:[NSNull null]];
+    [implicitSnapshot release];
+
+    BOOL stop = NO;
+    for (NSUInteger i = 0; i < [values count] && !stop; i++) {
+        id value = values[i];
+        if (value == [NSNull null])
+            continue;
+        NSData *key = keys[i];
+        LevelDBKey lkey = { (const char *)[key bytes], [key length] };
+        block(&lkey, value, &stop);
+    }
+}
+
+#pragma mark - Building
+
+- (LDBCancellationToken *) buildWithCompletion:(void (^)(NSError *error))completion {
+    return [_db _buildIndex:self completion:completion];
+}
+
+- (void) dealloc {
+    [_name release];
+    [_extractor release];
+    [super dealloc];
+}
+
+@end
@@ -0,0 +1,222 @@
+//
+//  LDBInstrumentation.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+typedef enum {
+    LevelDBOperationGet = 0,        // objectForKey: and friends, outside snapshots
+    LevelDBOperationSnapshotGet,    // objectForKey: and friends, inside snapshots
+    LevelDBOperationMultiGet,       // objectsForKeys:notFoundMarker:
+    LevelDBOperationPut,            // setObject:forKey:
+    LevelDBOperationDelete,         // removeObjectForKey:
+    LevelDBOperationWriteBatchPut,  // setObject:forKey: on write batches
+    LevelDBOperationWriteBatch,     // Applying write batches
+    LevelDBOperationScan,           // Enumerations
+    LevelDBOperationSnapshot,       // Taking snapshots
+    LevelDBOperationCount
+} LevelDBOperation;
+
+typedef enum {
+    LevelDBPhaseTotal = 0,          // The whole operation
+    LevelDBPhaseEngine,             // Time spent in leveldb (reads, writes, iterator moves)
+    LevelDBPhaseEncode,             // Time spent in the encoder block
+    LevelDBPhaseDecode,             // Time spent in the decoder block
+    LevelDBPhaseCount
+} LevelDBPhase;
+
+/**
+ A log-bucketed histogram of the durations of an operation phase, with 4 buckets per power of two nanoseconds.
+ */
+@interface LDBLatencyHistogram : NSObject
+
+/**
+ The number of recorded durations
+ */
+@property (nonatomic, readonly) uint64_t count;
+
+/**
+ The sum of the recorded durations, in seconds
+ */
+@property (nonatomic, readonly) NSTimeInterval totalTime;
+
+/**
+ The median duration, in seconds
+ */
+@property (nonatomic, readonly) NSTimeInterval p50;
+
+/**
+ The 99th percentile duration, in seconds
+ */
+@property (nonatomic, readonly) NSTimeInterval p99;
+
+/**
+ The 99.9th percentile duration, in seconds
+ */
+@property (nonatomic, readonly) NSTimeInterval p999;
+
+/**
+ Return an estimate of the duration below which a fraction of the recorded durations fall, in seconds
+
+ @param fraction A number between 0 and 1
+ */
+- (NSTimeInterval) percentile:(double)fraction;
+
+@end
+
+/**
+ The latencies recorded by a database, merged from every thread, since it was last reset.
+ */
+@interface LDBLatencySnapshot : NSObject
+
+/**
+ Return the histogram of the durations of a phase of an operation
+ */
+- (LDBLatencyHistogram *) histogramForOperation:(LevelDBOperation)operation phase:(LevelDBPhase)phase;
+
+/**
+ Return the number of keys read or written by an operation (scans and multi-gets)
+ */
+- (uint64_t) keyCountForOperation:(LevelDBOperation)operation;
+
+/**
+ Return the number of bytes of keys and values read or written by an operation (scans, multi-gets and write batches)
+ */
+- (uint64_t) byteCountForOperation:(LevelDBOperation)operation;
+
+@end
+
+#ifdef __cplusplus
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <pthread.h>
+
+/*
+ * Latency histograms of a database. Threads record into one of a fixed number of slots, picked
+ * by thread like the stripes of LDBInFlightTracker, with relaxed atomic adds and no lock, and
+ * snapshots add up every slot. Memory is bounded whatever the number of threads that ever
+ * recorded. Resetting only records a baseline subtracted from later snapshots, so that slots
+ * are only ever written by recording threads.
+ */
+class LDBLatencyRecorder {
+public:
+    static const int kBuckets = 4 + 40 * 4;    // Up to 2^42ns, about an hour
+    static const int kStripes = 16;
+
+    LDBLatencyRecorder();
+    ~LDBLatencyRecorder();
+
+    bool Enabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+    void SetEnabled(bool enabled) {
+        enabled_.store(enabled, std::memory_order_relaxed);
+    }
+
+    void Record(LevelDBOperation operation, LevelDBPhase phase, uint64_t nanoseconds);
+    void Count(LevelDBOperation operation, uint64_t keys, uint64_t bytes);
+
+    LDBLatencySnapshot *Snapshot();
+    void Reset();
+
+    struct Slot;
+
+private:
+    Slot *SlotForCurrentThread();
+    void Merge(Slot *into);
+
+    std::atomic<bool> enabled_;
+    std::atomic<Slot *> stripes_[kStripes];
+    std::mutex baselineMu_;
+    Slot *baseline_;
+};
+
+/*
+ * Time an operation, accumulating the durations of its phases, which are recorded (along with
+ * the total) when the timer goes out of scope. Does nothing if the recorder is NULL or disabled.
+ */
+class LDBLatencyTimer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    LDBLatencyTimer(LDBLatencyRecorder *recorder, LevelDBOperation operation)
+    : recorder_((recorder != NULL && recorder->Enabled()) ? recorder : NULL), operation_(operation),
+      phases_(0), keys_(0), bytes_(0) {
+        if (recorder_ != NULL)
+            start_ = mark_ = Clock::now();
+    }
+    ~LDBLatencyTimer() {
+        if (recorder_ == NULL)
+            return;
+        recorder_->Record(operation_, LevelDBPhaseTotal, Nanoseconds(Clock::now() - start_));
+        for (int phase = LevelDBPhaseTotal + 1; phase < LevelDBPhaseCount; phase++)
+            if (phases_ & (1 << phase))
+                recorder_->Record(operation_, (LevelDBPhase)phase, durations_[phase]);
+        if (keys_ || bytes_)
+            recorder_->Count(operation_, keys_, bytes_);
+    }
+
+    bool Active() const {
+        return recorder_ != NULL;
+    }
+
+    // Restart the current phase without accounting for the time elapsed since the last mark
+    void Mark() {
+        if (recorder_ != NULL)
+            mark_ = Clock::now();
+    }
+
+    // Account for the time elapsed since the last mark in `phase`
+    void Phase(LevelDBPhase phase) {
+        if (recorder_ == NULL)
+            return;
+        Clock::time_point now = Clock::now();
+        Add(phase, Nanoseconds(now - mark_));
+        mark_ = now;
+    }
+
+    // Time a phase nested in another one (decoding inside a user block), with `AddSince`
+    Clock::time_point Now() const {
+        return recorder_ != NULL ? Clock::now() : Clock::time_point();
+    }
+    void AddSince(LevelDBPhase phase, Clock::time_point since) {
+        if (recorder_ != NULL)
+            Add(phase, Nanoseconds(Clock::now() - since));
+    }
+
+    void Add(LevelDBPhase phase, uint64_t nanoseconds) {
+        if (recorder_ == NULL)
+            return;
+        if (!(phases_ & (1 << phase))) {
+            phases_ |= (1 << phase);
+            durations_[phase] = 0;
+        }
+        durations_[phase] += nanoseconds;
+    }
+
+    void Count(uint64_t keys, uint64_t bytes) {
+        if (recorder_ == NULL)
+            return;
+        keys_ += keys;
+        bytes_ += bytes;
+    }
+
+    static uint64_t Nanoseconds(Clock::duration duration) {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+    }
+
+private:
+    LDBLatencyRecorder *recorder_;
+    LevelDBOperation operation_;
+    Clock::time_point start_, mark_;
+    unsigned phases_;
+    uint64_t durations_[LevelDBPhaseCount];
+    uint64_t keys_, bytes_;
+
+    LDBLatencyTimer(const LDBLatencyTimer &);
+    LDBLatencyTimer &operator=(const LDBLatencyTimer &);
+};
+#endif
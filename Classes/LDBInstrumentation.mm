@@ -0,0 +1,239 @@
+//
+//  LDBInstrumentation.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBInstrumentation.h"
+
+struct LDBLatencyRecorder::Slot {
+    std::atomic<uint64_t> buckets[LevelDBOperationCount][LevelDBPhaseCount][kBuckets];
+    std::atomic<uint64_t> sums[LevelDBOperationCount][LevelDBPhaseCount];
+    std::atomic<uint64_t> keys[LevelDBOperationCount];
+    std::atomic<uint64_t> bytes[LevelDBOperationCount];
+
+    Slot() {
+        Clear();
+    }
+
+    void Clear() {
+        for (int o = 0; o < LevelDBOperationCount; o++) {
+            for (int p = 0; p < LevelDBPhaseCount; p++) {
+                for (int b = 0; b < kBuckets; b++)
+                    buckets[o][p][b].store(0, std::memory_order_relaxed);
+                sums[o][p].store(0, std::memory_order_relaxed);
+            }
+            keys[o].store(0, std::memory_order_relaxed);
+            bytes[o].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+namespace {
+    // Add to a slot only written by the current thread (a snapshot being merged, or the baseline under its lock)
+    inline void Increment(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    // Add to a stripe, which threads hashed to the same stripe share
+    inline void Add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    int BucketForNanoseconds(uint64_t nanoseconds) {
+        if (nanoseconds < 4)
+            return (int)nanoseconds;
+        int exponent = 63 - __builtin_clzll(nanoseconds);
+        int sub = (int)((nanoseconds >> (exponent - 2)) & 3);
+        int bucket = 4 + (exponent - 2) * 4 + sub;
+        return bucket < LDBLatencyRecorder::kBuckets ? bucket : LDBLatencyRecorder::kBuckets - 1;
+    }
+
+    // The middle of the range of durations counted in a bucket
+    double NanosecondsForBucket(int bucket) {
+        if (bucket < 4)
+            return bucket;
+        int exponent = (bucket - 4) / 4 + 2;
+        int sub = (bucket - 4) % 4;
+        return ((double)(4 + sub) + 0.5) * (double)(1ULL << (exponent - 2));
+    }
+}
+
+@interface LDBLatencyHistogram ()
+- (id) initWithBuckets:(const uint64_t *)buckets sum:(uint64_t)sum;
+@end
+
+@implementation LDBLatencyHistogram {
+    uint64_t _buckets[LDBLatencyRecorder::kBuckets];
+    uint64_t _sum;
+}
+
+- (id) initWithBuckets:(const uint64_t *)buckets sum:(uint64_t)sum {
+    self = [super init];
+    if (self) {
+        memcpy(_buckets, buckets, sizeof(_buckets));
+        _sum = sum;
+        for (int b = 0; b < LDBLatencyRecorder::kBuckets; b++)
+            _count += buckets[b];
+    }
+    return self;
+}
+
+- (NSTimeInterval) totalTime {
+    return _sum / 1e9;
+}
+
+- (NSTimeInterval) percentile:(double)fraction {
+    if (_count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(MIN(MAX(fraction, 0.0), 1.0) * _count);
+    uint64_t seen = 0;
+    for (int b = 0; b < LDBLatencyRecorder::kBuckets; b++) {
+        seen += _buckets[b];
+        if (seen >= rank && seen > 0)
+            return NanosecondsForBucket(b) / 1e9;
+    }
+    return NanosecondsForBucket(LDBLatencyRecorder::kBuckets - 1) / 1e9;
+}
+
+- (NSTimeInterval) p50 {
+    return [self percentile:0.5];
+}
+- (NSTimeInterval) p99 {
+    return [self percentile:0.99];
+}
+- (NSTimeInterval) p999 {
+    return [self percentile:0.999];
+}
+
+- (NSString *) description {
+    return [NSString stringWithFormat:@"<%@ count=%llu p50=%.1fus p99=%.1fus p999=%.1fus>", [self class],
+            (unsigned long long)_count, self.p50 * 1e6, self.p99 * 1e6, self.p999 * 1e6];
+}
+
+@end
+
+@interface LDBLatencySnapshot ()
+- (LDBLatencyRecorder::Slot *) slot;
+@end
+
+@implementation LDBLatencySnapshot {
+    LDBLatencyRecorder::Slot *_slot;
+}
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        _slot = new LDBLatencyRecorder::Slot();
+    }
+    return self;
+}
+
+- (LDBLatencyRecorder::Slot *) slot {
+    return _slot;
+}
+
+- (LDBLatencyHistogram *) histogramForOperation:(LevelDBOperation)operation phase:(LevelDBPhase)phase {
+    NSParameterAssert(operation < LevelDBOperationCount && phase < LevelDBPhaseCount);
+    uint64_t buckets[LDBLatencyRecorder::kBuckets];
+    for (int b = 0; b < LDBLatencyRecorder::kBuckets; b++)
+        buckets[b] = _slot->buckets[operation][phase][b].load(std::memory_order_relaxed);
+    return [[[LDBLatencyHistogram alloc] initWithBuckets:buckets
+                                                     sum:_slot->sums[operation][phase].load(std::memory_order_relaxed)] autorelease];
+}
+
+- (uint64_t) keyCountForOperation:(LevelDBOperation)operation {
+    NSParameterAssert(operation < LevelDBOperationCount);
+    return _slot->keys[operation].load(std::memory_order_relaxed);
+}
+- (uint64_t) byteCountForOperation:(LevelDBOperation)operation {
+    NSParameterAssert(operation < LevelDBOperationCount);
+    return _slot->bytes[operation].load(std::memory_order_relaxed);
+}
+
+- (void) dealloc {
+    delete _slot;
+    [super dealloc];
+}
+
+@end
+
+LDBLatencyRecorder::LDBLatencyRecorder()
+: enabled_(false), baseline_(new Slot()) {
+    for (int i = 0; i < kStripes; i++)
+        stripes_[i].store(NULL, std::memory_order_relaxed);
+}
+
+LDBLatencyRecorder::~LDBLatencyRecorder() {
+    for (int i = 0; i < kStripes; i++)
+        delete stripes_[i].load();
+    delete baseline_;
+}
+
+// Stripes are allocated on first use, so that a recorder only ever used by a few threads stays small
+LDBLatencyRecorder::Slot *LDBLatencyRecorder::SlotForCurrentThread() {
+    uint64_t thread = (uint64_t)(uintptr_t)pthread_self();
+    std::atomic<Slot *> &stripe = stripes_[((thread >> 4) * 0x9E3779B97F4A7C15ULL) >> 60];    // Top 4 bits, one of kStripes
+    Slot *slot = stripe.load(std::memory_order_acquire);
+    if (slot == NULL) {
+        Slot *allocated = new Slot();
+        if (stripe.compare_exchange_strong(slot, allocated, std::memory_order_acq_rel))
+            slot = allocated;
+        else
+            delete allocated;
+    }
+    return slot;
+}
+
+void LDBLatencyRecorder::Record(LevelDBOperation operation, LevelDBPhase phase, uint64_t nanoseconds) {
+    Slot *slot = SlotForCurrentThread();
+    Add(slot->buckets[operation][phase][BucketForNanoseconds(nanoseconds)], 1);
+    Add(slot->sums[operation][phase], nanoseconds);
+}
+
+void LDBLatencyRecorder::Count(LevelDBOperation operation, uint64_t keys, uint64_t bytes) {
+    Slot *slot = SlotForCurrentThread();
+    Add(slot->keys[operation], keys);
+    Add(slot->bytes[operation], bytes);
+}
+
+void LDBLatencyRecorder::Merge(Slot *into) {
+    for (int i = 0; i < kStripes; i++) {
+        Slot *slot = stripes_[i].load(std::memory_order_acquire);
+        if (slot == NULL)
+            continue;
+        for (int o = 0; o < LevelDBOperationCount; o++) {
+            for (int p = 0; p < LevelDBPhaseCount; p++) {
+                for (int b = 0; b < kBuckets; b++)
+                    Increment(into->buckets[o][p][b], slot->buckets[o][p][b].load(std::memory_order_relaxed));
+                Increment(into->sums[o][p], slot->sums[o][p].load(std::memory_order_relaxed));
+            }
+            Increment(into->keys[o], slot->keys[o].load(std::memory_order_relaxed));
+            Increment(into->bytes[o], slot->bytes[o].load(std::memory_order_relaxed));
+        }
+    }
+}
+
+LDBLatencySnapshot *LDBLatencyRecorder::Snapshot() {
+    LDBLatencySnapshot *snapshot = [[[LDBLatencySnapshot alloc] init] autorelease];
+    Slot *merged = [snapshot slot];
+
+    // Merged under the lock, after the baseline was, so that counters only grew since and subtracting it can't wrap
+    std::lock_guard<std::mutex> lock(baselineMu_);
+    Merge(merged);
+    for (int o = 0; o < LevelDBOperationCount; o++) {
+        for (int p = 0; p < LevelDBPhaseCount; p++) {
+            for (int b = 0; b < kBuckets; b++)
+                Increment(merged->buckets[o][p][b], -baseline_->buckets[o][p][b].load(std::memory_order_relaxed));
+            Increment(merged->sums[o][p], -baseline_->sums[o][p].load(std::memory_order_relaxed));
+        }
+        Increment(merged->keys[o], -baseline_->keys[o].load(std::memory_order_relaxed));
+        Increment(merged->bytes[o], -baseline_->bytes[o].load(std::memory_order_relaxed));
+    }
+    return snapshot;
+}
+
+void LDBLatencyRecorder::Reset() {
+    std::lock_guard<std::mutex> lock(baselineMu_);
+    baseline_->Clear();
+    Merge(baseline_);
+}
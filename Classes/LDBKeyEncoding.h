@@ -0,0 +1,76 @@
+//
+//  LDBKeyEncoding.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+/**
+ An encoding of typed keys whose bytewise order is the order of their values, so that numeric ids, timestamps and
+ composite keys sort correctly with leveldb's default comparator, and decode back into typed components.
+
+ A key is a tuple of components, each a type byte followed by its payload:
+
+ - `NSNull`, sorting first
+ - `NSData` and `NSString` (as UTF-8), terminated by a zero byte, with zero bytes escaped
+ - `NSNumber` instances, integer or floating point alike, as the 8 big-endian bytes of the largest double not above the
+   number, flipped to sort by value, followed by 2 bytes holding the distance from that double to the number (for
+   integers a double can't represent exactly) and whether the number is a double, a signed or an unsigned integer
+
+ Components of different types sort in that order, numbers by value whatever their type (a double before the integer of
+ the same value), and tuples sort component by component, so the key of a tuple is a prefix of the keys of every longer tuple starting with the
+ same components. It is not their exact prefix when the tuple ends with a string or data: `@[@"a"]` also prefixes
+ `@[@"a\0b"]`, whose escaped zero byte is followed by `0xFF`. A tuple and its extensions are exactly the keys in the
+ range [`keyWithComponents:`, `limitKeyWithComponents:`), as read by `-[LevelDB newCursorFromKey:toKey:]`.
+ */
+@interface LDBKeyEncoding : NSObject
+
+/**
+ Return the key of a tuple of `NSNull`, `NSData`, `NSString` and `NSNumber` instances
+ */
++ (NSData *) keyWithComponents:(NSArray *)components;
+
+/**
+ Return the key right after the keys of a tuple and of every longer tuple starting with the same components: the key
+ of the tuple followed by `0xFF`, which no component starts with
+ */
++ (NSData *) limitKeyWithComponents:(NSArray *)components;
+
+/**
+ Return the key of a single signed integer
+ */
++ (NSData *) keyWithInteger:(int64_t)value;
+
+/**
+ Return the key of a single unsigned integer
+ */
++ (NSData *) keyWithUnsignedInteger:(uint64_t)value;
+
+/**
+ Return the key of a single double, ordered by value (with `-0.0` before `0.0`, and NaNs last)
+ */
++ (NSData *) keyWithDouble:(double)value;
+
+/**
+ Return the key of a single string
+ */
++ (NSData *) keyWithString:(NSString *)value;
+
+/**
+ Decode the components of a key, or return `nil` if it wasn't encoded by this class. Integers come back as
+ `NSNumber` instances holding a `long long` (or an `unsigned long long` above `INT64_MAX`), and floating point
+ numbers as `NSNumber` instances holding a `double`.
+
+ @param key A key, as passed to enumeration blocks
+ */
++ (NSArray *) componentsOfKey:(LevelDBKey *)key;
+
+/**
+ Same as `componentsOfKey:`, with the key as `NSData`
+ */
++ (NSArray *) componentsOfKeyData:(NSData *)key;
+
+@end
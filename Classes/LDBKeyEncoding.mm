@@ -0,0 +1,253 @@
+//
+//  LDBKeyEncoding.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBKeyEncoding.h"
+
+#include <cmath>
+#include <cstring>
+
+// Type bytes of components, in the order components of different types sort
+static const uint8_t kKeyTypeNull = 0x00;
+static const uint8_t kKeyTypeData = 0x01;
+static const uint8_t kKeyTypeString = 0x02;
+static const uint8_t kKeyTypeNumber = 0x15;
+
+// Kinds of numbers, in the two low bits of the tail following the double of a number
+static const uint16_t kNumberKindDouble = 0;
+static const uint16_t kNumberKindInteger = 1;
+static const uint16_t kNumberKindUnsignedInteger = 2;
+
+// Zero bytes inside data and strings are followed by this byte, so that they sort before the terminator
+static const uint8_t kKeyEscape = 0xff;
+
+static const uint64_t kSignBit = 0x8000000000000000ULL;
+
+static void AppendBigEndian64(NSMutableData *key, uint64_t value) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = (uint8_t)(value >> (56 - 8 * i));
+    [key appendBytes:bytes length:8];
+}
+
+static uint64_t ReadBigEndian64(const uint8_t *bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+        value = (value << 8) | bytes[i];
+    return value;
+}
+
+static void AppendBigEndian16(NSMutableData *key, uint16_t value) {
+    uint8_t bytes[2] = { (uint8_t)(value >> 8), (uint8_t)value };
+    [key appendBytes:bytes length:2];
+}
+
+static void AppendEscaped(NSMutableData *key, uint8_t type, const uint8_t *bytes, NSUInteger length) {
+    static const uint8_t escapedZero[2] = { 0x00, kKeyEscape };
+    [key appendBytes:&type length:1];
+    NSUInteger start = 0;
+    for (NSUInteger i = 0; i < length; i++) {
+        if (bytes[i] != 0x00)
+            continue;
+        [key appendBytes:bytes + start length:i - start];
+        [key appendBytes:escapedZero length:2];
+        start = i + 1;
+    }
+    [key appendBytes:bytes + start length:length - start];
+    [key appendBytes:escapedZero length:1];
+}
+
+/*
+ * Every number is encoded as the largest double not above it, flipped to sort by value, followed by a 16-bit tail: the
+ * distance from that double to the number (below 2048 for any 64-bit integer), then its kind. Integers and doubles
+ * therefore sort together by value, and integers too large for a double keep their exact value.
+ */
+static void AppendNumber(NSMutableData *key, double value, uint16_t remainder, uint16_t kind) {
+    uint64_t bits;
+    if (std::isnan(value))
+        bits = 0x7ff8000000000000ULL;
+    else
+        memcpy(&bits, &value, sizeof(bits));
+    // Negative numbers sort in reverse with their bits flipped, positive ones after them with their sign set
+    bits = (bits & kSignBit) ? ~bits : (bits | kSignBit);
+    [key appendBytes:&kKeyTypeNumber length:1];
+    AppendBigEndian64(key, bits);
+    AppendBigEndian16(key, (uint16_t)(remainder << 2 | kind));
+}
+
+static void AppendDouble(NSMutableData *key, double value) {
+    AppendNumber(key, value, 0, kNumberKindDouble);
+}
+
+static void AppendInteger(NSMutableData *key, int64_t value) {
+    double rounded = (double)value;
+    // 2^63 itself doesn't fit, and is above any value rounding to it
+    if (rounded >= 9223372036854775808.0 || (int64_t)rounded > value)
+        rounded = nextafter(rounded, -INFINITY);
+    AppendNumber(key, rounded, (uint16_t)(value - (int64_t)rounded), kNumberKindInteger);
+}
+
+static void AppendUnsignedInteger(NSMutableData *key, uint64_t value) {
+    // Values that fit are encoded as signed integers, so that equal integers have the same key
+    if (value <= INT64_MAX) {
+        AppendInteger(key, (int64_t)value);
+        return;
+    }
+    double rounded = (double)value;
+    if (rounded >= 18446744073709551616.0 || (uint64_t)rounded > value)
+        rounded = nextafter(rounded, 0.0);
+    AppendNumber(key, rounded, (uint16_t)(value - (uint64_t)rounded), kNumberKindUnsignedInteger);
+}
+
+static void AppendComponent(NSMutableData *key, id component) {
+    if (component == [NSNull null]) {
+        [key appendBytes:&kKeyTypeNull length:1];
+    } else if ([component isKindOfClass:[NSData class]]) {
+        AppendEscaped(key, kKeyTypeData, (const uint8_t *)[component bytes], [component length]);
+    } else if ([component isKindOfClass:[NSString class]]) {
+        AppendEscaped(key, kKeyTypeString, (const uint8_t *)[component UTF8String],
+                      [component lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
+    } else if ([component isKindOfClass:[NSNumber class]]) {
+        char type = *[component objCType];
+        if (type == 'f' || type == 'd')
+            AppendDouble(key, [component doubleValue]);
+        else if (type == 'Q' || type == 'L' || type == 'I')
+            AppendUnsignedInteger(key, [component unsignedLongLongValue]);
+        else
+            AppendInteger(key, [component longLongValue]);
+    } else {
+        [NSException raise:NSInvalidArgumentException
+                    format:@"Keys can't hold instances of %@", [component class]];
+    }
+}
+
+// Read a component escaped by `AppendEscaped`, moving `offset` past its terminator
+static NSData * ReadEscaped(const uint8_t *bytes, NSUInteger length, NSUInteger *offset) {
+    NSMutableData *data = [NSMutableData data];
+    NSUInteger i = *offset;
+    while (i < length) {
+        if (bytes[i] != 0x00) {
+            NSUInteger start = i;
+            while (i < length && bytes[i] != 0x00)
+                i++;
+            [data appendBytes:bytes + start length:i - start];
+        } else if (i + 1 < length && bytes[i + 1] == kKeyEscape) {
+            [data appendBytes:bytes + i length:1];
+            i += 2;
+        } else {
+            *offset = i + 1;
+            return data;
+        }
+    }
+    return nil;
+}
+
+@implementation LDBKeyEncoding
+
++ (NSData *) keyWithComponents:(NSArray *)components {
+    NSMutableData *key = [NSMutableData data];
+    for (id component in components)
+        AppendComponent(key, component);
+    return key;
+}
+
++ (NSData *) limitKeyWithComponents:(NSArray *)components {
+    NSMutableData *key = [NSMutableData data];
+    for (id component in components)
+        AppendComponent(key, component);
+    [key appendBytes:&kKeyEscape length:1];
+    return key;
+}
+
++ (NSData *) keyWithInteger:(int64_t)value {
+    NSMutableData *key = [NSMutableData dataWithCapacity:9];
+    AppendInteger(key, value);
+    return key;
+}
+
++ (NSData *) keyWithUnsignedInteger:(uint64_t)value {
+    NSMutableData *key = [NSMutableData dataWithCapacity:9];
+    AppendUnsignedInteger(key, value);
+    return key;
+}
+
++ (NSData *) keyWithDouble:(double)value {
+    NSMutableData *key = [NSMutableData dataWithCapacity:9];
+    AppendDouble(key, value);
+    return key;
+}
+
++ (NSData *) keyWithString:(NSString *)value {
+    NSParameterAssert(value != nil);
+    NSMutableData *key = [NSMutableData data];
+    AppendComponent(key, value);
+    return key;
+}
+
++ (NSArray *) componentsOfKey:(LevelDBKey *)key {
+    const uint8_t *bytes = (const uint8_t *)key->data;
+    NSUInteger length = key->length;
+    NSMutableArray *components = [NSMutableArray array];
+    NSUInteger offset = 0;
+    while (offset < length) {
+        uint8_t type = bytes[offset++];
+        if (type == kKeyTypeNull) {
+            [components addObject:[NSNull null]];
+        } else if (type == kKeyTypeData || type == kKeyTypeString) {
+            NSData *data = ReadEscaped(bytes, length, &offset);
+            if (data == nil)
+                return nil;
+            if (type == kKeyTypeData) {
+                [components addObject:data];
+            } else {
+                NSString *string = [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
+                if (string == nil)
+                    return nil;
+                [components addObject:string];
+            }
+        } else if (type == kKeyTypeNumber) {
+            if (length - offset < 10)
+                return nil;
+            uint64_t bits = ReadBigEndian64(bytes + offset);
+            uint16_t tail = (uint16_t)(bytes[offset + 8] << 8 | bytes[offset + 9]);
+            offset += 10;
+            bits = (bits & kSignBit) ? (bits & ~kSignBit) : ~bits;
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            uint16_t kind = tail & 3, remainder = tail >> 2;
+            if (kind == kNumberKindDouble) {
+                if (remainder != 0)
+                    return nil;
+                [components addObject:@(value)];
+            } else if (kind == kNumberKindInteger || kind == kNumberKindUnsignedInteger) {
+                if (!(value >= -9223372036854775808.0 && value < 18446744073709551616.0) || value != floor(value))
+                    return nil;
+                uint64_t integer = (value < 0 ? (uint64_t)(int64_t)value : (uint64_t)value) + remainder;
+                // Only the canonical encoding of an integer decodes, which also rules out overflows
+                NSMutableData *canonical = [NSMutableData dataWithCapacity:11];
+                if (kind == kNumberKindInteger)
+                    AppendInteger(canonical, (int64_t)integer);
+                else
+                    AppendUnsignedInteger(canonical, integer);
+                if (memcmp([canonical bytes], bytes + offset - 11, 11) != 0)
+                    return nil;
+                [components addObject:(kind == kNumberKindInteger) ? @((long long)(int64_t)integer)
+                                                                  : @((unsigned long long)integer)];
+            } else {
+                return nil;
+            }
+        } else {
+            return nil;
+        }
+    }
+    return components;
+}
+
++ (NSArray *) componentsOfKeyData:(NSData *)key {
+    LevelDBKey lkey = { (const char *)[key bytes], [key length] };
+    return [self componentsOfKey:&lkey];
+}
+
+@end
@@ -0,0 +1,102 @@
+//
+//  LDBKeyPredicate.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+#import "LevelDB.h"
+
+typedef BOOL (^LDBKeyPredicateBlock)(LevelDBKey * key);
+
+/**
+ A condition on keys only, evaluated on the raw key bytes without decoding any value.
+
+ Range conditions (prefixes, bounds, `BETWEEN`) are turned into bounds the enumeration seeks to and stops at, so only
+ the matching range of the database is scanned. Other conditions are evaluated on each key in that range.
+ Keys are compared bytewise, like leveldb orders them.
+ */
+@interface LDBKeyPredicate : NSObject
+
+/**
+ The smallest key matching the predicate, or `nil` if there is no lower bound
+ */
+@property (nonatomic, readonly, copy) NSData *lowerBound;
+
+/**
+ A boolean value indicating whether `lowerBound` itself matches the predicate
+ */
+@property (nonatomic, readonly) BOOL lowerBoundInclusive;
+
+/**
+ The largest key matching the predicate, or `nil` if there is no upper bound
+ */
+@property (nonatomic, readonly, copy) NSData *upperBound;
+
+/**
+ A boolean value indicating whether `upperBound` itself matches the predicate
+ */
+@property (nonatomic, readonly) BOOL upperBoundInclusive;
+
+/**
+ A block evaluated on every key within the bounds, or `nil` if the bounds are the whole condition
+ */
+@property (nonatomic, readonly, copy) LDBKeyPredicateBlock block;
+
+/**
+ Return a predicate matching keys starting with `prefix`
+
+ @param prefix A `NSString` or `NSData` prefix
+ */
++ (instancetype) predicateWithPrefix:(id)prefix;
+
+/**
+ Return a predicate matching keys between two bounds
+
+ @param lowerBound (optional) The lower bound (`NSString` or `NSData`). If `nil`, keys are not bounded from below.
+ @param lowerInclusive A boolean value indicating whether the lower bound itself matches
+ @param upperBound (optional) The upper bound (`NSString` or `NSData`). If `nil`, keys are not bounded from above.
+ @param upperInclusive A boolean value indicating whether the upper bound itself matches
+ */
++ (instancetype) predicateWithLowerBound:(id)lowerBound
+                               inclusive:(BOOL)lowerInclusive
+                              upperBound:(id)upperBound
+                               inclusive:(BOOL)upperInclusive;
+
+/**
+ Return a predicate matching keys between `lowerBound` and `upperBound`, both included
+ */
++ (instancetype) predicateWithKeysBetween:(id)lowerBound and:(id)upperBound;
+
+/**
+ Return a predicate matching keys for which the block returns `TRUE`
+
+ @param block A block evaluated on the raw bytes of every key
+ */
++ (instancetype) predicateWithBlock:(LDBKeyPredicateBlock)block;
+
+/**
+ Return a predicate matching keys (as UTF-8 `NSString` instances) evaluated by a `NSPredicate`
+
+ Comparisons of `SELF` with a constant string, using `BEGINSWITH`, `BETWEEN`, `<`, `<=`, `>`, `>=` or `==` (without
+ options), and `AND` compounds of those, are turned into bounds. Anything else is evaluated on every key.
+
+ @param predicate A `NSPredicate` instance tested against the keys
+ */
++ (instancetype) predicateFromPredicate:(NSPredicate *)predicate;
+
+/**
+ Return a predicate matching keys matched by every predicate in `subpredicates`
+
+ @param subpredicates An array of `LDBKeyPredicate` instances
+ */
++ (instancetype) andPredicateWithSubpredicates:(NSArray *)subpredicates;
+
+/**
+ Return a boolean value indicating whether a key matches the predicate
+
+ @param key The key to test
+ */
+- (BOOL) matchesKey:(LevelDBKey *)key;
+
+@end
@@ -0,0 +1,235 @@
+//
+//  LDBKeyPredicate.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBKeyPredicate.h"
+
+static NSData * DataFromStringOrData(id obj) {
+    if (obj == nil) return nil;
+    NSCParameterAssert([obj isKindOfClass:[NSString class]] || [obj isKindOfClass:[NSData class]]);
+    return [obj isKindOfClass:[NSString class]] ? [obj dataUsingEncoding:NSUTF8StringEncoding] : obj;
+}
+
+static int CompareBytes(const void *a, NSUInteger aLength, const void *b, NSUInteger bLength) {
+    int cmp = memcmp(a, b, MIN(aLength, bLength));
+    if (cmp != 0) return cmp;
+    return (aLength < bLength) ? -1 : (aLength > bLength) ? 1 : 0;
+}
+
+static int CompareData(NSData *a, NSData *b) {
+    return CompareBytes(a.bytes, a.length, b.bytes, b.length);
+}
+
+@interface LDBKeyPredicate ()
+
+- (id) initWithLowerBound:(NSData *)lowerBound
+                inclusive:(BOOL)lowerInclusive
+               upperBound:(NSData *)upperBound
+                inclusive:(BOOL)upperInclusive
+                    block:(LDBKeyPredicateBlock)block;
+
+@end
+
+@implementation LDBKeyPredicate
+
++ (instancetype) predicateWithPrefix:(id)prefix {
+    NSData *lowerBound = DataFromStringOrData(prefix);
+
+    // The first key not starting with the prefix is the prefix with its last byte below 0xff incremented
+    NSMutableData *upperBound = [[lowerBound mutableCopy] autorelease];
+    unsigned char *bytes = (unsigned char *)upperBound.mutableBytes;
+    NSUInteger length = upperBound.length;
+    while (length > 0 && bytes[length - 1] == 0xff)
+        length--;
+    if (length > 0) {
+        bytes[length - 1]++;
+        upperBound.length = length;
+    } else {
+        upperBound = nil;
+    }
+
+    return [[[self alloc] initWithLowerBound:lowerBound.length ? lowerBound : nil
+                                   inclusive:YES
+                                  upperBound:upperBound
+                                   inclusive:NO
+                                       block:nil] autorelease];
+}
+
++ (instancetype) predicateWithLowerBound:(id)lowerBound
+                               inclusive:(BOOL)lowerInclusive
+                              upperBound:(id)upperBound
+                               inclusive:(BOOL)upperInclusive {
+
+    return [[[self alloc] initWithLowerBound:DataFromStringOrData(lowerBound)
+                                   inclusive:lowerInclusive
+                                  upperBound:DataFromStringOrData(upperBound)
+                                   inclusive:upperInclusive
+                                       block:nil] autorelease];
+}
+
++ (instancetype) predicateWithKeysBetween:(id)lowerBound and:(id)upperBound {
+    return [self predicateWithLowerBound:lowerBound inclusive:YES upperBound:upperBound inclusive:YES];
+}
+
++ (instancetype) predicateWithBlock:(LDBKeyPredicateBlock)block {
+    return [[[self alloc] initWithLowerBound:nil inclusive:YES upperBound:nil inclusive:YES block:block] autorelease];
+}
+
++ (instancetype) predicateFromPredicate:(NSPredicate *)predicate {
+    if ([predicate isKindOfClass:[NSCompoundPredicate class]]
+        && [(NSCompoundPredicate *)predicate compoundPredicateType] == NSAndPredicateType) {
+
+        NSMutableArray *subpredicates = [NSMutableArray array];
+        for (NSPredicate *subpredicate in [(NSCompoundPredicate *)predicate subpredicates])
+            [subpredicates addObject:[self predicateFromPredicate:subpredicate]];
+        return [self andPredicateWithSubpredicates:subpredicates];
+    }
+
+    if ([predicate isKindOfClass:[NSComparisonPredicate class]]) {
+        NSComparisonPredicate *comparison = (NSComparisonPredicate *)predicate;
+        NSExpression *left = comparison.leftExpression, *right = comparison.rightExpression;
+
+        if (comparison.comparisonPredicateModifier == NSDirectPredicateModifier
+            && comparison.options == 0
+            && left.expressionType == NSEvaluatedObjectExpressionType
+            && (right.expressionType == NSConstantValueExpressionType
+                || right.expressionType == NSAggregateExpressionType)) {
+
+            id constant = (right.expressionType == NSConstantValueExpressionType) ? right.constantValue : nil;
+            switch (comparison.predicateOperatorType) {
+                case NSBeginsWithPredicateOperatorType:
+                    if ([constant isKindOfClass:[NSString class]])
+                        return [self predicateWithPrefix:constant];
+                    break;
+                case NSLessThanPredicateOperatorType:
+                case NSLessThanOrEqualToPredicateOperatorType:
+                    if ([constant isKindOfClass:[NSString class]])
+                        return [self predicateWithLowerBound:nil inclusive:YES upperBound:constant
+                                                   inclusive:comparison.predicateOperatorType == NSLessThanOrEqualToPredicateOperatorType];
+                    break;
+                case NSGreaterThanPredicateOperatorType:
+                case NSGreaterThanOrEqualToPredicateOperatorType:
+                    if ([constant isKindOfClass:[NSString class]])
+                        return [self predicateWithLowerBound:constant
+                                                   inclusive:comparison.predicateOperatorType == NSGreaterThanOrEqualToPredicateOperatorType
+                                                  upperBound:nil inclusive:YES];
+                    break;
+                case NSEqualToPredicateOperatorType:
+                    if ([constant isKindOfClass:[NSString class]])
+                        return [self predicateWithKeysBetween:constant and:constant];
+                    break;
+                case NSBetweenPredicateOperatorType: {
+                    // The bounds are either an array constant, or an aggregate of two constant expressions
+                    NSArray *bounds = constant;
+                    if (right.expressionType == NSAggregateExpressionType) {
+                        NSMutableArray *values = [NSMutableArray array];
+                        for (NSExpression *expression in (NSArray *)right.collection) {
+                            if (expression.expressionType != NSConstantValueExpressionType) { values = nil; break; }
+                            [values addObject:expression.constantValue ?: [NSNull null]];
+                        }
+                        bounds = values;
+                    }
+                    if ([bounds isKindOfClass:[NSArray class]] && bounds.count == 2
+                        && [bounds[0] isKindOfClass:[NSString class]] && [bounds[1] isKindOfClass:[NSString class]])
+                        return [self predicateWithKeysBetween:bounds[0] and:bounds[1]];
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Not a range condition: the predicate is evaluated on every key, still without decoding values
+    return [self predicateWithBlock:^BOOL(LevelDBKey *key) {
+        return [predicate evaluateWithObject:NSStringFromLevelDBKey(key)];
+    }];
+}
+
++ (instancetype) andPredicateWithSubpredicates:(NSArray *)subpredicates {
+    NSData *lowerBound = nil, *upperBound = nil;
+    BOOL lowerInclusive = YES, upperInclusive = YES;
+    NSMutableArray *blocks = [NSMutableArray array];
+
+    for (LDBKeyPredicate *predicate in subpredicates) {
+        if (predicate.lowerBound) {
+            int cmp = lowerBound ? CompareData(predicate.lowerBound, lowerBound) : 1;
+            if (cmp > 0) {
+                lowerBound = predicate.lowerBound;
+                lowerInclusive = predicate.lowerBoundInclusive;
+            } else if (cmp == 0) {
+                lowerInclusive = lowerInclusive && predicate.lowerBoundInclusive;
+            }
+        }
+        if (predicate.upperBound) {
+            int cmp = upperBound ? CompareData(predicate.upperBound, upperBound) : -1;
+            if (cmp < 0) {
+                upperBound = predicate.upperBound;
+                upperInclusive = predicate.upperBoundInclusive;
+            } else if (cmp == 0) {
+                upperInclusive = upperInclusive && predicate.upperBoundInclusive;
+            }
+        }
+        if (predicate.block)
+            [blocks addObject:predicate.block];
+    }
+
+    LDBKeyPredicateBlock block = nil;
+    if (blocks.count == 1) {
+        block = blocks[0];
+    } else if (blocks.count > 1) {
+        block = ^BOOL(LevelDBKey *key) {
+            for (LDBKeyPredicateBlock subblock in blocks)
+                if (!subblock(key)) return NO;
+            return YES;
+        };
+    }
+
+    return [[[self alloc] initWithLowerBound:lowerBound
+                                   inclusive:lowerInclusive
+                                  upperBound:upperBound
+                                   inclusive:upperInclusive
+                                       block:block] autorelease];
+}
+
+- (id) initWithLowerBound:(NSData *)lowerBound
+                inclusive:(BOOL)lowerInclusive
+               upperBound:(NSData *)upperBound
+                inclusive:(BOOL)upperInclusive
+                    block:(LDBKeyPredicateBlock)block {
+
+    self = [super init];
+    if (self) {
+        _lowerBound = [lowerBound copy];
+        _lowerBoundInclusive = lowerInclusive;
+        _upperBound = [upperBound copy];
+        _upperBoundInclusive = upperInclusive;
+        _block = [block copy];
+    }
+    return self;
+}
+
+- (BOOL) matchesKey:(LevelDBKey *)key {
+    if (_lowerBound) {
+        int cmp = CompareBytes(key->data, key->length, _lowerBound.bytes, _lowerBound.length);
+        if (cmp < 0 || (cmp == 0 && !_lowerBoundInclusive))
+            return NO;
+    }
+    if (_upperBound) {
+        int cmp = CompareBytes(key->data, key->length, _upperBound.bytes, _upperBound.length);
+        if (cmp > 0 || (cmp == 0 && !_upperBoundInclusive))
+            return NO;
+    }
+    return _block == nil || _block(key);
+}
+
+- (void) dealloc {
+    [_lowerBound release];
+    [_upperBound release];
+    [_block release];
+    [super dealloc];
+}
+
+@end
@@ -0,0 +1,164 @@
+//
+//  LDBKeyspace.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+
+#import "LevelDB.h"
+
+/**
+ A view of the keys of a database sharing a given prefix, such as the keys of one tenant, which reads and writes them
+ as if the prefix wasn't there: the prefix is prepended to every key given to a keyspace, and stripped from every key
+ it hands back.
+
+ Values are still encoded and decoded with the database's blocks, which see whole keys. Scans seek straight to the
+ prefix, and stop at the first key without it. Setting `prefixFilterLength` to the length of the prefix, in the
+ options the database is opened with, lets point lookups skip tables holding no key of a keyspace.
+ */
+@interface LDBKeyspace : NSObject
+
+@property (nonatomic, readonly) LevelDB *db;
+
+/**
+ The prefix of every key of the keyspace
+ */
+@property (nonatomic, readonly) NSData *prefix;
+
+#pragma mark - Setters
+
+/**
+ Set the value associated with a key in the keyspace
+
+ @param value The value to put in the keyspace
+ @param key The key at which the value can be found
+ */
+- (void) setObject:(id)value forKey:(id)key;
+
+/**
+ Same as `[self setObject:forKey:]`
+ */
+- (void) setObject:(id)value forKeyedSubscript:(id)key;
+
+/**
+ Set the value associated with a key in the keyspace, without waiting for the write to be committed
+
+ Same as `-[LevelDB setObject:forKey:completion:]`, with the key prefixed.
+ */
+- (void) setObject:(id)value forKey:(id)key completion:(void (^)(NSError *error))completion;
+
+/**
+ Take all key-value pairs in the provided dictionary and insert them in the keyspace
+
+ @param dictionary A dictionary from which key-value pairs will be inserted
+ */
+- (void) addEntriesFromDictionary:(NSDictionary *)dictionary;
+
+#pragma mark - Write batches
+
+/**
+ Return a retained LDBWritebatch instance for this keyspace, prefixing every key it is given
+ */
+- (LDBWritebatch *) newWritebatch;
+
+/**
+ Create a new writebatch for this keyspace, and apply it once the block has filled it
+ */
+- (void) performWritebatch:(void (^)(LDBWritebatch *wb))block;
+
+#pragma mark - Getters
+
+/**
+ Return the value associated with a key in the keyspace
+
+ @param key The key to retrieve from the keyspace
+ */
+- (id) objectForKey:(id)key;
+
+/**
+ Same as `[self objectForKey:]`
+ */
+- (id) objectForKeyedSubscript:(id)key;
+
+/**
+ Return an array containing the values associated with the provided list of keys, read from a single implicit snapshot
+
+ @param keys The list of keys to fetch from the keyspace
+ @param marker The value to associate to missing keys
+ */
+- (NSArray *) objectsForKeys:(NSArray *)keys notFoundMarker:(id)marker;
+
+/**
+ Return a boolean value indicating whether or not the key exists in the keyspace
+
+ @param key The key to check for existence
+ */
+- (BOOL) objectExistsForKey:(id)key;
+
+#pragma mark - Removers
+
+/**
+ Remove a key (and its associated value) from the keyspace
+
+ @param key The key to remove from the keyspace
+ */
+- (void) removeObjectForKey:(id)key;
+
+/**
+ Remove a set of keys (and their associated values) from the keyspace
+
+ @param keyArray An array of keys to remove from the keyspace
+ */
+- (void) removeObjectsForKeys:(NSArray *)keyArray;
+
+/**
+ Remove every key of the keyspace, in bounded batches (see `-[LevelDB removeAllObjectsWithPrefix:]`)
+ */
+- (void) removeAllObjects;
+
+#pragma mark - Selection
+
+/**
+ Return an array containing all the keys of the keyspace, without their prefix
+ */
+- (NSArray *) allKeys;
+
+#pragma mark - Enumeration
+
+/**
+ Enumerate over the keys of the keyspace, in order
+ */
+- (void) enumerateKeysUsingBlock:(LevelDBKeyBlock)block;
+
+/**
+ Enumerate over the keys of the keyspace, in direct or backward order
+
+ Same as `-[LevelDB enumerateKeysBackward:startingAtKey:filteredByPredicate:andPrefix:usingBlock:]`, with the keys
+ given and handed back relative to the keyspace.
+ */
+- (void) enumerateKeysBackward:(BOOL)backward
+                 startingAtKey:(id)key
+           filteredByPredicate:(NSPredicate *)predicate
+                     andPrefix:(id)prefix
+                    usingBlock:(LevelDBKeyBlock)block;
+
+/**
+ Enumerate over the key value pairs of the keyspace, in order
+ */
+- (void) enumerateKeysAndObjectsUsingBlock:(LevelDBKeyValueBlock)block;
+
+/**
+ Enumerate over the key value pairs of the keyspace, in direct or backward order
+
+ Same as `-[LevelDB enumerateKeysAndObjectsBackward:lazily:startingAtKey:filteredByPredicate:andPrefix:usingBlock:]`,
+ with the keys given and handed back relative to the keyspace.
+ */
+- (void) enumerateKeysAndObjectsBackward:(BOOL)backward
+                                  lazily:(BOOL)lazily
+                           startingAtKey:(id)key
+                     filteredByPredicate:(NSPredicate *)predicate
+                               andPrefix:(id)prefix
+                              usingBlock:(id)block;
+
+@end
@@ -0,0 +1,170 @@
+//
+//  LDBKeyspace.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBKeyspace.h"
+#import "LDBWriteBatch.h"
+
+#import <leveldb/slice.h>
+
+#include "LDBCommon.h"
+
+@interface LDBWritebatch ()
++ (instancetype) writeBatchFromDB:(id)db mode:(LDBWritebatchMode)mode keyPrefix:(NSData *)keyPrefix;
+@end
+
+@interface LDBKeyspace ()
++ (instancetype) keyspaceWithDB:(LevelDB *)db prefix:(NSData *)prefix;
+@end
+
+@implementation LDBKeyspace
+
++ (instancetype) keyspaceWithDB:(LevelDB *)db prefix:(NSData *)prefix {
+    NSParameterAssert([prefix length] > 0);
+    LDBKeyspace *keyspace = [[[self alloc] init] autorelease];
+    keyspace->_db = [db retain];
+    keyspace->_prefix = [prefix copy];
+    return keyspace;
+}
+
+- (NSData *) prefixedKey:(id)key {
+    AssertKeyType(key);
+    leveldb::Slice k = KeyFromStringOrData(key);
+    NSMutableData *data = [NSMutableData dataWithCapacity:[_prefix length] + k.size()];
+    [data appendData:_prefix];
+    [data appendBytes:k.data() length:k.size()];
+    return data;
+}
+
+#pragma mark - Setters
+
+- (void) setObject:(id)value forKey:(id)key {
+    [_db setObject:value forKey:[self prefixedKey:key]];
+}
+- (void) setObject:(id)value forKeyedSubscript:(id)key {
+    [self setObject:value forKey:key];
+}
+- (void) setObject:(id)value forKey:(id)key completion:(void (^)(NSError *error))completion {
+    [_db setObject:value forKey:[self prefixedKey:key] completion:completion];
+}
+- (void) addEntriesFromDictionary:(NSDictionary *)dictionary {
+    [self performWritebatch:^(LDBWritebatch *wb) {
+        [wb addEntriesFromDictionary:dictionary];
+    }];
+}
+
+#pragma mark - Write batches
+
+- (LDBWritebatch *) newWritebatch {
+    return [[LDBWritebatch writeBatchFromDB:_db mode:LDBWritebatchSerialized keyPrefix:_prefix] retain];
+}
+- (void) performWritebatch:(void (^)(LDBWritebatch *wb))block {
+    LDBWritebatch *wb = [self newWritebatch];
+    block(wb);
+    [wb apply];
+    [wb release];
+}
+
+#pragma mark - Getters
+
+- (id) objectForKey:(id)key {
+    return [_db objectForKey:[self prefixedKey:key]];
+}
+- (id) objectForKeyedSubscript:(id)key {
+    return [self objectForKey:key];
+}
+- (NSArray *) objectsForKeys:(NSArray *)keys notFoundMarker:(id)marker {
+    NSMutableArray *prefixed = [NSMutableArray arrayWithCapacity:keys.count];
+    for (id key in keys)
+        [prefixed addObject:[self prefixedKey:key]];
+    return [_db objectsForKeys:prefixed notFoundMarker:marker];
+}
+- (BOOL) objectExistsForKey:(id)key {
+    return [_db objectExistsForKey:[self prefixedKey:key]];
+}
+
+#pragma mark - Removers
+
+- (void) removeObjectForKey:(id)key {
+    [_db removeObjectForKey:[self prefixedKey:key]];
+}
+- (void) removeObjectsForKeys:(NSArray *)keyArray {
+    [self performWritebatch:^(LDBWritebatch *wb) {
+        [wb removeObjectsForKeys:keyArray];
+    }];
+}
+- (void) removeAllObjects {
+    [_db removeAllObjectsWithPrefix:_prefix];
+}
+
+#pragma mark - Selection
+
+- (NSArray *) allKeys {
+    NSMutableArray *keys = [NSMutableArray array];
+    [self enumerateKeysUsingBlock:^(LevelDBKey *key, BOOL *stop) {
+        [keys addObject:NSDataFromLevelDBKey(key)];
+    }];
+    return keys;
+}
+
+#pragma mark - Enumeration
+
+- (void) enumerateKeysUsingBlock:(LevelDBKeyBlock)block {
+    [self enumerateKeysBackward:NO startingAtKey:nil filteredByPredicate:nil andPrefix:nil usingBlock:block];
+}
+
+- (void) enumerateKeysBackward:(BOOL)backward
+                 startingAtKey:(id)key
+           filteredByPredicate:(NSPredicate *)predicate
+                     andPrefix:(id)prefix
+                    usingBlock:(LevelDBKeyBlock)block {
+
+    NSUInteger prefixLength = [_prefix length];
+    [_db enumerateKeysBackward:backward
+                 startingAtKey:key ? [self prefixedKey:key] : nil
+           filteredByPredicate:predicate
+                     andPrefix:prefix ? [self prefixedKey:prefix] : _prefix
+                    usingBlock:^(LevelDBKey *key, BOOL *stop) {
+                        LevelDBKey relative = { key->data + prefixLength, key->length - prefixLength };
+                        block(&relative, stop);
+                    }];
+}
+
+- (void) enumerateKeysAndObjectsUsingBlock:(LevelDBKeyValueBlock)block {
+    [self enumerateKeysAndObjectsBackward:NO lazily:NO startingAtKey:nil filteredByPredicate:nil andPrefix:nil usingBlock:block];
+}
+
+- (void) enumerateKeysAndObjectsBackward:(BOOL)backward
+                                  lazily:(BOOL)lazily
+                           startingAtKey:(id)key
+                     filteredByPredicate:(NSPredicate *)predicate
+                               andPrefix:(id)prefix
+                              usingBlock:(id)block {
+
+    NSUInteger prefixLength = [_prefix length];
+    id relativeBlock = lazily
+        ? (id)^(LevelDBKey *key, LevelDBValueGetterBlock valueGetter, BOOL *stop) {
+            LevelDBKey relative = { key->data + prefixLength, key->length - prefixLength };
+            ((LevelDBLazyKeyValueBlock)block)(&relative, valueGetter, stop);
+          }
+        : (id)^(LevelDBKey *key, id value, BOOL *stop) {
+            LevelDBKey relative = { key->data + prefixLength, key->length - prefixLength };
+            ((LevelDBKeyValueBlock)block)(&relative, value, stop);
+          };
+    [_db enumerateKeysAndObjectsBackward:backward
+                                  lazily:lazily
+                           startingAtKey:key ? [self prefixedKey:key] : nil
+                     filteredByPredicate:predicate
+                               andPrefix:prefix ? [self prefixedKey:prefix] : _prefix
+                              usingBlock:relativeBlock];
+}
+
+- (void) dealloc {
+    [_db release];
+    [_prefix release];
+    [super dealloc];
+}
+
+@end
@@ -0,0 +1,237 @@
+//
+//  LDBOptions.h
+//
+//  See LICENCE for details.
+//
+
+#import <Foundation/Foundation.h>
+#import "LevelDB.h"
+
+#ifdef __cplusplus
+namespace leveldb { class Cache; class Comparator; class Env; }
+#endif
+
+/**
+ A leveldb block cache, which can be shared by several databases so that they draw from a single memory budget.
+ */
+@interface LDBCache : NSObject
+
+/**
+ The capacity of the cache, in bytes
+ */
+@property (nonatomic, readonly) size_t capacity;
+
+/**
+ The total size of the blocks currently held by the cache, in bytes
+ */
+@property (nonatomic, readonly) size_t usage;
+
+/**
+ Return a new LRU block cache
+
+ @param capacity The capacity of the cache, in bytes
+ */
++ (instancetype) cacheWithCapacity:(size_t)capacity;
+
+#ifdef __cplusplus
+- (leveldb::Cache *) cache;
+#endif
+
+@end
+
+/**
+ The options a database is opened with, mapping the fields of `leveldb::Options`, and the initial values of the read
+ and write options.
+
+ Unlike the `LevelDBOptions` struct, this class can grow new options without breaking existing code.
+ */
+@interface LDBOptions : NSObject <NSCopying>
+
+///------------------------------------------------------------------------
+/// @name Opening
+///------------------------------------------------------------------------
+
+/**
+ Create the database if it is missing (defaults to true)
+ */
+@property (nonatomic) BOOL createIfMissing;
+
+/**
+ Create the parent directories of the database if they are missing (defaults to true)
+ */
+@property (nonatomic) BOOL createIntermediateDirectories;
+
+/**
+ Fail to open the database if it already exists (defaults to false)
+ */
+@property (nonatomic) BOOL errorIfExists;
+
+/**
+ Check aggressively the integrity of the data, stopping early on any error (defaults to false)
+ */
+@property (nonatomic) BOOL paranoidChecks;
+
+/**
+ Reuse existing log and manifest files when opening the database, instead of starting new ones (defaults to false)
+ */
+@property (nonatomic) BOOL reuseLogs;
+
+///------------------------------------------------------------------------
+/// @name Tables
+///------------------------------------------------------------------------
+
+/**
+ Compress blocks with Snappy (defaults to true)
+ */
+@property (nonatomic) BOOL compression;
+
+/**
+ The number of bits per key of the bloom filter, or 0 for no filter (defaults to 0)
+ */
+@property (nonatomic) int filterPolicy;
+
+/**
+ The length of the key prefix also added to the bloom filter, or 0 for whole keys only (defaults to 0). Ignored
+ without a `filterPolicy`.
+ 
+ With keys namespaced by a fixed-length prefix (see `LDBKeyspace`), point lookups first probe the filter for the
+ prefix, so that tables holding no key of a keyspace are skipped even when the whole key would be a false positive.
+ Filters written with another prefix length (or none) are ignored until their tables are compacted.
+ */
+@property (nonatomic) size_t prefixFilterLength;
+
+/**
+ The approximate size of uncompressed data packed per block, in bytes (defaults to 4KB)
+ */
+@property (nonatomic) size_t blockSize;
+
+/**
+ The number of keys between restart points for delta encoding of keys (defaults to 16)
+ */
+@property (nonatomic) int blockRestartInterval;
+
+/**
+ The size of table files written by compactions before switching to a new one, in bytes (defaults to 2MB)
+ */
+@property (nonatomic) size_t maxFileSize;
+
+///------------------------------------------------------------------------
+/// @name Memory and resources
+///------------------------------------------------------------------------
+
+/**
+ The size of the memtable, built in memory before being written to disk, in bytes (defaults to 4MB).
+
+ Up to two memtables can be held in memory at once. Larger ones speed up bulk loads, at the cost of memory and a
+ longer recovery when the database is opened.
+ */
+@property (nonatomic) size_t writeBufferSize;
+
+/**
+ The number of files the database can keep open (defaults to 1000)
+ */
+@property (nonatomic) int maxOpenFiles;
+
+/**
+ The size of a block cache private to the database, in bytes, or 0 for leveldb's default 8MB cache (defaults to 0).
+ Ignored if `blockCache` is set.
+ */
+@property (nonatomic) size_t cacheSize;
+
+/**
+ A block cache shared with other databases (defaults to `nil`). The database retains it until it is closed.
+ */
+@property (nonatomic, retain) LDBCache *blockCache;
+
+#ifdef __cplusplus
+/**
+ The environment used for file system and thread operations, or `NULL` for `leveldb::Env::Default()`.
+ It isn't owned by the options, and must outlive the databases using it.
+ */
+@property (nonatomic) leveldb::Env *env;
+
+/**
+ The order of keys, or `NULL` for leveldb's bytewise order (defaults to `NULL`). It isn't owned by the options, and
+ must outlive the databases using it. A database must always be opened with a comparator of the same name.
+ 
+ Multi-gets, cursors, key predicates and range removals follow this order. Prefix enumerations and removals assume
+ that keys sharing a prefix are contiguous, and follow that prefix, as they are in bytewise order. Keys encoded with
+ `LDBKeyEncoding` already sort by value in bytewise order.
+ */
+@property (nonatomic) const leveldb::Comparator *comparator;
+#endif
+
+///------------------------------------------------------------------------
+/// @name Large values
+///------------------------------------------------------------------------
+
+/**
+ The size in bytes of the encoded values written to blob files instead of leveldb's tables, or 0 to keep every value
+ in leveldb (defaults to 0).
+
+ A separated value is appended to a blob file in the `blobs` directory of the database, and leveldb only stores a small
+ pointer to it, so that compactions, and scans reading keys only, no longer copy it around. Reads follow pointers
+ transparently, whatever the threshold the database is later opened with. Values smaller than a pointer (about 40
+ bytes) are never separated. See `-[LevelDB collectBlobGarbageWithRatio:maxFiles:]`.
+
+ A write separating values syncs its blob file before committing, even if it isn't synced itself, so that a pointer
+ leveldb persisted never outlives the value it points to in a system crash. Combining writes, or batching them,
+ amortizes that sync.
+ */
+@property (nonatomic) size_t valueSeparationThreshold;
+
+/**
+ The size a blob file reaches before writes switch to a new one, in bytes (defaults to 64MB)
+ */
+@property (nonatomic) size_t blobFileSize;
+
+///------------------------------------------------------------------------
+/// @name Reads and writes
+///------------------------------------------------------------------------
+
+/**
+ Verify the checksums of all data read from disk (defaults to false)
+ */
+@property (nonatomic) BOOL verifyChecksums;
+
+/**
+ Initial value of `-[LevelDB useCache]` (defaults to true)
+ */
+@property (nonatomic) BOOL fillCache;
+
+/**
+ Initial value of `-[LevelDB safe]` (defaults to false)
+ */
+@property (nonatomic) BOOL sync;
+
+///------------------------------------------------------------------------
+/// @name Presets
+///------------------------------------------------------------------------
+
+/**
+ Return options with leveldb's defaults
+ */
++ (instancetype) options;
+
+/**
+ Return options converted from a `LevelDBOptions` struct
+ */
++ (instancetype) optionsWithLevelDBOptions:(LevelDBOptions)opts;
+
+/**
+ Return options for loading large amounts of data: a 64MB memtable, larger table files, and reads that don't fill
+ the block cache.
+ */
++ (instancetype) bulkLoadOptions;
+
+/**
+ Return options for read-mostly workloads: a 64MB block cache, a 10 bits per key bloom filter, and more open files.
+ */
++ (instancetype) readHeavyOptions;
+
+/**
+ Return options for constrained devices: a 1MB memtable, a 1MB block cache, and fewer open files.
+ */
++ (instancetype) lowMemoryOptions;
+
+@end
@@ -0,0 +1,144 @@
+//
+//  LDBOptions.mm
+//
+//  See LICENCE for details.
+//
+
+#import "LDBOptions.h"
+
+#import <leveldb/cache.h>
+#import <leveldb/options.h>
+
+@implementation LDBCache {
+    leveldb::Cache *_cache;
+}
+
++ (instancetype) cacheWithCapacity:(size_t)capacity {
+    LDBCache *cache = [[[self alloc] init] autorelease];
+    cache->_cache = leveldb::NewLRUCache(capacity);
+    cache->_capacity = capacity;
+    return cache;
+}
+
+- (leveldb::Cache *) cache {
+    return _cache;
+}
+- (size_t) usage {
+    return _cache->TotalCharge();
+}
+
+- (void) dealloc {
+    delete _cache;
+    [super dealloc];
+}
+
+@end
+
+@implementation LDBOptions
+
+- (id) init {
+    self = [super init];
+    if (self) {
+        leveldb::Options defaults;
+        leveldb::ReadOptions readDefaults;
+
+        _createIfMissing = YES;
+        _createIntermediateDirectories = YES;
+        _errorIfExists = defaults.error_if_exists;
+        _paranoidChecks = defaults.paranoid_checks;
+        _reuseLogs = defaults.reuse_logs;
+
+        _compression = (defaults.compression != leveldb::kNoCompression);
+        _filterPolicy = 0;
+        _prefixFilterLength = 0;
+        _blockSize = defaults.block_size;
+        _blockRestartInterval = defaults.block_restart_interval;
+        _maxFileSize = defaults.max_file_size;
+
+        _writeBufferSize = defaults.write_buffer_size;
+        _maxOpenFiles = defaults.max_open_files;
+        _cacheSize = 0;
+
+        _valueSeparationThreshold = 0;
+        _blobFileSize = 64 * 1024 * 1024;
+
+        _verifyChecksums = readDefaults.verify_checksums;
+        _fillCache = readDefaults.fill_cache;
+        _sync = NO;
+    }
+    return self;
+}
+
++ (instancetype) options {
+    return [[[self alloc] init] autorelease];
+}
+
++ (instancetype) optionsWithLevelDBOptions:(LevelDBOptions)opts {
+    LDBOptions *options = [self options];
+    options.createIfMissing = opts.createIfMissing;
+    options.createIntermediateDirectories = opts.createIntermediateDirectories;
+    options.errorIfExists = opts.errorIfExists;
+    options.paranoidChecks = opts.paranoidCheck;
+    options.compression = opts.compression;
+    options.filterPolicy = opts.filterPolicy;
+    options.cacheSize = opts.cacheSize;
+    return options;
+}
+
++ (instancetype) bulkLoadOptions {
+    LDBOptions *options = [self options];
+    options.writeBufferSize = 64 * 1024 * 1024;
+    options.maxFileSize = 8 * 1024 * 1024;
+    options.fillCache = NO;
+    return options;
+}
+
++ (instancetype) readHeavyOptions {
+    LDBOptions *options = [self options];
+    options.cacheSize = 64 * 1024 * 1024;
+    options.filterPolicy = 10;
+    options.maxOpenFiles = 5000;
+    return options;
+}
+
++ (instancetype) lowMemoryOptions {
+    LDBOptions *options = [self options];
+    options.writeBufferSize = 1024 * 1024;
+    options.cacheSize = 1024 * 1024;
+    options.maxOpenFiles = 100;
+    return options;
+}
+
+- (id) copyWithZone:(NSZone *)zone {
+    LDBOptions *copy = [[[self class] allocWithZone:zone] init];
+    copy->_createIfMissing = _createIfMissing;
+    copy->_createIntermediateDirectories = _createIntermediateDirectories;
+    copy->_errorIfExists = _errorIfExists;
+    copy->_paranoidChecks = _paranoidChecks;
+    copy->_reuseLogs = _reuseLogs;
+    copy->_compression = _compression;
+    copy->_filterPolicy = _filterPolicy;
+    copy->_prefixFilterLength = _prefixFilterLength;
+    copy->_blockSize = _blockSize;
+    copy->_blockRestartInterval = _blockRestartInterval;
+    copy->_maxFileSize = _maxFileSize;
+    copy->_writeBufferSize = _writeBufferSize;
+    copy->_maxOpenFiles = _maxOpenFiles;
+    copy->_cacheSize = _cacheSize;
+    copy->_blockCache = [_blockCache retain];
+    copy->_env = _env;
+    copy->_comparator = _comparator;
+    copy->_valueSeparationThreshold = _valueSeparationThreshold;
+    copy->_blobFileSize = _blobFileSize;
+    copy->_verifyChecksums = _verifyChecksums;
+    copy->_fillCache = _fillCache;
+    copy->_sync = _sync;
+    return copy;
+}
+
+- (void) dealloc {
+    [_blockCache release];
+    [super dealloc];
+}
+
+@end
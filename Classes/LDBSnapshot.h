@@ -12,7 +12,7 @@
 
 @interface LDBSnapshot : NSObject 
 
-@property (nonatomic, readonly, assign) LevelDB * db;
+@property (nonatomic, readonly, retain) LevelDB * db;
 
 /**
  Return the value associated with a key
@@ -43,6 +43,17 @@
  */
 - (id) objectsForKeys:(NSArray *)keys notFoundMarker:(id)marker;
 
+/**
+ Same as `[self objectsForKeys:notFoundMarker:]`, reporting the lookup strategy and timings in `statistics`
+ 
+ @param keys The list of keys to fetch from the database
+ @param marker The value to associate to missing keys
+ @param statistics (optional) A pointer to a `LevelDBMultiGetStatistics` struct, filled with the chosen strategy and timings
+ */
+- (NSArray *) objectsForKeys:(NSArray *)keys
+              notFoundMarker:(id)marker
+                  statistics:(LevelDBMultiGetStatistics *)statistics;
+
 /**
  Return a boolean value indicating whether or not the key exists in the database
  
@@ -72,6 +83,21 @@
  */
 - (NSDictionary *)dictionaryByFilteringWithPredicate:(NSPredicate *)predicate;
 
+/**
+ Return an array of the keys matching a key predicate, without decoding any value
+ 
+ @param keyPredicate A `LDBKeyPredicate` instance tested against the database's keys
+ */
+- (NSArray *) keysMatchingKeyPredicate:(LDBKeyPredicate *)keyPredicate;
+
+/**
+ Return a dictionary with the key-value pairs whose key matches a key predicate, and whose value matches a predicate
+ 
+ See `-[LevelDB dictionaryByFilteringWithKeyPredicate:andPredicate:]`
+ */
+- (NSDictionary *) dictionaryByFilteringWithKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                                            andPredicate:(NSPredicate *)predicate;
+
 /**
  Enumerate over the keys in the database, in order.
  
@@ -122,7 +148,76 @@
                               usingBlock:(id)block;
 
 /**
- Close the snapshot.
+ Enumerate over the keys matching a key predicate, in direct or backward order
+ 
+ See `-[LevelDB enumerateKeysBackward:matchingKeyPredicate:filteredByPredicate:usingBlock:]`
+ */
+- (void) enumerateKeysBackward:(BOOL)backward
+          matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+           filteredByPredicate:(NSPredicate *)predicate
+                    usingBlock:(LevelDBKeyBlock)block;
+
+/**
+ Enumerate over the key value pairs whose key matches a key predicate, in direct or backward order
+ 
+ See `-[LevelDB enumerateKeysAndObjectsBackward:lazily:matchingKeyPredicate:filteredByPredicate:usingBlock:]`
+ */
+- (void) enumerateKeysAndObjectsBackward:(BOOL)backward
+                                  lazily:(BOOL)lazily
+                    matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                     filteredByPredicate:(NSPredicate *)predicate
+                              usingBlock:(id)block;
+
+/**
+ Enumerate over the key value pairs prefixed with a given value, splitting them into shards scanned concurrently.
+ 
+ See `-[LevelDB enumerateKeysAndObjectsConcurrentlyWithPrefix:shards:ordered:usingBlock:]`
+ */
+- (void) enumerateKeysAndObjectsConcurrentlyWithPrefix:(id)prefix
+                                                shards:(NSUInteger)shards
+                                               ordered:(BOOL)ordered
+                                            usingBlock:(LevelDBShardKeyValueBlock)block;
+
+/**
+ Enumerate over the key value pairs in the range [`startKey`, `endKey`), splitting them into shards scanned concurrently.
+ 
+ See `-[LevelDB enumerateKeysAndObjectsConcurrentlyFromKey:toKey:shards:ordered:usingBlock:]`
+ */
+- (void) enumerateKeysAndObjectsConcurrentlyFromKey:(id)startKey
+                                              toKey:(id)endKey
+                                             shards:(NSUInteger)shards
+                                            ordered:(BOOL)ordered
+                                         usingBlock:(LevelDBShardKeyValueBlock)block;
+
+/**
+ Return a retained LDBCursor instance over the keys of the snapshot in the range [`lowerBound`, `upperBound`)
+ 
+ See `-[LevelDB newCursorFromKey:toKey:]`
+ */
+- (LDBCursor *) newCursorFromKey:(id)lowerBound toKey:(id)upperBound;
+
+/**
+ Return a retained LDBCursor instance over the keys of the snapshot prefixed with a given value
+ 
+ See `-[LevelDB newCursorWithPrefix:]`
+ */
+- (LDBCursor *) newCursorWithPrefix:(id)prefix;
+
+/**
+ Write the key value pairs of the snapshot prefixed with a given value to an archive file, replacing it
+ 
+ Same as `-[LDBArchive exportSnapshot:withPrefix:resume:error:]`, with the default settings of `LDBArchive`.
+ 
+ @param path The path of the archive file
+ @param prefix (optional) A `NSString` or `NSData` prefix of the keys to export. If `nil`, every key is exported.
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if the export failed
+ 
+ @return A boolean value indicating whether the archive is complete
+ */
+- (BOOL) exportToPath:(NSString *)path withPrefix:(id)prefix error:(NSError **)error;
+
+/**
+ Close the snapshot. Snapshots still open when their database is closed are closed along.
  
  @warning The instance cannot be used to perform any query after it has been closed.
  */
@@ -6,11 +6,22 @@
 //
 
 #import "LDBSnapshot.h"
+#import "LDBArchive.h"
+#import "LDBCursor.h"
+#import "LDBInstrumentation.h"
+#import "LDBBlobStore.h"
 #import <leveldb/db.h>
 
+#include "LDBCommon.h"
+
 @interface LevelDB ()
 
 - (leveldb::DB *)db;
+- (LDBLatencyRecorder *) latencyRecorder;
+- (LDBInFlightTracker *) inFlightTracker;
+- (LDBBlobStore *) blobStore;
+- (void) _registerResource:(id)resource;
+- (void) _closeResource:(id)resource usingBlock:(void (^)(void))block;
 
 - (void) enumerateKeysBackward:(BOOL)backward
                  startingAtKey:(id)key
@@ -27,16 +38,63 @@
                             withSnapshot:(LDBSnapshot *)snapshot
                               usingBlock:(id)block;
 
+- (void) enumerateKeysBackward:(BOOL)backward
+          matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+           filteredByPredicate:(NSPredicate *)predicate
+                  withSnapshot:(LDBSnapshot *)snapshot
+                    usingBlock:(LevelDBKeyBlock)block;
+
+- (void) enumerateKeysAndObjectsBackward:(BOOL)backward
+                                  lazily:(BOOL)lazily
+                    matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                     filteredByPredicate:(NSPredicate *)predicate
+                            withSnapshot:(LDBSnapshot *)snapshot
+                              usingBlock:(id)block;
+
+- (NSArray *) keysMatchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                          withSnapshot:(LDBSnapshot *)snapshot;
+
+- (NSDictionary *) dictionaryByFilteringWithKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                                            andPredicate:(NSPredicate *)predicate
+                                            withSnapshot:(LDBSnapshot *)snapshot;
+
+- (LDBCursor *) newCursorFromKey:(id)lowerBound
+                           toKey:(id)upperBound
+                    withSnapshot:(LDBSnapshot *)snapshot;
+
+- (LDBCursor *) newCursorWithPrefix:(id)prefix
+                       withSnapshot:(LDBSnapshot *)snapshot;
+
 - (id) objectForKey:(id)key
        withSnapshot:(LDBSnapshot *)snapshot;
 
 - (BOOL) objectExistsForKey:(id)key
                withSnapshot:(LDBSnapshot *)snapshot;
 
+- (NSArray *) objectsForKeys:(NSArray *)keys
+              notFoundMarker:(id)marker
+                withSnapshot:(LDBSnapshot *)snapshot
+                  statistics:(LevelDBMultiGetStatistics *)statistics;
+
+- (void) enumerateKeysAndObjectsConcurrentlyWithPrefix:(id)prefix
+                                                shards:(NSUInteger)shards
+                                               ordered:(BOOL)ordered
+                                          withSnapshot:(LDBSnapshot *)snapshot
+                                            usingBlock:(LevelDBShardKeyValueBlock)block;
+
+- (void) enumerateKeysAndObjectsConcurrentlyFromKey:(id)startKey
+                                              toKey:(id)endKey
+                                             shards:(NSUInteger)shards
+                                            ordered:(BOOL)ordered
+                                       withSnapshot:(LDBSnapshot *)snapshot
+                                         usingBlock:(LevelDBShardKeyValueBlock)block;
+
 @end
 
 @interface LDBSnapshot () {
     const leveldb::Snapshot * _snapshot;
+    LDBBlobStore *_blobs;       // Pinned until the snapshot is released, so that the blobs it points to stay
+    uint64_t _blobPin;
 }
 
 @property (readonly, getter = getSnapshot) const leveldb::Snapshot * snapshot;
@@ -47,9 +105,20 @@
 @implementation LDBSnapshot 
 
 + (LDBSnapshot *) snapshotFromDB:(LevelDB *)database {
+    LDBOperation operation([database inFlightTracker]);
+    if (!operation.Entered())
+        return nil;
+    
+    LDBLatencyTimer timer([database latencyRecorder], LevelDBOperationSnapshot);
     LDBSnapshot *snapshot = [[[LDBSnapshot alloc] init] autorelease];
+    snapshot->_blobs = [database blobStore];
+    if (snapshot->_blobs)
+        snapshot->_blobPin = snapshot->_blobs->Pin();
+    timer.Mark();
     snapshot->_snapshot = [database db]->GetSnapshot();
-    snapshot->_db = database;
+    timer.Phase(LevelDBPhaseEngine);
+    snapshot->_db = [database retain];
+    [database _registerResource:snapshot];
     return snapshot;
 }
 
@@ -67,13 +136,12 @@
     return [_db objectExistsForKey:key withSnapshot:self];
 }
 - (id) objectsForKeys:(NSArray *)keys notFoundMarker:(id)marker {
-    NSMutableArray *result = [NSMutableArray arrayWithCapacity:keys.count];
-    [keys enumerateObjectsUsingBlock:^(id objId, NSUInteger idx, BOOL *stop) {
-        id object = [self objectForKey:objId];
-        if (object == nil) object = marker;
-        result[idx] = object;
-    }];
-    return [NSArray arrayWithArray:result];
+    return [_db objectsForKeys:keys notFoundMarker:marker withSnapshot:self statistics:NULL];
+}
+- (NSArray *) objectsForKeys:(NSArray *)keys
+              notFoundMarker:(id)marker
+                  statistics:(LevelDBMultiGetStatistics *)statistics {
+    return [_db objectsForKeys:keys notFoundMarker:marker withSnapshot:self statistics:statistics];
 }
 - (id) valueForKey:(NSString *)key {
     if ([key characterAtIndex:0] == '@') {
@@ -117,6 +185,14 @@
     return [NSDictionary dictionaryWithDictionary:results];
 }
 
+- (NSArray *) keysMatchingKeyPredicate:(LDBKeyPredicate *)keyPredicate {
+    return [_db keysMatchingKeyPredicate:keyPredicate withSnapshot:self];
+}
+- (NSDictionary *) dictionaryByFilteringWithKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                                            andPredicate:(NSPredicate *)predicate {
+    return [_db dictionaryByFilteringWithKeyPredicate:keyPredicate andPredicate:predicate withSnapshot:self];
+}
+
 - (void)enumerateKeysUsingBlock:(LevelDBKeyBlock)block {
     [_db enumerateKeysBackward:NO
                  startingAtKey:nil
@@ -162,14 +238,78 @@
                               usingBlock:block];
 }
 
+- (void)enumerateKeysBackward:(BOOL)backward
+         matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+          filteredByPredicate:(NSPredicate *)predicate
+                   usingBlock:(LevelDBKeyBlock)block {
+    [_db enumerateKeysBackward:backward
+          matchingKeyPredicate:keyPredicate
+           filteredByPredicate:predicate
+                  withSnapshot:self
+                    usingBlock:block];
+}
+- (void)enumerateKeysAndObjectsBackward:(BOOL)backward
+                                 lazily:(BOOL)lazily
+                   matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                    filteredByPredicate:(NSPredicate *)predicate
+                             usingBlock:(id)block {
+    [_db enumerateKeysAndObjectsBackward:backward
+                                  lazily:lazily
+                    matchingKeyPredicate:keyPredicate
+                     filteredByPredicate:predicate
+                            withSnapshot:self
+                              usingBlock:block];
+}
+
+- (void)enumerateKeysAndObjectsConcurrentlyWithPrefix:(id)prefix
+                                               shards:(NSUInteger)shards
+                                              ordered:(BOOL)ordered
+                                           usingBlock:(LevelDBShardKeyValueBlock)block {
+    [_db enumerateKeysAndObjectsConcurrentlyWithPrefix:prefix
+                                                shards:shards
+                                               ordered:ordered
+                                          withSnapshot:self
+                                            usingBlock:block];
+}
+- (void)enumerateKeysAndObjectsConcurrentlyFromKey:(id)startKey
+                                             toKey:(id)endKey
+                                            shards:(NSUInteger)shards
+                                           ordered:(BOOL)ordered
+                                        usingBlock:(LevelDBShardKeyValueBlock)block {
+    [_db enumerateKeysAndObjectsConcurrentlyFromKey:startKey
+                                              toKey:endKey
+                                             shards:shards
+                                            ordered:ordered
+                                       withSnapshot:self
+                                         usingBlock:block];
+}
+
+- (LDBCursor *) newCursorFromKey:(id)lowerBound toKey:(id)upperBound {
+    return [_db newCursorFromKey:lowerBound toKey:upperBound withSnapshot:self];
+}
+- (LDBCursor *) newCursorWithPrefix:(id)prefix {
+    return [_db newCursorWithPrefix:prefix withSnapshot:self];
+}
+
+- (BOOL) exportToPath:(NSString *)path withPrefix:(id)prefix error:(NSError **)error {
+    return [[LDBArchive archiveWithPath:path] exportSnapshot:self withPrefix:prefix resume:NO error:error];
+}
+
 - (void) close {
-    if (_snapshot && _db && ![_db closed]) {
-        [_db db]->ReleaseSnapshot(_snapshot);
-        _snapshot = nil;
-    }
+    [_db _closeResource:self usingBlock:^{
+        [self databaseWillClose];
+    }];
+}
+- (void) databaseWillClose {
+    [_db db]->ReleaseSnapshot(_snapshot);
+    _snapshot = NULL;
+    if (_blobs)
+        _blobs->Unpin(_blobPin);
+    _blobs = NULL;
 }
 - (void) dealloc {
     [self close];
+    [_db release];
     [super dealloc];
 }
 
@@ -13,6 +13,30 @@
 
 @property (nonatomic, assign) id db;
 
+/**
+ The way concurrent operations on the write batch are handled.
+ 
+ In `LDBWritebatchSerialized` mode (the default), every operation, including value encoding, is dispatched
+ synchronously to a serial queue. In `LDBWritebatchSingleThreaded` mode, operations are not synchronized at all, so the
+ batch, `count` and `byteSize` included, must only be used from one thread at a time.
+ In `LDBWritebatchConcurrent` mode, every thread encodes and appends to its own batch, under a lock no other writer
+ contends on, and those batches are merged when the write batch is applied. `count` and `byteSize` sum them up
+ without merging them.
+ 
+ @warning In `LDBWritebatchConcurrent` mode, all operations must be done before the batch is applied.
+ */
+@property (nonatomic, readonly) LDBWritebatchMode mode;
+
+/**
+ The number of operations (puts and deletes) in the write batch
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ The approximate size in bytes of the write batch, as it will be written to the database log
+ */
+@property (nonatomic, readonly) NSUInteger byteSize;
+
 /**
  Remove a key (and its associated value) from the database
  
@@ -27,11 +51,44 @@
  */
 - (void) removeObjectsForKeys:(NSArray *)keyArray;
 
+/**
+ The most deletions `removeAllObjects` and `removeAllObjectsWithPrefix:` add to the batch at once (defaults to
+ 1,000,000)
+ 
+ The batch is applied atomically, so it holds every deletion in memory until then, unlike
+ `-[LevelDB removeAllObjectsWithPrefix:compactingAfterwards:usingBlock:]`, which commits bounded chunks. A removal that
+ would exceed the limit adds nothing instead.
+ */
+@property (nonatomic) NSUInteger removalLimit;
+
 /**
  Remove all objects from the database
+ 
+ The keys are read in a single pass and added to the batch as deletions directly, without any intermediate object.
+ Nothing is removed, and the problem is logged, if there are more than `removalLimit` keys.
  */
 - (void) removeAllObjects;
 
+/**
+ Remove all objects prefixed with a given value (`NSString` or `NSData`)
+ 
+ Nothing is removed, and the problem is logged, if there are more than `removalLimit` matching keys.
+ 
+ @param prefix The key prefix used to remove all matching keys (of type `NSString` or `NSData`)
+ */
+- (void) removeAllObjectsWithPrefix:(id)prefix;
+
+/**
+ Remove all objects prefixed with a given value (`NSString` or `NSData`), or fail without removing any if there are more
+ than `removalLimit` of them
+ 
+ @param prefix The key prefix used to remove all matching keys (of type `NSString` or `NSData`), or nil for every key
+ @param error (optional) A pointer set to a `NSError` instance with the `LevelDBErrorLimitExceeded` code in the
+ `kLevelDBErrorDomain` domain if there were too many keys to remove
+ @return Whether the keys were added to the batch as deletions
+ */
+- (BOOL) removeAllObjectsWithPrefix:(id)prefix error:(NSError **)error;
+
 /**
  Set the raw data associated with a key in the database
  
@@ -74,4 +131,16 @@
  */
 - (void) apply;
 
+/**
+ Apply the write batch to the underlying database, choosing whether it should be flushed to disk before returning
+ 
+ The batch is committed in place, without being copied.
+ 
+ @param sync A boolean value indicating whether the write should be synchronous, regardless of the database's `safe` property
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if the write failed
+ 
+ @return A boolean value indicating whether the write batch was applied
+ */
+- (BOOL) applySynchronously:(BOOL)sync error:(NSError **)error;
+
 @end
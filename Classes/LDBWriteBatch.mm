@@ -9,34 +9,129 @@
 #import <leveldb/write_batch.h>
 
 #import "LDBWriteBatch.h"
+#import "LDBInstrumentation.h"
 #include "LDBCommon.h"
 
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <pthread.h>
+
+namespace {
+    // Size of the header of a leveldb write batch, which appending it to another leaves out
+    const size_t kWriteBatchHeaderSize = 12;
+    // Default number of deletions removing a range can add to a batch
+    const NSUInteger kDefaultRemovalLimit = 1000000;
+
+    // A leveldb write batch, along with the number of operations appended to it
+    struct PendingBatch {
+        leveldb::WriteBatch batch;
+        NSUInteger count;
+        pthread_t thread;   // The thread appending to it, in concurrent mode
+        PendingBatch *next;
+        std::mutex mu;      // Held while appending in concurrent mode, only ever contended by readers
+    };
+
+    // Lock a pending batch to append to it, in concurrent mode only: single-threaded batches are never read concurrently
+    class AppendLock {
+    public:
+        AppendLock(PendingBatch *pending, bool locks) : mu_(locks ? &pending->mu : NULL) {
+            if (mu_ != NULL)
+                mu_->lock();
+        }
+        ~AppendLock() {
+            if (mu_ != NULL)
+                mu_->unlock();
+        }
+
+    private:
+        std::mutex *mu_;
+    };
+
+    // The pending batch last used by the current thread, and the write batch it belongs to
+    struct PendingBatchCache {
+        uint64_t owner;
+        PendingBatch *batch;
+    };
+
+    pthread_key_t pendingBatchCacheKey;
+    std::atomic<uint64_t> nextWritebatchIdentifier(1);
+
+    PendingBatchCache * CurrentPendingBatchCache() {
+        static dispatch_once_t onceToken;
+        dispatch_once(&onceToken, ^{
+            pthread_key_create(&pendingBatchCacheKey, free);
+        });
+
+        PendingBatchCache *cache = (PendingBatchCache *)pthread_getspecific(pendingBatchCacheKey);
+        if (cache == NULL) {
+            cache = (PendingBatchCache *)calloc(1, sizeof(PendingBatchCache));
+            pthread_setspecific(pendingBatchCacheKey, cache);
+        }
+        return cache;
+    }
+
+    // Prepend the key prefix of a keyspace's batch to a key, using `storage` if there is one
+    inline leveldb::Slice PrefixedKey(const std::string &prefix, const leveldb::Slice &key, std::string *storage) {
+        if (prefix.empty())
+            return key;
+        storage->reserve(prefix.size() + key.size());
+        storage->assign(prefix);
+        storage->append(key.data(), key.size());
+        return leveldb::Slice(*storage);
+    }
+}
+
+@interface LevelDB ()
+- (LDBLatencyRecorder *) latencyRecorder;
+@end
+
 @interface LDBWritebatch () {
-    leveldb::WriteBatch _writeBatch;
+    PendingBatch _batch;
     id _db;
+    std::string _keyPrefix;     // Prepended to every key, in batches of a keyspace
 }
 
-@property (readonly) leveldb::WriteBatch writeBatch;
++ (instancetype) writeBatchFromDB:(id)db mode:(LDBWritebatchMode)mode keyPrefix:(NSData *)keyPrefix;
+
+- (void) performWithWriteBatch:(void (^)(leveldb::WriteBatch *batch))block;
 
 @end
 
 @implementation LDBWritebatch {
     dispatch_queue_t _serial_queue;
+    uint64_t _identifier;
+    std::atomic<PendingBatch *> _threadBatches;
 }
 
-@synthesize writeBatch = _writeBatch;
 @synthesize db = _db;
 
 + (instancetype) writeBatchFromDB:(id)db {
-    id wb = [[[self alloc] init] autorelease];
+    return [self writeBatchFromDB:db mode:LDBWritebatchSerialized];
+}
++ (instancetype) writeBatchFromDB:(id)db mode:(LDBWritebatchMode)mode {
+    return [self writeBatchFromDB:db mode:mode keyPrefix:nil];
+}
++ (instancetype) writeBatchFromDB:(id)db mode:(LDBWritebatchMode)mode keyPrefix:(NSData *)keyPrefix {
+    id wb = [[[self alloc] initWithMode:mode] autorelease];
     ((LDBWritebatch *)wb)->_db = [db retain];
+    if (keyPrefix)
+        ((LDBWritebatch *)wb)->_keyPrefix.assign((const char *)[keyPrefix bytes], [keyPrefix length]);
     return wb;
 }
 
 - (instancetype) init {
+    return [self initWithMode:LDBWritebatchSerialized];
+}
+- (instancetype) initWithMode:(LDBWritebatchMode)mode {
     self = [super init];
     if (self) {
-        _serial_queue = dispatch_queue_create(NULL, DISPATCH_QUEUE_SERIAL);
+        _mode = mode;
+        _identifier = nextWritebatchIdentifier++;
+        _removalLimit = kDefaultRemovalLimit;
+        _threadBatches.store(NULL);
+        if (mode == LDBWritebatchSerialized)
+            _serial_queue = dispatch_queue_create(NULL, DISPATCH_QUEUE_SERIAL);
     }
     return self;
 }
@@ -45,6 +140,12 @@
         dispatch_release(_serial_queue);
         _serial_queue = nil;
     }
+    PendingBatch *node = _threadBatches.load();
+    while (node != NULL) {
+        PendingBatch *next = node->next;
+        delete node;
+        node = next;
+    }
     if (_db) {
         [_db release];
         _db = nil;
@@ -52,12 +153,116 @@
     [super dealloc];
 }
 
+/*
+ * Return the batch operations should be appended to, from the current thread. Only used
+ * in unsynchronized modes (serialized batches always append to `_batch`, inside the queue).
+ */
+- (PendingBatch *) batchForCurrentThread {
+    if (_mode != LDBWritebatchConcurrent)
+        return &_batch;
+
+    PendingBatchCache *cache = CurrentPendingBatchCache();
+    if (cache->owner == _identifier)
+        return cache->batch;
+
+    pthread_t thread = pthread_self();
+    PendingBatch *node = _threadBatches.load(std::memory_order_acquire);
+    while (node != NULL && !pthread_equal(node->thread, thread))
+        node = node->next;
+
+    if (node == NULL) {
+        // Only the current thread can add a batch for itself, so pushing it without a lock is safe
+        node = new PendingBatch();
+        node->thread = thread;
+        node->next = _threadBatches.load(std::memory_order_relaxed);
+        while (!_threadBatches.compare_exchange_weak(node->next, node,
+                                                     std::memory_order_release,
+                                                     std::memory_order_relaxed));
+    }
+
+    cache->owner = _identifier;
+    cache->batch = node;
+    return node;
+}
+
+/*
+ * Run a block with the write batch holding every pending operation, without copying it.
+ * Thread batches of a concurrent write batch are first moved into the main one.
+ */
+- (void) performWithWriteBatch:(void (^)(leveldb::WriteBatch *batch))block {
+    if (_mode == LDBWritebatchSerialized) {
+        dispatch_sync(_serial_queue, ^{
+            block(&_batch.batch);
+        });
+        return;
+    }
+    std::lock_guard<std::mutex> mainLock(_batch.mu);
+    for (PendingBatch *node = _threadBatches.load(std::memory_order_acquire); node != NULL; node = node->next) {
+        std::lock_guard<std::mutex> lock(node->mu);
+        if (node->count == 0) continue;
+        _batch.batch.Append(node->batch);
+        _batch.count += node->count;
+        node->batch.Clear();
+        node->count = 0;
+    }
+    block(&_batch.batch);
+}
+
+/*
+ * Run a block with every pending batch, the main one first, without moving anything. Thread batches are
+ * visited under their lock, so this can run while other threads append to them.
+ */
+- (void) readPendingBatches:(void (^)(const PendingBatch *pending))block {
+    if (_mode == LDBWritebatchSerialized) {
+        dispatch_sync(_serial_queue, ^{
+            block(&_batch);
+        });
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_batch.mu);
+        block(&_batch);
+    }
+    for (PendingBatch *node = _threadBatches.load(std::memory_order_acquire); node != NULL; node = node->next) {
+        std::lock_guard<std::mutex> lock(node->mu);
+        block(node);
+    }
+}
+
+- (NSUInteger) count {
+    __block NSUInteger count = 0;
+    [self readPendingBatches:^(const PendingBatch *pending) {
+        count += pending->count;
+    }];
+    return count;
+}
+- (NSUInteger) byteSize {
+    __block NSUInteger size = 0;
+    [self readPendingBatches:^(const PendingBatch *pending) {
+        // Thread batches are merged into the main one without their header
+        if (pending == &_batch)
+            size += pending->batch.ApproximateSize();
+        else if (pending->count > 0)
+            size += pending->batch.ApproximateSize() - kWriteBatchHeaderSize;
+    }];
+    return size;
+}
+
 - (void) removeObjectForKey:(id)key {
     AssertKeyType(key);
-    leveldb::Slice k = KeyFromStringOrData(key);
-    dispatch_sync(_serial_queue, ^{
-        _writeBatch.Delete(k);
-    });
+    std::string storage;
+    leveldb::Slice k = PrefixedKey(_keyPrefix, KeyFromStringOrData(key), &storage);
+    if (_mode == LDBWritebatchSerialized) {
+        dispatch_sync(_serial_queue, ^{
+            _batch.batch.Delete(k);
+            _batch.count++;
+        });
+    } else {
+        PendingBatch *pending = [self batchForCurrentThread];
+        AppendLock lock(pending, _mode == LDBWritebatchConcurrent);
+        pending->batch.Delete(k);
+        pending->count++;
+    }
 }
 - (void) removeObjectsForKeys:(NSArray *)keyArray {
     [keyArray enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
@@ -65,29 +270,118 @@
     }];
 }
 - (void) removeAllObjects {
-    [_db enumerateKeysUsingBlock:^(LevelDBKey *key, BOOL *stop) {
-        [self removeObjectForKey:NSDataFromLevelDBKey(key)];
-    }];
+    [self removeAllObjectsWithPrefix:nil];
+}
+- (void) removeAllObjectsWithPrefix:(id)prefix {
+    NSError *error = nil;
+    if (![self removeAllObjectsWithPrefix:prefix error:&error])
+        NSLog(@"Problem removing keys in a write batch: %@", error.localizedDescription);
+}
+- (BOOL) removeAllObjectsWithPrefix:(id)prefix error:(NSError **)error {
+    // The keys enumerated are prefixed already
+    if (!_keyPrefix.empty()) {
+        NSMutableData *prefixed = [NSMutableData dataWithBytes:_keyPrefix.data() length:_keyPrefix.size()];
+        if (prefix) {
+            leveldb::Slice p = KeyFromStringOrData(prefix);
+            [prefixed appendBytes:p.data() length:p.size()];
+        }
+        prefix = prefixed;
+    }
+    
+    // Collected apart, so that a removal exceeding the limit leaves the batch untouched
+    leveldb::WriteBatch removals;
+    leveldb::WriteBatch *removalsPtr = &removals;
+    NSUInteger limit = _removalLimit;
+    __block NSUInteger count = 0;
+    __block BOOL exceeded = NO;
+    [_db enumerateKeysBackward:NO
+                 startingAtKey:nil
+           filteredByPredicate:nil
+                     andPrefix:prefix
+                    usingBlock:^(LevelDBKey *key, BOOL *stop) {
+                        if (count == limit) {
+                            exceeded = YES;
+                            *stop = YES;
+                            return;
+                        }
+                        removalsPtr->Delete(leveldb::Slice(key->data, key->length));
+                        count++;
+                    }];
+    if (exceeded) {
+        if (error != NULL)
+            *error = [NSError errorWithDomain:kLevelDBErrorDomain
+                                         code:LevelDBErrorLimitExceeded
+                                     userInfo:@{ NSLocalizedDescriptionKey: [NSString stringWithFormat:
+                                                 @"More than %lu keys to remove", (unsigned long)limit] }];
+        return NO;
+    }
+    
+    if (_mode == LDBWritebatchSerialized) {
+        dispatch_sync(_serial_queue, ^{
+            _batch.batch.Append(*removalsPtr);
+            _batch.count += count;
+        });
+    } else {
+        PendingBatch *pending = [self batchForCurrentThread];
+        AppendLock lock(pending, _mode == LDBWritebatchConcurrent);
+        pending->batch.Append(removals);
+        pending->count += count;
+    }
+    return YES;
 }
 
 - (void) setData:(NSData *)data forKey:(id)key {
     AssertKeyType(key);
-    dispatch_sync(_serial_queue, ^{
-        leveldb::Slice lkey = KeyFromStringOrData(key);
-        _writeBatch.Put(lkey, SliceFromData(data));
-    });
+    if (_mode == LDBWritebatchSerialized) {
+        dispatch_sync(_serial_queue, ^{
+            std::string storage;
+            leveldb::Slice lkey = PrefixedKey(_keyPrefix, KeyFromStringOrData(key), &storage);
+            _batch.batch.Put(lkey, SliceFromData(data));
+            _batch.count++;
+        });
+    } else {
+        std::string storage;
+        leveldb::Slice lkey = PrefixedKey(_keyPrefix, KeyFromStringOrData(key), &storage);
+        PendingBatch *pending = [self batchForCurrentThread];
+        AppendLock lock(pending, _mode == LDBWritebatchConcurrent);
+        pending->batch.Put(lkey, SliceFromData(data));
+        pending->count++;
+    }
 }
 - (void) setObject:(id)value forKey:(id)key {
     AssertKeyType(key);
-    dispatch_sync(_serial_queue, ^{
-        leveldb::Slice k = KeyFromStringOrData(key);
+    LDBLatencyTimer timer([(LevelDB *)_db latencyRecorder], LevelDBOperationWriteBatchPut);
+    if (_mode == LDBWritebatchSerialized) {
+        LDBLatencyTimer *timerPtr = &timer;
+        dispatch_sync(_serial_queue, ^{
+            std::string storage;
+            leveldb::Slice k = PrefixedKey(_keyPrefix, KeyFromStringOrData(key), &storage);
+            LevelDBKey lkey = GenericKeyFromSlice(k);
+
+            timerPtr->Mark();
+            NSData *data = ((LevelDB *)_db).encoder(&lkey, value);
+            leveldb::Slice v = SliceFromData(data);
+            timerPtr->Phase(LevelDBPhaseEncode);
+
+            _batch.batch.Put(k, v);
+            _batch.count++;
+        });
+    } else {
+        // Values are encoded on the calling thread, concurrently in `LDBWritebatchConcurrent` mode
+        std::string storage;
+        leveldb::Slice k = PrefixedKey(_keyPrefix, KeyFromStringOrData(key), &storage);
         LevelDBKey lkey = GenericKeyFromSlice(k);
-        
+
+        timer.Mark();
         NSData *data = ((LevelDB *)_db).encoder(&lkey, value);
         leveldb::Slice v = SliceFromData(data);
-        
-        _writeBatch.Put(k, v);
-    });
+        timer.Phase(LevelDBPhaseEncode);
+
+        PendingBatch *pending = [self batchForCurrentThread];
+        AppendLock lock(pending, _mode == LDBWritebatchConcurrent);
+        pending->batch.Put(k, v);
+        pending->count++;
+    }
 }
 - (void) setValue:(id)value forKey:(NSString *)key {
     [self setObject:value forKey:key];
@@ -104,5 +398,8 @@
 - (void) apply {
     [_db applyWritebatch:self];
 }
+- (BOOL) applySynchronously:(BOOL)sync error:(NSError **)error {
+    return [_db applyWritebatch:self synchronously:sync error:error];
+}
 
 @end
@@ -9,6 +9,16 @@
 
 @class LDBSnapshot;
 @class LDBWritebatch;
+@class LDBKeyPredicate;
+@class LDBOptions;
+@class LDBBulkLoader;
+@class LDBCursor;
+@class LDBChangeSubscription;
+@class LDBExecutor;
+@class LDBCancellationToken;
+@class LDBKeyspace;
+@class LDBIndex;
+@class LDBLatencySnapshot;
 
 typedef struct LevelDBOptions {
     BOOL createIfMissing ;
@@ -25,12 +35,105 @@ typedef struct {
     NSUInteger   length;
 } LevelDBKey;
 
+typedef enum {
+    LDBWritebatchSerialized = 0,  // Every operation is dispatched synchronously to a serial queue
+    LDBWritebatchSingleThreaded,  // No synchronization, the batch must only be used from one thread at a time
+    LDBWritebatchConcurrent       // Every thread appends to its own batch, all merged when applied
+} LDBWritebatchMode;
+
+typedef enum {
+    LDBChangeOverflowDropOldest = 0,  // The oldest waiting change is discarded to make room for the new one
+    LDBChangeOverflowDropNewest,      // The new change is discarded
+    LDBChangeOverflowCancel           // The subscription is cancelled, after delivering the waiting changes
+} LDBChangeOverflowPolicy;
+
+typedef enum {
+    LevelDBMultiGetPointLookups = 0,
+    LevelDBMultiGetIteratorSeeks
+} LevelDBMultiGetStrategy;
+
+typedef struct {
+    LevelDBMultiGetStrategy strategy;
+    NSUInteger     keyCount;
+    NSUInteger     foundCount;
+    NSUInteger     seekCount;
+    NSTimeInterval sortTime;
+    NSTimeInterval fetchTime;
+    NSTimeInterval decodeTime;
+} LevelDBMultiGetStatistics;
+
+typedef struct {
+    NSUInteger hits;
+    NSUInteger misses;
+    NSUInteger evictions;
+    NSUInteger count;   // Number of cached objects
+    NSUInteger size;    // Total size of the cached keys and encoded values, in bytes
+} LevelDBObjectCacheStatistics;
+
+#define LevelDBNumberOfLevels 7
+
+typedef struct {
+    NSUInteger     files;
+    uint64_t       size;            // Approximate size of the level's tables, in bytes
+    NSTimeInterval compactionTime;  // Time spent compacting into the level
+    uint64_t       bytesRead;       // Bytes read by compactions into the level
+    uint64_t       bytesWritten;    // Bytes written by compactions into the level
+} LevelDBLevelStatistics;
+
+typedef struct {
+    LevelDBLevelStatistics levels[LevelDBNumberOfLevels];
+    uint64_t memoryUsage;           // Memtables and block cache
+    uint64_t memtableUsage;
+    uint64_t blockCacheUsage;
+    uint64_t blockCacheCapacity;
+} LevelDBStatistics;
+
+typedef struct {
+    uint64_t       sizeBefore;      // Approximate size of the range on disk before compacting, in bytes
+    uint64_t       sizeAfter;       // Approximate size of the range on disk after compacting, in bytes
+    uint64_t       bytesReclaimed;
+    NSUInteger     steps;           // Number of sub-ranges compacted
+    NSTimeInterval time;
+    BOOL           cancelled;
+} LevelDBCompactionStatistics;
+
+typedef struct {
+    NSUInteger     files;           // Blob files on disk, including those waiting to be deleted
+    uint64_t       size;            // Total size of the blob files, in bytes
+    uint64_t       garbageBytes;    // Bytes of overwritten or removed values, as of the last examination of each file
+    NSUInteger     unexaminedFiles; // Files that no garbage collection examined since the database was opened
+    NSUInteger     pendingFiles;    // Collected files still readable by a snapshot, cursor or read in progress
+    uint64_t       blobsWritten;    // Values separated since the database was opened
+    uint64_t       bytesWritten;
+    uint64_t       blobsRead;       // Values read back from blob files since the database was opened
+    uint64_t       bytesRead;
+    NSUInteger     filesExamined;   // By garbage collections, since the database was opened
+    uint64_t       bytesRelocated;
+    uint64_t       bytesReclaimed;
+} LevelDBBlobStatistics;
+
+typedef struct {
+    NSUInteger     filesExamined;
+    NSUInteger     filesCollected;  // Files left without live values, deleted once no reader can use them
+    NSUInteger     filesDeleted;
+    uint64_t       bytesRelocated;  // Size of the live values moved to the current blob file
+    uint64_t       bytesReclaimed;  // Size of the files deleted
+    NSTimeInterval time;
+} LevelDBBlobCollectionStatistics;
+
 typedef NSData * (^LevelDBEncoderBlock) (LevelDBKey * key, id object);
 typedef id       (^LevelDBDecoderBlock) (LevelDBKey * key, id data);
 
 typedef void     (^LevelDBKeyBlock)     (LevelDBKey * key, BOOL *stop);
 typedef void     (^LevelDBKeyValueBlock)(LevelDBKey * key, id value, BOOL *stop);
 
+typedef void     (^LevelDBProgressBlock)(NSUInteger count, BOOL *stop);
+typedef void     (^LevelDBCompactionProgressBlock)(double progress, BOOL *stop);
+typedef void     (^LevelDBCompactionBlock)(NSData *startKey, NSData *endKey, LevelDBCompactionStatistics statistics);
+typedef void     (^LevelDBShardKeyValueBlock)(NSUInteger shard, LevelDBKey * key, id value, BOOL *stop);
+typedef void     (^LevelDBChangesBlock)(NSArray *changes, NSUInteger dropped);
+typedef NSArray *(^LevelDBIndexExtractorBlock)(LevelDBKey * key, id value);
+
 typedef id       (^LevelDBValueGetterBlock)  (void);
 typedef void     (^LevelDBLazyKeyValueBlock) (LevelDBKey * key, LevelDBValueGetterBlock lazyValue, BOOL *stop);
 
@@ -40,6 +143,17 @@ FOUNDATION_EXPORT NSString * const kLevelDBChangeTypeDelete;
 FOUNDATION_EXPORT NSString * const kLevelDBChangeValue;
 FOUNDATION_EXPORT NSString * const kLevelDBChangeKey;
 
+FOUNDATION_EXPORT NSString * const kLevelDBErrorDomain;
+
+typedef enum {
+    LevelDBErrorUnknown = 0,
+    LevelDBErrorNotFound,
+    LevelDBErrorCorruption,
+    LevelDBErrorIO,
+    LevelDBErrorCancelled,
+    LevelDBErrorLimitExceeded
+} LevelDBErrorCode;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -77,6 +191,100 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 @property (nonatomic) BOOL useCache;
 
+/**
+ A boolean value indicating whether values read during enumeration should be handed to the decoder without being
+ copied first (defaults to false).
+ 
+ Point lookups (`objectForKey:` and friends) never copy the fetched value before decoding it, regardless of this flag.
+ 
+ @warning When enabled, the `NSData` instance passed to the decoder block points directly inside the iterator's
+ buffer, and is only valid for the duration of the decoder call. The decoder must not retain it, nor return an object
+ that references its bytes.
+ */
+@property (nonatomic) BOOL decodeWithoutCopy;
+
+/**
+ A boolean value indicating whether writes from every thread should be combined into groups committed together
+ (defaults to false).
+ 
+ When enabled, `setObject:forKey:` and `removeObjectForKey:` queue their write and block until the group containing it
+ is committed, in a single write batch. The group is committed with a single sync if any of its writes was made while
+ `safe` was true, so durability is preserved for those writes. Asynchronous writes always go through this queue, and
+ while any is queued, other writes of the database go through it too (or wait for it to empty), so that they are
+ committed in the order they were made.
+ */
+@property (nonatomic) BOOL combinesWrites;
+
+/**
+ The size in bytes a group of combined writes can reach before it is committed (defaults to 1MB).
+ */
+@property (nonatomic) NSUInteger writeGroupSize;
+
+/**
+ The longest time, in seconds, a combined write can wait for its group to fill up before it is committed (defaults to 1ms).
+ A write made while no other is queued, and after a group of a single write, is committed right away.
+ */
+@property (nonatomic) NSTimeInterval writeGroupLatency;
+
+/**
+ The maximum size in bytes of the cache of decoded objects read by `objectForKey:` (defaults to 0, disabled).
+ 
+ The size of a cached object is counted as the size of its key and encoded value. Writes, removals and write batches
+ invalidate the objects cached for their keys, and reads from snapshots bypass the cache. Mutable arrays, dictionaries,
+ sets, strings and data are never cached.
+ 
+ @warning Cached objects are shared between every caller reading their key, and must not be mutated.
+ */
+@property (nonatomic) NSUInteger objectCacheSize;
+
+/**
+ Hit, miss and eviction counts of the object cache, along with its current content
+ */
+@property (nonatomic, readonly) LevelDBObjectCacheStatistics objectCacheStatistics;
+
+/**
+ A boolean value indicating whether ranges that accumulated deletions should be compacted in the background while
+ the database is idle (defaults to false).
+ 
+ Deletions are counted per range of keys sharing their first 4 bytes, along with the ranges cleared by
+ `removeAllObjectsWithPrefix:` and friends. Every `backgroundCompactionInterval`, if no write was made since the last
+ check and leveldb's own compactions made no progress either, the ranges with at least
+ `backgroundCompactionThreshold` deletions are compacted, one after the other. Then one blob file, if any, is examined
+ for garbage (see `collectBlobGarbageWithRatio:maxFiles:`).
+ */
+@property (nonatomic) BOOL compactsInBackground;
+
+/**
+ The number of deletions in a range above which it gets compacted in the background (defaults to 10000)
+ */
+@property (nonatomic) NSUInteger backgroundCompactionThreshold;
+
+/**
+ The interval, in seconds, between checks for idleness and ranges to compact in the background (defaults to 5s)
+ */
+@property (nonatomic) NSTimeInterval backgroundCompactionInterval;
+
+/**
+ A block called after every background compaction, with the compacted range and the bytes it reclaimed
+ (defaults to `nil`). It is called on the queue running compactions.
+ */
+@property (nonatomic, copy) LevelDBCompactionBlock backgroundCompactionBlock;
+
+/**
+ A boolean value indicating whether the latencies of reads, writes, write batches, snapshots and enumerations should be
+ recorded (defaults to false). See `latencySnapshot`.
+ 
+ When disabled, each operation only pays for a relaxed load of this flag. When enabled, it reads the clock once per
+ phase, and adds to one of 16 sets of histograms, picked by thread and shared by the threads picking the same one, with
+ a relaxed atomic add per counter and without taking any lock. Memory stays bounded however many threads record.
+ */
+@property (nonatomic) BOOL recordsLatencies;
+
+/**
+ The executor running the asynchronous operations of the database (defaults to `[LDBExecutor sharedExecutor]`)
+ */
+@property (nonatomic, retain) LDBExecutor *executor;
+
 /**
  A boolean readonly value indicating whether the database is closed or not.
  */
@@ -84,11 +292,17 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
 
 /**
  The data encoding block.
+
+ It must be thread-safe: it is called by the threads writing to the database, and bulk loads call it on several threads
+ at once.
  */
 @property (nonatomic, copy) LevelDBEncoderBlock encoder;
 
 /**
  The data decoding block.
+
+ It must be thread-safe: it is called by the threads reading from the database, and parallel scans call it on several
+ threads at once.
  */
 @property (nonatomic, copy) LevelDBDecoderBlock decoder;
 
@@ -112,6 +326,14 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 + (id) databaseInLibraryWithName:(NSString *)name andOptions:(LevelDBOptions)opts;
 
+/**
+ A class method that returns an autoreleased instance of LevelDB with the given name and options, inside the Library folder
+ 
+ @param name The database's filename
+ @param opts A LDBOptions instance with options for fine tuning leveldb
+ */
++ (id) databaseInLibraryWithName:(NSString *)name options:(LDBOptions *)opts;
+
 /**
  Initialize a leveldb instance
  
@@ -129,6 +351,15 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 - (id) initWithPath:(NSString *)path name:(NSString *)name andOptions:(LevelDBOptions)opts;
 
+/**
+ Initialize a leveldb instance
+ 
+ @param path The parent directory of the database file on disk
+ @param name the filename of the database file on disk
+ @param opts A LDBOptions instance with options for fine tuning leveldb, covering more settings than `LevelDBOptions`
+ */
+- (id) initWithPath:(NSString *)path name:(NSString *)name options:(LDBOptions *)opts;
+
 
 /**
  Delete the database file on disk
@@ -138,7 +369,12 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
 /**
  Close the database.
  
- @warning The instance cannot be used to perform any query after it has been closed.
+ Closing can happen from any thread, concurrently with other operations: it waits for the operations in flight to
+ finish, then closes the snapshots and cursors still open. Operations started once the database is closing fail,
+ returning `nil`, `NO` or zero (or an error, if they report one).
+ 
+ @warning The instance cannot be used to perform any query after it has been closed. Closing from inside a block
+ called by an operation of the database (an enumeration block, for instance) never returns.
  */
 - (void) close;
 
@@ -154,6 +390,18 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 - (void) setObject:(id)value forKey:(id)key;
 
+/**
+ Set the value associated with a key in the database, without waiting for the write to be committed
+ 
+ The write is queued with other combined writes (see `combinesWrites`), and the completion block is called on a global
+ queue once it is committed. Until then, reads may not reflect it.
+ 
+ @param value The value to put in the database
+ @param key The key at which the value can be found
+ @param completion (optional) A block called once the write is committed, with a `NSError` instance if it failed
+ */
+- (void) setObject:(id)value forKey:(id)key completion:(void (^)(NSError *error))completion;
+
 /**
  Same as `[self setObject:forKey:]`
  */
@@ -178,16 +426,108 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 - (LDBWritebatch *) newWritebatch;
 
+/**
+ Return an retained LDBWritebatch instance for this database, using the provided synchronization mode
+ 
+ @param mode The way concurrent operations on the write batch are handled (see `LDBWritebatchMode`)
+ */
+- (LDBWritebatch *) newWritebatchWithMode:(LDBWritebatchMode)mode;
+
 /**
  Apply the operations from a writebatch into the current database
  */
 - (void) applyWritebatch:(LDBWritebatch *)writeBatch;
 
+/**
+ Apply the operations from a writebatch into the current database, choosing whether it should be flushed to disk before returning
+ 
+ The writebatch is committed in place, without being copied.
+ 
+ @param writeBatch The writebatch to apply
+ @param sync A boolean value indicating whether the write should be synchronous, regardless of the `safe` property
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if the write failed
+ 
+ @return A boolean value indicating whether the writebatch was applied
+ */
+- (BOOL) applyWritebatch:(LDBWritebatch *)writeBatch
+           synchronously:(BOOL)sync
+                   error:(NSError **)error;
+
 /**
  Create new writebatch, apply the operations in block from a writebatch into the current database
  */
 - (void) performWritebatch:(void (^)(LDBWritebatch *wb))block;
 
+#pragma mark - Bulk loading
+
+/**
+ Return a retained LDBBulkLoader instance for this database
+ 
+ @param sorted A boolean value indicating whether keys will be added in ascending order (otherwise they are sorted externally)
+ */
+- (LDBBulkLoader *) newBulkLoaderWithSortedInput:(BOOL)sorted;
+
+/**
+ Load every key value pair of an enumerator with a bulk loader, then sync and compact the loaded range
+ 
+ @param enumerator An enumerator of arrays, each holding a key (`NSString` or `NSData`) and its value
+ @param sorted A boolean value indicating whether the enumerator yields keys in ascending order
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if a write failed
+ 
+ @return A boolean value indicating whether every pair was written
+ */
+- (BOOL) loadEntriesFromEnumerator:(NSEnumerator *)enumerator
+                            sorted:(BOOL)sorted
+                             error:(NSError **)error;
+
+#pragma mark - Archives
+
+/**
+ Load every key value pair of an archive written by `-[LDBSnapshot exportToPath:withPrefix:error:]` (see `LDBArchive`)
+ 
+ @param path The path of the archive file
+ @param error (optional) A pointer set to a `NSError` instance in the `kLevelDBErrorDomain` domain if the archive is incomplete or damaged, or if a write failed
+ 
+ @return A boolean value indicating whether every pair was loaded
+ */
+- (BOOL) importArchiveAtPath:(NSString *)path error:(NSError **)error;
+
+#pragma mark - Keyspaces
+
+/**
+ Return a view of the keys prefixed with a given value, reading and writing them relative to that prefix
+ 
+ @param prefix The prefix of the keys of the keyspace (`NSString` or `NSData`), which mustn't be empty
+ */
+- (LDBKeyspace *) keyspaceWithPrefix:(id)prefix;
+
+#pragma mark - Secondary indexes
+
+/**
+ Add a secondary index, maintained along with every write from then on (see `LDBIndex`)
+ 
+ If the database holds no key yet, the index is built already. Otherwise, it is only built once
+ `-[LDBIndex buildWithCompletion:]` completed, either now or after a previous launch.
+ 
+ @param name The name of the index, identifying its entries across launches
+ @param extractor The block returning the values a key value pair is indexed under: `NSString`, `NSData`, `NSNumber` or `NSNull` instances, or arrays of those for composite values, or `nil` to leave the pair out of the index. It is called on writing threads, and must not touch the database.
+ 
+ @return The index, replacing any index added with the same name, which stops answering queries
+ */
+- (LDBIndex *) addIndexNamed:(NSString *)name extractor:(LevelDBIndexExtractorBlock)extractor;
+
+/**
+ Return the index added with a given name, or `nil` if there is none
+ */
+- (LDBIndex *) indexNamed:(NSString *)name;
+
+/**
+ Stop maintaining an index, and remove its entries. The `LDBIndex` instance stops answering queries.
+ 
+ @param name The name of the index, which doesn't need to have been added since the database was opened
+ */
+- (void) removeIndexNamed:(NSString *)name;
+
 #pragma mark - Getters
 
 /**
@@ -219,6 +559,23 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 - (id) objectsForKeys:(NSArray *)keys notFoundMarker:(id)marker;
 
+/**
+ Return an array containing the values associated with the provided list of keys, and report how they were fetched.
+ 
+ All keys are read from a single implicit snapshot, so the result is consistent across the batch. Keys are sorted
+ before being looked up: when they are densely packed, a single iterator is walked forward with `Seek`s, otherwise
+ each key is fetched with a point lookup. Values are returned in the order of `keys`.
+ 
+ @warning marker should not be `nil`
+ 
+ @param keys The list of keys to fetch from the database
+ @param marker The value to associate to missing keys
+ @param statistics (optional) A pointer to a `LevelDBMultiGetStatistics` struct, filled with the chosen strategy and timings
+ */
+- (NSArray *) objectsForKeys:(NSArray *)keys
+              notFoundMarker:(id)marker
+                  statistics:(LevelDBMultiGetStatistics *)statistics;
+
 /**
  Return a boolean value indicating whether or not the key exists in the database
  
@@ -235,6 +592,17 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 - (void) removeObjectForKey:(id)key;
 
+/**
+ Remove a key (and its associated value) from the database, without waiting for the write to be committed
+ 
+ The removal is queued with other combined writes (see `combinesWrites`), and the completion block is called on a
+ global queue once it is committed.
+ 
+ @param key The key to remove from the database
+ @param completion (optional) A block called once the removal is committed, with a `NSError` instance if it failed
+ */
+- (void) removeObjectForKey:(id)key completion:(void (^)(NSError *error))completion;
+
 /**
  Remove a set of keys (and their associated values) from the database
  
@@ -250,10 +618,40 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
 /**
  Remove all objects prefixed with a given value (`NSString` or `NSData`)
  
+ Keys are deleted in bounded-size write batches, in a single pass over the prefixed range.
+ 
  @param prefix The key prefix used to remove all matching keys (of type `NSString` or `NSData`)
  */
 - (void) removeAllObjectsWithPrefix:(id)prefix;
 
+/**
+ Remove all objects prefixed with a given value (`NSString` or `NSData`), reporting progress as it goes
+ 
+ @param prefix The key prefix used to remove all matching keys (of type `NSString` or `NSData`). If `nil`, every key is removed.
+ @param compact A boolean value indicating whether the removed range should be compacted afterwards, reclaiming the space used by deletion markers
+ @param block (optional) A block called after every write batch is applied, with the number of keys removed so far. Setting its `stop` argument to `TRUE` cancels the removal (keys already removed stay removed).
+ 
+ @return The number of keys removed
+ */
+- (NSUInteger) removeAllObjectsWithPrefix:(id)prefix
+                     compactingAfterwards:(BOOL)compact
+                               usingBlock:(LevelDBProgressBlock)block;
+
+/**
+ Remove all objects whose key falls in the range [`startKey`, `endKey`), reporting progress as it goes
+ 
+ @param startKey (optional) The first key of the range (`NSString` or `NSData`). If `nil`, the range starts at the first key of the database.
+ @param endKey (optional) The key right after the range, which is not removed (`NSString` or `NSData`). If `nil`, the range ends with the last key of the database.
+ @param compact A boolean value indicating whether the removed range should be compacted afterwards, reclaiming the space used by deletion markers
+ @param block (optional) A block called after every write batch is applied, with the number of keys removed so far. Setting its `stop` argument to `TRUE` cancels the removal (keys already removed stay removed).
+ 
+ @return The number of keys removed
+ */
+- (NSUInteger) removeObjectsFromKey:(id)startKey
+                              toKey:(id)endKey
+               compactingAfterwards:(BOOL)compact
+                         usingBlock:(LevelDBProgressBlock)block;
+
 #pragma mark - Selection
 
 /**
@@ -277,6 +675,24 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 - (NSDictionary *) dictionaryByFilteringWithPredicate:(NSPredicate *)predicate;
 
+/**
+ Return an array of the keys matching a key predicate, without decoding any value
+ 
+ @param keyPredicate A `LDBKeyPredicate` instance tested against the database's keys
+ */
+- (NSArray *) keysMatchingKeyPredicate:(LDBKeyPredicate *)keyPredicate;
+
+/**
+ Return a dictionary with the key-value pairs whose key matches a key predicate, and whose value matches a predicate
+ 
+ Only the values associated to keys matching `keyPredicate` are decoded.
+ 
+ @param keyPredicate A `LDBKeyPredicate` instance tested against the database's keys. If `nil`, every key matches.
+ @param predicate A `NSPredicate` instance tested against the values of the matching keys. If `nil`, this is ignored.
+ */
+- (NSDictionary *) dictionaryByFilteringWithKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                                            andPredicate:(NSPredicate *)predicate;
+
 /**
  Return an retained LDBSnapshot instance for this database
  
@@ -286,6 +702,24 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
  */
 - (LDBSnapshot *) newSnapshot;
 
+/**
+ Return a retained LDBCursor instance over the keys in the range [`lowerBound`, `upperBound`)
+ 
+ Unlike `allKeys` or the enumeration methods, a cursor reads any number of key value pairs at a time, from a position
+ that can be saved as a continuation key and resumed later, so pages can be served with a constant amount of memory.
+ 
+ @param lowerBound (optional) The smallest key the cursor can reach (`NSString` or `NSData`). If `nil`, there is no lower bound.
+ @param upperBound (optional) The key above every key the cursor can reach (`NSString` or `NSData`). If `nil`, there is no upper bound.
+ */
+- (LDBCursor *) newCursorFromKey:(id)lowerBound toKey:(id)upperBound;
+
+/**
+ Return a retained LDBCursor instance over the keys prefixed with a given value
+ 
+ @param prefix The prefix of the keys the cursor can reach (`NSString` or `NSData`)
+ */
+- (LDBCursor *) newCursorWithPrefix:(id)prefix;
+
 #pragma mark - Enumeration
 
 /**
@@ -338,4 +772,278 @@ NSData   * NSDataFromLevelDBKey  (LevelDBKey * key);
                                andPrefix:(id)prefix
                               usingBlock:(id)block;
 
+/**
+ Enumerate over the keys matching a key predicate, in direct or backward order
+ 
+ The range of keys bounded by `keyPredicate` is the only one scanned, and no value is decoded unless `predicate` is provided.
+ 
+ @param backward A boolean value indicating whether the enumeration happens in direct or backward order
+ @param keyPredicate A `LDBKeyPredicate` instance tested against the keys. If `nil`, every key matches.
+ @param predicate A `NSPredicate` instance tested against the values of the matching keys. If `nil`, this is ignored.
+ @param block The enumeration block used when iterating over the matching keys.
+ */
+- (void) enumerateKeysBackward:(BOOL)backward
+          matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+           filteredByPredicate:(NSPredicate *)predicate
+                    usingBlock:(LevelDBKeyBlock)block;
+
+/**
+ Enumerate over the key value pairs whose key matches a key predicate, in direct or backward order
+ 
+ The range of keys bounded by `keyPredicate` is the only one scanned, and values are only decoded for matching keys.
+ 
+ @param backward A boolean value indicating whether the enumeration happens in direct or backward order
+ @param lazily A boolean value indicating whether the block takes a `LevelDBValueGetterBlock` decoding the value on demand
+ @param keyPredicate A `LDBKeyPredicate` instance tested against the keys. If `nil`, every key matches.
+ @param predicate A `NSPredicate` instance tested against the values of the matching keys. If `nil`, this is ignored.
+ @param block The enumeration block used when iterating over the matching key value pairs.
+ */
+- (void) enumerateKeysAndObjectsBackward:(BOOL)backward
+                                  lazily:(BOOL)lazily
+                    matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                     filteredByPredicate:(NSPredicate *)predicate
+                              usingBlock:(id)block;
+
+#pragma mark - Change notifications
+
+/**
+ Subscribe to the changes committed to keys with a given prefix, delivered on a private serial queue, keeping at most
+ 10000 changes waiting to be delivered and discarding the oldest ones beyond that
+ 
+ Same as `[self subscribeToChangesWithPrefix:prefix capacity:10000 overflowPolicy:LDBChangeOverflowDropOldest queue:nil usingBlock:block]`
+ */
+- (LDBChangeSubscription *) subscribeToChangesWithPrefix:(id)prefix
+                                              usingBlock:(LevelDBChangesBlock)block;
+
+/**
+ Subscribe to the puts and deletes committed to keys with a given prefix, by single writes, write batches, range
+ removals and bulk loads, once the subscription is returned.
+ 
+ While a database has subscribers, its writes are committed one at a time, so that changes are published in the order
+ they were committed.
+ 
+ @param prefix (optional) The prefix of the keys whose changes are delivered (`NSString` or `NSData`). If `nil`, every change is delivered.
+ @param capacity The maximum number of changes waiting to be delivered
+ @param policy What happens to changes committed while `capacity` changes are waiting to be delivered
+ @param queue (optional) The queue the block is called on, never called concurrently with itself. If `nil`, a private serial queue is used.
+ @param block The block called with every batch of changes delivered, as an array of dictionaries (see `LDBChangeSubscription`), and the number of changes lost to overflows since the previous delivery
+ 
+ @return The subscription, which lasts until it is cancelled or the database is closed
+ */
+- (LDBChangeSubscription *) subscribeToChangesWithPrefix:(id)prefix
+                                                capacity:(NSUInteger)capacity
+                                          overflowPolicy:(LDBChangeOverflowPolicy)policy
+                                                   queue:(dispatch_queue_t)queue
+                                              usingBlock:(LevelDBChangesBlock)block;
+
+#pragma mark - Asynchronous operations
+
+/**
+ Fetch the value associated with a key on the database's executor, ahead of writes and scans
+ 
+ @param key The key to retrieve from the database
+ @param completion A block called on the executor with the value (`nil` if the key is missing), or with a `NSError` instance if the database was closed or the read cancelled
+ 
+ @return A token cancelling the read, as long as it hasn't started
+ */
+- (LDBCancellationToken *) objectForKey:(id)key
+                             completion:(void (^)(id object, NSError *error))completion;
+
+/**
+ Fetch the values associated with a list of keys on the database's executor, ahead of writes and scans
+ 
+ Same as `[self objectsForKeys:keys notFoundMarker:marker]`, run asynchronously.
+ 
+ @param keys The list of keys to fetch from the database
+ @param marker The value to associate to missing keys
+ @param completion A block called on the executor with the values, or with a `NSError` instance if the database was closed or the read cancelled
+ 
+ @return A token cancelling the read, as long as it hasn't started
+ */
+- (LDBCancellationToken *) objectsForKeys:(NSArray *)keys
+                           notFoundMarker:(id)marker
+                               completion:(void (^)(NSArray *objects, NSError *error))completion;
+
+/**
+ Apply the operations from a writebatch on the database's executor, ahead of scans
+ 
+ Single puts and removals are asynchronous already, see `setObject:forKey:completion:` and `removeObjectForKey:completion:`.
+ 
+ @param writeBatch The writebatch to apply, which shouldn't be modified until the completion block is called
+ @param completion (optional) A block called on the executor once the write is committed, with a `NSError` instance if it failed or was cancelled
+ 
+ @return A token cancelling the write, as long as it hasn't started
+ */
+- (LDBCancellationToken *) applyWritebatch:(LDBWritebatch *)writeBatch
+                                completion:(void (^)(NSError *error))completion;
+
+/**
+ Enumerate over the key value pairs prefixed with a given value on the database's executor, behind reads and writes
+ 
+ Cancelling the token stops the enumeration before the next key.
+ 
+ @param prefix (optional) A `NSString` or `NSData` prefix used to filter the keys. If `nil`, every key is enumerated.
+ @param block The enumeration block, called on the executor
+ @param completion (optional) A block called on the executor once the enumeration is over, with a `NSError` instance if the database was closed or the scan cancelled
+ 
+ @return A token cancelling the scan
+ */
+- (LDBCancellationToken *) enumerateKeysAndObjectsWithPrefix:(id)prefix
+                                                  usingBlock:(LevelDBKeyValueBlock)block
+                                                  completion:(void (^)(NSError *error))completion;
+
+#pragma mark - Compaction
+
+/**
+ Compact the keys in the range [`startKey`, `endKey`], discarding deleted and overwritten values, and return the
+ space reclaimed.
+ 
+ Compaction rewrites every table overlapping the range, and blocks until done. It is split in a few steps holding
+ roughly the same amount of data, reporting progress after each one.
+ 
+ @param startKey (optional) The first key of the range (`NSString` or `NSData`). If `nil`, the range starts with the first key.
+ @param endKey (optional) The last key of the range (`NSString` or `NSData`). If `nil`, the range ends with the last key.
+ @param progress (optional) A block called after every step with the fraction of the range compacted so far. Setting its `stop` argument to `TRUE` cancels the remaining steps.
+ */
+- (LevelDBCompactionStatistics) compactRangeFromKey:(id)startKey
+                                              toKey:(id)endKey
+                                           progress:(LevelDBCompactionProgressBlock)progress;
+
+/**
+ Compact the keys starting with `prefix`. See `compactRangeFromKey:toKey:progress:`.
+ 
+ @param prefix A `NSString` or `NSData` prefix. If `nil`, the whole database is compacted.
+ */
+- (LevelDBCompactionStatistics) compactKeysWithPrefix:(id)prefix
+                                             progress:(LevelDBCompactionProgressBlock)progress;
+
+/**
+ Compact the keys in the range [`startKey`, `endKey`] on a background queue, one compaction at a time.
+ See `compactRangeFromKey:toKey:progress:`.
+ 
+ Closing the database cancels the remaining steps, after waiting for the current one.
+ 
+ @param progress (optional) A block called on the compaction queue after every step
+ @param completion (optional) A block called on a global queue once the compaction is done
+ */
+- (void) compactRangeFromKey:(id)startKey
+                       toKey:(id)endKey
+                    progress:(LevelDBCompactionProgressBlock)progress
+                  completion:(void (^)(LevelDBCompactionStatistics statistics))completion;
+
+#pragma mark - Large values
+
+/**
+ Collect the space taken in blob files by overwritten and removed values, when values are separated from leveldb's
+ tables (see `-[LDBOptions valueSeparationThreshold]`). Does nothing if the database holds no blob file.
+
+ Files are examined one at a time, in turn, by looking up the key of every blob they hold, without filling the block
+ cache. A file left without live values is collected, and one with at least `ratio` of its bytes in dead values has its
+ live values moved to the file being written first, while writes wait. Collected files are deleted as soon as no
+ snapshot, cursor or read started before may still read from them, by this pass or a later one.
+
+ When `compactsInBackground` is enabled, every idle window also examines one file, moving its live values if at least
+ half of it is garbage.
+
+ @param ratio The share of dead bytes above which the live values of a file are moved, between 0 and 1
+ @param maxFiles The number of files examined before returning
+ */
+- (LevelDBBlobCollectionStatistics) collectBlobGarbageWithRatio:(double)ratio maxFiles:(NSUInteger)maxFiles;
+
+/**
+ Return the number and size of blob files, the garbage they were found to hold, and counters of the values separated,
+ read and relocated since the database was opened
+ */
+- (LevelDBBlobStatistics) blobStatistics;
+
+#pragma mark - Introspection
+
+/**
+ Return the value of a leveldb property, or `nil` if it doesn't exist
+ 
+ Properties include `leveldb.stats`, `leveldb.sstables`, `leveldb.num-files-at-level<N>` and
+ `leveldb.approximate-memory-usage`.
+ 
+ @param name The name of the property
+ */
+- (NSString *) propertyNamed:(NSString *)name;
+
+/**
+ Return the number of files, sizes and compaction statistics of every level, along with the memory used by the
+ memtables and the block cache.
+ 
+ This only reads counters maintained by leveldb, and is cheap enough to be polled regularly.
+ */
+- (LevelDBStatistics) statistics;
+
+/**
+ Return the approximate size on disk of the keys in the range [`startKey`, `endKey`), in bytes
+ 
+ Only data written to tables is accounted for, recent writes still in the memtable are not.
+ 
+ @param startKey (optional) The first key of the range (`NSString` or `NSData`). If `nil`, the range starts with the first key.
+ @param endKey (optional) The key following the range (`NSString` or `NSData`). If `nil`, the range ends with the last key.
+ */
+- (uint64_t) approximateSizeFromKey:(id)startKey toKey:(id)endKey;
+
+/**
+ Return the approximate size on disk of the keys starting with `prefix`, in bytes
+ 
+ @param prefix A `NSString` or `NSData` prefix
+ */
+- (uint64_t) approximateSizeOfKeysWithPrefix:(id)prefix;
+
+/**
+ Return the latency histograms of every operation and phase, along with the keys and bytes counted by scans, recorded
+ from every thread since the database was opened or `resetLatencies` was last called.
+ 
+ The histograms are copied, so the snapshot doesn't change as more operations are recorded.
+ */
+- (LDBLatencySnapshot *) latencySnapshot;
+
+/**
+ Start recording latencies anew, so that later snapshots only account for operations that follow this call
+ */
+- (void) resetLatencies;
+
+#pragma mark - Parallel enumeration
+
+/**
+ Enumerate over the key value pairs prefixed with a given value, splitting them into shards scanned concurrently.
+ 
+ Same as `[self enumerateKeysAndObjectsConcurrentlyFromKey:prefix toKey:<first key after prefix> shards:shards ordered:ordered usingBlock:block]`
+ 
+ @param prefix A `NSString` or `NSData` prefix used to filter the keys. If `nil`, the whole database is enumerated.
+ @param shards The number of shards to split the keys into. If 0, the number of active processors is used.
+ @param ordered A boolean value indicating whether the block should be called in key order, from the calling thread
+ @param block The enumeration block, also given the index of the shard the key belongs to
+ */
+- (void) enumerateKeysAndObjectsConcurrentlyWithPrefix:(id)prefix
+                                                shards:(NSUInteger)shards
+                                               ordered:(BOOL)ordered
+                                            usingBlock:(LevelDBShardKeyValueBlock)block;
+
+/**
+ Enumerate over the key value pairs in the range [`startKey`, `endKey`), splitting them into shards scanned concurrently.
+ 
+ The range is split into contiguous shards of roughly the same size on disk (estimated with leveldb's
+ `GetApproximateSizes`). Every shard is scanned by its own iterator, on a global concurrent queue, and all of them read
+ from the same snapshot. Values are decoded by the worker scanning their shard, so the decoder must be thread-safe.
+ 
+ If `ordered` is false, the block is called concurrently from the workers, in key order within each shard only. If
+ `ordered` is true, the block is called from the calling thread in key order, while workers decode ahead of it.
+ Setting the block's `stop` argument to `TRUE` stops every shard.
+ 
+ @param startKey (optional) The first key of the range (`NSString` or `NSData`). If `nil`, the range starts at the first key of the database.
+ @param endKey (optional) The key right after the range (`NSString` or `NSData`). If `nil`, the range ends with the last key of the database.
+ @param shards The number of shards to split the keys into. If 0, the number of active processors is used.
+ @param ordered A boolean value indicating whether the block should be called in key order, from the calling thread
+ @param block The enumeration block, also given the index of the shard the key belongs to
+ */
+- (void) enumerateKeysAndObjectsConcurrentlyFromKey:(id)startKey
+                                              toKey:(id)endKey
+                                             shards:(NSUInteger)shards
+                                            ordered:(BOOL)ordered
+                                         usingBlock:(LevelDBShardKeyValueBlock)block;
+
 @end
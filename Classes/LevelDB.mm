@@ -8,15 +8,76 @@
 #import "LevelDB.h"
 #import "LDBSnapshot.h"
 #import "LDBWriteBatch.h"
+#import "LDBKeyPredicate.h"
+#import "LDBCodec.h"
+#import "LDBOptions.h"
+#import "LDBInstrumentation.h"
+#import "LDBBulkLoader.h"
+#import "LDBCursor.h"
+#import "LDBChangeFeed.h"
+#import "LDBExecutor.h"
+#import "LDBKeyspace.h"
+#import "LDBIndex.h"
+#import "LDBArchive.h"
+#import "LDBBlobStore.h"
 
 #import <leveldb/db.h>
 #import <leveldb/options.h>
 #import <leveldb/cache.h>
+#import <leveldb/comparator.h>
 #import <leveldb/filter_policy.h>
 #import <leveldb/write_batch.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "LDBCommon.h"
 
+// Below this many keys, a multi-get always uses point lookups
+static const NSUInteger kMultiGetMinimumSeekKeys = 16;
+// Keys spanning less than this many bytes on disk (on average) are fetched with a single iterator
+static const uint64_t kMultiGetDenseBytesPerKey = 16 * 1024;
+// Range removals are applied in write batches holding at most this many keys, or bytes of keys
+static const size_t kRemovalBatchCount = 10000;
+static const size_t kRemovalBatchBytes = 1024 * 1024;
+// A parallel scan estimates the size of this many key ranges per shard, to balance them
+static const size_t kParallelScanSamplesPerShard = 8;
+// In an ordered parallel scan, each shard buffers at most this many decoded values ahead of the caller
+static const size_t kParallelScanBufferSize = 1024;
+// Shard scans drain their autorelease pool every this many keys
+static const NSUInteger kParallelScanPoolSize = 256;
+// Size of the block cache of a database opened without one, as leveldb would create
+static const size_t kDefaultBlockCacheSize = 8 * 1024 * 1024;
+// Default limits of a group of combined writes
+static const NSUInteger kWriteGroupSize = 1024 * 1024;
+static const NSTimeInterval kWriteGroupLatency = 0.001;
+// A manual compaction is split into this many steps, to report progress
+static const size_t kCompactionSteps = 8;
+// Deletions are tracked per range of keys sharing this many first bytes, for background compactions
+static const size_t kDeletionRangePrefixLength = 4;
+// Beyond this many tracked ranges, further deletions are counted against the whole database
+static const size_t kMaxDeletionRanges = 1024;
+// Default triggers of background compactions
+static const NSUInteger kBackgroundCompactionThreshold = 10000;
+static const NSTimeInterval kBackgroundCompactionInterval = 5;
+// Default number of changes waiting to be delivered to a change subscriber
+static const NSUInteger kChangeSubscriptionCapacity = 10000;
+// Number of keys indexed per batch when building a secondary index, while writes wait
+static const size_t kIndexBuildBatchCount = 1000;
+// Share of garbage above which a background collection moves the live values of a blob file
+static const double kBackgroundBlobGarbageRatio = 0.5;
+
 #define MaybeAddSnapshotToOptions(_from_, _to_, _snap_) \
     leveldb::ReadOptions __to_;\
     leveldb::ReadOptions * _to_ = &__to_;\
@@ -38,8 +99,82 @@
     ([_obj_ isKindOfClass:[NSString class]]) ? [NSData dataWithBytes:[_obj_ cStringUsingEncoding:NSUTF8StringEncoding] \
                                                               length:[_obj_ lengthOfBytesUsingEncoding:NSUTF8StringEncoding]] : nil
 
-#define AssertDBExists(_db_) \
-    NSAssert(_db_ != NULL, @"Database reference is not existent (it has probably been closed)");
+// Keep the database open until the end of the scope, or return `_failure_` if it is closing or closed
+#define EnterOperation(_failure_) \
+    LDBOperation __operation(inFlight); \
+    if (!__operation.Entered()) \
+        return _failure_;
+
+// Same as `EnterOperation`, failing with an error instead
+#define EnterOperationOrFail(_error_) \
+    LDBOperation __operation(inFlight); \
+    if (!__operation.Entered()) { \
+        if (_error_ != NULL) \
+            *_error_ = ClosedDatabaseError(); \
+        return NO; \
+    }
+
+// Same as `EnterOperation`, calling an asynchronous completion block with an error instead
+#define EnterAsyncOperation(_completion_) \
+    LDBOperation __operation(inFlight); \
+    if (!__operation.Entered()) { \
+        if (_completion_ != nil) { \
+            void (^__completion)(NSError *) = [[_completion_ copy] autorelease]; \
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{ \
+                __completion(ClosedDatabaseError()); \
+            }); \
+        } \
+        return; \
+    }
+
+// Decode a value read from leveldb, reading it from its blob file first if it was separated
+#define DecodeSliceValue(_slice_, _key_) \
+    ((blobStore && LDBBlobStore::IsPointer(_slice_)) ? DecodeBlob(blobStore, _slice_, _key_, _decoder) \
+     : (_decodeWithoutCopy) ? DecodeFromTransientSlice(_slice_, _key_, _decoder) \
+                            : DecodeFromSlice(_slice_, _key_, _decoder))
+
+#define DecodeIteratorValue(_iter_, _key_) DecodeSliceValue(_iter_->value(), _key_)
+
+// Same as `DecodeSliceValue`, for a value fetched with `leveldb::DB::Get`
+#define DecodeStringValue(_string_, _key_) \
+    ((blobStore && LDBBlobStore::IsPointer(_string_)) ? DecodeBlob(blobStore, _string_, _key_, _decoder) \
+                                                      : DecodeFromString(_string_, _key_, _decoder))
+
+/*
+ * Decode a value separated into a blob file, given the pointer leveldb holds in its place. Returns nil, after logging
+ * why, if the blob can't be read.
+ */
+static id DecodeBlob(LDBBlobStore *blobs, const leveldb::Slice &pointer, LevelDBKey *key, LevelDBDecoderBlock decoder) {
+    leveldb::Status status;
+    NSData *data = blobs->Read(pointer, &status);
+    if (data == nil) {
+        NSLog(@"Problem reading a value from its blob file: %s", status.ToString().c_str());
+        return nil;
+    }
+    return decoder(key, data);
+}
+
+@interface LDBChangeSubscription ()
+- (id) initWithDB:(LevelDB *)db
+           prefix:(NSData *)prefix
+         capacity:(NSUInteger)capacity
+   overflowPolicy:(LDBChangeOverflowPolicy)policy
+            queue:(dispatch_queue_t)queue
+       usingBlock:(LevelDBChangesBlock)block;
+- (void) appendChange:(BOOL)put key:(const leveldb::Slice &)key value:(const leveldb::Slice &)value;
+- (void) flushWithDecoder:(LevelDBDecoderBlock)decoder;
+- (void) detach;
+@end
+
+@interface LDBIndex ()
++ (instancetype) indexWithDB:(LevelDB *)db name:(NSString *)name extractor:(LevelDBIndexExtractorBlock)extractor;
++ (std::string) entryPrefixForName:(NSString *)name;
++ (std::string) builtKeyForName:(NSString *)name;
+- (const std::string &) entryPrefix;
+- (void) setBuilt:(BOOL)built;
+- (void) addEntriesForKey:(const leveldb::Slice &)key value:(id)value toSet:(std::set<std::string> *)entries;
+- (void) detach;
+@end
 
 namespace {
     class BatchIterator : public leveldb::WriteBatch::Handler {
@@ -54,6 +189,821 @@ namespace {
             deleteCallback(key);
         }
     };
+    
+    // Decoded entries of a shard, waiting to be handed to the caller of an ordered parallel scan
+    struct ShardBuffer {
+        std::mutex mu;
+        std::condition_variable cv;
+        std::deque<std::pair<NSData *, id> > entries;   // Retained keys and values
+        bool finished;
+        
+        ShardBuffer() : finished(false) {}
+    };
+    
+    struct SliceHash {
+        size_t operator()(const leveldb::Slice &slice) const {
+            // FNV-1a
+            uint64_t hash = 14695981039346656037ULL;
+            for (size_t i = 0; i < slice.size(); i++)
+                hash = (hash ^ (unsigned char)slice[i]) * 1099511628211ULL;
+            return (size_t)hash;
+        }
+    };
+    
+    /*
+     * A size-bounded cache of decoded objects, keyed by raw key bytes, split into shards with
+     * their own lock and LRU list. Costs are the sizes of keys and encoded values.
+     *
+     * Every invalidation bumps the generation of the shards it touches, and an object is only
+     * inserted if its shard's generation didn't change since the lookup that missed it, so that
+     * a value read before a write can't be cached after that write invalidated its key.
+     */
+    class ObjectCache {
+    public:
+        static const size_t kShards = 16;
+        
+        explicit ObjectCache(const leveldb::Comparator *comparator)
+            : comparator_(comparator), capacity_(0), hits_(0), misses_(0), evictions_(0) {}
+        ~ObjectCache() {
+            Clear();
+        }
+        
+        bool Enabled() const {
+            return capacity_.load(std::memory_order_relaxed) > 0;
+        }
+        
+        void SetCapacity(size_t capacity) {
+            capacity_ = capacity;
+            for (Shard &shard : shards_) {
+                std::lock_guard<std::mutex> lock(shard.mu);
+                Evict(shard, capacity / kShards);
+            }
+        }
+        
+        // Return the cached object (retained and autoreleased), or nil, along with the generation to insert with
+        id Lookup(const leveldb::Slice &key, uint64_t *generation) {
+            Shard &shard = ShardFor(key);
+            std::lock_guard<std::mutex> lock(shard.mu);
+            *generation = shard.generation;
+            auto found = shard.index.find(key);
+            if (found == shard.index.end()) {
+                misses_++;
+                return nil;
+            }
+            shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+            hits_++;
+            return [[found->second->object retain] autorelease];
+        }
+        
+        // Mutable containers can't be shared between callers, and are decoded anew on every read
+        static bool Shareable(id object) {
+            Class cls = [object classForKeyedArchiver];
+            return cls != [NSMutableArray class] && cls != [NSMutableDictionary class] && cls != [NSMutableSet class]
+                && cls != [NSMutableString class] && cls != [NSMutableData class];
+        }
+        
+        void Insert(const leveldb::Slice &key, id object, size_t valueSize, uint64_t generation) {
+            size_t cost = key.size() + valueSize;
+            size_t shardCapacity = capacity_.load(std::memory_order_relaxed) / kShards;
+            Shard &shard = ShardFor(key);
+            std::lock_guard<std::mutex> lock(shard.mu);
+            if (shard.generation != generation || cost > shardCapacity)
+                return;
+            Erase(shard, key);
+            shard.lru.push_front(Entry(key, [object retain], cost));
+            // The index points inside the list entry's key, which never moves
+            shard.index[leveldb::Slice(shard.lru.front().key)] = shard.lru.begin();
+            shard.size += cost;
+            Evict(shard, shardCapacity);
+        }
+        
+        void Invalidate(const leveldb::Slice &key) {
+            Shard &shard = ShardFor(key);
+            std::lock_guard<std::mutex> lock(shard.mu);
+            shard.generation++;
+            Erase(shard, key);
+        }
+        
+        // Invalidate every key of [start, limit), NULL bounds meaning the range is unbounded
+        void InvalidateRange(const leveldb::Slice *start, const leveldb::Slice *limit) {
+            for (Shard &shard : shards_) {
+                std::lock_guard<std::mutex> lock(shard.mu);
+                shard.generation++;
+                for (auto entry = shard.lru.begin(); entry != shard.lru.end(); ) {
+                    leveldb::Slice key(entry->key);
+                    auto next = std::next(entry);
+                    if ((!start || comparator_->Compare(key, *start) >= 0) && (!limit || comparator_->Compare(key, *limit) < 0))
+                        Erase(shard, key);
+                    entry = next;
+                }
+            }
+        }
+        
+        void InvalidateBatch(const leveldb::WriteBatch &batch) {
+            BatchIterator iterator;
+            iterator.putCallback = ^(const leveldb::Slice &key, const leveldb::Slice &value) {
+                Invalidate(key);
+            };
+            iterator.deleteCallback = ^(const leveldb::Slice &key) {
+                Invalidate(key);
+            };
+            batch.Iterate(&iterator);
+        }
+        
+        void Clear() {
+            InvalidateRange(NULL, NULL);
+        }
+        
+        LevelDBObjectCacheStatistics Statistics() {
+            LevelDBObjectCacheStatistics stats = {};
+            stats.hits = (NSUInteger)hits_.load();
+            stats.misses = (NSUInteger)misses_.load();
+            stats.evictions = (NSUInteger)evictions_.load();
+            for (Shard &shard : shards_) {
+                std::lock_guard<std::mutex> lock(shard.mu);
+                stats.count += shard.index.size();
+                stats.size += shard.size;
+            }
+            return stats;
+        }
+        
+    private:
+        struct Entry {
+            std::string key;
+            id object;      // Retained
+            size_t cost;
+            
+            Entry(const leveldb::Slice &k, id o, size_t c) : key(k.data(), k.size()), object(o), cost(c) {}
+        };
+        
+        struct Shard {
+            std::mutex mu;
+            std::list<Entry> lru;   // Most recently used first
+            std::unordered_map<leveldb::Slice, std::list<Entry>::iterator, SliceHash> index;
+            size_t size;
+            uint64_t generation;
+            
+            Shard() : size(0), generation(0) {}
+        };
+        
+        Shard &ShardFor(const leveldb::Slice &key) {
+            return shards_[SliceHash()(key) % kShards];
+        }
+        
+        void Erase(Shard &shard, const leveldb::Slice &key) {
+            auto found = shard.index.find(key);
+            if (found == shard.index.end())
+                return;
+            std::list<Entry>::iterator entry = found->second;
+            shard.index.erase(found);
+            shard.size -= entry->cost;
+            [entry->object release];
+            shard.lru.erase(entry);
+        }
+        
+        void Evict(Shard &shard, size_t shardCapacity) {
+            while (shard.size > shardCapacity && !shard.lru.empty()) {
+                Erase(shard, leveldb::Slice(shard.lru.back().key));
+                evictions_++;
+            }
+        }
+        
+        const leveldb::Comparator *comparator_;
+        std::atomic<size_t> capacity_;
+        std::atomic<uint64_t> hits_;
+        std::atomic<uint64_t> misses_;
+        std::atomic<uint64_t> evictions_;
+        Shard shards_[kShards];
+    };
+    
+    /*
+     * The change subscriptions of a database. While there is any, writes are committed one at a
+     * time and decoded right after, so that every subscriber gets changes in commit order. Without
+     * subscribers, writes go straight to leveldb, or to the blob store separating large values.
+     */
+    class ChangeFeed {
+    public:
+        ChangeFeed() : count_(0), decoder_(nil), blobs_(NULL) {}
+        ~ChangeFeed() {
+            DetachAll();
+            [decoder_ release];
+        }
+        
+        bool Active() const {
+            return count_.load(std::memory_order_acquire) > 0;
+        }
+        
+        void SetDecoder(LevelDBDecoderBlock decoder) {
+            std::lock_guard<std::mutex> lock(mu_);
+            [decoder_ release];
+            decoder_ = [decoder retain];
+        }
+        
+        // Set once the database is opened, and cleared before it is closed
+        void SetBlobStore(LDBBlobStore *blobs) {
+            blobs_ = blobs;
+        }
+        LDBBlobStore *Blobs() const {
+            return blobs_;
+        }
+        
+        void Add(LDBChangeSubscription *subscription) {
+            std::lock_guard<std::mutex> lock(mu_);
+            subscriptions_.push_back([subscription retain]);
+            count_++;
+        }
+        void Remove(LDBChangeSubscription *subscription) {
+            std::lock_guard<std::mutex> lock(mu_);
+            auto found = std::find(subscriptions_.begin(), subscriptions_.end(), subscription);
+            if (found == subscriptions_.end())
+                return;
+            subscriptions_.erase(found);
+            count_--;
+            [subscription release];
+        }
+        // Stop publishing to every subscriber, which still get the changes already published
+        void DetachAll() {
+            std::vector<LDBChangeSubscription *> subscriptions;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                subscriptions.swap(subscriptions_);
+                count_ = 0;
+            }
+            for (LDBChangeSubscription *subscription : subscriptions) {
+                [subscription detach];
+                [subscription release];
+            }
+        }
+        
+        // Commit a batch, publishing the changes of `published` instead if given
+        leveldb::Status Write(leveldb::DB *db, const leveldb::WriteOptions &options, leveldb::WriteBatch *batch,
+                              const leveldb::WriteBatch *published = NULL) {
+            if (!Active())
+                return Commit(db, options, batch);
+            std::lock_guard<std::mutex> lock(commitMu_);
+            leveldb::Status status = Commit(db, options, batch);
+            if (status.ok())
+                Publish(published ? *published : *batch);
+            return status;
+        }
+        leveldb::Status Put(leveldb::DB *db, const leveldb::WriteOptions &options,
+                            const leveldb::Slice &key, const leveldb::Slice &value) {
+            if (!Active())
+                return blobs_ ? blobs_->Put(db, options, key, value) : db->Put(options, key, value);
+            leveldb::WriteBatch batch;
+            batch.Put(key, value);
+            return Write(db, options, &batch);
+        }
+        leveldb::Status Delete(leveldb::DB *db, const leveldb::WriteOptions &options, const leveldb::Slice &key) {
+            if (!Active())
+                return blobs_ ? blobs_->Delete(db, options, key) : db->Delete(options, key);
+            leveldb::WriteBatch batch;
+            batch.Delete(key);
+            return Write(db, options, &batch);
+        }
+        
+    private:
+        // Subscribers are given the values written, not the pointers to their blobs
+        leveldb::Status Commit(leveldb::DB *db, const leveldb::WriteOptions &options, leveldb::WriteBatch *batch) {
+            return blobs_ ? blobs_->Write(db, options, batch) : db->Write(options, batch);
+        }
+        
+        void Publish(const leveldb::WriteBatch &batch) {
+            std::vector<LDBChangeSubscription *> subscriptions;
+            LevelDBDecoderBlock decoder;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                for (LDBChangeSubscription *subscription : subscriptions_)
+                    subscriptions.push_back([subscription retain]);
+                decoder = [[decoder_ retain] autorelease];
+            }
+            
+            std::vector<LDBChangeSubscription *> *subscriptionsPtr = &subscriptions;
+            BatchIterator iterator;
+            iterator.putCallback = ^(const leveldb::Slice &key, const leveldb::Slice &value) {
+                for (LDBChangeSubscription *subscription : *subscriptionsPtr)
+                    [subscription appendChange:YES key:key value:value];
+            };
+            iterator.deleteCallback = ^(const leveldb::Slice &key) {
+                for (LDBChangeSubscription *subscription : *subscriptionsPtr)
+                    [subscription appendChange:NO key:key value:leveldb::Slice()];
+            };
+            batch.Iterate(&iterator);
+            
+            for (LDBChangeSubscription *subscription : subscriptions) {
+                [subscription flushWithDecoder:decoder];
+                [subscription release];
+            }
+        }
+        
+        std::atomic<size_t> count_;
+        std::mutex mu_;
+        std::mutex commitMu_;
+        std::vector<LDBChangeSubscription *> subscriptions_;    // Retained
+        LevelDBDecoderBlock decoder_;
+        LDBBlobStore *blobs_;
+    };
+    
+    /*
+     * The secondary indexes of a database, standing between writes and the change feed. While there
+     * is any, writes are committed one at a time, along with the index entries they add and remove:
+     * those of the values they replace (read from the database, or from earlier in the same batch)
+     * that their new values don't have, and the other way around.
+     */
+    class IndexSet {
+    public:
+        explicit IndexSet(ChangeFeed *feed) : feed_(feed), count_(0), decoder_(nil) {}
+        ~IndexSet() {
+            for (auto &entry : indexes_) {
+                [entry.second detach];
+                [entry.second release];
+            }
+            [decoder_ release];
+        }
+        
+        bool Active() const {
+            return count_.load(std::memory_order_acquire) > 0;
+        }
+        
+        void SetDecoder(LevelDBDecoderBlock decoder) {
+            std::lock_guard<std::mutex> lock(mu_);
+            [decoder_ release];
+            decoder_ = [decoder retain];
+        }
+        
+        // Add an index, replacing (and detaching) any index with the same name
+        void Add(LDBIndex *index) {
+            LDBIndex *replaced;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                LDBIndex *&slot = indexes_[[index entryPrefix]];
+                replaced = slot;
+                slot = [index retain];
+                count_ = indexes_.size();
+            }
+            [replaced detach];
+            [replaced release];
+        }
+        LDBIndex *Find(NSString *name) {
+            std::lock_guard<std::mutex> lock(mu_);
+            auto found = indexes_.find([LDBIndex entryPrefixForName:name]);
+            return found == indexes_.end() ? nil : [[found->second retain] autorelease];
+        }
+        void Remove(NSString *name) {
+            LDBIndex *removed = nil;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                auto found = indexes_.find([LDBIndex entryPrefixForName:name]);
+                if (found == indexes_.end())
+                    return;
+                removed = found->second;
+                indexes_.erase(found);
+                count_ = indexes_.size();
+            }
+            [removed detach];
+            [removed release];
+        }
+        
+        // Held while committing indexed writes, and by builds while they index a batch of keys
+        std::mutex &CommitMutex() {
+            return commitMu_;
+        }
+        
+        leveldb::Status Write(leveldb::DB *db, const leveldb::WriteOptions &options, leveldb::WriteBatch *batch) {
+            if (!Active())
+                return feed_->Write(db, options, batch);
+            std::lock_guard<std::mutex> lock(commitMu_);
+            leveldb::WriteBatch indexed(*batch);
+            leveldb::Status status = AppendEntries(db, *batch, &indexed);
+            if (!status.ok())
+                return status;
+            // Subscribers get the writes they were given, without their index entries
+            return feed_->Write(db, options, &indexed, batch);
+        }
+        leveldb::Status Put(leveldb::DB *db, const leveldb::WriteOptions &options,
+                            const leveldb::Slice &key, const leveldb::Slice &value) {
+            if (!Active())
+                return feed_->Put(db, options, key, value);
+            leveldb::WriteBatch batch;
+            batch.Put(key, value);
+            return Write(db, options, &batch);
+        }
+        leveldb::Status Delete(leveldb::DB *db, const leveldb::WriteOptions &options, const leveldb::Slice &key) {
+            if (!Active())
+                return feed_->Delete(db, options, key);
+            leveldb::WriteBatch batch;
+            batch.Delete(key);
+            return Write(db, options, &batch);
+        }
+        
+    private:
+        struct Indexing {
+            leveldb::DB *db;
+            LDBBlobStore *blobs;
+            std::vector<LDBIndex *> indexes;
+            LevelDBDecoderBlock decoder;
+            // The entries of the keys written earlier in the batch
+            std::unordered_map<std::string, std::set<std::string> > latest;
+            leveldb::WriteBatch *indexed;
+            leveldb::Status status;
+        };
+        
+        leveldb::Status AppendEntries(leveldb::DB *db, const leveldb::WriteBatch &batch, leveldb::WriteBatch *indexed) {
+            LDBBlobReadGuard blobReads(feed_->Blobs());
+            Indexing indexing;
+            indexing.db = db;
+            indexing.blobs = feed_->Blobs();
+            indexing.indexed = indexed;
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                for (auto &entry : indexes_)
+                    indexing.indexes.push_back([entry.second retain]);
+                indexing.decoder = [[decoder_ retain] autorelease];
+            }
+            
+            Indexing *indexingPtr = &indexing;
+            BatchIterator iterator;
+            iterator.putCallback = ^(const leveldb::Slice &key, const leveldb::Slice &value) {
+                Index(indexingPtr, key, &value);
+            };
+            iterator.deleteCallback = ^(const leveldb::Slice &key) {
+                Index(indexingPtr, key, NULL);
+            };
+            batch.Iterate(&iterator);
+            
+            for (LDBIndex *index : indexing.indexes)
+                [index release];
+            return indexing.status;
+        }
+        
+        // Index the put of `value` at `key`, or its deletion if `value` is NULL
+        static void Index(Indexing *indexing, const leveldb::Slice &key, const leveldb::Slice *value) {
+            if (!indexing->status.ok() || key.starts_with(kLDBReservedKeyPrefix))
+                return;
+            
+            @autoreleasepool {
+                LevelDBKey lkey = GenericKeyFromSlice(key);
+                std::string keyString = key.ToString();
+                std::set<std::string> removed, added;
+                
+                auto written = indexing->latest.find(keyString);
+                if (written != indexing->latest.end()) {
+                    removed.swap(written->second);
+                } else {
+                    std::string previous;
+                    leveldb::Status status = indexing->db->Get(leveldb::ReadOptions(), key, &previous);
+                    if (!status.ok() && !status.IsNotFound()) {
+                        indexing->status = status;
+                        return;
+                    }
+                    if (status.ok()) {
+                        id object = (indexing->blobs && LDBBlobStore::IsPointer(previous))
+                            ? DecodeBlob(indexing->blobs, previous, &lkey, indexing->decoder)
+                            : DecodeFromString(previous, &lkey, indexing->decoder);
+                        for (LDBIndex *index : indexing->indexes)
+                            [index addEntriesForKey:key value:object toSet:&removed];
+                    }
+                }
+                if (value != NULL) {
+                    id object = DecodeFromSlice((*value), &lkey, indexing->decoder);
+                    for (LDBIndex *index : indexing->indexes)
+                        [index addEntriesForKey:key value:object toSet:&added];
+                }
+                
+                for (const std::string &entry : removed) {
+                    if (added.count(entry) == 0)
+                        indexing->indexed->Delete(entry);
+                }
+                for (const std::string &entry : added) {
+                    if (removed.count(entry) == 0)
+                        indexing->indexed->Put(entry, leveldb::Slice());
+                }
+                indexing->latest[keyString].swap(added);
+            }
+        }
+        
+        ChangeFeed *feed_;
+        std::atomic<size_t> count_;
+        std::mutex mu_;
+        std::mutex commitMu_;
+        std::map<std::string, LDBIndex *> indexes_;     // Retained, by entry prefix
+        LevelDBDecoderBlock decoder_;
+    };
+    
+    // A write waiting to be committed by a WriteCombiner
+    struct PendingWrite {
+        leveldb::WriteBatch batch;
+        bool sync;
+        bool done;
+        leveldb::Status status;
+        void (^completion)(NSError *error);   // Only set (and copied) for asynchronous writes
+        std::chrono::steady_clock::time_point enqueued;
+        
+        PendingWrite() : sync(false), done(false), completion(nil) {}
+    };
+    
+    /*
+     * Coalesce writes from every thread into a single leveldb::WriteBatch, committed (with a
+     * single sync if any of its writes asked for one) once the group reaches `maxBytes`, or
+     * once its oldest write has been waiting for `latency`. Groups are committed one at a time,
+     * on a serial queue.
+     */
+    class WriteCombiner {
+    public:
+        WriteCombiner(leveldb::DB *db, ObjectCache *cache, IndexSet *indexes, size_t maxBytes, double latency)
+        : db_(db), cache_(cache), indexes_(indexes), maxBytes_(maxBytes), latency_(latency), pendingBytes_(0),
+          lastGroupSize_(0), committing_(false) {
+            queue_ = dispatch_queue_create("com.matehat.leveldb.writecombiner", DISPATCH_QUEUE_SERIAL);
+        }
+        ~WriteCombiner() {
+            Drain();
+            dispatch_release(queue_);
+        }
+        
+        void SetLimits(size_t maxBytes, double latency) {
+            std::lock_guard<std::mutex> lock(mu_);
+            maxBytes_ = maxBytes;
+            latency_ = latency;
+            groupCv_.notify_one();
+        }
+        
+        // Block until the write is committed, and return its status
+        leveldb::Status Write(PendingWrite *write) {
+            std::unique_lock<std::mutex> lock(mu_);
+            Enqueue(write);
+            doneCv_.wait(lock, [write] { return write->done; });
+            return write->status;
+        }
+        
+        // Take ownership of the write, and call its completion block once it is committed
+        void WriteAsync(PendingWrite *write) {
+            std::lock_guard<std::mutex> lock(mu_);
+            Enqueue(write);
+        }
+        
+        // Block until every pending write is committed
+        void Drain() {
+            std::unique_lock<std::mutex> lock(mu_);
+            doneCv_.wait(lock, [this] { return pending_.empty() && !committing_; });
+        }
+        
+        // Whether writes are queued or being committed, which a write bypassing the combiner must not overtake
+        bool Busy() {
+            std::lock_guard<std::mutex> lock(mu_);
+            return !pending_.empty() || committing_;
+        }
+        
+    private:
+        void Enqueue(PendingWrite *write) {
+            write->enqueued = std::chrono::steady_clock::now();
+            pending_.push_back(write);
+            pendingBytes_ += write->batch.ApproximateSize();
+            if (!committing_) {
+                committing_ = true;
+                dispatch_async_f(queue_, this, &WriteCombiner::CommitLoop);
+            } else if (pendingBytes_ >= maxBytes_) {
+                groupCv_.notify_one();
+            }
+        }
+        
+        static void CommitLoop(void *context) {
+            WriteCombiner *combiner = static_cast<WriteCombiner *>(context);
+            @autoreleasepool {
+                combiner->CommitPending();
+            }
+        }
+        
+        void CommitPending() {
+            std::unique_lock<std::mutex> lock(mu_);
+            while (!pending_.empty()) {
+                // A lone writer doesn't wait for a group: only writes queued together, or right after a group, do
+                if (pending_.size() > 1 || lastGroupSize_ > 1) {
+                    auto deadline = pending_.front()->enqueued
+                        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(latency_));
+                    groupCv_.wait_until(lock, deadline, [this] { return pendingBytes_ >= maxBytes_; });
+                }
+                
+                std::deque<PendingWrite *> group;
+                group.swap(pending_);
+                pendingBytes_ = 0;
+                lastGroupSize_ = group.size();
+                lock.unlock();
+                
+                leveldb::WriteBatch combined;
+                leveldb::WriteOptions options;
+                for (PendingWrite *write : group) {
+                    combined.Append(write->batch);
+                    options.sync = options.sync || write->sync;
+                }
+                leveldb::Status status = indexes_->Write(db_, options, &combined);
+                if (cache_->Enabled())
+                    cache_->InvalidateBatch(combined);
+                
+                std::vector<PendingWrite *> asyncWrites;
+                lock.lock();
+                for (PendingWrite *write : group) {
+                    write->status = status;
+                    write->done = true;
+                    if (write->completion != nil)
+                        asyncWrites.push_back(write);
+                }
+                doneCv_.notify_all();
+                lock.unlock();
+                
+                NSError *error = status.ok() ? nil : NSErrorFromLevelDBStatus(status);
+                for (PendingWrite *write : asyncWrites) {
+                    void (^completion)(NSError *) = write->completion;
+                    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                        completion(error);
+                    });
+                    [completion release];
+                    delete write;
+                }
+                lock.lock();
+            }
+            committing_ = false;
+            doneCv_.notify_all();
+        }
+        
+        leveldb::DB *db_;
+        ObjectCache *cache_;
+        IndexSet *indexes_;
+        size_t maxBytes_;
+        double latency_;
+        
+        std::mutex mu_;
+        std::condition_variable groupCv_;
+        std::condition_variable doneCv_;
+        std::deque<PendingWrite *> pending_;
+        size_t pendingBytes_;
+        size_t lastGroupSize_;
+        bool committing_;
+        dispatch_queue_t queue_;
+    };
+    
+    /*
+     * Count deletions per range of keys sharing their first bytes, and writes of any kind, so that
+     * background compactions can tell which ranges are full of deletion markers, and whether the
+     * database has been idle. Nothing is counted unless enabled.
+     */
+    class DeletionTracker {
+    public:
+        struct Range {
+            std::string smallest, largest;      // Inclusive bounds
+            bool unboundedStart, unboundedEnd;
+            uint64_t deletions;
+            
+            Range() : unboundedStart(false), unboundedEnd(false), deletions(0) {}
+        };
+        
+        DeletionTracker() : enabled_(false), writes_(0) {}
+        
+        bool Enabled() const {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+        void SetEnabled(bool enabled) {
+            enabled_.store(enabled, std::memory_order_relaxed);
+        }
+        
+        void RecordWrite() {
+            writes_.fetch_add(1, std::memory_order_relaxed);
+        }
+        uint64_t Writes() const {
+            return writes_.load(std::memory_order_relaxed);
+        }
+        
+        void RecordDelete(const leveldb::Slice &key) {
+            RecordRange(&key, &key, 1);
+        }
+        
+        // Record deletions in [start, end], either bound being unbounded if NULL
+        void RecordRange(const leveldb::Slice *start, const leveldb::Slice *end, uint64_t deletions) {
+            RecordWrite();
+            Range range;
+            range.unboundedStart = (start == NULL);
+            range.unboundedEnd = (end == NULL);
+            if (start) range.smallest = start->ToString();
+            if (end) range.largest = end->ToString();
+            range.deletions = deletions;
+            Merge(range);
+        }
+        
+        void RecordBatch(const leveldb::WriteBatch &batch) {
+            BatchIterator iterator;
+            iterator.putCallback = ^(const leveldb::Slice &key, const leveldb::Slice &value) {
+                RecordWrite();
+            };
+            iterator.deleteCallback = ^(const leveldb::Slice &key) {
+                RecordDelete(key);
+            };
+            batch.Iterate(&iterator);
+        }
+        
+        // Remove and return the ranges with at least `threshold` deletions
+        std::vector<Range> Take(uint64_t threshold) {
+            std::vector<Range> taken;
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto it = ranges_.begin(); it != ranges_.end(); ) {
+                if (it->second.deletions >= threshold) {
+                    taken.push_back(it->second);
+                    it = ranges_.erase(it);
+                } else
+                    it++;
+            }
+            return taken;
+        }
+        
+        // Put back a range taken but not compacted
+        void Restore(const Range &range) {
+            Merge(range);
+        }
+        
+    private:
+        void Merge(const Range &range) {
+            // Ranges are bucketed by the first bytes of their start, the whole database having a bucket of its own
+            static const std::string kWholeDatabase(kDeletionRangePrefixLength + 1, '\xff');
+            std::string bucket = range.unboundedStart ? kWholeDatabase
+                                                      : range.smallest.substr(0, kDeletionRangePrefixLength);
+            
+            std::lock_guard<std::mutex> lock(mu_);
+            if (ranges_.size() >= kMaxDeletionRanges && ranges_.find(bucket) == ranges_.end())
+                bucket = kWholeDatabase;
+            
+            Range &tracked = ranges_[bucket];
+            if (bucket == kWholeDatabase) {
+                tracked.unboundedStart = tracked.unboundedEnd = true;
+            } else if (tracked.deletions == 0) {
+                tracked.smallest = range.smallest;
+                tracked.largest = range.largest;
+                tracked.unboundedEnd = range.unboundedEnd;
+            } else {
+                if (range.smallest < tracked.smallest)
+                    tracked.smallest = range.smallest;
+                if (range.unboundedEnd)
+                    tracked.unboundedEnd = true;
+                else if (range.largest > tracked.largest)
+                    tracked.largest = range.largest;
+            }
+            tracked.deletions += range.deletions;
+        }
+        
+        std::atomic<bool> enabled_;
+        std::atomic<uint64_t> writes_;
+        std::mutex mu_;
+        std::map<std::string, Range> ranges_;
+    };
+    
+    /*
+     * A bloom filter holding the first `prefixLength` bytes of every key along with the whole key, so
+     * that point lookups skip tables holding no key with the same prefix, before probing for the key.
+     */
+    class PrefixBloomFilterPolicy : public leveldb::FilterPolicy {
+    public:
+        PrefixBloomFilterPolicy(int bitsPerKey, size_t prefixLength)
+            : bloom_(leveldb::NewBloomFilterPolicy(bitsPerKey)), prefixLength_(prefixLength) {
+            std::ostringstream name;
+            name << "objective-leveldb.PrefixBloomFilter." << prefixLength;
+            name_ = name.str();
+        }
+        ~PrefixBloomFilterPolicy() {
+            delete bloom_;
+        }
+        
+        const char * Name() const {
+            return name_.c_str();
+        }
+        
+        // Keys come sorted, so a prefix is only added once per run of keys sharing it
+        void CreateFilter(const leveldb::Slice *keys, int n, std::string *dst) const {
+            std::vector<leveldb::Slice> entries;
+            entries.reserve(2 * n);
+            leveldb::Slice last;
+            bool hasLast = false;
+            for (int i = 0; i < n; i++) {
+                if (keys[i].size() >= prefixLength_) {
+                    leveldb::Slice prefix(keys[i].data(), prefixLength_);
+                    if (!hasLast || prefix != last) {
+                        entries.push_back(prefix);
+                        last = prefix;
+                        hasLast = true;
+                    }
+                }
+                entries.push_back(keys[i]);
+            }
+            bloom_->CreateFilter(entries.data(), (int)entries.size(), dst);
+        }
+        
+        bool KeyMayMatch(const leveldb::Slice &key, const leveldb::Slice &filter) const {
+            if (key.size() >= prefixLength_ && !bloom_->KeyMayMatch(leveldb::Slice(key.data(), prefixLength_), filter))
+                return false;
+            return bloom_->KeyMayMatch(key, filter);
+        }
+        
+    private:
+        const leveldb::FilterPolicy *bloom_;
+        size_t prefixLength_;
+        std::string name_;
+    };
 }
 
 NSString * NSStringFromLevelDBKey(LevelDBKey * key) {
@@ -65,6 +1015,282 @@ NSData   * NSDataFromLevelDBKey(LevelDBKey * key) {
     return [NSData dataWithBytes:key->data length:key->length];
 }
 
+@implementation LDBStringData {
+    std::string _string;
+}
+
++ (instancetype) dataWithString:(std::string *)string {
+    LDBStringData *data = [[[self alloc] init] autorelease];
+    data->_string.swap(*string);
+    return data;
+}
+- (const void *) bytes {
+    return _string.data();
+}
+- (NSUInteger) length {
+    return _string.size();
+}
+
+@end
+
+static NSError * ClosedDatabaseError() {
+    return NSErrorFromLevelDBStatus(leveldb::Status::IOError("The database is closed"));
+}
+
+static NSError * CancelledError() {
+    return [NSError errorWithDomain:kLevelDBErrorDomain
+                               code:LevelDBErrorCancelled
+                           userInfo:@{ NSLocalizedDescriptionKey: @"The operation was cancelled" }];
+}
+
+bool PrefixUpperBound(const leveldb::Slice &prefix, std::string *limit) {
+    limit->assign(prefix.data(), prefix.size());
+    while (!limit->empty()) {
+        unsigned char c = (unsigned char)limit->back();
+        if (c < 0xff) {
+            (*limit)[limit->size() - 1] = (char)(c + 1);
+            return true;
+        }
+        limit->resize(limit->size() - 1);
+    }
+    return false;
+}
+
+namespace {
+    class UserKeyIterator : public leveldb::Iterator {
+    public:
+        UserKeyIterator(leveldb::Iterator *iter, bool contiguous) : iter_(iter), contiguous_(contiguous) {
+            PrefixUpperBound(kLDBReservedKeyPrefix, &reservedLimit_);
+        }
+        virtual ~UserKeyIterator() {
+            delete iter_;
+        }
+        
+        virtual bool Valid() const { return iter_->Valid(); }
+        virtual void SeekToFirst() { iter_->SeekToFirst(); SkipForward(); }
+        virtual void SeekToLast() { iter_->SeekToLast(); SkipBackward(); }
+        virtual void Seek(const leveldb::Slice &target) { iter_->Seek(target); SkipForward(); }
+        virtual void Next() { iter_->Next(); SkipForward(); }
+        virtual void Prev() { iter_->Prev(); SkipBackward(); }
+        virtual leveldb::Slice key() const { return iter_->key(); }
+        virtual leveldb::Slice value() const { return iter_->value(); }
+        virtual leveldb::Status status() const { return iter_->status(); }
+        
+    private:
+        bool Reserved() const {
+            return iter_->Valid() && iter_->key().starts_with(kLDBReservedKeyPrefix);
+        }
+        // Other comparators may not keep reserved keys together, which are then stepped over one at a time
+        void SkipForward() {
+            if (contiguous_ && Reserved())
+                iter_->Seek(reservedLimit_);
+            while (Reserved())
+                iter_->Next();
+        }
+        void SkipBackward() {
+            if (contiguous_ && Reserved()) {
+                iter_->Seek(kLDBReservedKeyPrefix);
+                if (iter_->Valid())
+                    iter_->Prev();
+                else
+                    iter_->SeekToLast();
+            }
+            while (Reserved())
+                iter_->Prev();
+        }
+        
+        leveldb::Iterator *iter_;
+        const bool contiguous_;
+        std::string reservedLimit_;
+    };
+}
+
+leveldb::Iterator * NewUserKeyIterator(leveldb::Iterator *iter, const leveldb::Comparator *comparator) {
+    return new UserKeyIterator(iter, comparator == leveldb::BytewiseComparator());
+}
+
+static uint64_t ReadBigEndian64(const std::string &key, size_t offset) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8; i++) {
+        unsigned char c = (offset + i < key.size()) ? (unsigned char)key[offset + i] : 0;
+        value = (value << 8) | c;
+    }
+    return value;
+}
+
+/*
+ * Split [start, limit) into at most `shards` contiguous ranges holding roughly the same amount
+ * of data on disk, and return the keys separating them.
+ *
+ * Candidate split keys are interpolated between `start` and `limit` (on the 8 bytes following
+ * their common prefix), then grouped greedily according to `GetApproximateSizes`. If nothing
+ * has been written to tables yet, candidates are spread evenly instead. Interpolated keys are
+ * only ordered in bytewise order, so the range isn't split under any other comparator.
+ */
+static std::vector<std::string> ShardSplitKeys(leveldb::DB *db,
+                                               const leveldb::Comparator *comparator,
+                                               const std::string &start,
+                                               const std::string *limit,
+                                               size_t shards) {
+    std::vector<std::string> splits;
+    if (shards <= 1 || comparator != leveldb::BytewiseComparator())
+        return splits;
+    
+    size_t common = 0;
+    if (limit)
+        while (common < start.size() && common < limit->size() && start[common] == (*limit)[common])
+            common++;
+    
+    uint64_t low = ReadBigEndian64(start, common);
+    uint64_t high = limit ? ReadBigEndian64(*limit, common) : UINT64_MAX;
+    if (high <= low + 1)
+        return splits;
+    
+    // (high - low) * i / pieces, split into quotient and remainder so that it can't overflow 64 bits
+    uint64_t pieces = (uint64_t)shards * kParallelScanSamplesPerShard;
+    uint64_t step = (high - low) / pieces, remainder = (high - low) % pieces;
+    std::vector<std::string> candidates;
+    for (uint64_t i = 1; i < pieces; i++) {
+        uint64_t point = low + step * i + remainder * i / pieces;
+        std::string key = start.substr(0, common);
+        for (int shift = 56; shift >= 0; shift -= 8)
+            key.push_back((char)((point >> shift) & 0xff));
+        
+        const std::string &previous = candidates.empty() ? start : candidates.back();
+        if (leveldb::Slice(key).compare(previous) > 0 && (!limit || leveldb::Slice(key).compare(*limit) < 0))
+            candidates.push_back(key);
+    }
+    if (candidates.empty())
+        return splits;
+    
+    std::string end = limit ? *limit : std::string(common + 9, '\xff');
+    std::vector<leveldb::Range> ranges;
+    for (size_t i = 0; i <= candidates.size(); i++) {
+        ranges.push_back(leveldb::Range(i == 0 ? start : candidates[i - 1],
+                                        i == candidates.size() ? end : candidates[i]));
+    }
+    std::vector<uint64_t> sizes(ranges.size());
+    db->GetApproximateSizes(ranges.data(), (int)ranges.size(), sizes.data());
+    
+    uint64_t total = 0;
+    for (uint64_t size : sizes)
+        total += size;
+    
+    if (total == 0) {
+        for (size_t shard = 1; shard < shards; shard++) {
+            size_t index = (ranges.size() * shard) / shards - 1;
+            if (index < candidates.size() && (splits.empty() || splits.back() != candidates[index]))
+                splits.push_back(candidates[index]);
+        }
+        return splits;
+    }
+    
+    uint64_t accumulated = 0;
+    size_t shard = 1;
+    for (size_t i = 0; i < candidates.size() && shard < shards; i++) {
+        accumulated += sizes[i];
+        if (accumulated >= (total * shard) / shards) {
+            splits.push_back(candidates[i]);
+            while (shard < shards && accumulated >= (total * shard) / shards)
+                shard++;
+        }
+    }
+    return splits;
+}
+
+/*
+ * Visit every key in [start, limit) through its own iterator, until the range is exhausted,
+ * the visitor stops, or another shard raised the shared `stop` flag.
+ */
+static void ScanShard(leveldb::DB *db,
+                      const leveldb::Comparator *comparator,
+                      const leveldb::ReadOptions &options,
+                      const leveldb::Slice &start,
+                      const leveldb::Slice *limit,
+                      std::atomic<bool> *stop,
+                      void (^visit)(const leveldb::Slice &key, const leveldb::Slice &value, BOOL *stop)) {
+    
+    leveldb::Iterator *iter = NewUserKeyIterator(db->NewIterator(options), comparator);
+    iter->Seek(start);
+    
+    bool done = false;
+    while (!done) {
+        @autoreleasepool {
+            for (NSUInteger i = 0; i < kParallelScanPoolSize; i++) {
+                if (!iter->Valid() || stop->load(std::memory_order_relaxed)
+                    || (limit && comparator->Compare(iter->key(), *limit) >= 0)) {
+                    done = true;
+                    break;
+                }
+                BOOL shouldStop = NO;
+                visit(iter->key(), iter->value(), &shouldStop);
+                if (shouldStop) {
+                    stop->store(true);
+                    done = true;
+                    break;
+                }
+                iter->Next();
+            }
+        }
+    }
+    
+    if (!iter->status().ok())
+        NSLog(@"Problem scanning a range of keys from database: %s", iter->status().ToString().c_str());
+    delete iter;
+}
+
+/*
+ * Position the iterator on the first key within the bounds of a key predicate, in the direction
+ * of enumeration.
+ */
+static void SeekToKeyPredicate(leveldb::Iterator *iter,
+                               const leveldb::Comparator *comparator,
+                               LDBKeyPredicate *predicate,
+                               BOOL backward) {
+    NSData *lower = predicate.lowerBound, *upper = predicate.upperBound;
+    if (!backward) {
+        if (lower == nil) {
+            iter->SeekToFirst();
+            return;
+        }
+        leveldb::Slice bound = SliceFromData(lower);
+        iter->Seek(bound);
+        if (iter->Valid() && !predicate.lowerBoundInclusive && iter->key() == bound)
+            iter->Next();
+    } else {
+        if (upper == nil) {
+            iter->SeekToLast();
+            return;
+        }
+        leveldb::Slice bound = SliceFromData(upper);
+        iter->Seek(bound);
+        if (!iter->Valid()) {
+            iter->SeekToLast();
+            return;
+        }
+        int cmp = comparator->Compare(iter->key(), bound);
+        if (cmp > 0 || (cmp == 0 && !predicate.upperBoundInclusive))
+            iter->Prev();
+    }
+}
+
+/*
+ * Whether a key lies beyond the bound of a key predicate the enumeration moves towards, in which
+ * case no further key can match.
+ */
+static bool PastKeyPredicateBounds(const leveldb::Slice &key,
+                                   const leveldb::Comparator *comparator,
+                                   LDBKeyPredicate *predicate,
+                                   BOOL backward) {
+    NSData *bound = backward ? predicate.lowerBound : predicate.upperBound;
+    if (bound == nil)
+        return false;
+    int cmp = comparator->Compare(key, SliceFromData(bound));
+    if (backward)
+        return cmp < 0 || (cmp == 0 && !predicate.lowerBoundInclusive);
+    return cmp > 0 || (cmp == 0 && !predicate.upperBoundInclusive);
+}
+
 NSString * getLibraryPath() {
     NSArray *paths = NSSearchPathForDirectoriesInDomains(NSLibraryDirectory, NSUserDomainMask, YES);
     return [paths objectAtIndex:0];
@@ -76,6 +1302,22 @@ NSString * const kLevelDBChangeTypeDelete   = @"del";
 NSString * const kLevelDBChangeValue        = @"value";
 NSString * const kLevelDBChangeKey          = @"key";
 
+NSString * const kLevelDBErrorDomain        = @"LevelDBErrorDomain";
+
+NSError * NSErrorFromLevelDBStatus(const leveldb::Status &status) {
+    LevelDBErrorCode code = LevelDBErrorUnknown;
+    if (status.IsNotFound())
+        code = LevelDBErrorNotFound;
+    else if (status.IsCorruption())
+        code = LevelDBErrorCorruption;
+    else if (status.IsIOError())
+        code = LevelDBErrorIO;
+    
+    return [NSError errorWithDomain:kLevelDBErrorDomain
+                               code:code
+                           userInfo:@{ NSLocalizedDescriptionKey: @(status.ToString().c_str()) }];
+}
+
 LevelDBOptions MakeLevelDBOptions() {
     return (LevelDBOptions) {true, true, false, false, true, 0, 0};
 }
@@ -83,19 +1325,51 @@ LevelDBOptions MakeLevelDBOptions() {
 @interface LDBSnapshot ()
 + (id) snapshotFromDB:(LevelDB *)database;
 - (const leveldb::Snapshot *) getSnapshot;
+- (void) databaseWillClose;
+@end
+
+@interface LDBCursor ()
++ (instancetype) cursorForDB:(LevelDB *)db
+                    iterator:(leveldb::Iterator *)iter
+                    snapshot:(LDBSnapshot *)snapshot
+                  lowerBound:(NSData *)lowerBound
+                  upperBound:(NSData *)upperBound;
+- (void) pinBlobs:(LDBBlobStore *)blobs epoch:(uint64_t)epoch;
+- (void) databaseWillClose;
+@end
+
+@interface LDBKeyspace ()
++ (instancetype) keyspaceWithDB:(LevelDB *)db prefix:(NSData *)prefix;
 @end
 
 @interface LDBWritebatch ()
 + (instancetype) writeBatchFromDB:(id)db;
-- (leveldb::WriteBatch) writeBatch;
++ (instancetype) writeBatchFromDB:(id)db mode:(LDBWritebatchMode)mode;
+- (void) performWithWriteBatch:(void (^)(leveldb::WriteBatch *batch))block;
 @end
 
 @interface LevelDB () {
     leveldb::DB *db;
+    LDBInFlightTracker *inFlight;
+    std::mutex closeMu;
+    std::mutex resourcesMu;
+    std::unordered_set<id> openResources;     // Snapshots and cursors, not retained
     leveldb::ReadOptions readOptions;
     leveldb::WriteOptions writeOptions;
-    const leveldb::Cache *cache;
+    LDBCache *blockCache;
     const leveldb::FilterPolicy *filterPolicy;
+    const leveldb::Comparator *comparator;
+    WriteCombiner *writeCombiner;
+    ObjectCache *objectCache;
+    ChangeFeed *changeFeed;
+    IndexSet *indexSet;
+    LDBLatencyRecorder *latencyRecorder;
+    DeletionTracker *deletionTracker;
+    LDBBlobStore *blobStore;                  // NULL unless values were ever separated
+    dispatch_queue_t compactionQueue;
+    dispatch_source_t compactionTimer;
+    std::atomic<bool> compactionCancelled;
+    uint64_t idleCheckWrites, idleCheckCompactionBytes;
 }
 
 @property (nonatomic, readonly) leveldb::DB * db;
@@ -115,6 +1389,9 @@ LevelDBOptions MakeLevelDBOptions() {
     return [self initWithPath:path name:name andOptions:opts];
 }
 - (id) initWithPath:(NSString *)path name:(NSString *)name andOptions:(LevelDBOptions)opts {
+    return [self initWithPath:path name:name options:[LDBOptions optionsWithLevelDBOptions:opts]];
+}
+- (id) initWithPath:(NSString *)path name:(NSString *)name options:(LDBOptions *)opts {
     self = [super init];
     if (self) {
         _name = [name retain];
@@ -123,17 +1400,29 @@ LevelDBOptions MakeLevelDBOptions() {
         leveldb::Options options;
         
         options.create_if_missing = opts.createIfMissing;
-        options.paranoid_checks = opts.paranoidCheck;
+        options.paranoid_checks = opts.paranoidChecks;
         options.error_if_exists = opts.errorIfExists;
+        options.reuse_logs = opts.reuseLogs;
         
         if (!opts.compression)
             options.compression = leveldb::kNoCompression;
         
-        if (opts.cacheSize > 0) {
-            options.block_cache = leveldb::NewLRUCache(opts.cacheSize);
-            cache = options.block_cache;
-        } else
-            readOptions.fill_cache = false;
+        options.block_size = opts.blockSize;
+        options.block_restart_interval = opts.blockRestartInterval;
+        options.max_file_size = opts.maxFileSize;
+        options.write_buffer_size = opts.writeBufferSize;
+        options.max_open_files = opts.maxOpenFiles;
+        if (opts.env != NULL)
+            options.env = opts.env;
+        comparator = opts.comparator != NULL ? opts.comparator : leveldb::BytewiseComparator();
+        options.comparator = comparator;
+        
+        // Without a configured cache, one the size of leveldb's default is created, so that its usage can be reported
+        if (opts.blockCache != nil)
+            blockCache = [opts.blockCache retain];
+        else
+            blockCache = [[LDBCache cacheWithCapacity:opts.cacheSize > 0 ? opts.cacheSize : kDefaultBlockCacheSize] retain];
+        options.block_cache = [blockCache cache];
         
         if (opts.createIntermediateDirectories) {
             NSFileManager *fm = [NSFileManager defaultManager];
@@ -144,42 +1433,63 @@ LevelDBOptions MakeLevelDBOptions() {
                                           attributes:nil
                                                error:&crError];
             if (!success) {
-                [_name release];
-                [_path release];
                 NSLog(@"Problem creating parent directory: %@", crError);
+                [self release];
                 return nil;
             }
         }
         
         if (opts.filterPolicy > 0) {
-            filterPolicy = leveldb::NewBloomFilterPolicy(opts.filterPolicy);;
+            if (opts.prefixFilterLength > 0)
+                filterPolicy = new PrefixBloomFilterPolicy(opts.filterPolicy, opts.prefixFilterLength);
+            else
+                filterPolicy = leveldb::NewBloomFilterPolicy(opts.filterPolicy);
             options.filter_policy = filterPolicy;
         }
+        inFlight = new LDBInFlightTracker();
         leveldb::Status status = leveldb::DB::Open(options, [_path UTF8String], &db);
         
-        readOptions.fill_cache = true;
-        writeOptions.sync = false;
+        readOptions.fill_cache = opts.fillCache;
+        readOptions.verify_checksums = opts.verifyChecksums;
+        writeOptions.sync = opts.sync;
+        
+        _writeGroupSize = kWriteGroupSize;
+        _writeGroupLatency = kWriteGroupLatency;
+        objectCache = new ObjectCache(comparator);
+        changeFeed = new ChangeFeed();
+        indexSet = new IndexSet(changeFeed);
+        _executor = [[LDBExecutor sharedExecutor] retain];
+        latencyRecorder = new LDBLatencyRecorder();
+        deletionTracker = new DeletionTracker();
+        compactionQueue = dispatch_queue_create("com.matehat.leveldb.compaction", DISPATCH_QUEUE_SERIAL);
+        dispatch_queue_set_specific(compactionQueue, &compactionQueue, &compactionQueue, NULL);
+        _backgroundCompactionThreshold = kBackgroundCompactionThreshold;
+        _backgroundCompactionInterval = kBackgroundCompactionInterval;
+        writeCombiner = new WriteCombiner(db, objectCache, indexSet, _writeGroupSize, _writeGroupLatency);
         
+        // Whatever was allocated so far is freed by dealloc, and leveldb's lock released by close
         if(!status.ok()) {
-            [_name release];
-            [_path release];
             NSLog(@"Problem creating LevelDB database: %s", status.ToString().c_str());
+            [self release];
             return nil;
         }
         
-        self.encoder = ^ NSData *(LevelDBKey *key, id object) {
-#ifdef DEBUG
-            static dispatch_once_t onceToken;
-            dispatch_once(&onceToken, ^{
-                NSLog(@"No encoder block was set for this database [%@]", name);
-                NSLog(@"Using a convenience encoder/decoder pair using NSKeyedArchiver.");
-            });
-#endif
-            return [NSKeyedArchiver archivedDataWithRootObject:object];
-        };
-        self.decoder = ^ id (LevelDBKey *key, NSData *data) {
-            return [NSKeyedUnarchiver unarchiveObjectWithData:data];
-        };
+        // Blob files are opened whenever there are any, for the pointers to them to be followed
+        NSString *blobPath = [_path stringByAppendingPathComponent:@"blobs"];
+        if (opts.valueSeparationThreshold > 0 || [[NSFileManager defaultManager] fileExistsAtPath:blobPath]) {
+            status = LDBBlobStore::Open([blobPath fileSystemRepresentation], opts.valueSeparationThreshold,
+                                        opts.blobFileSize, &blobStore);
+            if (!status.ok()) {
+                NSLog(@"Problem opening blob files: %s", status.ToString().c_str());
+                [self release];
+                return nil;
+            }
+            changeFeed->SetBlobStore(blobStore);
+        }
+        
+        LDBCodecRegistry *codecs = [LDBCodecRegistry sharedRegistry];
+        self.encoder = [codecs defaultEncoder];
+        self.decoder = [codecs decoder];
     }
     
     return self;
@@ -194,6 +1504,11 @@ LevelDBOptions MakeLevelDBOptions() {
     LevelDB *ldb = [[[self alloc] initWithPath:getLibraryPath() name:name andOptions:opts] autorelease];
     return ldb;
 }
++ (id) databaseInLibraryWithName:(NSString *)name
+                         options:(LDBOptions *)opts {
+    LevelDB *ldb = [[[self alloc] initWithPath:getLibraryPath() name:name options:opts] autorelease];
+    return ldb;
+}
 
 - (void) setSafe:(BOOL)safe {
     writeOptions.sync = safe;
@@ -207,26 +1522,125 @@ LevelDBOptions MakeLevelDBOptions() {
 - (BOOL) useCache {
     return readOptions.fill_cache;
 }
+- (void) setWriteGroupSize:(NSUInteger)writeGroupSize {
+    _writeGroupSize = writeGroupSize;
+    EnterOperation();
+    writeCombiner->SetLimits(_writeGroupSize, _writeGroupLatency);
+}
+- (void) setObjectCacheSize:(NSUInteger)objectCacheSize {
+    _objectCacheSize = objectCacheSize;
+    EnterOperation();
+    objectCache->SetCapacity(objectCacheSize);
+}
+- (LevelDBObjectCacheStatistics) objectCacheStatistics {
+    EnterOperation((LevelDBObjectCacheStatistics) {});
+    return objectCache->Statistics();
+}
+- (void) setCompactsInBackground:(BOOL)compactsInBackground {
+    @synchronized(self) {
+        if (compactsInBackground == _compactsInBackground || self.closed)
+            return;
+        _compactsInBackground = compactsInBackground;
+        deletionTracker->SetEnabled(compactsInBackground);
+        if (compactsInBackground)
+            [self _startCompactionTimer];
+        else
+            [self _stopCompactionTimer];
+    }
+}
+- (void) setBackgroundCompactionInterval:(NSTimeInterval)backgroundCompactionInterval {
+    @synchronized(self) {
+        _backgroundCompactionInterval = backgroundCompactionInterval;
+        if (compactionTimer != NULL) {
+            [self _stopCompactionTimer];
+            [self _startCompactionTimer];
+        }
+    }
+}
+- (void) setRecordsLatencies:(BOOL)recordsLatencies {
+    latencyRecorder->SetEnabled(recordsLatencies);
+}
+- (BOOL) recordsLatencies {
+    return latencyRecorder->Enabled();
+}
+- (LDBLatencyRecorder *) latencyRecorder {
+    return latencyRecorder;
+}
+- (void) setDecoder:(LevelDBDecoderBlock)decoder {
+    if (decoder == _decoder)
+        return;
+    [_decoder release];
+    _decoder = [decoder copy];
+    changeFeed->SetDecoder(_decoder);
+    indexSet->SetDecoder(_decoder);
+    // Cached objects were decoded by the previous decoder
+    EnterOperation();
+    if (objectCache != NULL)
+        objectCache->Clear();
+}
+- (void) setWriteGroupLatency:(NSTimeInterval)writeGroupLatency {
+    _writeGroupLatency = writeGroupLatency;
+    EnterOperation();
+    writeCombiner->SetLimits(_writeGroupSize, _writeGroupLatency);
+}
 
 #pragma mark - Setters
 
 - (void) setObject:(id)value forKey:(id)key {
-    AssertDBExists(db);
+    EnterOperation();
     AssertKeyType(key);
     NSParameterAssert(value != nil);
     
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationPut);
     leveldb::Slice k = KeyFromStringOrData(key);
     LevelDBKey lkey = GenericKeyFromSlice(k);
 
     NSData *data = _encoder(&lkey, value);
     leveldb::Slice v = SliceFromData(data);
+    timer.Phase(LevelDBPhaseEncode);
+    if (deletionTracker->Enabled())
+        deletionTracker->RecordWrite();
     
-    leveldb::Status status = db->Put(writeOptions, k, v);
+    // Asynchronous writes still queued are committed first, for this write not to be undone by an older one
+    leveldb::Status status;
+    if (_combinesWrites || writeCombiner->Busy()) {
+        PendingWrite write;
+        write.batch.Put(k, v);
+        write.sync = writeOptions.sync;
+        status = writeCombiner->Write(&write);
+    } else {
+        status = indexSet->Put(db, writeOptions, k, v);
+        if (objectCache->Enabled())
+            objectCache->Invalidate(k);
+    }
+    timer.Phase(LevelDBPhaseEngine);
     
     if(!status.ok()) {
         NSLog(@"Problem storing key/value pair in database: %s", status.ToString().c_str());
     }
 }
+- (void) setObject:(id)value forKey:(id)key completion:(void (^)(NSError *error))completion {
+    EnterAsyncOperation(completion);
+    AssertKeyType(key);
+    NSParameterAssert(value != nil);
+    
+    leveldb::Slice k = KeyFromStringOrData(key);
+    LevelDBKey lkey = GenericKeyFromSlice(k);
+    
+    NSData *data = _encoder(&lkey, value);
+    
+    if (deletionTracker->Enabled())
+        deletionTracker->RecordWrite();
+    
+    PendingWrite *write = new PendingWrite();
+    write->batch.Put(k, SliceFromData(data));
+    [self commitWriteAsynchronously:write completion:completion];
+}
+- (void) commitWriteAsynchronously:(PendingWrite *)write completion:(void (^)(NSError *error))completion {
+    write->sync = writeOptions.sync;
+    write->completion = [(completion ?: ^(NSError *error) {}) copy];
+    writeCombiner->WriteAsync(write);
+}
 - (void) setValue:(id)value forKey:(NSString *)key {
     [self setObject:value forKey:key];
 }
@@ -244,14 +1658,48 @@ LevelDBOptions MakeLevelDBOptions() {
 - (LDBWritebatch *)newWritebatch {
     return [[LDBWritebatch writeBatchFromDB:self] retain];
 }
+- (LDBWritebatch *)newWritebatchWithMode:(LDBWritebatchMode)mode {
+    return [[LDBWritebatch writeBatchFromDB:self mode:mode] retain];
+}
 
 - (void) applyWritebatch:(LDBWritebatch *)writeBatch {
-    leveldb::WriteBatch wb = [writeBatch writeBatch];
-    leveldb::Status status = db->Write(writeOptions, &wb);
-    if(!status.ok()) {
-        NSLog(@"Problem applying the write batch in database: %s", status.ToString().c_str());
+    NSError *error;
+    if (![self applyWritebatch:writeBatch synchronously:writeOptions.sync error:&error]) {
+        NSLog(@"Problem applying the write batch in database: %@", error.localizedDescription);
     }
 }
+- (BOOL) applyWritebatch:(LDBWritebatch *)writeBatch
+           synchronously:(BOOL)sync
+                   error:(NSError **)error {
+    
+    EnterOperationOrFail(error);
+    leveldb::WriteOptions options = writeOptions;
+    options.sync = sync;
+    
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationWriteBatch);
+    LDBLatencyTimer *timerPtr = &timer;
+    __block leveldb::Status status;
+    // Asynchronous writes still queued are committed first, for the batch not to be undone by older writes
+    if (writeCombiner->Busy())
+        writeCombiner->Drain();
+    [writeBatch performWithWriteBatch:^(leveldb::WriteBatch *wb) {
+        timerPtr->Mark();
+        status = indexSet->Write(db, options, wb);
+        timerPtr->Phase(LevelDBPhaseEngine);
+        timerPtr->Count(0, wb->ApproximateSize());
+        if (deletionTracker->Enabled())
+            deletionTracker->RecordBatch(*wb);
+        if (objectCache->Enabled())
+            objectCache->InvalidateBatch(*wb);
+    }];
+    
+    if (!status.ok()) {
+        if (error != NULL)
+            *error = NSErrorFromLevelDBStatus(status);
+        return NO;
+    }
+    return YES;
+}
 
 - (void)performWritebatch:(void (^)(LDBWritebatch *wb))block {
     LDBWritebatch *wb = [self newWritebatch];
@@ -260,6 +1708,238 @@ LevelDBOptions MakeLevelDBOptions() {
     [wb release];
 }
 
+#pragma mark - Bulk loading
+
+- (LDBBulkLoader *) newBulkLoaderWithSortedInput:(BOOL)sorted {
+    return [[LDBBulkLoader bulkLoaderForDB:self sorted:sorted] retain];
+}
+
+- (BOOL) loadEntriesFromEnumerator:(NSEnumerator *)enumerator
+                            sorted:(BOOL)sorted
+                             error:(NSError **)error {
+    LDBBulkLoader *loader = [self newBulkLoaderWithSortedInput:sorted];
+    [loader addEntriesFromEnumerator:enumerator];
+    BOOL success = [loader finishWithError:error];
+    [loader release];
+    return success;
+}
+
+- (BOOL) _writeBulkBatch:(leveldb::WriteBatch *)batch sync:(BOOL)sync error:(NSError **)error {
+    EnterOperationOrFail(error);
+    leveldb::WriteOptions options = writeOptions;
+    options.sync = sync;
+    
+    leveldb::Status status = indexSet->Write(db, options, batch);
+    if (objectCache->Enabled())
+        objectCache->InvalidateBatch(*batch);
+    if (deletionTracker->Enabled())
+        deletionTracker->RecordWrite();
+    
+    if (!status.ok()) {
+        if (error != NULL)
+            *error = NSErrorFromLevelDBStatus(status);
+        return NO;
+    }
+    return YES;
+}
+
+#pragma mark - Archives
+
+- (BOOL) importArchiveAtPath:(NSString *)path error:(NSError **)error {
+    return [[LDBArchive archiveWithPath:path] importIntoDB:self resume:NO error:error];
+}
+
+#pragma mark - Keyspaces
+
+- (LDBKeyspace *) keyspaceWithPrefix:(id)prefix {
+    AssertKeyType(prefix);
+    return [LDBKeyspace keyspaceWithDB:self prefix:(EnsureNSData(prefix))];
+}
+
+#pragma mark - Secondary indexes
+
+- (LDBIndex *) addIndexNamed:(NSString *)name extractor:(LevelDBIndexExtractorBlock)extractor {
+    EnterOperation(nil);
+    LDBIndex *index = [LDBIndex indexWithDB:self name:name extractor:extractor];
+    std::string builtKey = [LDBIndex builtKeyForName:name];
+    
+    // Under the commit lock, so that no indexed write can slip between checking for keys and marking the index built
+    std::lock_guard<std::mutex> lock(indexSet->CommitMutex());
+    indexSet->Add(index);
+    std::string value;
+    leveldb::Status status = db->Get(readOptions, builtKey, &value);
+    if (status.ok()) {
+        [index setBuilt:YES];
+    } else if (status.IsNotFound() && ![self _holdsUnreservedKeys]) {
+        status = db->Put(writeOptions, builtKey, leveldb::Slice());
+        [index setBuilt:status.ok()];
+    }
+    if (!status.ok() && !status.IsNotFound())
+        NSLog(@"Problem adding index '%@' to database: %s", name, status.ToString().c_str());
+    return index;
+}
+
+- (LDBIndex *) indexNamed:(NSString *)name {
+    return indexSet->Find(name);
+}
+
+- (void) removeIndexNamed:(NSString *)name {
+    EnterOperation();
+    indexSet->Remove(name);
+    leveldb::Status status = [self _removeEntriesOfIndexNamed:name];
+    if (!status.ok())
+        NSLog(@"Problem removing index '%@' from database: %s", name, status.ToString().c_str());
+}
+
+- (BOOL) _holdsUnreservedKeys {
+    std::string reservedLimit;
+    PrefixUpperBound(kLDBReservedKeyPrefix, &reservedLimit);
+    leveldb::Iterator *iter = db->NewIterator(readOptions);
+    iter->SeekToFirst();
+    if (iter->Valid() && iter->key().starts_with(kLDBReservedKeyPrefix))
+        iter->Seek(reservedLimit);
+    BOOL holdsKeys = iter->Valid();
+    delete iter;
+    return holdsKeys;
+}
+
+// Remove the entries of an index and the key marking it as built, a bounded batch at a time, along with writes
+- (leveldb::Status) _removeEntriesOfIndexNamed:(NSString *)name {
+    std::string prefix = [LDBIndex entryPrefixForName:name];
+    std::string builtKey = [LDBIndex builtKeyForName:name];
+    leveldb::ReadOptions options = readOptions;
+    options.fill_cache = false;
+    
+    leveldb::Status status;
+    bool first = true, done = false;
+    while (status.ok() && !done) {
+        std::lock_guard<std::mutex> lock(indexSet->CommitMutex());
+        leveldb::WriteBatch batch;
+        // The index stops being built before any of its entries is removed
+        if (first)
+            batch.Delete(builtKey);
+        first = false;
+        
+        size_t count = 0;
+        leveldb::Iterator *iter = db->NewIterator(options);
+        for (iter->Seek(prefix); iter->Valid() && iter->key().starts_with(prefix) && count < kRemovalBatchCount; iter->Next()) {
+            batch.Delete(iter->key());
+            count++;
+        }
+        done = (count < kRemovalBatchCount);
+        status = iter->status();
+        delete iter;
+        if (status.ok())
+            status = db->Write(writeOptions, &batch);
+    }
+    return status;
+}
+
+- (void) _enumerateIndexEntriesFromSlice:(const leveldb::Slice &)start
+                                 toSlice:(const leveldb::Slice &)limit
+                            withSnapshot:(LDBSnapshot *)snapshot
+                              usingBlock:(void (^)(const leveldb::Slice &entry, BOOL *stop))block {
+    
+    EnterOperation();
+    MaybeAddSnapshotToOptions(readOptions, readOptionsPtr, snapshot);
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationScan);
+    leveldb::Iterator *iter = db->NewIterator(*readOptionsPtr);
+    BOOL stop = NO;
+    size_t count = 0, bytes = 0;
+    for (iter->Seek(start); iter->Valid() && !stop; iter->Next()) {
+        leveldb::Slice entry = iter->key();
+        if (entry.compare(limit) >= 0)
+            break;
+        block(entry, &stop);
+        count++;
+        bytes += entry.size();
+    }
+    timer.Count(count, bytes);
+    if (!iter->status().ok())
+        NSLog(@"Problem reading index entries from database: %s", iter->status().ToString().c_str());
+    delete iter;
+}
+
+- (LDBCancellationToken *) _buildIndex:(LDBIndex *)index completion:(void (^)(NSError *error))completion {
+    if (completion == nil)
+        completion = ^(NSError *error) {};
+    return [self _submitWithPriority:LDBExecutorPriorityLow task:^(LDBCancellationToken *token) {
+        NSError *error = nil;
+        [self _buildIndex:index token:token error:&error];
+        completion(error);
+    } failed:completion];
+}
+
+/*
+ * Index every key again, a batch at a time. Each batch reads the latest values with writes waiting
+ * on the commit lock, so writes committed before it are indexed by it, and those committed after it
+ * find its entries to maintain.
+ */
+- (BOOL) _buildIndex:(LDBIndex *)index token:(LDBCancellationToken *)token error:(NSError **)error {
+    EnterOperationOrFail(error);
+    [index setBuilt:NO];
+    leveldb::Status status = [self _removeEntriesOfIndexNamed:index.name];
+    
+    std::string reservedLimit, resumeKey;
+    PrefixUpperBound(kLDBReservedKeyPrefix, &reservedLimit);
+    leveldb::ReadOptions options = readOptions;
+    options.fill_cache = false;
+    bool started = false, finished = false;
+    
+    while (status.ok() && !finished) {
+        // Stop between batches rather than holding a closing database open
+        if (token.cancelled || inFlight->Closing()) {
+            if (error != NULL)
+                *error = token.cancelled ? CancelledError() : ClosedDatabaseError();
+            return NO;
+        }
+        @autoreleasepool {
+            std::lock_guard<std::mutex> lock(indexSet->CommitMutex());
+            LDBBlobReadGuard blobReads(blobStore);
+            leveldb::WriteBatch batch;
+            size_t count = 0;
+            leveldb::Iterator *iter = db->NewIterator(options);
+            started ? iter->Seek(resumeKey) : iter->SeekToFirst();
+            while (iter->Valid() && count < kIndexBuildBatchCount) {
+                leveldb::Slice key = iter->key();
+                if (key.starts_with(kLDBReservedKeyPrefix)) {
+                    iter->Seek(reservedLimit);
+                    continue;
+                }
+                LevelDBKey lkey = GenericKeyFromSlice(key);
+                leveldb::Slice value = iter->value();
+                id object = (blobStore && LDBBlobStore::IsPointer(value)) ? DecodeBlob(blobStore, value, &lkey, _decoder)
+                                                                          : DecodeFromSlice(value, &lkey, _decoder);
+                std::set<std::string> entries;
+                [index addEntriesForKey:key value:object toSet:&entries];
+                for (const std::string &entry : entries)
+                    batch.Put(entry, leveldb::Slice());
+                count++;
+                iter->Next();
+            }
+            finished = !iter->Valid();
+            if (!finished) {
+                resumeKey = iter->key().ToString();
+                started = true;
+            }
+            status = iter->status();
+            delete iter;
+            if (status.ok() && count > 0)
+                status = db->Write(writeOptions, &batch);
+        }
+    }
+    
+    if (status.ok())
+        status = db->Put(writeOptions, [LDBIndex builtKeyForName:index.name], leveldb::Slice());
+    if (!status.ok()) {
+        if (error != NULL)
+            *error = NSErrorFromLevelDBStatus(status);
+        return NO;
+    }
+    [index setBuilt:YES];
+    return YES;
+}
+
 #pragma mark - Getters
 
 - (id) objectForKey:(id)key {
@@ -268,12 +1948,26 @@ LevelDBOptions MakeLevelDBOptions() {
 - (id) objectForKey:(id)key
        withSnapshot:(LDBSnapshot *)snapshot {
     
-    AssertDBExists(db);
+    EnterOperation(nil);
     AssertKeyType(key);
     std::string v_string;
     MaybeAddSnapshotToOptions(readOptions, readOptionsPtr, snapshot);
     leveldb::Slice k = KeyFromStringOrData(key);
+    LDBLatencyTimer timer(latencyRecorder, snapshot == nil ? LevelDBOperationGet : LevelDBOperationSnapshotGet);
+    
+    // Snapshot reads bypass the object cache, which only holds the latest values
+    BOOL cached = (snapshot == nil && objectCache->Enabled());
+    uint64_t generation = 0;
+    if (cached) {
+        id object = objectCache->Lookup(k, &generation);
+        if (object != nil)
+            return object;
+    }
+    
+    LDBBlobReadGuard blobReads(blobStore);
+    timer.Mark();
     leveldb::Status status = db->Get(*readOptionsPtr, k, &v_string);
+    timer.Phase(LevelDBPhaseEngine);
     
     if(!status.ok()) {
         if(!status.IsNotFound())
@@ -282,15 +1976,129 @@ LevelDBOptions MakeLevelDBOptions() {
     }
     
     LevelDBKey lkey = GenericKeyFromSlice(k);
-    return DecodeFromSlice(v_string, &lkey, _decoder);
+    size_t valueSize = LDBBlobStore::ValueSize(v_string);
+    id object = DecodeStringValue(v_string, &lkey);
+    timer.Phase(LevelDBPhaseDecode);
+    if (cached && object != nil && ObjectCache::Shareable(object))
+        objectCache->Insert(k, object, valueSize, generation);
+    return object;
 }
 - (id) objectsForKeys:(NSArray *)keys notFoundMarker:(id)marker {
-    NSMutableArray *result = [NSMutableArray arrayWithCapacity:keys.count];
-    [keys enumerateObjectsUsingBlock:^(id objId, NSUInteger idx, BOOL *stop) {
-        id object = [self objectForKey:objId];
-        if (object == nil) object = marker;
-        result[idx] = object;
-    }];
+    return [self objectsForKeys:keys notFoundMarker:marker withSnapshot:nil statistics:NULL];
+}
+- (NSArray *) objectsForKeys:(NSArray *)keys
+              notFoundMarker:(id)marker
+                  statistics:(LevelDBMultiGetStatistics *)statistics {
+    return [self objectsForKeys:keys notFoundMarker:marker withSnapshot:nil statistics:statistics];
+}
+- (NSArray *) objectsForKeys:(NSArray *)keys
+              notFoundMarker:(id)marker
+                withSnapshot:(LDBSnapshot *)snapshot
+                  statistics:(LevelDBMultiGetStatistics *)statistics {
+    
+    EnterOperation(nil);
+    NSParameterAssert(marker != nil);
+    
+    LevelDBMultiGetStatistics stats = { .strategy = LevelDBMultiGetPointLookups, .keyCount = keys.count };
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationMultiGet);
+    NSTimeInterval time = LDBMonotonicTime(), now;
+    size_t count = keys.count;
+    
+    std::vector<leveldb::Slice> slices;
+    slices.reserve(count);
+    for (id key in keys) {
+        AssertKeyType(key);
+        slices.push_back(KeyFromStringOrData(key));
+    }
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++)
+        order[i] = i;
+    const leveldb::Comparator *keyComparator = comparator;
+    std::sort(order.begin(), order.end(), [&slices, keyComparator](size_t a, size_t b) {
+        return keyComparator->Compare(slices[a], slices[b]) < 0;
+    });
+    
+    now = LDBMonotonicTime();
+    stats.sortTime = now - time;
+    time = now;
+    timer.Mark();
+    
+    // Every key is read from the same snapshot, whether or not one was provided
+    LDBBlobReadGuard blobReads(blobStore);
+    leveldb::ReadOptions options = readOptions;
+    const leveldb::Snapshot *implicitSnapshot = NULL;
+    if (snapshot != nil)
+        options.snapshot = [snapshot getSnapshot];
+    else
+        options.snapshot = implicitSnapshot = db->GetSnapshot();
+    
+    if (count >= kMultiGetMinimumSeekKeys) {
+        leveldb::Range range(slices[order.front()], slices[order.back()]);
+        uint64_t size;
+        db->GetApproximateSizes(&range, 1, &size);
+        if (size / count <= kMultiGetDenseBytesPerKey)
+            stats.strategy = LevelDBMultiGetIteratorSeeks;
+    }
+    
+    std::vector<std::string> values(count);
+    std::vector<bool> found(count, false);
+    
+    if (stats.strategy == LevelDBMultiGetIteratorSeeks) {
+        leveldb::Iterator *iter = db->NewIterator(options);
+        BOOL positioned = NO;
+        for (size_t i : order) {
+            const leveldb::Slice &k = slices[i];
+            // Only seek when the iterator is behind the key, sorted keys never make it move backward
+            if (!positioned || comparator->Compare(iter->key(), k) < 0) {
+                iter->Seek(k);
+                positioned = YES;
+                stats.seekCount++;
+                if (!iter->Valid())
+                    break;
+            }
+            if (iter->key() == k) {
+                values[i].assign(iter->value().data(), iter->value().size());
+                found[i] = true;
+            }
+        }
+        if (!iter->status().ok())
+            NSLog(@"Problem retrieving values from database: %s", iter->status().ToString().c_str());
+        delete iter;
+    } else {
+        for (size_t i : order) {
+            leveldb::Status status = db->Get(options, slices[i], &values[i]);
+            if (status.ok())
+                found[i] = true;
+            else if (!status.IsNotFound())
+                NSLog(@"Problem retrieving value for key '%@' from database: %s", keys[i], status.ToString().c_str());
+        }
+    }
+    
+    if (implicitSnapshot != NULL)
+        db->ReleaseSnapshot(implicitSnapshot);
+    
+    now = LDBMonotonicTime();
+    stats.fetchTime = now - time;
+    time = now;
+    timer.Phase(LevelDBPhaseEngine);
+    
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:count];
+    for (size_t i = 0; i < count; i++) {
+        id object = nil;
+        if (found[i]) {
+            LevelDBKey lkey = GenericKeyFromSlice(slices[i]);
+            object = DecodeStringValue(values[i], &lkey);
+            stats.foundCount++;
+            timer.Count(1, slices[i].size() + values[i].size());
+        }
+        [result addObject:(object != nil) ? object : marker];
+    }
+    
+    stats.decodeTime = LDBMonotonicTime() - time;
+    timer.Phase(LevelDBPhaseDecode);
+    if (statistics != NULL)
+        *statistics = stats;
+    
     return [NSArray arrayWithArray:result];
 }
 - (id) valueForKey:(NSString *)key {
@@ -310,7 +2118,7 @@ LevelDBOptions MakeLevelDBOptions() {
 - (BOOL) objectExistsForKey:(id)key
                withSnapshot:(LDBSnapshot *)snapshot {
     
-    AssertDBExists(db);
+    EnterOperation(NO);
     AssertKeyType(key);
     std::string v_string;
     MaybeAddSnapshotToOptions(readOptions, readOptionsPtr, snapshot);
@@ -331,16 +2139,42 @@ LevelDBOptions MakeLevelDBOptions() {
 #pragma mark - Removers
 
 - (void) removeObjectForKey:(id)key {
-    AssertDBExists(db);
+    EnterOperation();
     AssertKeyType(key);
     
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationDelete);
     leveldb::Slice k = KeyFromStringOrData(key);
-    leveldb::Status status = db->Delete(writeOptions, k);
+    if (deletionTracker->Enabled())
+        deletionTracker->RecordDelete(k);
+    leveldb::Status status;
+    if (_combinesWrites || writeCombiner->Busy()) {
+        PendingWrite write;
+        write.batch.Delete(k);
+        write.sync = writeOptions.sync;
+        status = writeCombiner->Write(&write);
+    } else {
+        status = indexSet->Delete(db, writeOptions, k);
+        if (objectCache->Enabled())
+            objectCache->Invalidate(k);
+    }
+    timer.Phase(LevelDBPhaseEngine);
     
     if(!status.ok()) {
         NSLog(@"Problem deleting key/value pair in database: %s", status.ToString().c_str());
     }
 }
+- (void) removeObjectForKey:(id)key completion:(void (^)(NSError *error))completion {
+    EnterAsyncOperation(completion);
+    AssertKeyType(key);
+    
+    leveldb::Slice k = KeyFromStringOrData(key);
+    if (deletionTracker->Enabled())
+        deletionTracker->RecordDelete(k);
+    
+    PendingWrite *write = new PendingWrite();
+    write->batch.Delete(k);
+    [self commitWriteAsynchronously:write completion:completion];
+}
 - (void) removeObjectsForKeys:(NSArray *)keyArray {
     [keyArray enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
         [self removeObjectForKey:obj];
@@ -351,30 +2185,114 @@ LevelDBOptions MakeLevelDBOptions() {
     [self removeAllObjectsWithPrefix:nil];
 }
 - (void) removeAllObjectsWithPrefix:(id)prefix {
-    AssertDBExists(db);
+    [self removeAllObjectsWithPrefix:prefix compactingAfterwards:NO usingBlock:nil];
+}
+- (NSUInteger) removeAllObjectsWithPrefix:(id)prefix
+                     compactingAfterwards:(BOOL)compact
+                               usingBlock:(LevelDBProgressBlock)block {
     
-    leveldb::Iterator * iter = db->NewIterator(readOptions);
-    leveldb::Slice lkey;
+    NSData *prefixData = EnsureNSData(prefix);
+    if (prefixData == nil || prefixData.length == 0)
+        return [self _removeObjectsFromSlice:NULL toSlice:NULL compactingAfterwards:compact usingBlock:block];
     
-    const void *prefixPtr;
-    size_t prefixLen;
-    prefix = EnsureNSData(prefix);
-    if (prefix) {
-        prefixPtr = [(NSData *)prefix bytes];
-        prefixLen = (size_t)[(NSData *)prefix length];
+    leveldb::Slice start = SliceFromData(prefixData);
+    std::string limitString;
+    bool bounded = PrefixUpperBound(start, &limitString);
+    leveldb::Slice limit = limitString;
+    
+    return [self _removeObjectsFromSlice:&start
+                                 toSlice:bounded ? &limit : NULL
+                    compactingAfterwards:compact
+                              usingBlock:block];
+}
+- (NSUInteger) removeObjectsFromKey:(id)startKey
+                              toKey:(id)endKey
+               compactingAfterwards:(BOOL)compact
+                         usingBlock:(LevelDBProgressBlock)block {
+    
+    leveldb::Slice start, limit;
+    if (startKey) {
+        AssertKeyType(startKey);
+        start = KeyFromStringOrData(startKey);
     }
-
-    for (SeekToFirstOrKey(iter, (id)prefix, NO)
-         ; iter->Valid()
-         ; MoveCursor(iter, NO)) {
+    if (endKey) {
+        AssertKeyType(endKey);
+        limit = KeyFromStringOrData(endKey);
+    }
+    
+    return [self _removeObjectsFromSlice:startKey ? &start : NULL
+                                 toSlice:endKey ? &limit : NULL
+                    compactingAfterwards:compact
+                              usingBlock:block];
+}
+- (NSUInteger) _removeObjectsFromSlice:(const leveldb::Slice *)start
+                               toSlice:(const leveldb::Slice *)limit
+                  compactingAfterwards:(BOOL)compact
+                            usingBlock:(LevelDBProgressBlock)block {
+    
+    EnterOperation(0);
+    if (writeCombiner->Busy())
+        writeCombiner->Drain();
+    
+    // Scanning the range to remove shouldn't evict hot blocks from the cache
+    leveldb::ReadOptions options = readOptions;
+    options.fill_cache = false;
+    leveldb::Iterator *iter = NewUserKeyIterator(db->NewIterator(options), comparator);
+    
+    leveldb::WriteBatch batch;
+    leveldb::Status status;
+    size_t batchCount = 0, batchBytes = 0;
+    NSUInteger removed = 0;
+    BOOL stop = false;
+    
+    for (start ? iter->Seek(*start) : iter->SeekToFirst()
+         ; iter->Valid() && !stop
+         ; iter->Next()) {
         
-        lkey = iter->key();
-        if (prefix && memcmp(lkey.data(), prefixPtr, MIN(prefixLen, lkey.size())) != 0)
+        leveldb::Slice lkey = iter->key();
+        if (limit && comparator->Compare(lkey, *limit) >= 0)
             break;
         
-        db->Delete(writeOptions, lkey);
+        batch.Delete(lkey);
+        batchCount++;
+        batchBytes += lkey.size();
+        
+        if (batchCount >= kRemovalBatchCount || batchBytes >= kRemovalBatchBytes) {
+            status = indexSet->Write(db, writeOptions, &batch);
+            if (objectCache->Enabled())
+                objectCache->InvalidateRange(start, limit);
+            if (!status.ok())
+                break;
+            
+            removed += batchCount;
+            batch.Clear();
+            batchCount = batchBytes = 0;
+            if (block) block(removed, &stop);
+        }
     }
+    if (status.ok() && !iter->status().ok())
+        status = iter->status();
     delete iter;
+    
+    if (status.ok() && batchCount > 0) {
+        status = indexSet->Write(db, writeOptions, &batch);
+        if (objectCache->Enabled())
+            objectCache->InvalidateRange(start, limit);
+        if (status.ok()) {
+            removed += batchCount;
+            if (block) block(removed, &stop);
+        }
+    }
+    
+    if (!status.ok()) {
+        NSLog(@"Problem removing a range of keys from database: %s", status.ToString().c_str());
+    } else if (compact && removed > 0) {
+        db->CompactRange(start, limit);
+    } else if (removed > 0 && deletionTracker->Enabled()) {
+        deletionTracker->RecordRange(start, limit, removed);
+    }
+    
+    return removed;
 }
 
 #pragma mark - Selection
@@ -413,72 +2331,111 @@ LevelDBOptions MakeLevelDBOptions() {
     return [NSDictionary dictionaryWithDictionary:results];
 }
 
+- (NSArray *) keysMatchingKeyPredicate:(LDBKeyPredicate *)keyPredicate {
+    return [self keysMatchingKeyPredicate:keyPredicate withSnapshot:nil];
+}
+- (NSArray *) keysMatchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                          withSnapshot:(LDBSnapshot *)snapshot {
+    NSMutableArray *keys = [[[NSMutableArray alloc] init] autorelease];
+    [self enumerateKeysBackward:NO
+           matchingKeyPredicate:keyPredicate
+            filteredByPredicate:nil
+                   withSnapshot:snapshot
+                     usingBlock:^(LevelDBKey *key, BOOL *stop) {
+                         [keys addObject:NSDataFromLevelDBKey(key)];
+                     }];
+    return [NSArray arrayWithArray:keys];
+}
+
+- (NSDictionary *) dictionaryByFilteringWithKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                                            andPredicate:(NSPredicate *)predicate {
+    return [self dictionaryByFilteringWithKeyPredicate:keyPredicate andPredicate:predicate withSnapshot:nil];
+}
+- (NSDictionary *) dictionaryByFilteringWithKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                                            andPredicate:(NSPredicate *)predicate
+                                            withSnapshot:(LDBSnapshot *)snapshot {
+    NSMutableDictionary *results = [NSMutableDictionary dictionary];
+    [self enumerateKeysAndObjectsBackward:NO lazily:NO
+                     matchingKeyPredicate:keyPredicate
+                      filteredByPredicate:predicate
+                             withSnapshot:snapshot
+                               usingBlock:^(LevelDBKey *key, id obj, BOOL *stop) {
+                                   [results setObject:obj forKey:NSDataFromLevelDBKey(key)];
+                               }];
+    
+    return [NSDictionary dictionaryWithDictionary:results];
+}
+
 - (LDBSnapshot *) newSnapshot {
     return [[LDBSnapshot snapshotFromDB:self] retain];
 }
 
+- (LDBCursor *) newCursorFromKey:(id)lowerBound toKey:(id)upperBound {
+    return [self newCursorFromKey:lowerBound toKey:upperBound withSnapshot:nil];
+}
+- (LDBCursor *) newCursorWithPrefix:(id)prefix {
+    return [self newCursorWithPrefix:prefix withSnapshot:nil];
+}
+- (LDBCursor *) newCursorFromKey:(id)lowerBound
+                           toKey:(id)upperBound
+                    withSnapshot:(LDBSnapshot *)snapshot {
+    EnterOperation(nil);
+    MaybeAddSnapshotToOptions(readOptions, readOptionsPtr, snapshot);
+    // Without a snapshot, the cursor keeps the blob files its iterator may read from until it is closed
+    LDBBlobStore *pinnedBlobs = (snapshot == nil) ? blobStore : NULL;
+    uint64_t blobPin = pinnedBlobs ? pinnedBlobs->Pin() : 0;
+    leveldb::Iterator *iter = NewUserKeyIterator(db->NewIterator(*readOptionsPtr), comparator);
+    LDBCursor *cursor = [LDBCursor cursorForDB:self
+                                      iterator:iter
+                                      snapshot:snapshot
+                                    lowerBound:(EnsureNSData(lowerBound))
+                                    upperBound:(EnsureNSData(upperBound))];
+    [cursor pinBlobs:pinnedBlobs epoch:blobPin];
+    [self _registerResource:cursor];
+    return [cursor retain];
+}
+- (LDBCursor *) newCursorWithPrefix:(id)prefix
+                       withSnapshot:(LDBSnapshot *)snapshot {
+    NSData *prefixData = EnsureNSData(prefix);
+    NSParameterAssert(prefixData != nil);
+    std::string limit;
+    NSData *upperBound = nil;
+    if (PrefixUpperBound(SliceFromData(prefixData), &limit))
+        upperBound = [NSData dataWithBytes:limit.data() length:limit.size()];
+    return [self newCursorFromKey:prefixData toKey:upperBound withSnapshot:snapshot];
+}
+
 #pragma mark - Enumeration
 
+/*
+ * Position an iterator on the first key of an enumeration. With a prefix, the enumeration starts at `key` if it is
+ * prefixed with it, and otherwise at the first (or, backward, the last) prefixed key.
+ */
 - (void) _startIterator:(leveldb::Iterator*)iter
                backward:(BOOL)backward
-                 prefix:(id)prefix
+                 prefix:(const leveldb::Slice *)prefix
                   start:(id)key {
     
-    const void *prefixPtr;
-    size_t prefixLen;
-    leveldb::Slice lkey, startingKey;
-    
-    prefix = EnsureNSData(prefix);
     if (prefix) {
-        prefixPtr = [(NSData *)prefix bytes];
-        prefixLen = (size_t)[(NSData *)prefix length];
-        startingKey = leveldb::Slice((char *)prefixPtr, prefixLen);
-        
+        leveldb::Slice startingKey = *prefix;
         if (key) {
             leveldb::Slice skey = KeyFromStringOrData(key);
-            if (skey.size() > prefixLen && memcmp(skey.data(), prefixPtr, prefixLen) == 0) {
+            if (skey.size() > prefix->size() && skey.starts_with(*prefix))
                 startingKey = skey;
-            }
         }
         
-        /*
-         * If a prefix is provided and the iteration is backwards
-         * we need to start on the next key (maybe discarding the first iteration)
-         */
         if (backward) {
-            signed long long i = startingKey.size() - 1;
-            void * startingKeyPtr = malloc(startingKey.size());
-            unsigned char *keyChar;
-            memcpy(startingKeyPtr, startingKey.data(), startingKey.size());
-            while (1) {
-                if (i < 0) {
-                    iter->SeekToLast();
-                    break;
-                }
-                keyChar = (unsigned char *)startingKeyPtr + i;
-                if (*keyChar < 255) {
-                    *keyChar = *keyChar + 1;
-                    iter->Seek(leveldb::Slice((char *)startingKeyPtr, startingKey.size()));
-                    if (!iter->Valid()) {
-                        iter->SeekToLast();
-                    }
-                    break;
-                }
-                i--;
-            };
-            free(startingKeyPtr);
-            if (!iter->Valid())
-                return;
-            
-            lkey = iter->key();
-            if (startingKey.size() && prefix) {
-                signed int cmp = memcmp(lkey.data(), startingKey.data(), startingKey.size());
-                if (cmp > 0) {
+            // Start on the last key below the first key not prefixed with the starting key
+            std::string limit;
+            if (PrefixUpperBound(startingKey, &limit)) {
+                iter->Seek(limit);
+                if (iter->Valid())
                     iter->Prev();
-                }
-            }
+                else
+                    iter->SeekToLast();
+            } else
+                iter->SeekToLast();
         } else {
-            // Otherwise, we start at the provided prefix
             iter->Seek(startingKey);
         }
     } else if (key) {
@@ -521,13 +2478,17 @@ LevelDBOptions MakeLevelDBOptions() {
                   withSnapshot:(LDBSnapshot *)snapshot
                     usingBlock:(LevelDBKeyBlock)block {
     
-    AssertDBExists(db);
+    EnterOperation();
     MaybeAddSnapshotToOptions(readOptions, readOptionsPtr, snapshot);
-    leveldb::Iterator* iter = db->NewIterator(*readOptionsPtr);
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationScan);
+    LDBBlobReadGuard blobReads(blobStore);
+    leveldb::Iterator* iter = NewUserKeyIterator(db->NewIterator(*readOptionsPtr), comparator);
     leveldb::Slice lkey;
     BOOL stop = false;
     
     NSData *prefixData = EnsureNSData(prefix);
+    leveldb::Slice prefixSlice = prefixData ? SliceFromData(prefixData) : leveldb::Slice();
+    const leveldb::Slice *prefixPtr = prefixData ? &prefixSlice : NULL;
     
     LevelDBKeyValueBlock iterate = (predicate != nil)
         ? ^(LevelDBKey *lk, id value, BOOL *stop) {
@@ -538,16 +2499,24 @@ LevelDBOptions MakeLevelDBOptions() {
             block(lk, stop);
           };
     
-    for ([self _startIterator:iter backward:backward prefix:prefix start:key]
-         ; iter->Valid()
-         ; MoveCursor(iter, backward)) {
+    // Only the time spent positioning the iterator is accounted for as engine time, not the time spent in blocks
+    for ([self _startIterator:iter backward:backward prefix:prefixPtr start:key]
+         ; (timer.Phase(LevelDBPhaseEngine), iter->Valid())
+         ; (timer.Mark(), MoveCursor(iter, backward))) {
         
         lkey = iter->key();
-        if (prefix && memcmp(lkey.data(), [prefixData bytes], MIN((size_t)[prefixData length], lkey.size())) != 0)
+        if (prefixPtr && !lkey.starts_with(prefixSlice))
             break;
         
         LevelDBKey lk = GenericKeyFromSlice(lkey);
-        id v = (predicate == nil) ? nil : DecodeFromSlice(iter->value(), &lk, _decoder);
+        if (timer.Active())
+            timer.Count(1, lkey.size() + iter->value().size());
+        id v = nil;
+        if (predicate != nil) {
+            LDBLatencyTimer::Clock::time_point decodeStart = timer.Now();
+            v = DecodeIteratorValue(iter, &lk);
+            timer.AddSince(LevelDBPhaseDecode, decodeStart);
+        }
         iterate(&lk, v, &stop);
         if (stop) break;
     }
@@ -589,9 +2558,12 @@ LevelDBOptions MakeLevelDBOptions() {
                             withSnapshot:(LDBSnapshot *)snapshot
                               usingBlock:(id)block{
     
-    AssertDBExists(db);
+    EnterOperation();
     MaybeAddSnapshotToOptions(readOptions, readOptionsPtr, snapshot);
-    leveldb::Iterator* iter = db->NewIterator(*readOptionsPtr);
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationScan);
+    LDBLatencyTimer *timerPtr = &timer;
+    LDBBlobReadGuard blobReads(blobStore);
+    leveldb::Iterator* iter = NewUserKeyIterator(db->NewIterator(*readOptionsPtr), comparator);
     leveldb::Slice lkey;
     BOOL stop = false;
     
@@ -620,23 +2592,29 @@ LevelDBOptions MakeLevelDBOptions() {
         };
     
     NSData *prefixData = EnsureNSData(prefix);
+    leveldb::Slice prefixSlice = prefixData ? SliceFromData(prefixData) : leveldb::Slice();
+    const leveldb::Slice *prefixPtr = prefixData ? &prefixSlice : NULL;
     
     LevelDBValueGetterBlock getter;
-    for ([self _startIterator:iter backward:backward prefix:prefix start:key]
-         ; iter->Valid()
-         ; MoveCursor(iter, backward)) {
+    for ([self _startIterator:iter backward:backward prefix:prefixPtr start:key]
+         ; (timer.Phase(LevelDBPhaseEngine), iter->Valid())
+         ; (timer.Mark(), MoveCursor(iter, backward))) {
         
         lkey = iter->key();
         // If there is prefix provided, and the prefix and key don't match, we break out of iteration
-        if (prefix && memcmp(lkey.data(), [prefixData bytes], MIN((size_t)[prefixData length], lkey.size())) != 0)
+        if (prefixPtr && !lkey.starts_with(prefixSlice))
             break;
         
         __block LevelDBKey lk = GenericKeyFromSlice(lkey);
         __block id v = nil;
+        if (timer.Active())
+            timer.Count(1, lkey.size() + iter->value().size());
         
         getter = ^ id {
             if (v) return v;
-            v = DecodeFromSlice(iter->value(), &lk, _decoder);
+            LDBLatencyTimer::Clock::time_point decodeStart = timerPtr->Now();
+            v = DecodeIteratorValue(iter, &lk);
+            timerPtr->AddSince(LevelDBPhaseDecode, decodeStart);
             return v;
         };
         
@@ -647,6 +2625,706 @@ LevelDBOptions MakeLevelDBOptions() {
     delete iter;
 }
 
+- (void) enumerateKeysBackward:(BOOL)backward
+          matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+           filteredByPredicate:(NSPredicate *)predicate
+                    usingBlock:(LevelDBKeyBlock)block {
+    
+    [self enumerateKeysBackward:backward
+           matchingKeyPredicate:keyPredicate
+            filteredByPredicate:predicate
+                   withSnapshot:nil
+                     usingBlock:block];
+}
+
+- (void) enumerateKeysBackward:(BOOL)backward
+          matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+           filteredByPredicate:(NSPredicate *)predicate
+                  withSnapshot:(LDBSnapshot *)snapshot
+                    usingBlock:(LevelDBKeyBlock)block {
+    
+    // Values are only decoded (lazily) if there is a value predicate to evaluate
+    [self enumerateKeysAndObjectsBackward:backward
+                                   lazily:YES
+                     matchingKeyPredicate:keyPredicate
+                      filteredByPredicate:predicate
+                             withSnapshot:snapshot
+                               usingBlock:^(LevelDBKey *key, LevelDBValueGetterBlock valueGetter, BOOL *stop) {
+                                   block(key, stop);
+                               }];
+}
+
+- (void) enumerateKeysAndObjectsBackward:(BOOL)backward
+                                  lazily:(BOOL)lazily
+                    matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                     filteredByPredicate:(NSPredicate *)predicate
+                              usingBlock:(id)block {
+    
+    [self enumerateKeysAndObjectsBackward:backward
+                                   lazily:lazily
+                     matchingKeyPredicate:keyPredicate
+                      filteredByPredicate:predicate
+                             withSnapshot:nil
+                               usingBlock:block];
+}
+
+- (void) enumerateKeysAndObjectsBackward:(BOOL)backward
+                                  lazily:(BOOL)lazily
+                    matchingKeyPredicate:(LDBKeyPredicate *)keyPredicate
+                     filteredByPredicate:(NSPredicate *)predicate
+                            withSnapshot:(LDBSnapshot *)snapshot
+                              usingBlock:(id)block {
+    
+    EnterOperation();
+    MaybeAddSnapshotToOptions(readOptions, readOptionsPtr, snapshot);
+    LDBLatencyTimer timer(latencyRecorder, LevelDBOperationScan);
+    LDBLatencyTimer *timerPtr = &timer;
+    LDBBlobReadGuard blobReads(blobStore);
+    leveldb::Iterator* iter = NewUserKeyIterator(db->NewIterator(*readOptionsPtr), comparator);
+    LDBKeyPredicateBlock keyBlock = keyPredicate.block;
+    BOOL stop = false;
+    
+    // The key predicate's bounds delimit the scanned range, and only keys left to its block
+    // within that range are tested individually, before anything gets decoded
+    for (SeekToKeyPredicate(iter, comparator, keyPredicate, backward)
+         ; (timer.Phase(LevelDBPhaseEngine), iter->Valid())
+         ; (timer.Mark(), MoveCursor(iter, backward))) {
+        
+        leveldb::Slice lkey = iter->key();
+        if (PastKeyPredicateBounds(lkey, comparator, keyPredicate, backward))
+            break;
+        
+        __block LevelDBKey lk = GenericKeyFromSlice(lkey);
+        if (timer.Active())
+            timer.Count(1, lkey.size() + iter->value().size());
+        if (keyBlock && !keyBlock(&lk))
+            continue;
+        
+        __block id v = nil;
+        LevelDBValueGetterBlock getter = ^ id {
+            if (v) return v;
+            LDBLatencyTimer::Clock::time_point decodeStart = timerPtr->Now();
+            v = DecodeIteratorValue(iter, &lk);
+            timerPtr->AddSince(LevelDBPhaseDecode, decodeStart);
+            return v;
+        };
+        
+        if (predicate != nil && ![predicate evaluateWithObject:getter()])
+            continue;
+        
+        if (lazily)
+            ((LevelDBLazyKeyValueBlock)block)(&lk, getter, &stop);
+        else
+            ((LevelDBKeyValueBlock)block)(&lk, getter(), &stop);
+        if (stop) break;
+    }
+    
+    delete iter;
+}
+
+#pragma mark - Change notifications
+
+- (LDBChangeSubscription *) subscribeToChangesWithPrefix:(id)prefix
+                                              usingBlock:(LevelDBChangesBlock)block {
+    return [self subscribeToChangesWithPrefix:prefix
+                                     capacity:kChangeSubscriptionCapacity
+                               overflowPolicy:LDBChangeOverflowDropOldest
+                                        queue:nil
+                                   usingBlock:block];
+}
+- (LDBChangeSubscription *) subscribeToChangesWithPrefix:(id)prefix
+                                                capacity:(NSUInteger)capacity
+                                          overflowPolicy:(LDBChangeOverflowPolicy)policy
+                                                   queue:(dispatch_queue_t)queue
+                                              usingBlock:(LevelDBChangesBlock)block {
+    EnterOperation(nil);
+    LDBChangeSubscription *subscription = [[LDBChangeSubscription alloc] initWithDB:self
+                                                                             prefix:(EnsureNSData(prefix))
+                                                                           capacity:capacity
+                                                                     overflowPolicy:policy
+                                                                              queue:queue
+                                                                         usingBlock:block];
+    changeFeed->Add(subscription);
+    return [subscription autorelease];
+}
+- (void) _removeChangeSubscription:(LDBChangeSubscription *)subscription {
+    changeFeed->Remove(subscription);
+}
+
+#pragma mark - Asynchronous operations
+
+// Run a task on the executor, or call `failed` instead if it is cancelled or the database is closed before it starts
+- (LDBCancellationToken *) _submitWithPriority:(LDBExecutorPriority)priority
+                                          task:(void (^)(LDBCancellationToken *token))task
+                                        failed:(void (^)(NSError *error))failed {
+    LDBCancellationToken *token = [LDBCancellationToken token];
+    [_executor submitWithPriority:priority token:token task:^{
+        if (self.closed)
+            failed(ClosedDatabaseError());
+        else
+            task(token);
+    } cancelled:^{
+        failed(CancelledError());
+    }];
+    return token;
+}
+
+- (LDBCancellationToken *) objectForKey:(id)key
+                             completion:(void (^)(id object, NSError *error))completion {
+    AssertKeyType(key);
+    NSParameterAssert(completion != nil);
+    key = [[key copy] autorelease];
+    return [self _submitWithPriority:LDBExecutorPriorityHigh task:^(LDBCancellationToken *token) {
+        id object = [self objectForKey:key];
+        // A read racing a close finds nothing
+        completion(object, (object == nil && self.closed) ? ClosedDatabaseError() : nil);
+    } failed:^(NSError *error) {
+        completion(nil, error);
+    }];
+}
+
+- (LDBCancellationToken *) objectsForKeys:(NSArray *)keys
+                           notFoundMarker:(id)marker
+                               completion:(void (^)(NSArray *objects, NSError *error))completion {
+    NSParameterAssert(marker != nil && completion != nil);
+    keys = [[keys copy] autorelease];
+    return [self _submitWithPriority:LDBExecutorPriorityHigh task:^(LDBCancellationToken *token) {
+        NSArray *objects = [self objectsForKeys:keys notFoundMarker:marker];
+        completion(objects, objects == nil ? ClosedDatabaseError() : nil);
+    } failed:^(NSError *error) {
+        completion(nil, error);
+    }];
+}
+
+- (LDBCancellationToken *) applyWritebatch:(LDBWritebatch *)writeBatch
+                                completion:(void (^)(NSError *error))completion {
+    NSParameterAssert(writeBatch != nil);
+    if (completion == nil)
+        completion = ^(NSError *error) {};
+    return [self _submitWithPriority:LDBExecutorPriorityDefault task:^(LDBCancellationToken *token) {
+        NSError *error = nil;
+        [self applyWritebatch:writeBatch synchronously:writeOptions.sync error:&error];
+        completion(error);
+    } failed:completion];
+}
+
+- (LDBCancellationToken *) enumerateKeysAndObjectsWithPrefix:(id)prefix
+                                                  usingBlock:(LevelDBKeyValueBlock)block
+                                                  completion:(void (^)(NSError *error))completion {
+    NSParameterAssert(block != nil);
+    prefix = [[prefix copy] autorelease];
+    if (completion == nil)
+        completion = ^(NSError *error) {};
+    return [self _submitWithPriority:LDBExecutorPriorityLow task:^(LDBCancellationToken *token) {
+        __block BOOL cancelled = NO;
+        [self enumerateKeysAndObjectsBackward:NO
+                                       lazily:NO
+                                startingAtKey:nil
+                          filteredByPredicate:nil
+                                    andPrefix:prefix
+                                   usingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+            if (token.cancelled) {
+                cancelled = YES;
+                *stop = YES;
+                return;
+            }
+            block(key, value, stop);
+        }];
+        completion(cancelled ? CancelledError() : self.closed ? ClosedDatabaseError() : nil);
+    } failed:completion];
+}
+
+#pragma mark - Compaction
+
+- (LevelDBCompactionStatistics) compactRangeFromKey:(id)startKey
+                                              toKey:(id)endKey
+                                           progress:(LevelDBCompactionProgressBlock)progress {
+    leveldb::Slice start, end;
+    if (startKey) {
+        AssertKeyType(startKey);
+        start = KeyFromStringOrData(startKey);
+    }
+    if (endKey) {
+        AssertKeyType(endKey);
+        end = KeyFromStringOrData(endKey);
+    }
+    return [self _compactFromSlice:startKey ? &start : NULL
+                      throughSlice:endKey ? &end : NULL
+                          progress:progress];
+}
+- (LevelDBCompactionStatistics) compactKeysWithPrefix:(id)prefix
+                                             progress:(LevelDBCompactionProgressBlock)progress {
+    NSData *prefixData = EnsureNSData(prefix);
+    if (prefixData == nil || prefixData.length == 0)
+        return [self _compactFromSlice:NULL throughSlice:NULL progress:progress];
+    
+    leveldb::Slice start = SliceFromData(prefixData);
+    std::string limitString;
+    bool bounded = PrefixUpperBound(start, &limitString);
+    leveldb::Slice limit = limitString;
+    
+    // The upper bound of the prefix is compacted along, which is harmless
+    return [self _compactFromSlice:&start throughSlice:bounded ? &limit : NULL progress:progress];
+}
+- (void) compactRangeFromKey:(id)startKey
+                       toKey:(id)endKey
+                    progress:(LevelDBCompactionProgressBlock)progress
+                  completion:(void (^)(LevelDBCompactionStatistics statistics))completion {
+    
+    EnterOperation();
+    NSData *startData = startKey ? [[(EnsureNSData(startKey)) copy] autorelease] : nil;
+    NSData *endData = endKey ? [[(EnsureNSData(endKey)) copy] autorelease] : nil;
+    
+    dispatch_async(compactionQueue, ^{
+        LevelDBCompactionStatistics stats = {};
+        if (compactionCancelled.load())
+            stats.cancelled = YES;
+        else
+            stats = [self compactRangeFromKey:startData toKey:endData progress:progress];
+        if (completion) {
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                completion(stats);
+            });
+        }
+    });
+}
+
+- (LevelDBCompactionStatistics) _compactFromSlice:(const leveldb::Slice *)start
+                                     throughSlice:(const leveldb::Slice *)end
+                                         progress:(LevelDBCompactionProgressBlock)progress {
+    LevelDBCompactionStatistics stats = {};
+    stats.cancelled = YES;
+    EnterOperation(stats);
+    stats.cancelled = NO;
+    NSTimeInterval time = LDBMonotonicTime();
+    leveldb::Slice lower = start ? *start : leveldb::Slice();
+    stats.sizeBefore = [self _approximateSizeFromSlice:lower throughSlice:end];
+    
+    // Steps hold roughly the same amount of data, so that progress is meaningful
+    std::string endString = end ? end->ToString() : std::string();
+    std::vector<std::string> splits = ShardSplitKeys(db, comparator, lower.ToString(), end ? &endString : NULL, kCompactionSteps);
+    size_t steps = splits.size() + 1;
+    BOOL stop = false;
+    
+    for (size_t i = 0; i < steps && !stop; i++) {
+        if (compactionCancelled.load())
+            break;
+        leveldb::Slice from, to;
+        if (i > 0) from = splits[i - 1];
+        if (i < steps - 1) to = splits[i];
+        db->CompactRange(i > 0 ? &from : start, i < steps - 1 ? &to : end);
+        stats.steps++;
+        if (progress) progress((double)stats.steps / steps, &stop);
+    }
+    
+    stats.cancelled = (stats.steps < steps);
+    stats.sizeAfter = [self _approximateSizeFromSlice:lower throughSlice:end];
+    stats.bytesReclaimed = (stats.sizeBefore > stats.sizeAfter) ? stats.sizeBefore - stats.sizeAfter : 0;
+    stats.time = LDBMonotonicTime() - time;
+    return stats;
+}
+
+- (void) _startCompactionTimer {
+    // The timer doesn't retain the database, which stops it when closed
+    __block LevelDB *blockSelf = self;
+    uint64_t interval = (uint64_t)(_backgroundCompactionInterval * NSEC_PER_SEC);
+    compactionTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, compactionQueue);
+    dispatch_source_set_timer(compactionTimer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+    dispatch_source_set_event_handler(compactionTimer, ^{
+        [blockSelf _compactInBackground];
+    });
+    dispatch_resume(compactionTimer);
+}
+- (void) _stopCompactionTimer {
+    if (compactionTimer == NULL)
+        return;
+    dispatch_source_cancel(compactionTimer);
+    dispatch_release(compactionTimer);
+    compactionTimer = NULL;
+}
+
+- (uint64_t) _compactionBytesWritten {
+    LevelDBStatistics stats = [self statistics];
+    uint64_t written = 0;
+    for (int level = 0; level < LevelDBNumberOfLevels; level++)
+        written += stats.levels[level].bytesWritten;
+    return written;
+}
+
+- (void) _compactInBackground {
+    if (compactionCancelled.load())
+        return;
+    
+    // The database is idle if nothing was written since the last check, and leveldb isn't busy compacting itself
+    uint64_t writes = deletionTracker->Writes();
+    uint64_t compactionBytes = [self _compactionBytesWritten];
+    BOOL idle = (writes == idleCheckWrites && compactionBytes == idleCheckCompactionBytes);
+    idleCheckWrites = writes;
+    idleCheckCompactionBytes = compactionBytes;
+    if (!idle)
+        return;
+    
+    std::vector<DeletionTracker::Range> ranges = deletionTracker->Take(_backgroundCompactionThreshold);
+    for (size_t i = 0; i < ranges.size(); i++) {
+        const DeletionTracker::Range &range = ranges[i];
+        // Give up as soon as the database is in use again, the remaining ranges waiting for the next idle window
+        if (compactionCancelled.load() || deletionTracker->Writes() != writes) {
+            for (; i < ranges.size(); i++)
+                deletionTracker->Restore(ranges[i]);
+            break;
+        }
+        
+        leveldb::Slice start = range.smallest, end = range.largest;
+        LevelDBCompactionStatistics stats = [self _compactFromSlice:range.unboundedStart ? NULL : &start
+                                                       throughSlice:range.unboundedEnd ? NULL : &end
+                                                           progress:nil];
+        LevelDBCompactionBlock block = [[_backgroundCompactionBlock retain] autorelease];
+        if (block) {
+            @autoreleasepool {
+                block(range.unboundedStart ? nil : DataFromSlice(start),
+                      range.unboundedEnd ? nil : DataFromSlice(end),
+                      stats);
+            }
+        }
+    }
+    
+    // One blob file is examined per idle window, unless the database is in use again
+    if (blobStore && !compactionCancelled.load() && deletionTracker->Writes() == writes)
+        blobStore->CollectGarbage(db, kBackgroundBlobGarbageRatio, 1, &compactionCancelled);
+    
+    // Our own compactions shouldn't count as activity at the next check
+    idleCheckCompactionBytes = [self _compactionBytesWritten];
+}
+
+#pragma mark - Large values
+
+- (LevelDBBlobCollectionStatistics) collectBlobGarbageWithRatio:(double)ratio maxFiles:(NSUInteger)maxFiles {
+    LevelDBBlobCollectionStatistics stats = {};
+    EnterOperation(stats);
+    if (blobStore == NULL)
+        return stats;
+    return blobStore->CollectGarbage(db, ratio, maxFiles, NULL);
+}
+
+- (LevelDBBlobStatistics) blobStatistics {
+    LevelDBBlobStatistics stats = {};
+    EnterOperation(stats);
+    if (blobStore == NULL)
+        return stats;
+    return blobStore->Statistics();
+}
+
+#pragma mark - Introspection
+
+- (NSString *) propertyNamed:(NSString *)name {
+    EnterOperation(nil);
+    std::string value;
+    if (!db->GetProperty(SliceFromString(name), &value))
+        return nil;
+    return [NSString stringWithUTF8String:value.c_str()];
+}
+
+- (LevelDBStatistics) statistics {
+    EnterOperation((LevelDBStatistics) {});
+    LevelDBStatistics stats = {};
+    std::string value;
+    
+    for (int level = 0; level < LevelDBNumberOfLevels; level++) {
+        std::string name = "leveldb.num-files-at-level" + std::to_string(level);
+        if (db->GetProperty(name, &value))
+            stats.levels[level].files = (NSUInteger)strtoull(value.c_str(), NULL, 10);
+    }
+    
+    // Compaction statistics are only available as a table, with a row per level that has any:
+    // Level  Files Size(MB) Time(sec) Read(MB) Write(MB)
+    if (db->GetProperty("leveldb.stats", &value)) {
+        std::istringstream lines(value);
+        std::string line;
+        while (std::getline(lines, line)) {
+            int level, files;
+            double size, time, read, written;
+            if (sscanf(line.c_str(), "%d %d %lf %lf %lf %lf", &level, &files, &size, &time, &read, &written) != 6
+                || level < 0 || level >= LevelDBNumberOfLevels)
+                continue;
+            stats.levels[level].size = (uint64_t)(size * 1048576.0);
+            stats.levels[level].compactionTime = time;
+            stats.levels[level].bytesRead = (uint64_t)(read * 1048576.0);
+            stats.levels[level].bytesWritten = (uint64_t)(written * 1048576.0);
+        }
+    }
+    
+    if (db->GetProperty("leveldb.approximate-memory-usage", &value))
+        stats.memoryUsage = strtoull(value.c_str(), NULL, 10);
+    stats.blockCacheUsage = blockCache.usage;
+    stats.blockCacheCapacity = blockCache.capacity;
+    // The memory usage property adds the block cache to the memtables
+    stats.memtableUsage = (stats.memoryUsage > stats.blockCacheUsage) ? stats.memoryUsage - stats.blockCacheUsage : 0;
+    
+    return stats;
+}
+
+- (uint64_t) approximateSizeFromKey:(id)startKey toKey:(id)endKey {
+    EnterOperation(0);
+    leveldb::Slice start, limit;
+    if (startKey) {
+        AssertKeyType(startKey);
+        start = KeyFromStringOrData(startKey);
+    }
+    if (!endKey)
+        return [self _approximateSizeFromSlice:start throughSlice:NULL];
+    
+    AssertKeyType(endKey);
+    limit = KeyFromStringOrData(endKey);
+    return [self _approximateSizeFromSlice:start toSlice:limit];
+}
+
+- (uint64_t) approximateSizeOfKeysWithPrefix:(id)prefix {
+    NSData *prefixData = EnsureNSData(prefix);
+    if (prefixData == nil || prefixData.length == 0)
+        return [self approximateSizeFromKey:nil toKey:nil];
+    
+    leveldb::Slice start = SliceFromData(prefixData);
+    std::string limit;
+    if (!PrefixUpperBound(start, &limit))
+        return [self approximateSizeFromKey:prefixData toKey:nil];
+    return [self _approximateSizeFromSlice:start toSlice:limit];
+}
+
+- (uint64_t) _approximateSizeFromSlice:(const leveldb::Slice &)start throughSlice:(const leveldb::Slice *)end {
+    EnterOperation(0);
+    std::string limit;
+    if (end) {
+        limit = end->ToString();
+    } else {
+        // Without an end key, the range ends with the last key
+        leveldb::Iterator *iter = NewUserKeyIterator(db->NewIterator(readOptions), comparator);
+        iter->SeekToLast();
+        if (iter->Valid())
+            limit = iter->key().ToString();
+        delete iter;
+    }
+    limit.push_back('\0');
+    return [self _approximateSizeFromSlice:start toSlice:limit];
+}
+- (uint64_t) _approximateSizeFromSlice:(const leveldb::Slice &)start toSlice:(const leveldb::Slice &)limit {
+    EnterOperation(0);
+    if (comparator->Compare(limit, start) <= 0)
+        return 0;
+    leveldb::Range range(start, limit);
+    uint64_t size = 0;
+    db->GetApproximateSizes(&range, 1, &size);
+    return size;
+}
+
+- (LDBLatencySnapshot *) latencySnapshot {
+    return latencyRecorder->Snapshot();
+}
+
+- (void) resetLatencies {
+    latencyRecorder->Reset();
+}
+
+#pragma mark - Parallel enumeration
+
+- (void) enumerateKeysAndObjectsConcurrentlyWithPrefix:(id)prefix
+                                                shards:(NSUInteger)shards
+                                               ordered:(BOOL)ordered
+                                            usingBlock:(LevelDBShardKeyValueBlock)block {
+    [self enumerateKeysAndObjectsConcurrentlyWithPrefix:prefix
+                                                 shards:shards
+                                                ordered:ordered
+                                           withSnapshot:nil
+                                             usingBlock:block];
+}
+- (void) enumerateKeysAndObjectsConcurrentlyWithPrefix:(id)prefix
+                                                shards:(NSUInteger)shards
+                                               ordered:(BOOL)ordered
+                                          withSnapshot:(LDBSnapshot *)snapshot
+                                            usingBlock:(LevelDBShardKeyValueBlock)block {
+    
+    NSData *prefixData = EnsureNSData(prefix);
+    NSData *limitData = nil;
+    if (prefixData.length > 0) {
+        std::string limit;
+        if (PrefixUpperBound(SliceFromData(prefixData), &limit))
+            limitData = [NSData dataWithBytes:limit.data() length:limit.size()];
+    }
+    [self enumerateKeysAndObjectsConcurrentlyFromKey:prefixData
+                                               toKey:limitData
+                                              shards:shards
+                                             ordered:ordered
+                                        withSnapshot:snapshot
+                                          usingBlock:block];
+}
+- (void) enumerateKeysAndObjectsConcurrentlyFromKey:(id)startKey
+                                              toKey:(id)endKey
+                                             shards:(NSUInteger)shards
+                                            ordered:(BOOL)ordered
+                                         usingBlock:(LevelDBShardKeyValueBlock)block {
+    [self enumerateKeysAndObjectsConcurrentlyFromKey:startKey
+                                               toKey:endKey
+                                              shards:shards
+                                             ordered:ordered
+                                        withSnapshot:nil
+                                          usingBlock:block];
+}
+- (void) enumerateKeysAndObjectsConcurrentlyFromKey:(id)startKey
+                                              toKey:(id)endKey
+                                             shards:(NSUInteger)shards
+                                            ordered:(BOOL)ordered
+                                       withSnapshot:(LDBSnapshot *)snapshot
+                                         usingBlock:(LevelDBShardKeyValueBlock)block {
+    
+    EnterOperation();
+    NSParameterAssert(block != nil);
+    if (shards == 0)
+        shards = [[NSProcessInfo processInfo] activeProcessorCount];
+    
+    std::string start, limit;
+    if (startKey) {
+        AssertKeyType(startKey);
+        start = KeyFromStringOrData(startKey).ToString();
+    }
+    if (endKey) {
+        AssertKeyType(endKey);
+        limit = KeyFromStringOrData(endKey).ToString();
+    }
+    
+    // Every shard reads from the same snapshot, whether or not one was provided
+    LDBBlobReadGuard blobReads(blobStore);
+    leveldb::ReadOptions options = readOptions;
+    const leveldb::Snapshot *implicitSnapshot = NULL;
+    if (snapshot != nil)
+        options.snapshot = [snapshot getSnapshot];
+    else
+        options.snapshot = implicitSnapshot = db->GetSnapshot();
+    
+    std::vector<std::string> splits = ShardSplitKeys(db, comparator, start, endKey ? &limit : NULL, shards);
+    size_t shardCount = splits.size() + 1;
+    
+    // Blocks can't capture these by copy, so they are handed over by pointer
+    const std::vector<std::string> *splitsPtr = &splits;
+    const std::string *startPtr = &start, *limitPtr = endKey ? &limit : NULL;
+    const leveldb::ReadOptions *optionsPtr = &options;
+    std::atomic<bool> stopFlag(false);
+    std::atomic<bool> *stopPtr = &stopFlag;
+    
+    void (^scan)(size_t, void (^)(const leveldb::Slice &, const leveldb::Slice &, BOOL *)) =
+    ^(size_t shard, void (^visit)(const leveldb::Slice &, const leveldb::Slice &, BOOL *)) {
+        leveldb::Slice shardStart = (shard == 0) ? leveldb::Slice(*startPtr) : leveldb::Slice((*splitsPtr)[shard - 1]);
+        leveldb::Slice shardLimit;
+        bool bounded = true;
+        if (shard < shardCount - 1)
+            shardLimit = (*splitsPtr)[shard];
+        else if (limitPtr)
+            shardLimit = *limitPtr;
+        else
+            bounded = false;
+        
+        ScanShard(db, comparator, *optionsPtr, shardStart, bounded ? &shardLimit : NULL, stopPtr, visit);
+    };
+    
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    
+    if (!ordered) {
+        dispatch_apply(shardCount, queue, ^(size_t shard) {
+            scan(shard, ^(const leveldb::Slice &key, const leveldb::Slice &value, BOOL *stop) {
+                LevelDBKey lk = GenericKeyFromSlice(key);
+                id v = DecodeSliceValue(value, &lk);
+                block(shard, &lk, v, stop);
+            });
+        });
+    } else {
+        // Shards are decoded concurrently, and handed to the caller one after the other, in key order
+        std::vector<ShardBuffer> buffers(shardCount);
+        ShardBuffer *buffersPtr = buffers.data();
+        dispatch_group_t group = dispatch_group_create();
+        
+        for (size_t shard = 0; shard < shardCount; shard++) {
+            dispatch_group_async(group, queue, ^{
+                ShardBuffer *buffer = &buffersPtr[shard];
+                scan(shard, ^(const leveldb::Slice &key, const leveldb::Slice &value, BOOL *stop) {
+                    LevelDBKey lk = GenericKeyFromSlice(key);
+                    id v = [DecodeSliceValue(value, &lk) retain];
+                    NSData *k = [[NSData alloc] initWithBytes:key.data() length:key.size()];
+                    
+                    std::unique_lock<std::mutex> lock(buffer->mu);
+                    buffer->cv.wait(lock, [buffer, stopPtr] {
+                        return buffer->entries.size() < kParallelScanBufferSize || stopPtr->load();
+                    });
+                    if (stopPtr->load()) {
+                        [k release];
+                        [v release];
+                        *stop = YES;
+                        return;
+                    }
+                    buffer->entries.push_back(std::make_pair(k, v));
+                    buffer->cv.notify_all();
+                });
+                std::lock_guard<std::mutex> lock(buffer->mu);
+                buffer->finished = true;
+                buffer->cv.notify_all();
+            });
+        }
+        
+        for (size_t shard = 0; shard < shardCount && !stopFlag.load(); shard++) {
+            ShardBuffer &buffer = buffers[shard];
+            while (true) {
+                NSData *k;
+                id v;
+                {
+                    std::unique_lock<std::mutex> lock(buffer.mu);
+                    buffer.cv.wait(lock, [&buffer] { return !buffer.entries.empty() || buffer.finished; });
+                    if (buffer.entries.empty())
+                        break;
+                    k = buffer.entries.front().first;
+                    v = buffer.entries.front().second;
+                    buffer.entries.pop_front();
+                    buffer.cv.notify_all();
+                }
+                
+                BOOL stop = NO;
+                @autoreleasepool {
+                    LevelDBKey lk = (LevelDBKey) { .data = (const char *)[k bytes], .length = [k length] };
+                    block(shard, &lk, v, &stop);
+                    [k release];
+                    [v release];
+                }
+                if (stop) {
+                    stopFlag.store(true);
+                    break;
+                }
+            }
+        }
+        
+        // Wake up shards waiting for room in their buffer, so they notice the enumeration was stopped
+        if (stopFlag.load()) {
+            for (ShardBuffer &buffer : buffers) {
+                std::lock_guard<std::mutex> lock(buffer.mu);
+                buffer.cv.notify_all();
+            }
+        }
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        dispatch_release(group);
+        
+        for (ShardBuffer &buffer : buffers) {
+            for (auto &entry : buffer.entries) {
+                [entry.first release];
+                [entry.second release];
+            }
+        }
+    }
+    
+    if (implicitSnapshot != NULL)
+        db->ReleaseSnapshot(implicitSnapshot);
+}
+
+- (std::vector<std::string>) _shardSplitKeysFromKey:(const std::string &)start
+                                              toKey:(const std::string *)limit
+                                             shards:(size_t)shards {
+    return ShardSplitKeys(db, comparator, start, limit, shards);
+}
+
 #pragma mark - Bookkeeping
 
 - (void) deleteDatabaseFromDisk {
@@ -656,29 +3334,99 @@ LevelDBOptions MakeLevelDBOptions() {
     [fileManager removeItemAtPath:_path error:&error];
 }
 
+- (LDBInFlightTracker *) inFlightTracker {
+    return inFlight;
+}
+
+- (const leveldb::Comparator *) comparator {
+    return comparator;
+}
+
+- (LDBBlobStore *) blobStore {
+    return blobStore;
+}
+
+// Decode a value read by an iterator of the database, for cursors to share `DecodeSliceValue`
+- (id) _decodeValue:(const leveldb::Slice &)value forKey:(LevelDBKey *)key {
+    return DecodeSliceValue(value, key);
+}
+
+- (void) _registerResource:(id)resource {
+    std::lock_guard<std::mutex> lock(resourcesMu);
+    openResources.insert(resource);
+}
+- (void) _closeResource:(id)resource usingBlock:(void (^)(void))block {
+    // Under the same lock as the database closing them, so that a resource is only ever closed once
+    std::lock_guard<std::mutex> lock(resourcesMu);
+    if (openResources.erase(resource) > 0)
+        block();
+}
+
 - (void) close {
-    @synchronized(self) {
-        if (db) {
-            delete db;
-            if (cache) {
-                delete cache;
-            }
-            if (filterPolicy) {
-                delete filterPolicy;
-            }
-            db = NULL;
+    // Not under the monitor of the compaction setters, which operations in flight may be waiting for
+    std::lock_guard<std::mutex> lock(closeMu);
+    if (db) {
+        // Cancel compactions and refuse new operations, so that the setters can't restart the timer
+        @synchronized(self) {
+            compactionCancelled = true;
+            [self _stopCompactionTimer];
+            inFlight->BeginClose();
+        }
+        // Wait for every operation in flight (including the compaction in progress)
+        inFlight->WaitForOperations();
+        if (dispatch_get_specific(&compactionQueue) == NULL)
+            dispatch_sync(compactionQueue, ^{});
+        
+        // Release the snapshots and iterators still open
+        {
+            std::lock_guard<std::mutex> lock(resourcesMu);
+            for (id resource : openResources)
+                [resource databaseWillClose];
+            openResources.clear();
+        }
+        
+        // Wait for pending combined writes before closing
+        delete writeCombiner;
+        writeCombiner = NULL;
+        changeFeed->DetachAll();
+        delete objectCache;
+        objectCache = NULL;
+        changeFeed->SetBlobStore(NULL);
+        delete db;
+        delete blobStore;
+        blobStore = NULL;
+        [blockCache release];
+        blockCache = nil;
+        if (filterPolicy) {
+            delete filterPolicy;
+            filterPolicy = NULL;
         }
+        db = NULL;
     }
 }
 - (BOOL) closed {
-    return db == NULL;
+    return db == NULL || inFlight->Closing();
 }
 - (void) dealloc {
     [self close];
+    // Left over by an initialization that failed before the database was opened
+    delete writeCombiner;
+    delete objectCache;
+    delete filterPolicy;
+    [blockCache release];
+    // Latencies stay available once the database is closed
+    delete latencyRecorder;
+    delete deletionTracker;
+    delete indexSet;
+    delete changeFeed;
+    delete inFlight;
+    if (compactionQueue) dispatch_release(compactionQueue);
     if (_path) [_path release];
     if (_name) [_name release];
     if (_encoder) [_encoder release];
     if (_decoder) [_decoder release];
+    [_backgroundCompactionBlock release];
+    [_executor release];
     [super dealloc];
 }
 
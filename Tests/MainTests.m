@@ -7,6 +7,20 @@
 //
 
 #import "BaseTestClass.h"
+#import <Objective-LevelDB/LDBKeyPredicate.h>
+#import <Objective-LevelDB/LDBCodec.h>
+#import <Objective-LevelDB/LDBSnapshot.h>
+#import <Objective-LevelDB/LDBWriteBatch.h>
+#import <Objective-LevelDB/LDBOptions.h>
+#import <Objective-LevelDB/LDBInstrumentation.h>
+#import <Objective-LevelDB/LDBBulkLoader.h>
+#import <Objective-LevelDB/LDBCursor.h>
+#import <Objective-LevelDB/LDBChangeFeed.h>
+#import <Objective-LevelDB/LDBExecutor.h>
+#import <Objective-LevelDB/LDBKeyspace.h>
+#import <Objective-LevelDB/LDBKeyEncoding.h>
+#import <Objective-LevelDB/LDBIndex.h>
+#import <Objective-LevelDB/LDBArchive.h>
 
 @interface MainTests : BaseTestClass
 
@@ -57,6 +71,40 @@ static NSUInteger numberOfIterations = 2500;
     XCTAssertEqual([db allKeys], @[], @"The list of keys should be empty after removing all objects from the database");
 }
 
+- (void)testCombinedWrites {
+    db.combinesWrites = YES;
+    db.safe = YES;
+    
+    dispatch_apply(100, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        [db setObject:@[@(i)] forKey:[NSString stringWithFormat:@"key:%03lu", (unsigned long)i]];
+    });
+    XCTAssertEqual([db allKeys].count, (NSUInteger)100, @"Every combined write should be committed once it returns");
+    
+    [db removeObjectForKey:@"key:042"];
+    XCTAssertNil(db[@"key:042"], @"A combined removal should be committed once it returns");
+    
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    __block NSError *writeError = nil;
+    [db setObject:@[@42] forKey:@"key:042" completion:^(NSError *error) {
+        writeError = error;
+        dispatch_semaphore_signal(semaphore);
+    }];
+    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    XCTAssertNil(writeError, @"An asynchronous write should succeed");
+    XCTAssertEqualObjects(db[@"key:042"], @[@42], @"An asynchronous write should be visible once completed");
+    
+    // Without combined writes, a synchronous write still commits after the asynchronous writes made before it
+    db.combinesWrites = NO;
+    db.writeGroupLatency = 0.1;
+    for (NSUInteger i = 0; i < 10; i++)
+        [db setObject:@[@(i)] forKey:@"key:000" completion:nil];
+    [db setObject:@[@"last"] forKey:@"key:000"];
+    [db removeObjectForKey:@"key:001" completion:nil];
+    [db setObject:@[@"kept"] forKey:@"key:001"];
+    XCTAssertEqualObjects(db[@"key:000"], @[@"last"], @"");
+    XCTAssertEqualObjects(db[@"key:001"], @[@"kept"], @"");
+}
+
 - (void)testRemovingKeysWithPrefix {
     id value = @{@"foo": @"bar"};
     [db setObject:value forKey:@"dict1"];
@@ -69,6 +117,29 @@ static NSUInteger numberOfIterations = 2500;
                    @"There should be only 1 key remaining after removing all those prefixed with 'dict'");
 }
 
+- (void)testRemovingKeyRanges {
+    for (int i = 0; i < 100; i++)
+        [db setObject:@[@(i)] forKey:[NSString stringWithFormat:@"key:%03d", i]];
+    [db setObject:@[@0] forKey:@"key"];
+    
+    NSUInteger removed = [db removeObjectsFromKey:@"key:010"
+                                            toKey:@"key:020"
+                             compactingAfterwards:YES
+                                       usingBlock:nil];
+    XCTAssertEqual(removed, (NSUInteger)10, @"Only keys in [start, end) should be removed");
+    XCTAssertNotNil(db[@"key:020"], @"The end key of the range should be kept");
+    
+    __block NSUInteger progress = 0;
+    removed = [db removeAllObjectsWithPrefix:@"key:"
+                        compactingAfterwards:NO
+                                  usingBlock:^(NSUInteger count, BOOL *stop) {
+                                      progress = count;
+                                  }];
+    XCTAssertEqual(removed, (NSUInteger)90, @"Every remaining prefixed key should be removed");
+    XCTAssertEqual(progress, removed, @"Progress should be reported up to the last removed key");
+    XCTAssertNotNil(db[@"key"], @"A key shorter than the prefix should not be removed");
+}
+
 - (void)testDictionaryManipulations {
     NSDictionary *objects = @{
         @"key1": @[@1, @2],
@@ -94,6 +165,37 @@ static NSUInteger numberOfIterations = 2500;
     }
 }
 
+- (void)testMultiGetStrategies {
+    NSMutableArray *keys = [NSMutableArray array];
+    for (int i = 0; i < 100; i++) {
+        NSString *key = [NSString stringWithFormat:@"key:%03d", i];
+        [keys addObject:key];
+        if (i % 2 == 0)
+            [db setObject:@[@(i)] forKey:key];
+    }
+    
+    // Shuffle the keys, results should still come back in the caller's order
+    for (NSUInteger i = keys.count - 1; i > 0; i--)
+        [keys exchangeObjectAtIndex:i withObjectAtIndex:arc4random_uniform((u_int32_t)i + 1)];
+    
+    LevelDBMultiGetStatistics stats;
+    NSArray *values = [db objectsForKeys:keys notFoundMarker:[NSNull null] statistics:&stats];
+    XCTAssertEqual(stats.strategy, LevelDBMultiGetIteratorSeeks,
+                   @"Densely packed keys should be fetched with a single iterator");
+    XCTAssertEqual(stats.keyCount, (NSUInteger)100, @"Every key should be accounted for");
+    XCTAssertEqual(stats.foundCount, (NSUInteger)50, @"Only half of the keys were inserted");
+    
+    [keys enumerateObjectsUsingBlock:^(NSString *key, NSUInteger idx, BOOL *stop) {
+        int i = [[key substringFromIndex:4] intValue];
+        id expected = (i % 2 == 0) ? @[@(i)] : [NSNull null];
+        XCTAssertEqualObjects(values[idx], expected, @"Values should be returned in the order of the keys");
+    }];
+    
+    values = [db objectsForKeys:@[@"key:002", @"key:001"] notFoundMarker:[NSNull null] statistics:&stats];
+    XCTAssertEqual(stats.strategy, LevelDBMultiGetPointLookups, @"A handful of keys should use point lookups");
+    XCTAssertEqualObjects(values, (@[@[@2], [NSNull null]]), @"Point lookups should yield the same values");
+}
+
 - (void)testPredicateFiltering {
     NSPredicate *predicate = [NSPredicate predicateWithFormat:@"price BETWEEN {25, 50}"];
     NSMutableArray *resultKeys = [NSMutableArray array];
@@ -495,4 +597,994 @@ static NSUInteger numberOfIterations = 2500;
     [db removeAllObjects];
 }
 
+- (void)testParallelEnumerations {
+    NSArray *pairs = [self nPairs:numberOfIterations];
+    
+    __block NSUInteger r = 0;
+    [db enumerateKeysAndObjectsConcurrentlyWithPrefix:nil
+                                               shards:4
+                                              ordered:YES
+                                           usingBlock:^(NSUInteger shard, LevelDBKey *lkey, id value, BOOL *stop) {
+                                               XCTAssertEqualObjects(NSStringFromLevelDBKey(lkey), pairs[r][0],
+                                                                     @"Ordered parallel enumeration should yield keys in order");
+                                               XCTAssertEqualObjects(value, pairs[r][1],
+                                                                     @"Ordered parallel enumeration should yield the values");
+                                               r++;
+                                           }];
+    XCTAssertEqual(r, pairs.count, @"Every key should be enumerated once");
+    
+    NSMutableSet *keys = [NSMutableSet set];
+    NSLock *lock = [[NSLock alloc] init];
+    [db enumerateKeysAndObjectsConcurrentlyFromKey:nil
+                                             toKey:nil
+                                            shards:4
+                                           ordered:NO
+                                        usingBlock:^(NSUInteger shard, LevelDBKey *lkey, id value, BOOL *stop) {
+                                            [lock lock];
+                                            [keys addObject:NSStringFromLevelDBKey(lkey)];
+                                            [lock unlock];
+                                        }];
+    XCTAssertEqual(keys.count, pairs.count, @"Every key should be enumerated by one of the shards");
+    
+    r = 0;
+    [db enumerateKeysAndObjectsConcurrentlyWithPrefix:nil
+                                               shards:4
+                                              ordered:YES
+                                           usingBlock:^(NSUInteger shard, LevelDBKey *lkey, id value, BOOL *stop) {
+                                               if (++r == 10) *stop = YES;
+                                           }];
+    XCTAssertEqual(r, (NSUInteger)10, @"Stopping an ordered parallel enumeration should stop every shard");
+}
+
+- (void)testKeyPredicateEnumerations {
+    [db addEntriesFromDictionary:@{@"tess:0": @{@"key": @0},
+                                   @"test:1": @{@"key": @1},
+                                   @"test:2": @{@"key": @2},
+                                   @"test:3": @{@"key": @3},
+                                   @"test:4": @{@"key": @4},
+                                   @"tesu:5": @{@"key": @5}}];
+    
+    __block NSUInteger decoded = 0;
+    LevelDBDecoderBlock decoder = db.decoder;
+    db.decoder = ^ id (LevelDBKey *key, NSData *data) {
+        decoded++;
+        return decoder(key, data);
+    };
+    
+    NSArray *keys = [db keysMatchingKeyPredicate:[LDBKeyPredicate predicateWithPrefix:@"test"]];
+    XCTAssertEqual(keys.count, (NSUInteger)4, @"Prefix key predicates should restrict keys to the prefixed region");
+    
+    LDBKeyPredicate *between = [LDBKeyPredicate predicateFromPredicate:
+                                [NSPredicate predicateWithFormat:@"SELF BETWEEN {'test:2', 'test:3'}"]];
+    XCTAssertNotNil(between.lowerBound, @"BETWEEN predicates should be turned into bounds");
+    XCTAssertNil(between.block, @"BETWEEN predicates should be turned into bounds");
+    
+    __block int i = 3;
+    [db enumerateKeysBackward:YES
+         matchingKeyPredicate:between
+          filteredByPredicate:nil
+                   usingBlock:^(LevelDBKey *lkey, BOOL *stop) {
+                       XCTAssertEqualObjects(NSStringFromLevelDBKey(lkey), ([NSString stringWithFormat:@"test:%d", i]),
+                                             @"Keys should be restricted to the bounds, included");
+                       i--;
+                   }];
+    XCTAssertEqual(i, 1, @"");
+    
+    LDBKeyPredicate *compound = [LDBKeyPredicate predicateFromPredicate:
+                                 [NSPredicate predicateWithFormat:@"SELF BEGINSWITH 'test' AND SELF > 'test:1' AND SELF ENDSWITH '3'"]];
+    XCTAssertEqualObjects([db keysMatchingKeyPredicate:compound], @[[@"test:3" dataUsingEncoding:NSUTF8StringEncoding]],
+                          @"Compound predicates should combine bounds and key tests");
+    XCTAssertEqual(decoded, (NSUInteger)0, @"Key predicates alone should not decode any value");
+    
+    LDBKeyPredicate *odd = [LDBKeyPredicate predicateWithBlock:^BOOL(LevelDBKey *key) {
+        return (key->data[key->length - 1] - '0') % 2 == 1;
+    }];
+    NSDictionary *results = [db dictionaryByFilteringWithKeyPredicate:odd
+                                                         andPredicate:[NSPredicate predicateWithFormat:@"key > 1"]];
+    XCTAssertEqual(results.count, (NSUInteger)2, @"Value predicates should apply to the keys matching the key predicate");
+    XCTAssertEqual(decoded, (NSUInteger)3, @"Only the values of matching keys should be decoded");
+    
+    LDBKeyPredicate *exclusive = [LDBKeyPredicate predicateWithLowerBound:@"test:1" inclusive:NO
+                                                               upperBound:@"test:4" inclusive:NO];
+    i = 2;
+    [db enumerateKeysAndObjectsBackward:NO
+                                 lazily:NO
+                   matchingKeyPredicate:exclusive
+                    filteredByPredicate:nil
+                             usingBlock:^(LevelDBKey *lkey, NSDictionary *value, BOOL *stop) {
+                                 XCTAssertEqualObjects(value[@"key"], @(i), @"Exclusive bounds should be skipped");
+                                 i++;
+                             }];
+    XCTAssertEqual(i, 4, @"");
+}
+
+- (void)testCursors {
+    for (NSUInteger i = 0; i < 100; i++)
+        [db setObject:@[@(i)] forKey:[NSString stringWithFormat:@"page:%03lu", (unsigned long)i]];
+    [db setObject:@[@"outside"] forKey:@"pagf"];
+    
+    LDBCursor *cursor = [db newCursorWithPrefix:@"page:"];
+    NSMutableArray *keys = [NSMutableArray array], *values = [NSMutableArray array];
+    XCTAssertEqual([cursor fetchNext:30 intoKeys:keys values:values], (NSUInteger)30, @"");
+    XCTAssertEqualObjects(values[29], @[@29], @"");
+    NSData *continuation = [cursor continuationKey];
+    
+    // Keys removed or added past the continuation key are seen by a resumed cursor
+    [db removeObjectForKey:@"page:030"];
+    [db setObject:@[@"added"] forKey:@"page:030a"];
+    LDBCursor *resumed = [db newCursorWithPrefix:@"page:"];
+    [resumed seekToContinuationKey:continuation];
+    XCTAssertEqual([resumed fetchNext:2 intoKeys:keys values:values], (NSUInteger)2, @"");
+    XCTAssertEqualObjects(values, (@[@[@"added"], @[@31]]), @"Buffers should be emptied before every page");
+    
+    NSUInteger total = 32;
+    while ([resumed fetchNext:30 intoKeys:keys values:nil] > 0)
+        total += keys.count;
+    XCTAssertEqual(total, (NSUInteger)100, @"The cursor should stop at its upper bound");
+    XCTAssertFalse(resumed.valid, @"");
+    XCTAssertNil([resumed continuationKey], @"");
+    
+    [cursor seekToLast];
+    XCTAssertEqualObjects(cursor.key, [@"page:099" dataUsingEncoding:NSUTF8StringEncoding], @"");
+    [cursor prev];
+    XCTAssertEqualObjects(cursor.value, @[@98], @"");
+    [cursor seekToKey:@"a"];
+    XCTAssertEqualObjects(cursor.key, [@"page:000" dataUsingEncoding:NSUTF8StringEncoding],
+                          @"Seeking before the lower bound should stop on the first key");
+    
+    LDBSnapshot *snapshot = [db newSnapshot];
+    [db setObject:@[@"late"] forKey:@"page:100"];
+    LDBCursor *frozen = [snapshot newCursorFromKey:@"page:090" toKey:nil];
+    NSUInteger count = 0;
+    for (NSData *key in frozen)
+        count++;
+    XCTAssertEqual(count, (NSUInteger)11, @"Snapshot cursors should ignore later writes, and honor their bounds");
+    [frozen close];
+    [snapshot close];
+}
+
+- (void)testKeyspaces {
+    LDBKeyspace *tenant1 = [db keyspaceWithPrefix:@"t1:"];
+    LDBKeyspace *tenant2 = [db keyspaceWithPrefix:@"t2:"];
+    for (NSUInteger i = 0; i < 10; i++) {
+        NSString *key = [NSString stringWithFormat:@"%lu", (unsigned long)i];
+        tenant1[key] = @[@(i)];
+        tenant2[key] = @[@(i * 2)];
+    }
+    XCTAssertEqualObjects(tenant1[@"3"], @[@3], @"");
+    XCTAssertEqualObjects(tenant2[@"3"], @[@6], @"Keyspaces should be isolated");
+    XCTAssertEqualObjects(db[@"t2:3"], @[@6], @"Keys should be stored with their prefix");
+    XCTAssertEqualObjects([tenant1 objectsForKeys:@[@"1", @"missing"] notFoundMarker:@""], (@[@[@1], @""]), @"");
+    
+    NSMutableArray *keys = [NSMutableArray array];
+    [tenant1 enumerateKeysBackward:YES startingAtKey:@"5" filteredByPredicate:nil andPrefix:nil usingBlock:^(LevelDBKey *key, BOOL *stop) {
+        [keys addObject:NSStringFromLevelDBKey(key)];
+    }];
+    XCTAssertEqualObjects(keys, (@[@"5", @"4", @"3", @"2", @"1", @"0"]), @"Keys should be relative to the keyspace");
+    
+    [tenant1 performWritebatch:^(LDBWritebatch *wb) {
+        [wb removeObjectForKey:@"0"];
+        [wb setObject:@[@"batched"] forKey:@"10"];
+    }];
+    XCTAssertFalse([tenant1 objectExistsForKey:@"0"], @"");
+    XCTAssertEqualObjects(db[@"t1:10"], @[@"batched"], @"Write batches should prefix their keys");
+    
+    [tenant1 removeAllObjects];
+    XCTAssertEqual([tenant1 allKeys].count, (NSUInteger)0, @"");
+    XCTAssertEqual([tenant2 allKeys].count, (NSUInteger)10, @"Removing a keyspace should leave the others alone");
+    
+    // Keys shorter than a prefix aren't prefixed with it
+    db[@"ab"] = @[@"short"];
+    db[@"abc1"] = @[@"long"];
+    [keys removeAllObjects];
+    [db enumerateKeysBackward:YES startingAtKey:nil filteredByPredicate:nil andPrefix:@"abc" usingBlock:^(LevelDBKey *key, BOOL *stop) {
+        [keys addObject:NSStringFromLevelDBKey(key)];
+    }];
+    XCTAssertEqualObjects(keys, (@[@"abc1"]), @"");
+    
+    // Prefix filters only reject lookups, and never miss keys
+    LDBOptions *options = [LDBOptions options];
+    options.filterPolicy = 10;
+    options.prefixFilterLength = 3;
+    LevelDB *filtered = [LevelDB databaseInLibraryWithName:@"PrefixFilterDB" options:options];
+    LDBKeyspace *keyspace = [filtered keyspaceWithPrefix:@"t1:"];
+    for (NSUInteger i = 0; i < 1000; i++)
+        keyspace[[NSString stringWithFormat:@"%04lu", (unsigned long)i]] = @(i);
+    [filtered compactKeysWithPrefix:nil progress:nil];
+    XCTAssertEqualObjects(keyspace[@"0500"], @500, @"");
+    XCTAssertNil([filtered keyspaceWithPrefix:@"t2:"][@"0500"], @"");
+    [filtered close];
+    [filtered deleteDatabaseFromDisk];
+}
+
+- (void)testBuiltinCodecs {
+    LDBCodecRegistry *codecs = [LDBCodecRegistry sharedRegistry];
+    db.encoder = [codecs defaultEncoder];
+    db.decoder = [codecs decoder];
+    
+    NSDate *date = [NSDate dateWithTimeIntervalSinceReferenceDate:123456.5];
+    NSArray *values = @[@YES, @(-42), @(ULLONG_MAX), @3.25, @"laval", [@"bytes" dataUsingEncoding:NSUTF8StringEncoding],
+                        date, [NSNull null], @[@1, @"two", @[@3]], @{@"foo": @{@"bar": @[@1, @2]}, @"baz": @NO}];
+    [values enumerateObjectsUsingBlock:^(id value, NSUInteger idx, BOOL *stop) {
+        NSString *key = [NSString stringWithFormat:@"value:%lu", (unsigned long)idx];
+        [db setObject:value forKey:key];
+        XCTAssertEqualObjects([db objectForKey:key], value, @"The binary codec should keep property list values intact");
+    }];
+    
+    NSURL *url = [NSURL URLWithString:@"http://example.com"];
+    [db setObject:url forKey:@"url"];
+    XCTAssertEqualObjects([db objectForKey:@"url"], url, @"Other objects should fall back to keyed archiving");
+    
+    unichar surrogate[] = { 'a', 0xd800, 'b' };
+    NSString *unconvertible = [NSString stringWithCharacters:surrogate length:3];
+    XCTAssertFalse([[LDBBinaryCodec codec] canEncodeObject:unconvertible], @"Strings without UTF-8 form should be left to keyed archiving");
+    [db setObject:unconvertible forKey:@"surrogate"];
+    XCTAssertEqualObjects([db objectForKey:@"surrogate"], unconvertible, @"Strings without UTF-8 form should round trip");
+    
+    XCTAssertFalse([[db objectForKey:@"value:9"] isKindOfClass:[NSMutableDictionary class]],
+                   @"Binary encoded dictionaries should decode immutable");
+    NSMutableArray *mutable = [NSMutableArray arrayWithObject:@"element"];
+    XCTAssertFalse([[LDBBinaryCodec codec] canEncodeObject:mutable], @"Mutable containers should be left to keyed archiving");
+    [db setObject:mutable forKey:@"mutable"];
+    XCTAssertEqualObjects([db objectForKey:@"mutable"], mutable, @"");
+    XCTAssertTrue([[db objectForKey:@"mutable"] isKindOfClass:[NSMutableArray class]],
+                  @"Keyed archiving should keep mutable containers mutable");
+    
+    id nested = @"leaf";
+    for (NSUInteger i = 0; i < 100; i++)
+        nested = @[nested];
+    XCTAssertFalse([[LDBBinaryCodec codec] canEncodeObject:nested], @"Deep nesting should be left to keyed archiving");
+    [db setObject:nested forKey:@"nested"];
+    XCTAssertEqualObjects([db objectForKey:@"nested"], nested, @"Deeply nested values should round trip");
+    
+    db.encoder = [codecs encoderWithCodec:[LDBNumberCodec codec]];
+    [db setObject:@(1 << 20) forKey:@"number"];
+    db.encoder = [codecs encoderWithCodec:[LDBRawDataCodec codec]];
+    [db setObject:[@"raw" dataUsingEncoding:NSUTF8StringEncoding] forKey:@"raw"];
+    db.encoder = ^ NSData * (LevelDBKey *key, id object) {
+        return [NSKeyedArchiver archivedDataWithRootObject:object];
+    };
+    [db setObject:@{@"legacy": @YES} forKey:@"legacy"];
+    
+    XCTAssertEqualObjects(db[@"number"], @(1 << 20), @"Values should be decoded by the codec they were tagged with");
+    XCTAssertEqualObjects(db[@"raw"], [@"raw" dataUsingEncoding:NSUTF8StringEncoding],
+                          @"Values should be decoded by the codec they were tagged with");
+    XCTAssertEqualObjects(db[@"legacy"], @{@"legacy": @YES}, @"Untagged keyed archives should still be decoded");
+    XCTAssertEqualObjects(db[@"value:9"], values[9], @"Values written before the encoder changed should still be decoded");
+}
+
+- (void)testObjectCache {
+    db.objectCacheSize = 1024 * 1024;
+    [db setObject:@{@"key": @1} forKey:@"hot"];
+    
+    XCTAssertEqualObjects(db[@"hot"], @{@"key": @1}, @"");
+    XCTAssertEqualObjects(db[@"hot"], @{@"key": @1}, @"");
+    LevelDBObjectCacheStatistics stats = db.objectCacheStatistics;
+    XCTAssertEqual(stats.misses, (NSUInteger)1, @"The first read should miss the object cache");
+    XCTAssertEqual(stats.hits, (NSUInteger)1, @"Following reads should hit the object cache");
+    XCTAssertEqual(stats.count, (NSUInteger)1, @"");
+    
+    LDBSnapshot *snapshot = [db newSnapshot];
+    [db setObject:@{@"key": @2} forKey:@"hot"];
+    XCTAssertEqualObjects(db[@"hot"], @{@"key": @2}, @"Setting a key should invalidate its cached object");
+    XCTAssertEqualObjects([snapshot objectForKey:@"hot"], @{@"key": @1}, @"Snapshot reads should bypass the object cache");
+    [snapshot close];
+    
+    [db removeObjectForKey:@"hot"];
+    XCTAssertNil(db[@"hot"], @"Removing a key should invalidate its cached object");
+    
+    [db setObject:@{@"key": @3} forKey:@"prefix:hot"];
+    XCTAssertNotNil(db[@"prefix:hot"], @"");
+    [db removeAllObjectsWithPrefix:@"prefix:"];
+    XCTAssertNil(db[@"prefix:hot"], @"Removing a prefix should invalidate the cached objects in it");
+    
+    [db setObject:@{@"key": @4} forKey:@"batched"];
+    XCTAssertNotNil(db[@"batched"], @"");
+    [db performWritebatch:^(LDBWritebatch *wb) {
+        [wb removeObjectForKey:@"batched"];
+    }];
+    XCTAssertNil(db[@"batched"], @"Applying a write batch should invalidate the cached objects of its keys");
+    
+    db.objectCacheSize = 16 * 64;
+    for (NSUInteger i = 0; i < 100; i++) {
+        NSString *key = [NSString stringWithFormat:@"evicted:%03lu", (unsigned long)i];
+        [db setObject:@{@"key": @(i)} forKey:key];
+        [db objectForKey:key];
+    }
+    stats = db.objectCacheStatistics;
+    XCTAssertTrue(stats.evictions > 0, @"Objects should be evicted once the cache is full");
+    XCTAssertTrue(stats.size <= 16 * 64, @"The object cache should stay within its size");
+}
+
+- (void)testSharedBlockCache {
+    LDBCache *cache = [LDBCache cacheWithCapacity:1024 * 1024];
+    LDBOptions *options = [LDBOptions lowMemoryOptions];
+    options.blockCache = cache;
+    options.blockSize = 1024;
+    
+    NSMutableArray *databases = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 2; i++) {
+        LevelDB *database = [LevelDB databaseInLibraryWithName:[NSString stringWithFormat:@"SharedCacheDB%lu", (unsigned long)i]
+                                                       options:options];
+        XCTAssertNotNil(database, @"Databases should open with LDBOptions");
+        for (NSUInteger j = 0; j < 1000; j++)
+            [database setObject:@(j) forKey:[NSString stringWithFormat:@"key:%04lu", (unsigned long)j]];
+        [databases addObject:database];
+    }
+    
+    for (LevelDB *database in databases) {
+        // Reopening moves the written values from the log into tables, read through the block cache
+        NSString *name = database.name;
+        [database close];
+        LevelDB *reopened = [LevelDB databaseInLibraryWithName:name options:options];
+        XCTAssertEqualObjects(reopened[@"key:0500"], @500, @"Values should be read back");
+        [reopened close];
+        [reopened deleteDatabaseFromDisk];
+    }
+    XCTAssertTrue(cache.usage > 0, @"Both databases should fill the shared block cache");
+    XCTAssertTrue(cache.usage <= cache.capacity, @"");
+}
+
+- (void)testStatistics {
+    XCTAssertNotNil([db propertyNamed:@"leveldb.stats"], @"");
+    XCTAssertNil([db propertyNamed:@"leveldb.unknown"], @"Unknown properties should be nil");
+    
+    // Enough data to fill and flush a few memtables
+    NSString *padding = [@"" stringByPaddingToLength:4096 withString:@"x" startingAtIndex:0];
+    for (NSUInteger i = 0; i < numberOfIterations; i++)
+        [db setObject:@[padding] forKey:[NSString stringWithFormat:@"stats:%05lu", (unsigned long)i]];
+    
+    LevelDBStatistics stats = [db statistics];
+    NSUInteger files = 0;
+    for (int level = 0; level < LevelDBNumberOfLevels; level++)
+        files += stats.levels[level].files;
+    XCTAssertTrue(files > 0, @"Flushed memtables should be counted as files");
+    XCTAssertTrue(stats.memtableUsage > 0, @"The memtable should hold the latest writes");
+    XCTAssertEqual(stats.blockCacheCapacity, (uint64_t)8 * 1024 * 1024, @"The default block cache should be reported");
+    
+    uint64_t all = [db approximateSizeFromKey:nil toKey:nil];
+    uint64_t prefixed = [db approximateSizeOfKeysWithPrefix:@"stats:0"];
+    XCTAssertTrue(all > 0, @"Flushed data should have a size on disk");
+    XCTAssertTrue(prefixed <= all, @"");
+    XCTAssertEqual([db approximateSizeOfKeysWithPrefix:@"missing:"], (uint64_t)0, @"");
+}
+
+- (void)testCompaction {
+    NSString *padding = [@"" stringByPaddingToLength:4096 withString:@"x" startingAtIndex:0];
+    for (NSUInteger i = 0; i < numberOfIterations; i++)
+        [db setObject:@[padding] forKey:[NSString stringWithFormat:@"compact:%05lu", (unsigned long)i]];
+    [db setObject:@[@"kept"] forKey:@"kept"];
+    [db removeAllObjectsWithPrefix:@"compact:"];
+    
+    __block double lastProgress = 0;
+    LevelDBCompactionStatistics stats = [db compactKeysWithPrefix:@"compact:" progress:^(double progress, BOOL *stop) {
+        XCTAssertTrue(progress > lastProgress, @"Progress should only increase");
+        lastProgress = progress;
+    }];
+    XCTAssertEqualWithAccuracy(lastProgress, 1.0, 0.0001, @"Every step should be reported");
+    XCTAssertFalse(stats.cancelled, @"");
+    XCTAssertTrue(stats.steps > 0, @"");
+    XCTAssertTrue(stats.sizeAfter < stats.sizeBefore, @"Removed values should be reclaimed");
+    XCTAssertEqual(stats.bytesReclaimed, stats.sizeBefore - stats.sizeAfter, @"");
+    XCTAssertEqualObjects(db[@"kept"], @[@"kept"], @"Keys outside the range should be left alone");
+    
+    stats = [db compactRangeFromKey:nil toKey:nil progress:^(double progress, BOOL *stop) {
+        *stop = YES;
+    }];
+    XCTAssertEqual(stats.steps, (NSUInteger)1, @"Stopping should skip the remaining steps");
+    
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    __block LevelDBCompactionStatistics asyncStats;
+    [db compactRangeFromKey:@"compact:" toKey:@"compact:~" progress:nil completion:^(LevelDBCompactionStatistics statistics) {
+        asyncStats = statistics;
+        dispatch_semaphore_signal(semaphore);
+    }];
+    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    XCTAssertFalse(asyncStats.cancelled, @"");
+}
+
+- (void)testBackgroundCompaction {
+    NSString *padding = [@"" stringByPaddingToLength:1024 withString:@"x" startingAtIndex:0];
+    for (NSUInteger i = 0; i < numberOfIterations; i++)
+        [db setObject:@[padding] forKey:[NSString stringWithFormat:@"background:%05lu", (unsigned long)i]];
+    
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    __block NSData *compactedStart = nil;
+    db.backgroundCompactionThreshold = numberOfIterations;
+    db.backgroundCompactionInterval = 0.05;
+    db.backgroundCompactionBlock = ^(NSData *startKey, NSData *endKey, LevelDBCompactionStatistics statistics) {
+        compactedStart = startKey;
+        dispatch_semaphore_signal(semaphore);
+    };
+    db.compactsInBackground = YES;
+    [db removeAllObjectsWithPrefix:@"background:"];
+    
+    long timedOut = dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC));
+    XCTAssertEqual(timedOut, 0L, @"The removed range should be compacted once the database is idle");
+    XCTAssertEqualObjects(compactedStart, [@"background:" dataUsingEncoding:NSUTF8StringEncoding], @"");
+    db.compactsInBackground = NO;
+}
+
+- (void)testChangeFeed {
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    NSMutableArray *changes = [NSMutableArray array];
+    LDBChangeSubscription *subscription = [db subscribeToChangesWithPrefix:@"feed:" usingBlock:^(NSArray *batch, NSUInteger dropped) {
+        XCTAssertFalse([NSThread isMainThread], @"Changes should be delivered off the writing thread");
+        [changes addObjectsFromArray:batch];
+        if (changes.count >= 4)
+            dispatch_semaphore_signal(semaphore);
+    }];
+    
+    [db setObject:@[@1] forKey:@"feed:1"];
+    [db setObject:@[@"ignored"] forKey:@"other"];
+    [db performWritebatch:^(LDBWritebatch *wb) {
+        [wb setObject:@[@2] forKey:@"feed:2"];
+        [wb removeObjectForKey:@"feed:1"];
+    }];
+    [db removeObjectForKey:@"feed:2"];
+    
+    long timedOut = dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC));
+    XCTAssertEqual(timedOut, 0L, @"");
+    XCTAssertEqual(changes.count, (NSUInteger)4, @"Only changes to prefixed keys should be delivered");
+    XCTAssertEqualObjects(changes[0][kLevelDBChangeType], kLevelDBChangeTypePut, @"");
+    XCTAssertEqualObjects(changes[0][kLevelDBChangeValue], @[@1], @"Values should be decoded");
+    XCTAssertEqualObjects(changes[2][kLevelDBChangeType], kLevelDBChangeTypeDelete, @"Changes should be in commit order");
+    XCTAssertEqualObjects(changes[3][kLevelDBChangeKey], [@"feed:2" dataUsingEncoding:NSUTF8StringEncoding], @"");
+    [subscription cancel];
+    
+    // A suspended consumer loses the newest changes, without blocking writes
+    dispatch_queue_t queue = dispatch_queue_create("test.changes", DISPATCH_QUEUE_SERIAL);
+    dispatch_suspend(queue);
+    __block NSUInteger delivered = 0, lost = 0;
+    subscription = [db subscribeToChangesWithPrefix:nil
+                                           capacity:2
+                                     overflowPolicy:LDBChangeOverflowDropNewest
+                                              queue:queue
+                                         usingBlock:^(NSArray *batch, NSUInteger dropped) {
+                                             delivered += batch.count;
+                                             lost += dropped;
+                                         }];
+    for (NSUInteger i = 0; i < 5; i++)
+        [db setObject:@[@(i)] forKey:[NSString stringWithFormat:@"overflow:%lu", (unsigned long)i]];
+    dispatch_resume(queue);
+    dispatch_sync(queue, ^{});
+    XCTAssertEqual(delivered, (NSUInteger)2, @"");
+    XCTAssertEqual(lost, (NSUInteger)3, @"Lost changes should be reported with the next delivery");
+    XCTAssertEqual(subscription.droppedCount, (NSUInteger)3, @"");
+    [subscription cancel];
+}
+
+- (void)testConcurrentClose {
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    for (NSUInteger round = 0; round < 10; round++) {
+        LevelDB *stressed = [LevelDB databaseInLibraryWithName:[NSString stringWithFormat:@"StressDB%lu", (unsigned long)round]];
+        stressed.encoder = db.encoder;
+        stressed.decoder = db.decoder;
+        for (NSUInteger i = 0; i < 100; i++)
+            [stressed setObject:@[@(i)] forKey:[NSString stringWithFormat:@"stress:%03lu", (unsigned long)i]];
+        LDBSnapshot *held = [stressed newSnapshot];
+        
+        // Readers, writers, snapshots and cursors, racing with a close
+        dispatch_group_t group = dispatch_group_create();
+        for (NSUInteger worker = 0; worker < 8; worker++) {
+            dispatch_group_async(group, queue, ^{
+                NSMutableArray *keys = [NSMutableArray array];
+                for (NSUInteger i = 0; i < 500; i++) {
+                    NSString *key = [NSString stringWithFormat:@"stress:%03lu", (unsigned long)(i % 100)];
+                    switch ((worker + i) % 4) {
+                        case 0:
+                            [stressed objectForKey:key];
+                            break;
+                        case 1:
+                            [stressed setObject:@[@(i)] forKey:key];
+                            break;
+                        case 2: {
+                            LDBSnapshot *snapshot = [stressed newSnapshot];
+                            [snapshot objectForKey:key];
+                            [snapshot close];
+                            break;
+                        }
+                        case 3: {
+                            LDBCursor *cursor = [stressed newCursorWithPrefix:@"stress:"];
+                            [cursor seekToKey:key];
+                            [cursor fetchNext:10 intoKeys:keys values:nil];
+                            break;
+                        }
+                    }
+                }
+            });
+        }
+        // Setters used from inside an operation, while closing waits for it
+        dispatch_group_async(group, queue, ^{
+            [stressed enumerateKeysUsingBlock:^(LevelDBKey *lkey, BOOL *stop) {
+                stressed.compactsInBackground = !stressed.compactsInBackground;
+                stressed.writeGroupSize = 4;
+                stressed.objectCacheSize = 1024;
+            }];
+        });
+        dispatch_group_async(group, queue, ^{
+            usleep((useconds_t)(round * 500));
+            [stressed close];
+        });
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        
+        XCTAssertTrue(stressed.closed, @"");
+        stressed.writeGroupLatency = 0.01;
+        stressed.compactsInBackground = YES;
+        XCTAssertEqual(stressed.objectCacheStatistics.count, (NSUInteger)0, @"Settings and statistics should be no-ops once closed");
+        XCTAssertNil([stressed objectForKey:@"stress:000"], @"Operations should fail once the database is closed");
+        XCTAssertNil([held objectForKey:@"stress:000"], @"Snapshots should be closed along with their database");
+        [held close];
+        [stressed deleteDatabaseFromDisk];
+    }
+}
+
+- (void)testAsynchronousOperations {
+    [db setObject:@[@"async"] forKey:@"async:1"];
+    [db setObject:@[@"async"] forKey:@"async:2"];
+    
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    [db objectForKey:@"async:1" completion:^(id object, NSError *error) {
+        XCTAssertEqualObjects(object, @[@"async"], @"");
+        XCTAssertNil(error, @"");
+        dispatch_semaphore_signal(done);
+    }];
+    XCTAssertEqual(dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L, @"");
+    
+    // Hold both threads of a private executor, one with a scan, and queue a scan, a read, and a cancelled read behind
+    LDBExecutor *executor = [[LDBExecutor alloc] initWithConcurrency:2 maxOutstanding:8];
+    db.executor = executor;
+    dispatch_semaphore_t started = dispatch_semaphore_create(0);
+    dispatch_semaphore_t blocker = dispatch_semaphore_create(0), writeBlocker = dispatch_semaphore_create(0);
+    [executor submitWithPriority:LDBExecutorPriorityLow token:nil task:^{
+        dispatch_semaphore_signal(started);
+        dispatch_semaphore_wait(blocker, DISPATCH_TIME_FOREVER);
+    } cancelled:nil];
+    [executor submitWithPriority:LDBExecutorPriorityDefault token:nil task:^{
+        dispatch_semaphore_signal(started);
+        dispatch_semaphore_wait(writeBlocker, DISPATCH_TIME_FOREVER);
+    } cancelled:nil];
+    for (NSUInteger i = 0; i < 2; i++)
+        XCTAssertEqual(dispatch_semaphore_wait(started, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L, @"");
+    
+    NSMutableArray *order = [NSMutableArray array];
+    __block NSUInteger scanned = 0;
+    [db enumerateKeysAndObjectsWithPrefix:@"async:" usingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+        scanned++;
+    } completion:^(NSError *error) {
+        XCTAssertNil(error, @"");
+        [order addObject:@"scan"];
+        dispatch_semaphore_signal(done);
+    }];
+    [db objectsForKeys:@[@"async:1", @"missing"] notFoundMarker:@"" completion:^(NSArray *objects, NSError *error) {
+        XCTAssertEqualObjects(objects, (@[@[@"async"], @""]), @"");
+        [order addObject:@"read"];
+        dispatch_semaphore_signal(done);
+    }];
+    LDBCancellationToken *token = [db objectForKey:@"async:2" completion:^(id object, NSError *error) {
+        XCTAssertNil(object, @"");
+        XCTAssertEqual(error.code, (NSInteger)LevelDBErrorCancelled, @"A read cancelled before it starts should not run");
+        [order addObject:@"cancelled"];
+        dispatch_semaphore_signal(done);
+    }];
+    [token cancel];
+    XCTAssertEqual(executor.outstandingCount, (NSUInteger)5, @"");
+    
+    // The thread freed by the scan runs everything queued, while the other one stays held
+    dispatch_semaphore_signal(blocker);
+    for (NSUInteger i = 0; i < 3; i++)
+        XCTAssertEqual(dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L, @"");
+    XCTAssertEqualObjects(order, (@[@"read", @"cancelled", @"scan"]), @"Point reads should run ahead of scans");
+    XCTAssertEqual(scanned, (NSUInteger)2, @"");
+    
+    // Tasks submitting more tasks than can be queued run them in place, instead of waiting for their own thread
+    __block NSUInteger nested = 0;
+    [executor submitWithPriority:LDBExecutorPriorityHigh token:nil task:^{
+        for (NSUInteger i = 0; i < 16; i++)
+            [executor submitWithPriority:LDBExecutorPriorityHigh token:nil task:^{
+                @synchronized(executor) {
+                    nested++;
+                }
+            } cancelled:nil];
+        dispatch_semaphore_signal(done);
+    } cancelled:nil];
+    XCTAssertEqual(dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L, @"");
+    dispatch_semaphore_signal(writeBlocker);
+    while (executor.outstandingCount > 0)
+        usleep(1000);
+    XCTAssertEqual(nested, (NSUInteger)16, @"");
+    
+    db.executor = [LDBExecutor sharedExecutor];
+}
+
+- (void)testBulkLoad {
+    NSMutableArray *pairs = [NSMutableArray array];
+    for (NSUInteger i = 0; i < numberOfIterations; i++)
+        [pairs addObject:@[[NSString stringWithFormat:@"sorted:%05lu", (unsigned long)i], @[@(i)]]];
+    NSError *error;
+    XCTAssertTrue([db loadEntriesFromEnumerator:pairs.objectEnumerator sorted:YES error:&error], @"%@", error);
+    XCTAssertEqualObjects(db[@"sorted:00042"], @[@42], @"");
+    
+    // Unsorted keys, spilled to disk in many small runs, with a key loaded twice
+    LDBBulkLoader *loader = [db newBulkLoaderWithSortedInput:NO];
+    loader.memoryLimit = 16 * 1024;
+    loader.batchSize = 4 * 1024;
+    __block NSUInteger progressCalls = 0;
+    loader.progress = ^(NSUInteger count, BOOL *stop) {
+        progressCalls++;
+    };
+    for (NSUInteger i = numberOfIterations; i > 0; i--)
+        [loader setObject:@[@(i)] forKey:[NSString stringWithFormat:@"unsorted:%05lu", (unsigned long)i]];
+    [loader setObject:@[@"last"] forKey:@"unsorted:00001"];
+    XCTAssertEqual(loader.count, numberOfIterations + 1, @"");
+    XCTAssertTrue([loader finishWithError:&error], @"%@", error);
+    XCTAssertTrue(progressCalls > 1, @"Progress should be reported for every batch");
+    
+    __block NSUInteger count = 0;
+    __block NSString *previous = nil;
+    [db enumerateKeysBackward:NO startingAtKey:nil filteredByPredicate:nil andPrefix:@"unsorted:"
+                   usingBlock:^(LevelDBKey *key, BOOL *stop) {
+                       NSString *string = NSStringFromLevelDBKey(key);
+                       XCTAssertTrue(previous == nil || [previous compare:string] == NSOrderedAscending, @"");
+                       previous = string;
+                       count++;
+                   }];
+    XCTAssertEqual(count, numberOfIterations, @"Every key should be loaded once");
+    XCTAssertEqualObjects(db[@"unsorted:00001"], @[@"last"], @"The last value of a key loaded twice should win");
+    XCTAssertEqualObjects(db[@"unsorted:02500"], @[@2500], @"");
+}
+
+- (void)testLatencyHistograms {
+    [db setObject:@"untimed" forKey:@"latency:untimed"];
+    XCTAssertEqual([[db.latencySnapshot histogramForOperation:LevelDBOperationPut phase:LevelDBPhaseTotal] count],
+                   (uint64_t)0, @"Nothing should be recorded until enabled");
+    
+    db.recordsLatencies = YES;
+    // More writers than the recorder has slots, so that some of them share one
+    dispatch_apply(32, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+        for (NSUInteger i = 0; i < 100; i++)
+            [db setObject:@{@"thread": @(thread)} forKey:[NSString stringWithFormat:@"latency:%lu:%03lu", (unsigned long)thread, (unsigned long)i]];
+    });
+    for (NSUInteger i = 0; i < 100; i++)
+        [db objectForKey:[NSString stringWithFormat:@"latency:0:%03lu", (unsigned long)i]];
+    __block NSUInteger scanned = 0;
+    [db enumerateKeysAndObjectsBackward:NO lazily:NO startingAtKey:nil filteredByPredicate:nil andPrefix:@"latency:1:"
+                             usingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+                                 scanned++;
+                             }];
+    
+    LDBLatencySnapshot *snapshot = [db latencySnapshot];
+    LDBLatencyHistogram *puts = [snapshot histogramForOperation:LevelDBOperationPut phase:LevelDBPhaseTotal];
+    XCTAssertEqual(puts.count, (uint64_t)3200, @"Puts from every thread should be merged");
+    XCTAssertEqual([snapshot histogramForOperation:LevelDBOperationPut phase:LevelDBPhaseEncode].count, (uint64_t)3200, @"");
+    XCTAssertTrue(puts.p50 > 0 && puts.p50 <= puts.p99 && puts.p99 <= puts.p999, @"Percentiles should be ordered");
+    XCTAssertEqual([snapshot histogramForOperation:LevelDBOperationGet phase:LevelDBPhaseDecode].count, (uint64_t)100, @"");
+    XCTAssertEqual([snapshot histogramForOperation:LevelDBOperationScan phase:LevelDBPhaseTotal].count, (uint64_t)1, @"");
+    XCTAssertEqual([snapshot keyCountForOperation:LevelDBOperationScan], (uint64_t)scanned, @"Scanned keys should be counted");
+    XCTAssertTrue([snapshot byteCountForOperation:LevelDBOperationScan] > 0, @"");
+    
+    [db resetLatencies];
+    XCTAssertEqual([[db.latencySnapshot histogramForOperation:LevelDBOperationPut phase:LevelDBPhaseTotal] count],
+                   (uint64_t)0, @"Resetting should start from empty histograms");
+    
+    // Snapshots taken while resetting and recording never count more than was recorded
+    dispatch_apply(4, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+        for (NSUInteger i = 0; i < 200; i++) {
+            if (thread == 0) {
+                [db setObject:@{@"i": @(i)} forKey:@"latency:reset"];
+            } else if (thread == 1) {
+                [db resetLatencies];
+            } else {
+                LDBLatencyHistogram *histogram = [db.latencySnapshot histogramForOperation:LevelDBOperationPut
+                                                                                     phase:LevelDBPhaseTotal];
+                XCTAssertTrue(histogram.count <= 200, @"Snapshots racing with resets should stay bounded");
+                XCTAssertTrue(histogram.totalTime < 3600, @"");
+            }
+        }
+    });
+    [db removeObjectForKey:@"latency:untimed"];
+    XCTAssertEqual([[db.latencySnapshot histogramForOperation:LevelDBOperationDelete phase:LevelDBPhaseEngine] count],
+                   (uint64_t)1, @"");
+    XCTAssertEqual(puts.count, (uint64_t)3200, @"Snapshots shouldn't change after being taken");
+}
+
+
+- (void)testKeyEncoding {
+    NSArray *numbers = @[@(INT64_MIN), @(-1e10), @(-2), @(-0.5), @0, @0.25, @1, @2.5, @((1LL << 53) + 1),
+                         @9007199254740994.0, @(INT64_MAX), @1e19, @(UINT64_MAX), @1e20];
+    for (NSUInteger i = numbers.count; i > 0; i--)
+        [db setObject:@[@(i - 1)] forKey:[LDBKeyEncoding keyWithComponents:@[@"numbers", numbers[i - 1]]]];
+    
+    __block NSUInteger index = 0;
+    [db enumerateKeysAndObjectsBackward:NO lazily:NO startingAtKey:nil filteredByPredicate:nil
+                              andPrefix:[LDBKeyEncoding keyWithComponents:@[@"numbers"]]
+                             usingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+                                 XCTAssertEqualObjects(value, @[@(index)], @"Numbers should sort by value");
+                                 XCTAssertEqualObjects([LDBKeyEncoding componentsOfKey:key], (@[@"numbers", numbers[index]]),
+                                                       @"Components should round-trip");
+                                 index++;
+                             }];
+    XCTAssertEqual(index, numbers.count, @"");
+    
+    // Tuples sort component by component, and zero bytes in strings don't end them early
+    NSData *a = [LDBKeyEncoding keyWithComponents:@[@"tenant", @1, @"a"]];
+    NSString *withZero = [NSString stringWithFormat:@"a%Cb", (unichar)0];
+    NSData *a0 = [LDBKeyEncoding keyWithComponents:@[@"tenant", @1, withZero]];
+    NSData *b = [LDBKeyEncoding keyWithComponents:@[@"tenant", @2]];
+    NSData *other = [LDBKeyEncoding keyWithComponents:@[@"tenant2", [NSNull null]]];
+    for (NSData *key in @[other, b, a0, a])
+        [db setObject:@[] forKey:key];
+    NSArray *keys = [db allKeys];
+    XCTAssertEqualObjects([keys subarrayWithRange:NSMakeRange(keys.count - 4, 4)], (@[a, a0, b, other]), @"");
+    XCTAssertEqualObjects([LDBKeyEncoding componentsOfKeyData:a0], (@[@"tenant", @1, withZero]), @"");
+    
+    __block NSUInteger tenantKeys = 0;
+    [db enumerateKeysBackward:NO startingAtKey:nil filteredByPredicate:nil
+                    andPrefix:[LDBKeyEncoding keyWithComponents:@[@"tenant", @1]]
+                   usingBlock:^(LevelDBKey *key, BOOL *stop) {
+                       tenantKeys++;
+                   }];
+    XCTAssertEqual(tenantKeys, (NSUInteger)2, @"A tuple's key should prefix those of its extensions");
+    
+    // A tuple ending with a string prefixes strings continuing with a zero byte, which its limit key excludes
+    LDBCursor *cursor = [db newCursorFromKey:a toKey:[LDBKeyEncoding limitKeyWithComponents:@[@"tenant", @1, @"a"]]];
+    NSMutableArray *range = [NSMutableArray array];
+    [cursor fetchNext:10 intoKeys:range values:nil];
+    XCTAssertEqualObjects(range, @[a], @"");
+    [cursor close];
+    
+    XCTAssertNil([LDBKeyEncoding componentsOfKeyData:[@"plain" dataUsingEncoding:NSUTF8StringEncoding]], @"");
+}
+
+
+- (void)testSecondaryIndexes {
+    NSData *(^keyData)(NSString *) = ^(NSString *key) {
+        return [key dataUsingEncoding:NSUTF8StringEncoding];
+    };
+    db[@"user:1"] = @{@"city": @"Paris", @"age": @30};
+    db[@"user:2"] = @{@"city": @"Oslo", @"age": @25};
+    
+    LDBIndex *cities = [db addIndexNamed:@"city" extractor:^NSArray *(LevelDBKey *key, id value) {
+        return value[@"city"] ? @[value[@"city"]] : nil;
+    }];
+    XCTAssertFalse(cities.built, @"Keys written before the index should need a build");
+    dispatch_semaphore_t built = dispatch_semaphore_create(0);
+    __block NSError *buildError = nil;
+    [cities buildWithCompletion:^(NSError *error) {
+        buildError = error;
+        dispatch_semaphore_signal(built);
+    }];
+    XCTAssertEqual(dispatch_semaphore_wait(built, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L, @"");
+    XCTAssertNil(buildError, @"%@", buildError);
+    XCTAssertTrue(cities.built, @"");
+    XCTAssertEqualObjects([cities keysForValue:@"Paris"], @[keyData(@"user:1")], @"");
+    
+    // Puts, removals and write batches maintain the index
+    db[@"user:1"] = @{@"city": @"Berlin", @"age": @31};
+    XCTAssertEqual([cities keysForValue:@"Paris"].count, (NSUInteger)0, @"Replaced values should leave the index");
+    XCTAssertEqualObjects([cities objectsForValue:@"Berlin"], (@[@{@"city": @"Berlin", @"age": @31}]), @"");
+    [db performWritebatch:^(LDBWritebatch *wb) {
+        [wb setObject:@{@"city": @"Oslo", @"age": @40} forKey:@"user:3"];
+        [wb setObject:@{@"age": @41} forKey:@"user:3"];
+        [wb removeObjectForKey:@"user:1"];
+    }];
+    XCTAssertEqualObjects([cities keysForValue:@"Oslo"], @[keyData(@"user:2")], @"Only the last write of a key in a batch should count");
+    XCTAssertEqual([cities keysForValue:@"Berlin"].count, (NSUInteger)0, @"");
+    
+    // Numeric and composite values sort by value
+    LDBIndex *ages = [db addIndexNamed:@"age" extractor:^NSArray *(LevelDBKey *key, id value) {
+        return @[value[@"age"], @[value[@"city"] ?: [NSNull null], value[@"age"]]];
+    }];
+    XCTAssertFalse(ages.built, @"");
+    [ages buildWithCompletion:^(NSError *error) {
+        dispatch_semaphore_signal(built);
+    }];
+    XCTAssertEqual(dispatch_semaphore_wait(built, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L, @"");
+    db[@"user:4"] = @{@"city": @"Oslo", @"age": @9};
+    XCTAssertEqualObjects([ages keysFromValue:@9 toValue:@30 withSnapshot:nil], (@[keyData(@"user:4"), keyData(@"user:2")]), @"");
+    XCTAssertEqualObjects([ages keysFromValue:@30 toValue:nil withSnapshot:nil], @[keyData(@"user:3")], @"");
+    XCTAssertEqualObjects([ages keysForValue:@[@"Oslo"]], (@[keyData(@"user:4"), keyData(@"user:2")]), @"Composite values should match by prefix");
+    
+    // Queries read from a snapshot
+    LDBSnapshot *snapshot = [db newSnapshot];
+    [db removeObjectForKey:@"user:2"];
+    XCTAssertEqualObjects([cities objectsFromValue:@"Oslo" toValue:@"Oslo" withSnapshot:snapshot],
+                          (@[@{@"city": @"Oslo", @"age": @25}, @{@"city": @"Oslo", @"age": @9}]), @"");
+    XCTAssertEqualObjects([cities keysForValue:@"Oslo"], @[keyData(@"user:4")], @"");
+    
+    XCTAssertEqual([db indexNamed:@"city"], cities, @"");
+    [db removeIndexNamed:@"city"];
+    XCTAssertNil([db indexNamed:@"city"], @"");
+    cities = [db addIndexNamed:@"city" extractor:^NSArray *(LevelDBKey *key, id value) {
+        return value[@"city"] ? @[value[@"city"]] : nil;
+    }];
+    XCTAssertFalse(cities.built, @"");
+    XCTAssertEqual([cities keysForValue:@"Oslo"].count, (NSUInteger)0, @"Removing an index should remove its entries");
+    [snapshot close];
+    
+    // Index entries and markers are hidden from enumerations, and removing every key leaves them in place
+    XCTAssertEqualObjects([db allKeys], (@[keyData(@"user:3"), keyData(@"user:4")]), @"");
+    __block NSUInteger backward = 0;
+    [db enumerateKeysBackward:YES startingAtKey:nil filteredByPredicate:nil andPrefix:nil
+                   usingBlock:^(LevelDBKey *key, BOOL *stop) {
+                       backward++;
+                   }];
+    XCTAssertEqual(backward, (NSUInteger)2, @"");
+    [db removeAllObjects];
+    XCTAssertEqual([db allKeys].count, (NSUInteger)0, @"");
+    XCTAssertEqual([ages keysFromValue:@0 toValue:nil withSnapshot:nil].count, (NSUInteger)0, @"");
+    
+    NSString *name = db.name;
+    LevelDBEncoderBlock encoder = db.encoder;
+    LevelDBDecoderBlock decoder = db.decoder;
+    [db close];
+    db = [LevelDB databaseInLibraryWithName:name];
+    db.encoder = encoder;
+    db.decoder = decoder;
+    ages = [db addIndexNamed:@"age" extractor:^NSArray *(LevelDBKey *key, id value) {
+        return @[value[@"age"]];
+    }];
+    XCTAssertTrue(ages.built, @"An index should stay built once every key was removed");
+}
+
+- (void)testArchives {
+    for (NSUInteger i = 0; i < 3000; i++)
+        db[[NSString stringWithFormat:@"item:%05lu", (unsigned long)i]] = @[@(i)];
+    db[@"other:1"] = @[@1];
+    
+    // Exports read from a snapshot, while the database is written to
+    LDBSnapshot *snapshot = [db newSnapshot];
+    db[@"item:00000"] = @[@-1];
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"TestArchive.ldba"];
+    LDBArchive *archive = [LDBArchive archiveWithPath:path];
+    archive.shards = 4;
+    archive.blockSize = 4096;
+    NSError *error = nil;
+    XCTAssertTrue([archive exportSnapshot:snapshot withPrefix:@"item:" resume:NO error:&error], @"%@", error);
+    XCTAssertTrue([archive verifyWithError:&error], @"%@", error);
+    
+    LevelDB *restored = [LevelDB databaseInLibraryWithName:@"RestoredDB"];
+    [restored removeAllObjects];
+    restored.encoder = db.encoder;
+    restored.decoder = db.decoder;
+    XCTAssertTrue([restored importArchiveAtPath:path error:&error], @"%@", error);
+    XCTAssertEqual([restored allKeys].count, (NSUInteger)3000, @"");
+    XCTAssertEqualObjects(restored[@"item:00000"], @[@0], @"The archive should hold the snapshot's values");
+    XCTAssertEqualObjects(restored[@"item:02999"], @[@2999], @"");
+    XCTAssertNil(restored[@"other:1"], @"");
+    
+    // Importing into a database holding keys replaces their values
+    restored[@"item:00001"] = @[@"changed"];
+    restored[@"extra"] = @[@"kept"];
+    XCTAssertTrue([archive importIntoDB:restored resume:NO error:&error], @"%@", error);
+    XCTAssertEqualObjects(restored[@"item:00001"], @[@1], @"");
+    XCTAssertEqualObjects(restored[@"extra"], @[@"kept"], @"");
+    
+    // A stopped export is incomplete, and resumes where it stopped
+    __block NSUInteger calls = 0;
+    archive.progress = ^(uint64_t count, uint64_t bytes, BOOL *stop) {
+        calls++;
+        *stop = YES;
+    };
+    XCTAssertFalse([archive exportSnapshot:snapshot fromKey:@"item:" toKey:@"item;" resume:NO error:&error], @"");
+    XCTAssertEqual(error.code, (NSInteger)LevelDBErrorCancelled, @"");
+    XCTAssertEqual(calls, (NSUInteger)1, @"");
+    XCTAssertFalse([archive verifyWithError:NULL], @"");
+    archive.progress = nil;
+    XCTAssertFalse([archive exportSnapshot:snapshot withPrefix:@"other:" resume:YES error:NULL], @"Only the same range should be resumed");
+    XCTAssertTrue([archive exportSnapshot:snapshot fromKey:@"item:" toKey:@"item;" resume:YES error:&error], @"%@", error);
+    XCTAssertTrue([archive verifyWithError:&error], @"%@", error);
+    [restored removeAllObjects];
+    XCTAssertTrue([archive importIntoDB:restored resume:YES error:&error], @"%@", error);
+    XCTAssertEqual([restored allKeys].count, (NSUInteger)3000, @"");
+    XCTAssertEqualObjects(restored[@"item:01500"], @[@1500], @"");
+    [snapshot close];
+    
+    // The library's own keys are neither exported, nor published by imports
+    LevelDB *indexed = [LevelDB databaseInLibraryWithName:@"IndexedDB"];
+    [indexed removeAllObjects];
+    indexed.encoder = db.encoder;
+    indexed.decoder = db.decoder;
+    NSArray *(^first)(LevelDBKey *, id) = ^NSArray *(LevelDBKey *key, id value) {
+        return @[value[0]];
+    };
+    XCTAssertTrue([indexed addIndexNamed:@"first" extractor:first].built, @"");
+    for (NSUInteger i = 0; i < 10; i++)
+        indexed[[NSString stringWithFormat:@"item:%lu", (unsigned long)i]] = @[@(i)];
+    NSString *wholePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"TestWholeArchive.ldba"];
+    LDBArchive *whole = [LDBArchive archiveWithPath:wholePath];
+    LDBSnapshot *indexedSnapshot = [indexed newSnapshot];
+    XCTAssertTrue([whole exportSnapshot:indexedSnapshot withPrefix:nil resume:NO error:&error], @"%@", error);
+    [indexedSnapshot close];
+    
+    [restored removeAllObjects];
+    NSData *doneKey = [@"done" dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableArray *changes = [NSMutableArray array];
+    dispatch_semaphore_t published = dispatch_semaphore_create(0);
+    LDBChangeSubscription *subscription = [restored subscribeToChangesWithPrefix:nil usingBlock:^(NSArray *batch, NSUInteger dropped) {
+        [changes addObjectsFromArray:batch];
+        if ([[batch lastObject][kLevelDBChangeKey] isEqual:doneKey])
+            dispatch_semaphore_signal(published);
+    }];
+    XCTAssertTrue([whole importIntoDB:restored resume:NO error:&error], @"%@", error);
+    restored[@"done"] = @[@YES];
+    XCTAssertEqual(dispatch_semaphore_wait(published, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0L, @"");
+    XCTAssertEqual(changes.count, (NSUInteger)11, @"Only the imported keys should be published");
+    [subscription cancel];
+    XCTAssertFalse([restored addIndexNamed:@"first" extractor:first].built, @"Index markers shouldn't be exported");
+    [restored removeIndexNamed:@"first"];
+    
+    [[NSFileManager defaultManager] removeItemAtPath:wholePath error:nil];
+    [indexed close];
+    [indexed deleteDatabaseFromDisk];
+    
+    // Damaged blocks fail to import
+    NSMutableData *contents = [NSMutableData dataWithContentsOfFile:path];
+    ((uint8_t *)[contents mutableBytes])[[contents length] / 2] ^= 0xff;
+    [contents writeToFile:path atomically:YES];
+    XCTAssertFalse([archive verifyWithError:&error], @"");
+    XCTAssertEqual(error.code, (NSInteger)LevelDBErrorCorruption, @"");
+    XCTAssertFalse([restored importArchiveAtPath:path error:NULL], @"");
+    
+    [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    [restored close];
+    [restored deleteDatabaseFromDisk];
+}
+
+- (void)testValueSeparation {
+    LDBOptions *options = [LDBOptions options];
+    options.valueSeparationThreshold = 1024;
+    options.blobFileSize = 64 * 1024;
+    LevelDB *separated = [LevelDB databaseInLibraryWithName:@"SeparatedDB" options:options];
+    [separated removeAllObjects];
+    separated.encoder = db.encoder;
+    separated.decoder = db.decoder;
+    
+    NSString *large = [@"" stringByPaddingToLength:4096 withString:@"blob" startingAtIndex:0];
+    for (NSUInteger i = 0; i < 100; i++)
+        separated[[NSString stringWithFormat:@"large:%03lu", (unsigned long)i]] = @[large, @(i)];
+    separated[@"small"] = @[@1];
+    
+    LevelDBBlobStatistics statistics = [separated blobStatistics];
+    XCTAssertEqual(statistics.blobsWritten, (uint64_t)100, @"Only values over the threshold should be separated");
+    XCTAssertTrue(statistics.files > 1, @"Blob files should be rotated once full");
+    XCTAssertEqualObjects(separated[@"large:042"], (@[large, @42]), @"");
+    XCTAssertEqualObjects(separated[@"small"], @[@1], @"");
+    NSArray *values = [separated objectsForKeys:@[@"large:000", @"large:099"] notFoundMarker:[NSNull null]];
+    XCTAssertEqualObjects(values[1], (@[large, @99]), @"");
+    
+    // Snapshots and cursors keep reading the values they saw, while these are deleted and collected
+    LDBSnapshot *snapshot = [separated newSnapshot];
+    LDBCursor *cursor = [separated newCursorWithPrefix:@"large:"];
+    [cursor seekToFirst];
+    for (NSUInteger i = 0; i < 90; i++)
+        [separated removeObjectForKey:[NSString stringWithFormat:@"large:%03lu", (unsigned long)i]];
+    LevelDBBlobCollectionStatistics collection = [separated collectBlobGarbageWithRatio:0.5 maxFiles:100];
+    XCTAssertTrue(collection.filesCollected > 0, @"");
+    XCTAssertEqual(collection.filesDeleted, (NSUInteger)0, @"Files still read from should be kept");
+    XCTAssertTrue([separated blobStatistics].pendingFiles > 0, @"");
+    XCTAssertEqualObjects(snapshot[@"large:000"], (@[large, @0]), @"");
+    XCTAssertEqualObjects(cursor.value, (@[large, @0]), @"");
+    [cursor close];
+    [snapshot close];
+    
+    collection = [separated collectBlobGarbageWithRatio:0.5 maxFiles:100];
+    XCTAssertTrue(collection.filesDeleted > 0, @"");
+    XCTAssertTrue([separated blobStatistics].bytesReclaimed > 0, @"");
+    __block NSUInteger count = 0;
+    [separated enumerateKeysAndObjectsUsingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+        XCTAssertEqualObjects([value firstObject], [NSStringFromLevelDBKey(key) hasPrefix:@"large:"] ? large : @1, @"");
+        count++;
+    }];
+    XCTAssertEqual(count, (NSUInteger)11, @"Live values should survive collections");
+    
+    // Pointers are followed whatever the threshold the database is reopened with
+    [separated close];
+    separated = [LevelDB databaseInLibraryWithName:@"SeparatedDB"];
+    separated.decoder = db.decoder;
+    XCTAssertEqualObjects(separated[@"large:099"], (@[large, @99]), @"");
+    [separated close];
+    [separated deleteDatabaseFromDisk];
+}
+
 @end
@@ -0,0 +1,250 @@
+//
+//  PerformanceTests.m
+//  Objective-LevelDB Tests
+//
+
+#import "BaseTestClass.h"
+#import <Objective-LevelDB/LDBWriteBatch.h>
+#import <Objective-LevelDB/LDBCodec.h>
+#import <Objective-LevelDB/LDBBulkLoader.h>
+#import <malloc/malloc.h>
+
+static NSUInteger numberOfReads = 2500;
+static NSUInteger valueSize = 4096;
+static NSUInteger numberOfBatchedWrites = 100000;
+static NSUInteger numberOfSafeWrites = 2000;
+static NSUInteger numberOfCodings = 10000;
+static NSUInteger numberOfBulkLoads = 50000;
+
+@interface PerformanceTests : BaseTestClass
+
+@end
+
+/*
+ * The size of a value handed to a decoder if it is a copy: fetched into a std::string by leveldb::DB::Get (and handed
+ * over as a LDBStringData), or copied into a buffer of its own, on the heap or inside the data object. Views of the
+ * memory leveldb reads from (memtable arenas, table blocks) start inside a larger block, or outside the heap.
+ */
+static NSUInteger CopiedBytes(NSData *data) {
+    static Class stringDataClass;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        stringDataClass = NSClassFromString(@"LDBStringData");
+    });
+    const char *bytes = data.bytes;
+    const char *object = (__bridge const char *)data;
+    BOOL owned = [data isKindOfClass:stringDataClass] || malloc_size(bytes) > 0
+                 || (bytes >= object && bytes < object + malloc_size((__bridge const void *)data));
+    return owned ? data.length : 0;
+}
+
+@implementation PerformanceTests {
+    NSUInteger bytesCopied;
+}
+
+- (void)setUp {
+    [super setUp];
+
+    // Values are stored as raw bytes, and the decoder only sums them up, so that
+    // it never keeps a reference to the data it is handed.
+    db.encoder = ^ NSData * (LevelDBKey *key, NSData *value) {
+        return value;
+    };
+    __weak PerformanceTests *weakSelf = self;
+    db.decoder = ^ id (LevelDBKey *key, NSData *data) {
+        PerformanceTests *strongSelf = weakSelf;
+        if (strongSelf)
+            strongSelf->bytesCopied += CopiedBytes(data);
+        const unsigned char *bytes = data.bytes;
+        NSUInteger sum = 0;
+        for (NSUInteger i = 0; i < data.length; i++)
+            sum += bytes[i];
+        return @(sum);
+    };
+
+    NSMutableData *value = [NSMutableData dataWithLength:valueSize];
+    memset(value.mutableBytes, 'x', valueSize);
+    for (NSUInteger i = 0; i < numberOfReads; i++)
+        [db setObject:value forKey:[NSString stringWithFormat:@"blob:%06lu", (unsigned long)i]];
+}
+
+- (void)readAllKeys {
+    for (NSUInteger i = 0; i < numberOfReads; i++)
+        [db objectForKey:[NSString stringWithFormat:@"blob:%06lu", (unsigned long)i]];
+}
+
+- (void)testPointReadsCopyingValues {
+    // Emulates the previous read path, where the fetched std::string was copied into a NSData before decoding
+    LevelDBDecoderBlock decoder = db.decoder;
+    __weak PerformanceTests *weakSelf = self;
+    db.decoder = ^ id (LevelDBKey *key, NSData *data) {
+        PerformanceTests *strongSelf = weakSelf;
+        if (strongSelf)
+            strongSelf->bytesCopied += CopiedBytes(data);
+        return decoder(key, [NSData dataWithBytes:data.bytes length:data.length]);
+    };
+
+    [self measureBlock:^{
+        bytesCopied = 0;
+        [self readAllKeys];
+    }];
+    NSLog(@"Point reads (copying): %lu bytes copied per read", (unsigned long)(bytesCopied / numberOfReads));
+}
+
+- (void)testPointReadsWithoutCopy {
+    [self measureBlock:^{
+        bytesCopied = 0;
+        [self readAllKeys];
+    }];
+    NSLog(@"Point reads (no copy): %lu bytes copied per read", (unsigned long)(bytesCopied / numberOfReads));
+}
+
+- (void)testEnumerationCopyingValues {
+    db.decodeWithoutCopy = NO;
+    [self measureBlock:^{
+        bytesCopied = 0;
+        __block NSUInteger count = 0;
+        [db enumerateKeysAndObjectsUsingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+            count++;
+        }];
+        XCTAssertEqual(count, numberOfReads, @"Every value should be enumerated");
+    }];
+    NSLog(@"Enumeration (copying): %lu bytes copied per value", (unsigned long)(bytesCopied / numberOfReads));
+}
+
+- (void)testEnumerationWithoutCopy {
+    db.decodeWithoutCopy = YES;
+    [self measureBlock:^{
+        bytesCopied = 0;
+        __block NSUInteger count = 0;
+        [db enumerateKeysAndObjectsUsingBlock:^(LevelDBKey *key, id value, BOOL *stop) {
+            XCTAssertEqualObjects(value, @(valueSize * 'x'), @"Values decoded without copy should be intact");
+            count++;
+        }];
+        XCTAssertEqual(count, numberOfReads, @"Every value should be enumerated");
+        XCTAssertEqual(bytesCopied, (NSUInteger)0, @"Values should be handed to the decoder without any copy");
+    }];
+    NSLog(@"Enumeration (no copy): %lu bytes copied per value", (unsigned long)(bytesCopied / numberOfReads));
+}
+
+- (void)measureWritebatchBuildingWithMode:(LDBWritebatchMode)mode concurrently:(BOOL)concurrently {
+    NSData *value = [NSMutableData dataWithLength:64];
+    [self measureBlock:^{
+        LDBWritebatch *wb = [db newWritebatchWithMode:mode];
+        void (^put)(size_t) = ^(size_t i) {
+            [wb setObject:value forKey:[NSString stringWithFormat:@"batch:%08lu", (unsigned long)i]];
+        };
+        if (concurrently) {
+            dispatch_apply(numberOfBatchedWrites, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), put);
+        } else {
+            for (size_t i = 0; i < numberOfBatchedWrites; i++)
+                put(i);
+        }
+        [wb apply];
+    }];
+}
+
+- (void)testWritebatchBuildingSerialized {
+    [self measureWritebatchBuildingWithMode:LDBWritebatchSerialized concurrently:NO];
+}
+
+- (void)testWritebatchBuildingSerializedConcurrently {
+    [self measureWritebatchBuildingWithMode:LDBWritebatchSerialized concurrently:YES];
+}
+
+- (void)testWritebatchBuildingSingleThreaded {
+    [self measureWritebatchBuildingWithMode:LDBWritebatchSingleThreaded concurrently:NO];
+}
+
+- (void)testWritebatchBuildingConcurrent {
+    [self measureWritebatchBuildingWithMode:LDBWritebatchConcurrent concurrently:YES];
+}
+
+- (double)safeWritesPerSecondWithThreads:(NSUInteger)threads {
+    NSUInteger writesPerThread = numberOfSafeWrites / threads;
+    NSData *value = [NSMutableData dataWithLength:128];
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    dispatch_apply(threads, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+        for (NSUInteger i = 0; i < writesPerThread; i++)
+            [db setObject:value forKey:[NSString stringWithFormat:@"safe:%02lu:%06lu", thread, (unsigned long)i]];
+    });
+    return (writesPerThread * threads) / (CFAbsoluteTimeGetCurrent() - start);
+}
+
+- (void)testGroupCommitThroughput {
+    db.safe = YES;
+    for (NSUInteger threads = 1; threads <= 32; threads *= 2) {
+        db.combinesWrites = NO;
+        double direct = [self safeWritesPerSecondWithThreads:threads];
+        db.combinesWrites = YES;
+        double combined = [self safeWritesPerSecondWithThreads:threads];
+        NSLog(@"Safe writes with %2lu threads: %8.0f/s direct, %8.0f/s combined",
+              (unsigned long)threads, direct, combined);
+    }
+}
+
+- (void)testCodecsAgainstKeyedArchiver {
+    NSMutableArray *numbers = [NSMutableArray array];
+    NSMutableDictionary *record = [NSMutableDictionary dictionary];
+    for (NSUInteger i = 0; i < 100; i++)
+        [numbers addObject:@(i * 7919)];
+    for (NSUInteger i = 0; i < 20; i++)
+        record[[NSString stringWithFormat:@"field%lu", (unsigned long)i]] = (i % 2) ? @(i) : [NSString stringWithFormat:@"value %lu", (unsigned long)i];
+    
+    NSDictionary *shapes = @{@"number": @(123456789),
+                             @"short string": @"Objective-LevelDB",
+                             @"4KB data": [NSData dataWithData:[NSMutableData dataWithLength:4096]],
+                             @"100 numbers": [NSArray arrayWithArray:numbers],
+                             @"20 field record": [NSDictionary dictionaryWithDictionary:record]};
+    
+    LDBCodecRegistry *codecs = [LDBCodecRegistry sharedRegistry];
+    NSArray *candidates = @[[LDBKeyedArchiverCodec codec], [LDBBinaryCodec codec], [LDBNumberCodec codec], [LDBRawDataCodec codec]];
+    LevelDBDecoderBlock decoder = [codecs decoder];
+    
+    [shapes enumerateKeysAndObjectsUsingBlock:^(NSString *shape, id value, BOOL *stop) {
+        for (id<LDBCodec> codec in candidates) {
+            if (![codec canEncodeObject:value]) continue;
+            LevelDBEncoderBlock encoder = [codecs encoderWithCodec:codec];
+            
+            __block NSData *data;
+            CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+            for (NSUInteger i = 0; i < numberOfCodings; i++) @autoreleasepool {
+                data = encoder(NULL, value);
+            }
+            CFAbsoluteTime encoded = CFAbsoluteTimeGetCurrent();
+            for (NSUInteger i = 0; i < numberOfCodings; i++) @autoreleasepool {
+                XCTAssertNotNil(decoder(NULL, data), @"Encoded values should decode");
+            }
+            CFAbsoluteTime decoded = CFAbsoluteTimeGetCurrent();
+            
+            NSLog(@"%-16@ %-22@ %6lu bytes, encode %7.2fus, decode %7.2fus", shape, NSStringFromClass([codec class]),
+                  (unsigned long)data.length, (encoded - start) * 1e6 / numberOfCodings, (decoded - encoded) * 1e6 / numberOfCodings);
+        }
+    }];
+}
+
+- (void)testBulkLoadAgainstSetObject {
+    NSMutableData *value = [NSMutableData dataWithLength:256];
+    memset(value.mutableBytes, 'x', value.length);
+    NSMutableArray *pairs = [NSMutableArray arrayWithCapacity:numberOfBulkLoads];
+    for (NSUInteger i = 0; i < numberOfBulkLoads; i++)
+        [pairs addObject:@[[NSString stringWithFormat:@"bulk:%08lu", (unsigned long)((i * 7919) % numberOfBulkLoads)], value]];
+    double megabytes = numberOfBulkLoads * (value.length + 13) / 1048576.0;
+    
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for (NSArray *pair in pairs)
+        [db setObject:pair[1] forKey:pair[0]];
+    double setObjectRate = megabytes / (CFAbsoluteTimeGetCurrent() - start);
+    
+    [db removeAllObjectsWithPrefix:@"bulk:"];
+    start = CFAbsoluteTimeGetCurrent();
+    NSError *error;
+    XCTAssertTrue([db loadEntriesFromEnumerator:pairs.objectEnumerator sorted:NO error:&error], @"%@", error);
+    double bulkRate = megabytes / (CFAbsoluteTimeGetCurrent() - start);
+    
+    NSLog(@"Loading %lu unsorted pairs: setObject:forKey: %.1f MB/s, bulk loader %.1f MB/s (including sort, sync and compaction)",
+          (unsigned long)numberOfBulkLoads, setObjectRate, bulkRate);
+}
+
+@end
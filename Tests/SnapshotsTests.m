@@ -28,6 +28,18 @@ static NSUInteger numberOfIterations = 2500;
     snapshot = nil;
 }
 
+- (void) testMultiGetInvariability {
+    [db addEntriesFromDictionary:@{@"key1": @[@1], @"key2": @[@2]}];
+    snapshot = [db newSnapshot];
+    [db setObject:@[@3] forKey:@"key3"];
+    [db removeObjectForKey:@"key1"];
+    
+    XCTAssertEqualObjects([snapshot objectsForKeys:@[@"key3", @"key1", @"key2"] notFoundMarker:[NSNull null]],
+                          (@[[NSNull null], @[@1], @[@2]]),
+                          @"Fetching multiple keys from a snapshot should ignore later changes");
+    snapshot = nil;
+}
+
 - (NSArray *)nPairs:(NSUInteger)n {
     NSMutableArray  *pairs = [NSMutableArray array];
     
@@ -64,6 +64,20 @@
     
     [wb apply];
     XCTAssertEqual([db allKeys], @[], @"The list of keys should be empty after removing all objects from the database");
+    
+    [db setObject:value forKey:@"dict1"];
+    [db setObject:value forKey:@"dict2"];
+    wb = [db newWritebatch];
+    wb.removalLimit = 1;
+    NSError *error = nil;
+    XCTAssertFalse([wb removeAllObjectsWithPrefix:nil error:&error], @"Removals over the limit should fail");
+    XCTAssertEqual(error.code, (NSInteger)LevelDBErrorLimitExceeded, @"");
+    XCTAssertEqual(wb.count, (NSUInteger)0, @"A removal over the limit should add nothing to the batch");
+    wb.removalLimit = 2;
+    XCTAssertTrue([wb removeAllObjectsWithPrefix:@"dict" error:&error], @"%@", error);
+    XCTAssertEqual(wb.count, (NSUInteger)2, @"");
+    [wb apply];
+    XCTAssertEqual([db allKeys], @[], @"");
 }
 
 - (void)testDictionaryManipulations {
@@ -85,4 +99,44 @@
                               @"Objects should match between dictionary and db");
 }
 
+- (void)testConcurrentMode {
+    LDBWritebatch *wb = [db newWritebatchWithMode:LDBWritebatchConcurrent];
+    
+    dispatch_apply(1000, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        [wb setObject:@[@(i)] forKey:[NSString stringWithFormat:@"key:%04lu", (unsigned long)i]];
+    });
+    XCTAssertEqual([db allKeys].count, (NSUInteger)0, @"The list of keys should be empty before applying the writebatch");
+    XCTAssertEqual(wb.count, (NSUInteger)1000, @"Operations appended from every thread should be counted");
+    NSUInteger size = wb.byteSize;
+    XCTAssertEqual(wb.byteSize, size, @"Reading the size shouldn't change it");
+    
+    [wb apply];
+    XCTAssertEqual(wb.count, (NSUInteger)1000, @"");
+    XCTAssertEqual(wb.byteSize, size, @"Merging thread batches should keep the size");
+    XCTAssertEqual([db allKeys].count, (NSUInteger)1000,
+                   @"Operations appended from every thread should be merged when applying the writebatch");
+    XCTAssertEqualObjects(db[@"key:0042"], @[@42], @"Values should be encoded with the database's encoder");
+    
+    wb = [db newWritebatchWithMode:LDBWritebatchSingleThreaded];
+    [wb removeObjectForKey:@"key:0042"];
+    [wb apply];
+    XCTAssertNil(db[@"key:0042"], @"A deleted key, once the writebatch is applied, should return nil");
+}
+
+- (void)testCommitReporting {
+    LDBWritebatch *wb = [db newWritebatch];
+    XCTAssertEqual(wb.count, (NSUInteger)0, @"A new writebatch should be empty");
+    
+    [wb setObject:@{@"foo": @"bar"} forKey:@"dict1"];
+    [wb setObject:@{@"foo": @"bar"} forKey:@"dict2"];
+    [wb removeObjectForKey:@"dict3"];
+    XCTAssertEqual(wb.count, (NSUInteger)3, @"Every put and delete should be counted");
+    XCTAssertGreaterThan(wb.byteSize, (NSUInteger)0, @"The writebatch size should account for its operations");
+    
+    NSError *error = nil;
+    XCTAssertTrue([wb applySynchronously:YES error:&error], @"Applying the writebatch should succeed");
+    XCTAssertNil(error, @"No error should be reported when applying the writebatch succeeds");
+    XCTAssertEqualObjects(db[@"dict2"], @{@"foo": @"bar"}, @"Applying the writebatch should reflect its changes in the DB");
+}
+
 @end